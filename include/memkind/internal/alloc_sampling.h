@@ -0,0 +1,50 @@
+#pragma once
+
+#include "stdbool.h"
+#include "stddef.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Statistical sampling of allocations for data hotness tracking
+///
+/// Tracking every small allocation as a separate tblock costs two events
+/// and a critnib entry per object. In sampling mode, allocations are
+/// sampled like jemalloc heap profiling does: each thread counts allocated
+/// bytes down from a value drawn from exponential distribution with mean
+/// of sampling interval, the allocation that reaches zero is sampled. This
+/// is a Poisson process over allocated bytes - an allocation of s bytes is
+/// sampled with probability 1 - exp(-s / interval), independently of
+/// others.
+///
+/// Sampled allocations carry weight - the inverse of their probability -
+/// so that the weighted size of sampled blocks is an unbiased estimate of
+/// the size of all allocations, and DRAM/total ratio derived from ranking
+/// stays correct.
+///
+/// Addresses of sampled allocations are kept in a hash set. Checking an
+/// address of unsampled allocation on free is a single load of an empty
+/// bucket in most cases.
+
+/// @brief set mean sampling interval in bytes, 0 disables sampling
+/// @note clears the set of sampled allocations - has to be called before
+/// tracked allocations are made, or after all of them are freed
+extern void alloc_sampling_set_interval(size_t interval);
+
+/// @return mean sampling interval in bytes, 0 if sampling is disabled
+extern size_t alloc_sampling_get_interval(void);
+
+/// @brief decide if allocation should be tracked, record it if sampled
+/// @param[out] weight number of bytes represented by one byte of the
+/// allocation, 1 when sampling is disabled
+/// @return true if allocation should be tracked
+extern bool alloc_sampling_sample(void *addr, size_t size, float *weight);
+
+/// @brief forget allocation on free
+/// @return true if the freed allocation was tracked
+extern bool alloc_sampling_forget(void *addr);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,8 +2,41 @@
 // SPDX-License-Identifier: BSD-2-Clause
 /* Copyright (C) 2021 Intel Corporation. */
 
+#include "stdbool.h"
 #include "stdint.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// @brief read stack location and build index of executable mappings
 void read_maps(void);
+/// @brief update index of executable mappings after dlopen/dlclose
+/// @return true if the index changed
+/// @note cheap if nothing changed, but takes the dynamic loader lock -
+/// should not be called from the malloc path
+bool bthash_refresh_maps(void);
+/// @brief hash of allocation @p size and its call site,
+/// computed with the method selected by BTHASH_METHOD
+/// @note return addresses are hashed as sites (see exec_maps_lookup()), so
+/// the hash of a call stack is the same in every run of the same binaries
+/// @pre called in a QSBR read-side section, see exec_maps_get()
 uint64_t bthash(uint64_t size);
 void bthash_set_stack_range(void *p1, void *p2);
+
+/// @brief hash raw stack words from range set by bthash_set_stack_range
+/// that point into executable mappings
+uint64_t bthash_stack_scan(uint64_t size);
+/// @brief hash return addresses obtained from libc backtrace()
+uint64_t bthash_backtrace(uint64_t size);
+/// @brief hash first BTHASH_FRAME_DEPTH return addresses found by walking
+/// frame pointer chain
+/// @note requires code compiled with -fno-omit-frame-pointer; when the
+/// chain is found broken, the hash is computed by bthash_backtrace()
+/// instead - a function that does not maintain frame pointer but leaves
+/// the register intact is skipped, not detected
+uint64_t bthash_frame_pointers(uint64_t size);
+
+#ifdef __cplusplus
+}
+#endif
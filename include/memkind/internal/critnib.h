@@ -4,6 +4,7 @@
 #ifndef CRITNIB_H
 #define CRITNIB_H 1
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -23,6 +24,7 @@ enum find_dir_t {
 
 critnib *critnib_new(void);
 void critnib_delete(critnib *c);
+size_t critnib_release_free_memory(critnib *c);
 
 int critnib_insert(critnib *c, uintptr_t key, void *value, int update);
 void *critnib_remove(critnib *c, uintptr_t key);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Index of executable mappings used by bthash
+///
+/// Code segments of all loaded objects are obtained with dl_iterate_phdr(),
+/// merged into sorted, non-overlapping intervals and published as
+/// an immutable table. Readers (malloc path) only load the table pointer -
+/// they never lock. The table is rebuilt by exec_maps_refresh() only when
+/// the loader reports that objects were added or removed (dlopen/dlclose);
+/// if the loader does not provide these counters, only after a failed
+/// exec_maps_lookup().
+///
+/// Each interval keeps the offset of its object, so that code addresses can
+/// be turned into sites that do not change between runs.
+///
+/// Replaced tables are retired with qsbr_retire() - readers use the table
+/// only in a QSBR read-side section (qsbr_online()/qsbr_offline()).
+
+typedef struct exec_maps exec_maps_t;
+
+/// @return current table; empty table if exec_maps_refresh() was not called
+/// @note the table stays valid until the caller's qsbr_offline()
+extern const exec_maps_t *exec_maps_get(void);
+
+/// @brief rebuild the table if loaded objects changed
+/// @p force rebuild even if no change was detected
+/// @return true if new table was published
+/// @note might take the dynamic loader lock - should not be called from
+/// the malloc path
+extern bool exec_maps_refresh(bool force);
+
+/// @brief free the current table, retired ones are freed by qsbr_reclaim()
+/// @warning no readers are allowed during and after this call
+extern void exec_maps_fini(void);
+
+/// @return true if @p addr lies in code segment of any loaded object
+extern bool exec_maps_contains(const exec_maps_t *maps, const void *addr);
+
+/// @brief identify code address @p addr independently of load addresses
+/// @p site key of the object (hash of its GNU build-id, or of its path)
+/// plus offset of @p addr in the object - the same in every run of the
+/// same binaries, regardless of ASLR
+/// @return false if @p addr does not lie in code segment of any object
+extern bool exec_maps_lookup(const exec_maps_t *maps, const void *addr,
+                             uint64_t *site);
+
+/// @return true if unwinding should stop at @p addr (thread start routine)
+extern bool exec_maps_is_terminal(const exec_maps_t *maps, const void *addr);
+
+/// @return generation of @p maps, different for every published table;
+/// 0 for the empty table
+extern unsigned exec_maps_generation(const exec_maps_t *maps);
+
+extern size_t exec_maps_count(const exec_maps_t *maps);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+#include "memkind_memtier.h" // only for config macros
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Persisted hotness of allocation sites for warm start
+///
+/// Types are identified by hashes of their call stacks, which are made of
+/// sites (object build-id and offset, see exec_maps_lookup()) - they are
+/// the same in the next run of the same binaries. At exit, hotness of all
+/// measured types and the tier thresholds are saved to a profile; the next
+/// run preloads them before the first allocation, so that allocations from
+/// known sites get their tier without waiting for a measure window.
+///
+/// File layout: hotness_profile_header_t followed by count entries
+/// (hotness_profile_entry_t), native byte order. A profile is loaded only
+/// if it was written with the same hotness policy and number of
+/// coefficients.
+
+#define HOTNESS_PROFILE_MAGIC   "MKHPROF1"
+#define HOTNESS_PROFILE_VERSION 1u
+
+typedef struct hotness_profile_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t policy;       // HOTNESS_POLICY
+    uint32_t coeffs;       // EXPONENTIAL_COEFFS_NUMBER
+    uint32_t thresholds;   // number of tier boundaries
+    uint32_t thresh_valid; // bit i: thresh[i] is valid
+    uint32_t reserved;
+    double thresh[HOTNESS_MAX_THRESHOLDS];
+    uint64_t count;
+} hotness_profile_header_t;
+
+typedef struct hotness_profile_entry {
+    uint64_t hash;
+    uint64_t total_size; // allocated when the profile was saved
+    double f;            // hotness
+    double coeffs[EXPONENTIAL_COEFFS_NUMBER];
+} hotness_profile_entry_t;
+
+/// @brief save hotness of measured types and thresholds to @p path
+/// @note the file is replaced atomically; ranking events and touches must
+/// not be processed meanwhile
+/// @return 0 on success, -1 on error
+int hotness_profile_save(const char *path);
+
+/// @brief preload types and thresholds from profile @p path
+/// @p timestamp time the loaded hotness is valid at (ranking event clock)
+/// @return number of types loaded, -1 if @p path is not a valid profile
+ptrdiff_t hotness_profile_load(const char *path, uint64_t timestamp);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "sys/types.h"
+
+#include "memkind_memtier.h" // only for config macros
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Live statistics of the data hotness pipeline
+///
+/// The PEBS monitor thread publishes a snapshot of memtier, tachanka and
+/// PEBS state once per cycle to a page mapped from
+/// /dev/shm/memkind_hotness_stats.<pid>, so that a running process can be
+/// watched from outside (see utils/hotness_stats) - without debug builds
+/// and without logging. The file is created exclusively and is readable only
+/// by the owner of the process.
+///
+/// The page has a single writer and is protected with a sequence counter:
+/// the writer makes it odd for the time of the update, readers copy the
+/// page and retry if the counter was odd or has changed meanwhile. Readers
+/// never block the writer.
+///
+/// Layout is versioned - fields are only appended, readers check magic,
+/// version and size of the page.
+
+#define HOTNESS_STATS_MAGIC   0x5354415453544f48ull // "HOTSTATS"
+#define HOTNESS_STATS_VERSION 3u
+#define HOTNESS_STATS_PATH    "/dev/shm/memkind_hotness_stats.%d"
+/// number of EventType_t values with latency histogram
+#define HOTNESS_STATS_EVENT_TYPES 8u
+/// bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one - longer
+#define HOTNESS_STATS_LATENCY_BUCKETS 24u
+/// page purity visits all tracked blocks - it is recalculated once per this
+/// many updates
+#define HOTNESS_STATS_PURITY_INTERVAL 10u
+
+typedef struct hotness_stats {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size;     // size of the page written by the process
+    uint64_t sequence; // odd while the page is updated
+    int64_t pid;
+    uint64_t timestamp; // CLOCK_MONOTONIC of the last update [ns]
+    uint64_t cycles;    // PEBS monitor cycles
+
+    // memtier - tiers ordered by hotness
+    uint64_t tiers;
+    uint64_t tier_size[HOTNESS_MAX_TIERS]; // allocated bytes
+    double hot_total_desired_ratio;
+    double hot_total_actual_ratio;
+
+    // tachanka - one entry per tier boundary
+    uint64_t thresholds;
+    double thresh[HOTNESS_MAX_THRESHOLDS];
+    uint64_t thresh_valid[HOTNESS_MAX_THRESHOLDS];
+    double controller_error[HOTNESS_MAX_THRESHOLDS];
+    double controller_integral[HOTNESS_MAX_THRESHOLDS];
+    uint64_t types;
+    uint64_t blocks;
+
+    // ranking event rings
+    uint64_t event_rings;
+    uint64_t events_pushed;
+    uint64_t events_overflowed;
+    uint64_t events_dropped;
+    uint64_t events_popped;
+    uint64_t event_queue_depth; // pushed and not yet popped
+
+    // PEBS
+    uint64_t pebs_samples;
+    uint64_t pebs_lost;
+    uint64_t pebs_dropped;
+    double pebs_samples_per_second; // since the previous update
+    double pebs_lost_per_second;
+
+    // processing time of ranking events by EventType_t
+    uint64_t event_latency[HOTNESS_STATS_EVENT_TYPES]
+                          [HOTNESS_STATS_LATENCY_BUCKETS];
+
+    // version 2: adaptive PEBS period
+    uint64_t pebs_period;
+    double pebs_overhead; // CPU time of draining PEBS rings per second
+
+    // version 3: arena classes
+    double page_purity; // see tachanka_get_page_purity(), -1 if unknown
+} hotness_stats_t;
+
+/// @return latency histogram bucket of @p ns nanoseconds
+static inline unsigned hotness_stats_latency_bucket(uint64_t ns)
+{
+    unsigned bucket = ns ? 63u - (unsigned)__builtin_clzll(ns) : 0u;
+    return bucket < HOTNESS_STATS_LATENCY_BUCKETS
+        ? bucket
+        : HOTNESS_STATS_LATENCY_BUCKETS - 1u;
+}
+
+/// @brief create the stats page of the calling process
+/// @note page of the parent process, inherited after fork, is dropped
+/// @return 0 on success, -1 if the page cannot be created
+int hotness_stats_open(void);
+
+/// @brief unmap and remove the stats page
+void hotness_stats_close(void);
+
+/// @return true if the stats page is published
+bool hotness_stats_enabled(void);
+
+/// @brief copy @p stats to the stats page; header fields are filled in
+/// @note single writer only; no-op if the page is not published
+void hotness_stats_publish(const hotness_stats_t *stats);
+
+/// @return stats page of process @p pid mapped read-only, NULL if it does
+/// not exist or is not a page of supported version
+const hotness_stats_t *hotness_stats_map(pid_t pid);
+
+void hotness_stats_unmap(const hotness_stats_t *page);
+
+/// @brief take a consistent snapshot of @p page
+/// @return 0 on success, -1 if the writer keeps updating the page
+int hotness_stats_read(const hotness_stats_t *page,
+                       hotness_stats_t *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
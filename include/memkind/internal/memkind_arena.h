@@ -20,6 +20,9 @@ extern "C" {
 
 struct memkind *get_kind_by_arena(unsigned arena_ind);
 struct memkind *memkind_arena_detect_kind(void *ptr);
+struct memkind *memkind_arena_detect_kind_lookup(void *ptr);
+void memkind_arena_map_extent(void *addr, size_t size, unsigned arena_ind);
+void memkind_arena_unmap_extent(void *addr, size_t size, unsigned arena_ind);
 int memkind_arena_create(struct memkind *kind, struct memkind_ops *ops,
                          const char *name);
 int memkind_arena_create_map(struct memkind *kind, extent_hooks_t *hooks);
@@ -53,6 +56,20 @@ void *memkind_arena_defrag_reallocate(struct memkind *kind, void *ptr);
 void *memkind_arena_defrag_reallocate_with_kind_detect(void *ptr);
 bool memkind_get_hog_memory(void);
 void memkind_set_hog_memory(const char *str);
+void memkind_arena_set_extent_release_hook(void (*hook)(void *addr,
+                                                        size_t size));
+int memkind_arena_create_classes(struct memkind *kind, unsigned classes);
+unsigned memkind_arena_get_classes(struct memkind *kind);
+void *memkind_arena_class_malloc(struct memkind *kind, unsigned cls,
+                                 size_t size);
+void *memkind_arena_class_calloc(struct memkind *kind, unsigned cls,
+                                 size_t num, size_t size);
+int memkind_arena_class_posix_memalign(struct memkind *kind, unsigned cls,
+                                       void **memptr, size_t alignment,
+                                       size_t size);
+void *memkind_arena_class_realloc(struct memkind *kind, void *ptr,
+                                  size_t size);
+bool memkind_arena_class_free(void *ptr);
 int memkind_arena_stats_print(void (*write_cb)(void *, const char *),
                               void *cbopaque, memkind_stat_print_opt opts);
 #ifdef __cplusplus
@@ -34,6 +34,9 @@ typedef enum memtier_policy_t
 
     /**
      * Hotness prediction policy
+     * Supports 2 to HOTNESS_MAX_TIERS tiers, ordered by hotness in the order
+     * they were added to the builder (hottest first); in the two tier
+     * configuration MEMKIND_DEFAULT is always the hot tier
      */
     MEMTIER_POLICY_DATA_HOTNESS = 2,
 
@@ -233,13 +236,57 @@ double memtier_kind_get_actual_hot_to_total_desired_ratio(void);
 
 size_t memtier_kind_get_total_size(void);
 
+// per-thread allocation statistics, see memkind_memtier.c
+#define THREAD_BUCKETS  (256U)
+#define FLUSH_THRESHOLD (51200LL)
+
+/// @brief get allocated size of @p kind without folding per-thread
+/// allocation statistics, as seen by the static ratio policy
+/// @note differs from memtier_kind_allocated_size() by at most
+/// min(threads, THREAD_BUCKETS) * FLUSH_THRESHOLD bytes
+size_t memtier_kind_allocated_size_unflushed(memkind_t kind);
+
+/// @brief fold per-thread allocation statistics of data hotness tiers
+/// into global ones and update actual tier ratios
+/// @note called periodically from the PEBS thread, bounds the staleness
+/// of hot/total ratio in time
+void memtier_flush_alloc_size(void);
+
+/// @brief move accounting of @p size bytes between hot and cold tiers
+/// @p to_hot true if the bytes were migrated from cold to hot tier
+/// @note used by the page migration engine; the memory remains owned by
+/// the kind it was allocated from, so the opposite transfer has to be
+/// applied before the memory is released
+void memtier_policy_data_hotness_transfer_size(bool to_hot, size_t size);
+
+/// @brief get allocated size of data hotness tiers, ordered by hotness
+/// @p sizes array of HOTNESS_MAX_TIERS elements
+/// @return number of tiers, 0 if data hotness policy is not used
+/// @note values are as fresh as the last memtier_flush_alloc_size()
+size_t memtier_policy_data_hotness_get_tier_sizes(size_t *sizes);
+
 // DEBUG
 // float get_obj_hotness(int size);
 
 // PEBS
 extern double sampling_interval;
 extern double pebs_freq_hz;
+// data pages of each PEBS ring (power of 2)
+extern unsigned long long pebs_ring_pages;
+// open one PEBS event (and ring) per cpu instead of one for the process
+extern bool pebs_per_cpu;
+// threads draining PEBS rings, including the PEBS monitor thread
+extern unsigned long long pebs_consumer_threads;
+// source of memory access samples, SAMPLE_SOURCE_* (see sample_source.h)
+extern int hotness_sample_source;
+// target CPU overhead of PEBS (fraction of one core), 0 - fixed period
+extern double pebs_overhead_target;
+// samples per type per measure window wanted by adaptive period
+extern unsigned long long pebs_type_samples;
 #define MMAP_DATA_SIZE   8
+#define PEBS_PER_CPU_DEFAULT false
+#define PEBS_CONSUMER_THREADS_DEFAULT 1
+#define PEBS_CONSUMER_THREADS_MAX 64
 
 // critnib
 // #define INIT_MALLOC_HOTNESS   20u
@@ -248,14 +295,34 @@ extern double pebs_freq_hz;
 #define MAXBLOCKS           16*1024*1024
 
 // bthash
-#define CUSTOM_BACKTRACE 1
+#define BTHASH_STACK_SCAN 0
+#define BTHASH_BACKTRACE 1
+#define BTHASH_FRAME_POINTERS 2
+#define BTHASH_METHOD BTHASH_FRAME_POINTERS
+// number of return addresses hashed by BTHASH_FRAME_POINTERS
+#define BTHASH_FRAME_DEPTH 8
+// per-thread memo of return address classification, power of 2
+#define BTHASH_MEMO_ENTRIES 512
+// per-thread direct-mapped cache of hash -> tier decisions on allocation
+// path, invalidated each time thresholds are recalculated
+#define TIER_DECISION_CACHE_ENABLED 1
+// power of 2; 16 bytes each
+#define TIER_DECISION_CACHE_ENTRIES 1024
+// return fully free 2MB chunks of tachanka metadata (tblocks, critnib
+// nodes) to the OS once per PEBS monitor cycle
+#define METADATA_RELEASE_ENABLED 1
 #define STACK_RANGE 1
 #define STACK_RANGE_NO_SEARCH 0
 #define STACK_RANGE_REDUCED 1
 #define STACK_RANGE_REGULAR 2
 #define STACK_RANGE_OPTION STACK_RANGE_NO_SEARCH
-#define SIMD_INSTRUCTIONS 0
-#define LIB_BINSEARCH 0
+// lookup in index of executable mappings
+#define EXEC_MAPS_SEARCH_LINEAR 0
+#define EXEC_MAPS_SEARCH_BINARY 1
+#define EXEC_MAPS_SEARCH_EYTZINGER 2
+#define EXEC_MAPS_SEARCH_AVX2 3
+#define EXEC_MAPS_SEARCH_AVX512 4
+#define EXEC_MAPS_SEARCH EXEC_MAPS_SEARCH_EYTZINGER
 #define FINALIZE_HASH 0
 
 // hotness calculation
@@ -265,6 +332,14 @@ extern double old_time_window_hotness_weight;
 #define DEFAULT_HOTNESS_MEASURE_WINDOW  1000000000 // time window is 1s
 #define DEFAULT_OLD_HOTNESS_WINDOW_WEIGHT  0.4
 #define RANKING_BUFFER_SIZE_ELEMENTS    1000000 // TODO make tests, add error handling and come up with some sensible value
+// size of ranking event ring of each producer thread
+#define RANKING_EVENT_RING_ENTRIES      8192
+// events are popped from rings in batches of this size
+#define RANKING_EVENT_BATCH_ENTRIES     1024
+// destroy events that arrived before their create event are kept
+// for this long [ns], at most RANKING_PENDING_DESTROYS_MAX of them
+#define RANKING_PENDING_DESTROY_TIMEOUT 1000000000
+#define RANKING_PENDING_DESTROYS_MAX    1024
 #define RANKING_TOUCH_ALL 0
 
 // logging
@@ -309,6 +384,19 @@ extern double old_time_window_hotness_weight;
 
 #define QUANTIFICATION_ENABLED 0
 #define INTERPOLATED_THRESH 1
+
+// data structure that aggregates size per hotness in ranking
+// weighted AVL tree, one node per distinct (quantified) hotness
+#define RANKING_BACKEND_WRE 0
+// log-bucketed histogram with a Fenwick tree over buckets
+#define RANKING_BACKEND_HISTOGRAM 1
+#define RANKING_BACKEND RANKING_BACKEND_HISTOGRAM
+// histogram buckets: 2^RANKING_HISTOGRAM_SUB_BUCKETS_LOG2 buckets per octave
+// of hotness in [2^RANKING_HISTOGRAM_MIN_EXP, 2^RANKING_HISTOGRAM_MAX_EXP);
+// lower hotness (e.g. 0) goes to the first bucket, higher - to the last one
+#define RANKING_HISTOGRAM_SUB_BUCKETS_LOG2 7
+#define RANKING_HISTOGRAM_MIN_EXP (-64)
+#define RANKING_HISTOGRAM_MAX_EXP 64
 #define FALLBACK_TO_STATIC 1
 
 #define RANKING_CONTROLLER_ENABLED 1
@@ -316,6 +404,21 @@ extern double old_time_window_hotness_weight;
 // #define CONTROLLER_INTEGRAL_GAIN_PER_SECOND 50
 #define CONTROLLER_PROPORTIONAL_GAIN 0.3
 #define CONTROLLER_INTEGRAL_GAIN_PER_SECOND 0.1
+// largest change of the ratio passed to threshold search, per second;
+// 0 - unlimited
+#define CONTROLLER_MAX_RATE_PER_SECOND 0.5
+// error is not integrated while used ratio differs from the one selected by
+// the threshold in force by more than this (data being moved) for up to
+// CONTROLLER_TRACKING_WINDOW_SECONDS; steady difference is integrated unless
+// placement does not follow the threshold (hot tier exhausted);
+// 0 - always integrated
+#define CONTROLLER_TRACKING_LIMIT 0.1
+#define CONTROLLER_TRACKING_WINDOW_SECONDS 5.0
+// gain of controller feed-forward term: difference between used ratio and
+// the ratio selected by the threshold in force (ranking's weighted CDF) is
+// compensated directly, without waiting for the integral term; 0 - disabled,
+// can be set with HOTNESS_CONTROLLER_FEED_FORWARD env variable
+#define DEFAULT_HOTNESS_CONTROLLER_FEED_FORWARD 0.0
 
 // TODO temporary fix for issue - background thread overload
 // as a result of overload, threshold was not calculated
@@ -339,9 +442,107 @@ extern double old_time_window_hotness_weight;
 // smaller value -> more frequent sampling
 // 10000 = around 100 samples on *my machine* / sec in matmul test
 #define HOTNESS_PEBS_SAMPLING_INTERVAL 1000
-
+// sampling period is retuned every PEBS thread cycle to keep CPU time of
+// draining PEBS rings at this fraction of one core, can be set with
+// HOTNESS_PEBS_OVERHEAD env variable; 0 - period is fixed
+#define DEFAULT_HOTNESS_PEBS_OVERHEAD 0.01
+// samples per tracked type per measure window wanted for its ranking;
+// period is not made shorter once they are collected, can be set with
+// HOTNESS_PEBS_TYPE_SAMPLES env variable
+#define DEFAULT_HOTNESS_PEBS_TYPE_SAMPLES 16u
+#define HOTNESS_PEBS_PERIOD_MIN 100u
+#define HOTNESS_PEBS_PERIOD_MAX 10000000u
+// largest change of period in one cycle (factor)
+#define HOTNESS_PEBS_PERIOD_STEP 2.0
+// period is not reprogrammed if it would change by less than this fraction
+#define HOTNESS_PEBS_PERIOD_HYSTERESIS 0.1
+// PEBS samples are resolved to types and applied to ranking in batches
+// of up to this size: one ranking update per touched type per batch;
+// a full perf ring (MMAP_DATA_SIZE pages) fits in a single batch
+#define PEBS_TOUCH_BATCH_ENTRIES 2048
+
+// gains for nominal frequency; scheduled by actual pebs_freq_hz at runtime,
+// see ranking_set_controller_params()
 #define CONTROLLER_INTEGRAL_GAIN \
     (CONTROLLER_INTEGRAL_GAIN_PER_SECOND/HOTNESS_PEBS_THREAD_FREQUENCY)
+#define CONTROLLER_MAX_STEP \
+    (CONTROLLER_MAX_RATE_PER_SECOND/HOTNESS_PEBS_THREAD_FREQUENCY)
+#define CONTROLLER_TRACKING_WINDOW \
+    (CONTROLLER_TRACKING_WINDOW_SECONDS*HOTNESS_PEBS_THREAD_FREQUENCY)
+
+// maximum number of tiers supported by data hotness policy;
+// tiers are ordered by hotness, one threshold (and one ranking controller)
+// is used per boundary between neighbouring tiers
+#define HOTNESS_MAX_TIERS 4
+#define HOTNESS_MAX_THRESHOLDS (HOTNESS_MAX_TIERS-1)
+
+// page migration
+// pages of blocks whose type changed its hot/cold classification are moved
+// between hot and cold NUMA node by the PEBS thread;
+// budget (bytes per PEBS thread cycle) can be set with
+// HOTNESS_MIGRATION_BUDGET env variable, 0 disables migration
+#define HOTNESS_MIGRATION_ENABLED 1
+#define DEFAULT_HOTNESS_MIGRATION_BUDGET 0
+// limits the number of blocks moved per cycle
+#define HOTNESS_MIGRATION_MAX_BLOCKS_PER_CYCLE 1024
+// limits the time spent in critnib_iter (under critnib mutex) per cycle -
+// the next cycle continues where this one stopped
+#define HOTNESS_MIGRATION_MAX_VISITS_PER_CYCLE 16384
+// pages of freed migrated blocks are moved back in the next cycles, within
+// the budget; when more of them wait, pages of the oldest stay where they are
+#define HOTNESS_MIGRATION_MOVE_BACKS_MAX 4096
+#define PRINT_PAGE_MIGRATION_INFO 0
+
+// tracking granularity of data hotness policy, can be set with
+// HOTNESS_TRACKING_GRANULARITY env variable ("block" or "run"):
+//  - block: each allocation is a separate tblock, with one create and one
+//           destroy event,
+//  - run:   allocations up to HOTNESS_TRACKING_RUN_MAX_OBJECT bytes are
+//           aggregated per page run (HOTNESS_TRACKING_RUN_SIZE aligned
+//           range) into one tblock, attributed to the type that allocated
+//           in the run first; size deltas are accumulated per thread and
+//           sent in batches
+#define HOTNESS_TRACKING_BLOCK 0
+#define HOTNESS_TRACKING_RUN 1
+#define DEFAULT_HOTNESS_TRACKING_GRANULARITY HOTNESS_TRACKING_BLOCK
+// power of 2
+#define HOTNESS_TRACKING_RUN_SIZE (64u << 10)
+// jemalloc size class - compared with usable size of objects
+#define HOTNESS_TRACKING_RUN_MAX_OBJECT 4096u
+// per-thread direct-mapped cache of pending run deltas, power of 2
+#define HOTNESS_TRACKING_RUN_CACHE_ENTRIES 16
+// allocated + freed bytes pending in a cache entry that trigger an update
+#define HOTNESS_TRACKING_RUN_FLUSH_BYTES (16u << 10)
+
+// mean number of allocated bytes between sampled allocations, can be set
+// with HOTNESS_ALLOC_SAMPLE_INTERVAL env variable; only sampled allocations
+// are tracked as tblocks (with size scaled by inverse of their sampling
+// probability), frees of the others skip the event queue; 0 - all
+// allocations are tracked
+#define DEFAULT_HOTNESS_ALLOC_SAMPLE_INTERVAL 0u
+// number of allocation-site clusters with separate jemalloc arenas in each
+// kind of data hotness policy, can be set with HOTNESS_ARENA_CLUSTERS env
+// variable; allocations of types that have a tier decision go to arena of
+// their cluster (hash of the type), the others - placed by static ratio -
+// to a separate one, so that objects of different hotness rarely share
+// pages; 0 - arenas of kinds are used
+#define DEFAULT_HOTNESS_ARENA_CLUSTERS 0u
+#define HOTNESS_ARENA_CLUSTERS_MAX 16u
+// publish live statistics of data hotness policy on a shared memory page
+// (see hotness_stats.h, read with utils/hotness_stats), can be set with
+// HOTNESS_STATS_PAGE env variable (0 or 1)
+#define DEFAULT_HOTNESS_STATS_PAGE 0
+// source of memory access samples of data hotness policy (see
+// sample_source.h), can be set with HOTNESS_SAMPLE_SOURCE env variable:
+// "auto", "pebs", "idle_page", "synthetic" or "none"
+#define DEFAULT_HOTNESS_SAMPLE_SOURCE "auto"
+// pages scanned by idle_page sample source per PEBS thread cycle, can be
+// set with HOTNESS_IDLE_PAGE_SCAN_BUDGET env variable
+#define DEFAULT_HOTNESS_IDLE_PAGE_SCAN_BUDGET 4096u
+// buckets of the set of sampled allocations, power of 2
+#define HOTNESS_ALLOC_SAMPLE_BUCKETS (1u << 16)
+// mutexes protecting the buckets, power of 2
+#define HOTNESS_ALLOC_SAMPLE_LOCKS 64u
 
 // ENUM-LIKE #defs
 #define HOTNESS_POLICY_TOTAL_COUNTER 0
@@ -388,6 +589,19 @@ static const double
 EXPONENTIAL_COEFFS_CONMPENSATION_COEFFS[EXPONENTIAL_COEFFS_NUMBER] = {
     1.00000000e+0, 9.53899645e-02, 9.49597036e-03, 9.49169617e-04};
 
+/// Precalculated natural logarithms of EXPONENTIAL_COEFFS_VALS;
+/// coeff^seconds_diff is calculated as exp(seconds_diff*log(coeff))
+static const double
+EXPONENTIAL_COEFFS_LOG_VALS[EXPONENTIAL_COEFFS_NUMBER] = {
+    -0.10536051565782628, -0.01005033585350145, -0.0010005003335835344,
+    -0.00010000500033334732};
+
+// update of hotness_history_coeffs
+#define EXPONENTIAL_COEFFS_UPDATE_POW 0
+// exp() approximation, all coeffs at once (AVX2 if available)
+#define EXPONENTIAL_COEFFS_UPDATE_FAST_EXP 1
+#define EXPONENTIAL_COEFFS_UPDATE EXPONENTIAL_COEFFS_UPDATE_FAST_EXP
+
 #define HOTNESS_POLICY HOTNESS_POLICY_EXPONENTIAL_COEFFS
 #define CONTROLLER_TRANSFORM_ENABLED 0
 
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "stdbool.h"
+#include "stddef.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Page migration engine used by MEMTIER_POLICY_DATA_HOTNESS
+///
+/// Blocks are placed in a tier at allocation time; once the hotness of their
+/// type changes, their pages can be moved between the hot (DRAM) and the cold
+/// (e.g. PMEM/DAX_KMEM) NUMA node. Migration is driven from the PEBS thread,
+/// see tachanka_migrate_blocks().
+
+typedef struct page_migration_stats {
+    size_t movedBytes;   /// bytes successfully moved since init
+    size_t failedPages;  /// pages that move_pages() failed to move
+    size_t cycles;       /// number of migration cycles executed
+} page_migration_stats_t;
+
+/// @p hot_node NUMA node of the hot tier, -1 if unknown
+/// @p cold_node NUMA node of the cold tier, -1 if unknown
+/// @p budget maximum number of bytes moved per migration cycle,
+/// 0 disables migration
+extern void page_migration_init(int hot_node, int cold_node, size_t budget);
+extern bool page_migration_enabled(void);
+extern size_t page_migration_get_budget(void);
+extern size_t page_migration_get_page_size(void);
+
+/// @return number of bytes in pages fully contained in
+/// [@p addr, @p addr + @p size) - the most page_migration_move() can move
+extern size_t page_migration_movable_size(const void *addr, size_t size);
+
+/// @brief move pages fully contained in [@p addr, @p addr + @p size)
+/// to the hot (@p to_hot true) or to the cold tier
+/// @note partial pages are skipped - they might be shared with neighbouring
+/// allocations
+/// @return number of bytes that reside on the destination node
+extern size_t page_migration_move(void *addr, size_t size, bool to_hot);
+
+extern void page_migration_cycle_done(void);
+extern void page_migration_get_stats(page_migration_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <linux/hw_breakpoint.h> /* Definition of HW_* constants */
 #include <linux/perf_event.h>    /* Definition of PERF_* constants */
@@ -32,6 +33,41 @@ void pebs_fini();
 void pebs_fork(pid_t pid);
 void pebs_set_process_hardware_touches(bool process);
 
+typedef struct pebs_stats {
+    size_t rings;        // opened PEBS events (one per cpu or one in total)
+    size_t consumers;    // threads draining rings
+    size_t samples;      // PERF_RECORD_SAMPLE records read
+    size_t lost;         // samples lost by kernel, from PERF_RECORD_LOST
+    size_t lost_records; // PERF_RECORD_LOST records read
+    size_t dropped;      // samples dropped - too many types in one cycle
+    uint64_t busy_ns;    // CPU time of consumers draining rings
+    uint64_t period;     // current sampling period (events per sample)
+    double overhead;     // busy time per second in the last cycle
+} pebs_stats_t;
+
+/// \brief Get cumulative PEBS statistics
+/// \note counters are updated concurrently, values are approximate
+void pebs_get_stats(pebs_stats_t *stats);
+
+typedef struct pebs_period_input {
+    uint64_t period;        // current sampling period
+    double seconds;         // since the previous adaptation
+    size_t samples;         // read meanwhile
+    size_t lost;            // lost by kernel meanwhile
+    uint64_t busy_ns;       // CPU time of consumers meanwhile
+    double overhead_target; // wanted busy time per second
+    double wanted_rate;     // samples per second enough for ranking
+} pebs_period_input_t;
+
+/// \brief Choose sampling period for the next cycle
+///
+/// Rate of samples is aimed at the lower of: the rate whose draining costs
+/// overhead_target (cost of a sample is measured) and wanted_rate; lost
+/// samples (ring overflow) make the period longer. The period changes by
+/// at most HOTNESS_PEBS_PERIOD_STEP times per call and stays within
+/// [HOTNESS_PEBS_PERIOD_MIN, HOTNESS_PEBS_PERIOD_MAX]
+uint64_t pebs_period_adapt(const pebs_period_input_t *in);
+
 #ifdef __cplusplus
 }
 #endif
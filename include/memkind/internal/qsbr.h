@@ -0,0 +1,60 @@
+#pragma once
+
+#include "stddef.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Quiescent state based reclamation of tachanka metadata
+///
+/// Lookups of tachanka structures (critnib trees, tblocks) are done without
+/// locks from application threads, while the PEBS thread removes entries.
+/// Removed memory is retired instead of freed and reclaimed only after every
+/// thread that could have seen it passed through a quiescent state.
+///
+/// Threads are quiescent by default - they announce a read-side section with
+/// qsbr_online() and leave it with qsbr_offline(), so threads that do not
+/// look up tachanka metadata (or are blocked outside of it) never delay
+/// reclamation. A long lived reader can report quiescence without going
+/// offline with qsbr_quiescent().
+///
+/// Grace periods are driven by qsbr_reclaim(), called periodically by the
+/// writer (once per PEBS monitor cycle).
+
+typedef void (*qsbr_free_fn)(void *ptr, void *arg);
+
+/// @brief enter read-side section, nesting is allowed
+/// @note pointers obtained in the section stay valid until matching
+/// qsbr_offline()
+extern void qsbr_online(void);
+
+/// @brief leave read-side section
+extern void qsbr_offline(void);
+
+/// @brief report that calling thread holds no pointers obtained so far,
+/// stays in read-side section
+/// @pre called between qsbr_online() and qsbr_offline()
+extern void qsbr_quiescent(void);
+
+/// @brief defer @p free_fn(@p ptr, @p arg) until no thread can access @p ptr
+/// @pre @p ptr is already unreachable for new readers
+/// @note thread-safe
+extern void qsbr_retire(void *ptr, qsbr_free_fn free_fn, void *arg);
+
+/// @brief start a new grace period and free memory retired in completed ones
+/// @return number of freed objects
+/// @note concurrent calls do not wait - only one of them reclaims
+extern size_t qsbr_reclaim(void);
+
+/// @return number of retired, not yet freed objects
+extern size_t qsbr_pending(void);
+
+/// @brief drop retired objects with @p arg without calling their free_fn
+/// @note used when the owner of retired memory releases it as a whole,
+/// e.g. destroys the allocator it came from
+extern void qsbr_forget(void *arg);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,6 +2,7 @@
 #include "stdbool.h"
 #include "stdlib.h"
 
+#include "memkind/internal/ranking_controller.h"
 #include "memkind/internal/tachanka.h"
 
 typedef struct ranking ranking_t;
@@ -28,6 +29,11 @@ typedef struct thresh_t {
 ///     - @p old_weight is the weight of old hotness,
 ///     - (1 - @p old_weight) is the weight of current frequency
 extern void ranking_create(ranking_t **ranking, double old_weight);
+/// @brief same as ranking_create(), with explicit @p backend
+/// @p backend RANKING_BACKEND_WRE or RANKING_BACKEND_HISTOGRAM;
+/// ranking_create() uses RANKING_BACKEND
+extern void ranking_create_backend(ranking_t **ranking, double old_weight,
+                                   int backend);
 extern void ranking_destroy(ranking_t *ranking);
 extern void ranking_add(ranking_t *ranking, double hotness, size_t size);
 /// @p entry ownership stays with the caller
@@ -41,6 +47,23 @@ extern void ranking_touch(ranking_t *ranking, struct ttype *entry,
                           uint64_t timestamp, double add_hotness);
 extern void ranking_remove(ranking_t *ranking, double hotness, size_t size);
 
+typedef struct ranking_touch_sample {
+    struct ttype *entry;
+    uint64_t timestamp;
+    double add_hotness;
+} ranking_touch_sample_t;
+
+/// @brief apply @p count touches at once, under a single lock
+///
+/// each entry is removed from and added back to ranking once per batch,
+/// and its hotness is updated with all of its samples in one pass
+/// @pre @p samples are sorted by entry address, then by timestamp
+/// @note result is the same as ranking_touch() called for each sample
+/// in timestamp order
+extern void ranking_touch_batch(ranking_t *ranking,
+                                const ranking_touch_sample_t *samples,
+                                size_t count);
+
 // --- extended API ---
 /// @brief atomically update values of @p entry_to_update with values from @p
 /// updated_values
@@ -61,6 +84,36 @@ ranking_calculate_hot_threshold_dram_total(ranking_t *ranking,
 /// @p dram_pmem_ratio : dram/pmem (does not support 0 pmem)
 extern thresh_t ranking_calculate_hot_threshold_dram_pmem(
     ranking_t *ranking, double dram_pmem_ratio, double dram_pmem_used_ratio);
+/// @brief calculate thresholds for @p thresh_count + 1 tiers ordered by hotness
+/// @p tier_total_ratios cumulative ratios: i-th element is the desired ratio
+/// of (size of i+1 hottest tiers)/(total size)
+/// @p tier_total_used_ratios actual cumulative ratios, same layout
+/// @p thresh output array of @p thresh_count elements; thresh[i] separates
+/// tier i from tier i+1, thresholds are non-increasing
+/// @note each boundary is adjusted by a separate ranking controller;
+/// threshold 0 is the one returned by ranking_get_hot_threshold
+/// @pre @p thresh_count <= HOTNESS_MAX_THRESHOLDS
+extern void ranking_calculate_thresholds_total(
+    ranking_t *ranking, size_t thresh_count, const double *tier_total_ratios,
+    const double *tier_total_used_ratios, thresh_t *thresh);
+/// get last calculated thresholds, @p thresh_count first ones are copied
+extern void ranking_get_thresholds(ranking_t *ranking, thresh_t *thresh,
+                                   size_t thresh_count);
+/// @brief replace last calculated thresholds until the next calculation,
+/// e.g. with thresholds of a previous run
+extern void ranking_set_thresholds(ranking_t *ranking, const thresh_t *thresh,
+                                   size_t thresh_count);
+/// @brief schedule gains of all controllers for thresholds calculated
+/// @p freq_hz times per second, set gain of feed-forward term to
+/// @p feed_forward (0 - disabled)
+/// @note ranking_create() uses HOTNESS_PEBS_THREAD_FREQUENCY and
+/// DEFAULT_HOTNESS_CONTROLLER_FEED_FORWARD
+extern void ranking_set_controller_params(ranking_t *ranking, double freq_hz,
+                                          double feed_forward);
+/// get state of controllers of @p count first tier boundaries
+extern void ranking_get_controllers(ranking_t *ranking,
+                                    ranking_controller *controllers,
+                                    size_t count);
 extern bool ranking_is_hot(ranking_t *ranking, struct ttype *entry);
 extern thresh_t ranking_get_thresh(ranking_t *ranking);
 
@@ -85,3 +138,16 @@ size_t ranking_calculate_total_size(ranking_t *ranking);
 extern double
 ranking_update_coeffs(double *hotness_history_coeffs, double seconds_diff,
                       double add_hotness);
+/// @brief reference implementation of ranking_update_coeffs, using pow()
+/// @note exported for unit tests and benchmarks
+extern double
+ranking_update_coeffs_pow(double *hotness_history_coeffs, double seconds_diff,
+                          double add_hotness);
+/// @brief apply @p count samples of a single type, in order
+/// @return hotness after the last sample
+/// @pre @p count > 0
+/// @note exported for unit tests and benchmarks
+extern double ranking_update_coeffs_batch(double *hotness_history_coeffs,
+                                          const double *seconds_diffs,
+                                          const double *add_hotness,
+                                          size_t count);
@@ -1,19 +1,38 @@
 #pragma once
 
+#include "stdbool.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct ranking_info {
+    double error; // of the last calculation
     double integrated_error;
     double proportional;
     double integral;
 //     double derivative; // This would require filtering!!!
     double hotTierSize;
     double coldTierSize;
+    double output;       // of the last calculation, NAN before the first one
+    double correction;   // output - expected of the last calculation
+    double maxStep;      // largest change of correction per calculation
+    double trackingLimit; // see ranking_controller_set_limits()
+    double trackingWindow; // see ranking_controller_set_limits()
+    double feedForward;  // gain of feed-forward term, 0 - disabled
+    // calculations since used ratio left trackingLimit of the ranked one
+    double lagCalculations;
+    // state at the end of trackingWindow, to check if placement follows
+    // the threshold
+    double probeFound;
+    double probeRanked;
+    double probeIntegratedError;
+    bool placementStuck; // placement does not follow the threshold
 } ranking_controller;
 
 /// @p gain 1) has no effect (0;1) lowers response, (1;inf) amplifies response
+/// @note output change is not limited and feed-forward is disabled,
+/// see ranking_controller_set_limits()
 extern void ranking_controller_init_ranking_controller(
     ranking_controller *controller, double expected_dram_total,
     double proportional_term, double integral_term);
@@ -22,9 +41,41 @@ extern void
 ranking_controller_set_expected_dram_total(ranking_controller *controller,
                                           double expected_dram_total);
 
+/// @brief change gains, e.g. when calculation frequency changes
+/// @note integral term keeps its current value (bumpless transfer)
+extern void ranking_controller_set_gains(ranking_controller *controller,
+                                         double proportional_term,
+                                         double integral_term);
+
+/// @p max_step largest change of correction (output - expected ratio) per
+/// calculation, 0 - unlimited; changes of expected ratio are not limited
+/// @p tracking_limit error is not integrated while used ratio differs
+/// from the ratio selected by ranking by more than this for at most
+/// @p tracking_window calculations (data being moved); after that the
+/// difference is treated as steady (e.g. memory unknown to ranking) and
+/// integrated, unless placement does not follow the threshold (e.g. hot
+/// tier is exhausted); 0 - always integrated
+/// @p feed_forward gain of feed-forward term in range <0,1>, 0 - disabled
+extern void ranking_controller_set_limits(ranking_controller *controller,
+                                          double max_step,
+                                          double tracking_limit,
+                                          double tracking_window,
+                                          double feed_forward);
+
 extern double ranking_controller_calculate_fixed_thresh(
     ranking_controller *controller, double found_dram_total);
 
+/// @brief same as ranking_controller_calculate_fixed_thresh(), with
+/// feed-forward term
+/// @p ranked_dram_total ratio that the threshold in force selects according
+/// to ranking (its weighted CDF); difference between @p found_dram_total
+/// and @p ranked_dram_total is not caused by threshold choice (e.g. memory
+/// unknown to ranking, data not moved yet) and is compensated directly
+extern double
+ranking_controller_calculate_fixed_thresh_ff(ranking_controller *controller,
+                                             double found_dram_total,
+                                             double ranked_dram_total);
+
 #ifdef __cplusplus
 }
 #endif
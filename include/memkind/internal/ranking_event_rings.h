@@ -0,0 +1,59 @@
+#pragma once
+
+#include "stdbool.h"
+#include "stddef.h"
+
+#include "ranking_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Per-thread ranking event rings
+///
+/// Every producer thread pushes onto its own single-producer single-consumer
+/// ring, so there is no cross-core cache line sharing on malloc/free path.
+/// Rings are registered in a global list on first push and are drained in
+/// batches by a single consumer (PEBS thread).
+///
+/// When the ring of a thread is full:
+///     - events that have to be delivered (e.g. EVENT_DESTROY_REMOVE) are
+///       put on a global, unbounded overflow list,
+///     - remaining events are dropped.
+/// Both situations are counted in ring statistics.
+///
+/// @warning events from different rings are not ordered; the consumer has
+/// to use EventEntry_t timestamp if the order matters
+
+typedef struct ranking_event_rings_stats {
+    size_t rings;       /// number of registered rings
+    size_t pushed;      /// events pushed onto per-thread rings
+    size_t overflowed;  /// events put on the overflow list
+    size_t dropped;     /// events lost due to full ring
+    size_t popped;      /// events popped by the consumer
+} ranking_event_rings_stats_t;
+
+/// @p ring_entries number of entries of each per-thread ring,
+/// rounded up to a power of 2
+/// @note rings and overflow list of previous initialization are freed,
+/// statistics are reset
+/// @warning should not be called concurrently with push
+extern void ranking_event_rings_init(size_t ring_entries);
+extern void ranking_event_rings_fini(void);
+
+/// @p must_deliver event cannot be dropped - overflow list is used when
+/// ring is full
+/// @return false if the event was dropped
+extern bool ranking_event_rings_push(const EventEntry_t *event,
+                                     bool must_deliver);
+
+/// @brief pop up to @p max events, from all rings and overflow list
+/// @return number of events written to @p events
+/// @warning single consumer only
+extern size_t ranking_event_rings_pop_batch(EventEntry_t *events, size_t max);
+
+extern void ranking_event_rings_get_stats(ranking_event_rings_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
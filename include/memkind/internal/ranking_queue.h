@@ -18,6 +18,8 @@ typedef enum EventType
     EVENT_REALLOC,
     EVENT_TOUCH,
     EVENT_SET_TOUCH_CALLBACK,
+    EVENT_RUN_UPDATE,
+    EVENT_RUN_RELEASE,
 } EventType_t;
 
 typedef struct EventDataTouch {
@@ -33,9 +35,11 @@ typedef struct EventDataDestroyRemove {
 typedef struct EventDataRealloc {
     void *addressOld;
     void *addressNew;
-    size_t sizeOld;
+    // type of the block, used if the old block is not tracked (yet)
+    uint64_t hash;
     size_t sizeNew;
     bool isHot;
+    float weight; // see EventDataCreateAdd
 } EventDataRealloc;
 
 typedef struct EventDataCreateAdd {
@@ -43,6 +47,9 @@ typedef struct EventDataCreateAdd {
     void *address;
     size_t size;
     bool isHot;
+    // bytes represented by one byte of a sampled allocation, see
+    // alloc_sampling.h; 0 is treated as 1 - allocation is not sampled
+    float weight;
     // TODO use size in TOUCH!!!
     // idea: pass it instead of FROM_MALLOC parameter:
     // nonzero-> from_malloc, size; zero: pebs touch, not from malloc!
@@ -55,16 +62,36 @@ typedef struct EventDataSetTouchCallback {
     ;
 } EventDataSetTouchCallback;
 
+// size change of a page run, aggregated over allocations and frees
+typedef struct EventDataRunUpdate {
+    uint64_t hash; // type of the run, used if it is not tracked yet
+    void *address; // HOTNESS_TRACKING_RUN_SIZE aligned
+    size_t added;
+    size_t removed;
+    bool isHot;
+} EventDataRunUpdate;
+
+// range returned to the allocator - holds no live objects
+typedef struct EventDataRunRelease {
+    void *address;
+    size_t size;
+} EventDataRunRelease;
+
 typedef union EventData {
     EventDataTouch touchData;
     EventDataCreateAdd createAddData;
     EventDataDestroyRemove destroyRemoveData;
     EventDataRealloc reallocData;
     EventDataSetTouchCallback touchCallbackData;
+    EventDataRunUpdate runUpdateData;
+    EventDataRunRelease runReleaseData;
 } EventData_t;
 
 typedef struct EventEntry {
     EventType_t type;
+    // CLOCK_MONOTONIC [ns] at push time; orders events from different
+    // producer threads
+    __u64 timestamp;
     EventData_t data;
 } EventEntry_t;
 
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "sys/types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Sources of memory access samples for data hotness policy
+///
+/// The PEBS monitor thread asks the active source once per cycle for
+/// touches of tracked blocks gathered since the previous cycle. Sources:
+///  - pebs:      MEM_LOAD_RETIRED:L3_MISS samples (pebs.c), Intel only,
+///               needs perf events access,
+///  - idle_page: scan of pages of tracked blocks with idle page tracking -
+///               a page accessed since the previous scan touches the blocks
+///               on it; works on any CPU, needs
+///               /sys/kernel/mm/page_idle/bitmap and page frame numbers in
+///               /proc/<pid>/pagemap (CAP_SYS_ADMIN); the number of pages
+///               scanned per cycle is limited,
+///  - synthetic: touches pushed with sample_source_synthetic_push(),
+///               delivered in the next cycle - deterministic input for
+///               tests,
+///  - none:      no touches, types are placed by static ratio.
+/// With "auto", the first of pebs and idle_page that starts is used.
+
+#define SAMPLE_SOURCE_AUTO      0
+#define SAMPLE_SOURCE_PEBS      1
+#define SAMPLE_SOURCE_IDLE_PAGE 2
+#define SAMPLE_SOURCE_SYNTHETIC 3
+#define SAMPLE_SOURCE_NONE      4
+
+struct tachanka_touch_sample;
+
+typedef struct sample_source {
+    const char *name;
+    /// @brief start sampling accesses of process @p pid
+    /// @return 0 on success, -1 if the source does not work here
+    int (*start)(pid_t pid);
+    /// @pre monitor thread is stopped
+    void (*stop)(void);
+    /// @brief pass touches gathered since the previous call to tachanka
+    /// @note called once per cycle, from the thread that processes ranking
+    /// events
+    /// @return number of types touched
+    size_t (*collect)(void);
+} sample_source_t;
+
+extern const sample_source_t sample_source_idle_page;
+extern const sample_source_t sample_source_synthetic;
+
+/// @return id of source named @p name, -1 if there is no such source
+int sample_source_parse(const char *name);
+
+/// @brief set the number of pages scanned by idle_page source per cycle
+void sample_source_idle_page_set_budget(size_t pages);
+
+/// @brief queue @p count touches for synthetic source
+/// @note thread-safe
+void sample_source_synthetic_push(const struct tachanka_touch_sample *samples,
+                                  size_t count);
+
+#ifdef __cplusplus
+}
+#endif
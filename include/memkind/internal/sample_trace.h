@@ -0,0 +1,112 @@
+#pragma once
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Replayable trace of the data hotness pipeline input
+///
+/// Records ranking events (allocations, frees, reallocs) in the order they
+/// are processed by the PEBS monitor thread, PEBS samples (touches) and
+/// ends of monitor cycles, so that tachanka/ranking can be driven offline,
+/// deterministically (see utils/hotness_trace_replay).
+///
+/// File layout: SAMPLE_TRACE_HEADER_SIZE bytes of header (magic, version),
+/// followed by records. Record is one byte of type (and flags), followed by
+/// LEB128 varints:
+///  - ALLOC:   zigzag timestamp delta, hash (8 bytes, little endian),
+///             address, size,
+///  - FREE:    zigzag timestamp delta, address,
+///  - REALLOC: zigzag timestamp delta, old address, new address, size,
+///  - TOUCH:   zigzag sample timestamp delta, zigzag address delta,
+///  - CYCLE:   zigzag timestamp delta.
+/// REALLOC with known type has a flag set and is followed by hash (8 bytes,
+/// little endian). ALLOC and REALLOC of sampled allocations (see
+/// alloc_sampling.h) have a flag set and are followed by weight (4 bytes
+/// float, little endian).
+/// Event and sample timestamps come from different clocks - deltas are
+/// calculated against previous record of the same kind.
+
+#define SAMPLE_TRACE_MAGIC       "MKHTRACE"
+#define SAMPLE_TRACE_VERSION     1u
+#define SAMPLE_TRACE_HEADER_SIZE 16u
+/// upper bound of encoded record size
+#define SAMPLE_TRACE_RECORD_MAX  64u
+
+typedef enum sample_trace_type
+{
+    SAMPLE_TRACE_ALLOC = 1,
+    SAMPLE_TRACE_FREE = 2,
+    SAMPLE_TRACE_REALLOC = 3,
+    SAMPLE_TRACE_TOUCH = 4,
+    SAMPLE_TRACE_CYCLE = 5,
+} sample_trace_type_t;
+
+typedef struct sample_trace_record {
+    sample_trace_type_t type;
+    bool is_hot;        // ALLOC: block was allocated from the hot tier
+    uint64_t timestamp; // event push time or sample time [ns]
+    uint64_t hash;      // ALLOC, REALLOC: 0 if type is not known
+    uintptr_t addr;     // old address for REALLOC
+    uintptr_t new_addr; // REALLOC only
+    size_t size;        // ALLOC, REALLOC
+    float weight;       // ALLOC, REALLOC: 0 if allocation is not sampled
+} sample_trace_record_t;
+
+/// Delta encoding state, one per direction (encoder or decoder)
+typedef struct sample_trace_codec {
+    uint64_t last_event_timestamp;
+    uint64_t last_touch_timestamp;
+    uintptr_t last_touch_addr;
+} sample_trace_codec_t;
+
+/// @brief encode @p record into @p buf
+/// @pre @p buf has at least SAMPLE_TRACE_RECORD_MAX bytes
+/// @return number of bytes written
+size_t sample_trace_encode(sample_trace_codec_t *codec,
+                           const sample_trace_record_t *record, uint8_t *buf);
+
+/// @brief decode single record from @p buf
+/// @return number of bytes consumed, 0 if @p buf holds an incomplete
+/// record, -1 if data is corrupted
+ptrdiff_t sample_trace_decode(sample_trace_codec_t *codec, const uint8_t *buf,
+                              size_t len, sample_trace_record_t *record);
+
+/// @brief start recording the trace to @p path (truncated)
+/// @return 0 on success, -1 if file cannot be created
+int sample_trace_open(const char *path);
+
+/// @brief flush buffered records and stop recording
+void sample_trace_close(void);
+
+/// @return true if trace is recorded
+bool sample_trace_enabled(void);
+
+/// @brief append @p record to the trace
+/// @note thread-safe; no-op if trace is not recorded
+void sample_trace_write(const sample_trace_record_t *record);
+
+struct tachanka_touch_sample;
+/// @brief append @p count touches with one lock acquisition
+void sample_trace_write_touches(const struct tachanka_touch_sample *samples,
+                                size_t count);
+
+typedef struct sample_trace_reader sample_trace_reader_t;
+
+/// @return reader of trace at @p path or NULL if the file cannot be opened
+/// or is not a trace of supported version
+sample_trace_reader_t *sample_trace_reader_open(const char *path);
+
+/// @return 1 if @p record was read, 0 at the end of trace, -1 on error
+int sample_trace_reader_next(sample_trace_reader_t *reader,
+                             sample_trace_record_t *record);
+
+void sample_trace_reader_close(sample_trace_reader_t *reader);
+
+#ifdef __cplusplus
+}
+#endif
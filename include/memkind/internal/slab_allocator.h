@@ -2,6 +2,7 @@
 
 #include "memkind/internal/bigary.h"
 #include "stddef.h"
+#include "stdint.h"
 #include "pthread.h"
 
 #ifdef __cplusplus
@@ -17,34 +18,79 @@ extern "C" {
 
 #define USE_LOCKLESS
 
+/// number of free elements cached in a magazine; every thread keeps up to
+/// two magazines per allocator and exchanges whole magazines with a depot
+#define SLAB_ALLOC_MAGAZINE_SIZE 64
+/// number of per-thread caches a thread can hold at once, power of 2;
+/// caches are indexed by allocator id - colliding allocators evict each other
+#define SLAB_ALLOC_THREAD_CACHES 16
+/// with NUMA depots, threads return magazines to the depot of their node
+/// and reuse elements from it first
+#define SLAB_ALLOC_NUMA_DEPOTS 0
+#define SLAB_ALLOC_MAX_DEPOTS 8
+/// unit of memory returned to the OS by slab_alloc_release_free_chunks()
+#define SLAB_ALLOC_CHUNK_SIZE (2u << 20)
+
 // -------- typedefs ----------------------------------------------------------
 
 /// metadata
-#ifdef USE_LOCKLESS
-typedef _Atomic(struct freelist_node_meta*) freelist_node_thread_safe_meta_ptr;
-#else
-typedef struct freelist_node_meta* freelist_node_thread_safe_meta_ptr;
-#endif
-
 typedef struct freelist_node_meta {
-    // pointer required to know how to free and which free lists to put it on
-    struct slab_alloc *allocator;
+    union {
+        // pointer required to know how to free and which free lists to put
+        // it on; overwritten while the element heads a magazine in a depot
+        struct slab_alloc *allocator;
+        struct freelist_node_meta *nextMagazine;
+    };
 //     size_t size; not stored - all allocations have the same size
+    // next free element of the same magazine
     struct freelist_node_meta *next;
 } freelist_node_meta_t;
 
-typedef struct glob_free_list {
-    freelist_node_thread_safe_meta_ptr freelist;
+/// stack of magazines (lists of free elements)
+typedef struct slab_depot {
+#ifdef USE_LOCKLESS
+    // index of the top magazine head + 1 (0 - empty) in lower 32 bits,
+    // version in upper 32 bits - incremented on every change to avoid ABA
+    _Atomic(uint64_t) top;
+#else
+    freelist_node_meta_t *top;
     pthread_mutex_t mutex;
-} glob_free_list_t;
+#endif
+} slab_depot_t;
+
+struct slab_thread_cache;
+
+typedef struct slab_chunk {
+    // elements outside of depots (allocated or cached by threads),
+    // as seen by the last release
+    uint32_t live;
+    // memory returned to the OS, elements are in no free list
+    uint32_t released;
+} slab_chunk_t;
 
 typedef struct slab_alloc {
-    glob_free_list_t globFreelist;
+    slab_depot_t depots[SLAB_ALLOC_MAX_DEPOTS];
+    size_t depotsCount;
     bigary mappedMemory;
     size_t elementSize;
     // TODO stdatomic would poses issues to c++,
     // a wrapper might be necessary
     atomic_size_t used;
+    // unique among all allocators, also the ones already destroyed
+    uint64_t id;
+    // per-thread caches of this allocator
+    struct slab_thread_cache *threadCaches;
+    pthread_mutex_t threadCachesMutex;
+    // free elements in depots
+    atomic_size_t depotElements;
+    // --- release of free chunks, protected by chunksMutex
+    pthread_mutex_t chunksMutex;
+    size_t depotElementsAfterRelease;
+    slab_chunk_t *chunks;
+    size_t chunksCapacity;
+    size_t *releasedChunks;
+    atomic_size_t releasedCount;
+    size_t releasedSize;
 } slab_alloc_t;
 
 // -------- public functions --------------------------------------------------
@@ -54,6 +100,17 @@ extern void slab_alloc_destroy(slab_alloc_t *alloc);
 extern void *slab_alloc_malloc(slab_alloc_t *alloc);
 extern void slab_alloc_free(void *addr);
 
+/// @brief return memory of chunks whose elements are all free to the OS
+/// and put remaining free elements of the densest chunks on top of depots
+/// @return number of released bytes
+/// @note intended to be called periodically by a single thread; skipped
+/// when not enough elements were freed since the previous release.
+/// Elements cached by threads are not free from the depot's point of view.
+extern size_t slab_alloc_release_free_chunks(slab_alloc_t *alloc);
+
+/// @return size of created elements, without released chunks
+extern size_t slab_alloc_resident_size(slab_alloc_t *alloc);
+
 #ifdef __cplusplus
 }
 #endif
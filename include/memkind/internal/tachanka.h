@@ -32,19 +32,175 @@ void unregister_block(void *addr);
 void realloc_block(void *addr, void *new_addr, size_t size);
 void *new_block(size_t size);
 void touch(void *addr, __u64 timestamp, int from_malloc);
+
+typedef struct tachanka_touch_sample {
+    void *addr;
+    __u64 timestamp;
+} tachanka_touch_sample_t;
+
+/// \brief Apply a batch of sampled accesses to ranking
+///
+/// Samples are sorted by address and resolved to blocks in a single pass
+/// (consecutive samples of one block need only one lookup), then touches
+/// are aggregated per type: each type gets one ranking update, with
+/// hotness of all of its samples and timestamp of the newest one
+/// \param samples reordered in place
+/// \return number of types touched
+size_t tachanka_touch_batch(tachanka_touch_sample_t *samples, size_t count);
+
+/// Accumulates touches per type; lets several threads resolve samples,
+/// while ranking is updated by a single one
+typedef struct tachanka_touch_aggregator tachanka_touch_aggregator_t;
+tachanka_touch_aggregator_t *tachanka_touch_aggregator_create(void);
+void tachanka_touch_aggregator_destroy(tachanka_touch_aggregator_t *agg);
+/// \brief Resolve samples to types and accumulate them in \p agg
+///
+/// Different aggregators can be used concurrently, but not concurrently
+/// with processing of ranking events (blocks would be freed under our feet)
+/// \param samples reordered in place
+/// \return number of samples that hit tracked blocks and were accumulated;
+/// samples of new types are dropped if \p agg is full
+size_t tachanka_touch_aggregator_add(tachanka_touch_aggregator_t *agg,
+                                     tachanka_touch_sample_t *samples,
+                                     size_t count);
+/// \return number of samples dropped because \p agg was full
+size_t
+tachanka_touch_aggregator_dropped(const tachanka_touch_aggregator_t *agg);
+/// \brief Apply touches accumulated in \p aggs to ranking and reset them
+/// \note should be called from the thread that processes ranking events
+/// \return number of types touched
+size_t tachanka_touch_aggregators_flush(tachanka_touch_aggregator_t **aggs,
+                                        size_t aggs_count);
 void tachanka_init(double old_window_hotness_weight, size_t event_queue_size);
 void tachanka_destroy(void);
 void tachanka_update_threshold(void);
+/// \brief Move pages of blocks whose hot/cold classification changed
+/// \note should be called from the thread that processes ranking events
+void tachanka_migrate_blocks(void);
+/// \brief Return memory of freed blocks and critnib nodes to the OS
+/// \note should be called from the thread that processes ranking events,
+/// after qsbr_reclaim()
+/// \return number of released bytes
+size_t tachanka_release_free_memory(void);
+typedef struct tachanka_range {
+    void *addr;
+    size_t size;
+} tachanka_range_t;
+/// \brief Get address ranges of tracked blocks, in address order
+/// \param cursor address to start from, updated to continue in the next
+/// call; 0 - from the beginning, set to 0 when the last range was returned
+/// \param runs ranges of page runs instead of blocks
+/// \return number of ranges written to \p ranges
+/// \note should be called from the thread that processes ranking events
+size_t tachanka_get_tracked_ranges(uintptr_t *cursor, bool runs,
+                                   tachanka_range_t *ranges, size_t max);
+/// \brief Page-hotness purity of tracked blocks
+/// \note for each page, bytes of blocks of hot types and of cold types
+/// (compared with hot threshold) are summed; purity is the sum over pages of
+/// the larger of them, divided by all bytes - 1 if no page holds both hot
+/// and cold blocks, 0.5 if every page holds them in equal parts; page runs
+/// are not included
+/// \return purity, -1 if threshold is not valid or no blocks are tracked
+double tachanka_get_page_purity(void);
+/// \brief Set source of total allocated size used to scale hotness of touches
+/// \param source NULL restores the default, memtier_kind_get_total_size();
+/// offline replay provides the size of its simulated heap
+void tachanka_set_total_size_source(size_t (*source)(void));
+/// \brief Select granularity of tracking, HOTNESS_TRACKING_BLOCK or
+/// HOTNESS_TRACKING_RUN
+/// \note should be set before allocations are tracked
+void tachanka_set_tracking_granularity(int granularity);
+int tachanka_get_tracking_granularity(void);
+/// \brief Account allocation at \p addr in its page run
+///
+/// Size delta is accumulated in a per-thread cache, first allocation in
+/// a run that is not cached is sent at once
+/// \return false if allocation has to be tracked as a separate block
+bool tachanka_run_alloc(uint64_t hash, void *addr, bool is_hot);
+/// \brief Account free of allocation at \p addr with usable \p size
+/// \return false if allocation is tracked as a separate block
+bool tachanka_run_free(void *addr, size_t size);
+/// \brief Send size deltas pending in the cache of the calling thread
+void tachanka_run_flush(void);
+/// \brief Drop runs fully inside a range that holds no live objects
+/// \note called from arena extent hooks - only pushes an event
+void tachanka_run_release(void *addr, size_t size);
 void tachanka_set_dram_total_ratio(double desired, double actual);
+/// \brief Set cumulative ratios of tiers ordered by hotness
+/// \param thresh_count number of tier boundaries (number of tiers - 1)
+/// \param desired i-th element: desired size of i+1 hottest tiers to total
+/// \param actual i-th element: actual size of i+1 hottest tiers to total
+void tachanka_set_tier_total_ratios(size_t thresh_count, const double *desired,
+                                    const double *actual);
 double tachanka_get_obj_hotness(int size);
 double tachanka_get_addr_hotness(void *addr);
+/// \brief Get type of the block containing @p addr
+/// \return false if @p addr is not tracked
+bool tachanka_get_addr_hash(const void *addr, uint64_t *hash);
 // double tachanka_set_touch_callback(void *addr, const char*name);
 int tachanka_set_touch_callback(void *addr, tachanka_touch_callback cb, void* arg);
 Hotness_e tachanka_get_hotness_type(const void *addr);
 Hotness_e tachanka_get_hotness_type_hash(uint64_t hash);
+/// \brief Multi-threshold variant of tachanka_get_hotness_type_hash
+/// \note type exactly at a threshold belongs to the hotter tier
+/// \return index of tier (0 - hottest) or -1 if hotness is unknown
+int tachanka_get_tier_hash(uint64_t hash);
+/// \brief Same as tachanka_get_tier_hash, memoized in a per-thread cache
+/// \note decision is refreshed only when the threshold epoch changes -
+/// it might lag behind hotness of the type by up to one monitor cycle
+int tachanka_get_tier_hash_cached(uint64_t hash);
+/// \return threshold epoch - incremented whenever cached tier decisions
+/// become outdated (thresholds recalculated, tiers reconfigured)
+uint64_t tachanka_get_threshold_epoch(void);
 double tachanka_get_hot_thresh(void);
+
+typedef struct tachanka_stats {
+    size_t types;      // types created since tachanka_init()
+    size_t blocks;     // tracked blocks, including page runs
+    size_t thresholds; // number of tier boundaries
+    double thresh[HOTNESS_MAX_THRESHOLDS]; // last calculated thresholds
+    bool thresh_valid[HOTNESS_MAX_THRESHOLDS];
+    // ranking controller of each boundary: error of the last threshold
+    // calculation and integrated error
+    double controller_error[HOTNESS_MAX_THRESHOLDS];
+    double controller_integral[HOTNESS_MAX_THRESHOLDS];
+} tachanka_stats_t;
+
+/// \brief Get counts of tracked objects and state of tier thresholds
+/// \note thresholds and controllers are consistent only when called from
+/// the thread that processes ranking events
+void tachanka_get_stats(tachanka_stats_t *stats);
+struct ttype;
+/// \brief Call \p cb for every type, stop when it returns non-zero
+/// \note types are not freed, but their hotness changes while ranking
+/// events and touches are processed
+void tachanka_iter_types(int (*cb)(const struct ttype *type, void *arg),
+                         void *arg);
+/// \brief Set hotness of type \p hash, e.g. measured in a previous run
+/// \param coeffs EXPONENTIAL_COEFFS_NUMBER hotness history coefficients,
+/// used by HOTNESS_POLICY_EXPONENTIAL_COEFFS only
+/// \param timestamp time the hotness is valid at; it decays from then on
+/// \note types that already have tracked blocks are not changed - ranking
+/// holds their blocks with the current hotness
+void tachanka_preload_type(uint64_t hash, double f, const double *coeffs,
+                           __u64 timestamp);
+/// \brief Replace tier thresholds until the next tachanka_update_threshold()
+void tachanka_set_thresholds(size_t thresh_count, const double *thresh,
+                             const bool *thresh_valid);
+/// \brief Schedule ranking controllers for tachanka_update_threshold()
+/// called \p freq_hz times per second, see ranking_set_controller_params()
+void tachanka_set_controller_params(double freq_hz, double feed_forward);
+/// \brief Push event onto ranking event ring of the calling thread
+/// \note sets event timestamp
+/// \return false if event was dropped
 bool tachanka_ranking_event_push(EventEntry_t *event);
 bool tachanka_ranking_event_pop(EventEntry_t *event);
+/// \brief Pop up to \p max events from rings of all threads
+/// \return number of events written to \p events
+size_t tachanka_ranking_event_pop_batch(EventEntry_t *events, size_t max);
+/// \brief Apply event to ranking and block/type structures
+/// \note should be called from a single thread, in pop order
+void tachanka_ranking_event_process(const EventEntry_t *event);
 
 /// \brief Touch every ttype object to update hotness
 /// \param timestamp timestamp from pebs
@@ -98,6 +254,19 @@ struct tblock
     // TODO only temporary - duing productization,
     // some other method should be used to avoid memory overhead
     bool is_hot;
+    // pages were moved to the tier other than the one block was allocated
+    // from; allocation statistics have to be transferred back on free
+    bool is_migrated;
+    // page run of small allocations, covers HOTNESS_TRACKING_RUN_SIZE bytes
+    // regardless of size, which is the size of live objects in it
+    bool is_run;
+    // weight of sampled allocation, size * weight is accounted in its type
+    // and ranking and each touch counts weight times; 1 if allocation is
+    // not sampled
+    float weight;
+    // timestamp of create event (last update for runs), used to order
+    // events of different threads
+    __u64 created;
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,181 @@
+#include "memkind/internal/alloc_sampling.h"
+#include "memkind/internal/memkind_log.h"
+#include "memkind/internal/memkind_memtier.h"
+#include "memkind/internal/slab_allocator.h"
+
+#include "math.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "threads.h"
+#include "time.h"
+
+#ifndef MEMKIND_EXPORT
+#define MEMKIND_EXPORT __attribute__((visibility("default")))
+#endif
+
+typedef struct sampled_node {
+    uintptr_t addr;
+    struct sampled_node *next;
+} sampled_node_t;
+
+static atomic_size_t g_interval = 0u;
+// bucket heads are read without a lock on free - NULL means that the
+// address was not sampled; lists are accessed under the stripe lock only
+static _Atomic(sampled_node_t *) g_buckets[HOTNESS_ALLOC_SAMPLE_BUCKETS];
+static pthread_mutex_t g_locks[HOTNESS_ALLOC_SAMPLE_LOCKS];
+static slab_alloc_t g_nodeAlloc;
+static pthread_once_t g_initOnce = PTHREAD_ONCE_INIT;
+
+// bytes left to the next sampled allocation, drawn again after each sample
+static thread_local int64_t t_bytesUntilSample = 0;
+// xorshift64* state, 0 - not seeded
+static thread_local uint64_t t_prngState = 0u;
+
+static void alloc_sampling_once(void)
+{
+    for (unsigned i = 0u; i < HOTNESS_ALLOC_SAMPLE_LOCKS; ++i)
+        pthread_mutex_init(&g_locks[i], NULL);
+    if (slab_alloc_init(&g_nodeAlloc, sizeof(sampled_node_t), 0)) {
+        log_fatal("alloc_sampling: slab_alloc_init() failed");
+        exit(-1);
+    }
+}
+
+static inline size_t bucket_of(uintptr_t addr)
+{
+    // allocations are at least 8 bytes aligned
+    return ((addr >> 3) * 0x9E3779B97F4A7C15ull) >>
+        (64 - __builtin_ctz(HOTNESS_ALLOC_SAMPLE_BUCKETS));
+}
+
+static inline pthread_mutex_t *lock_of(size_t bucket)
+{
+    return &g_locks[bucket & (HOTNESS_ALLOC_SAMPLE_LOCKS - 1u)];
+}
+
+static uint64_t prng_next(void)
+{
+    if (!t_prngState) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        t_prngState = ((uint64_t)(uintptr_t)&t_prngState ^
+                       ((uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec)) |
+            1u;
+    }
+    t_prngState ^= t_prngState >> 12;
+    t_prngState ^= t_prngState << 25;
+    t_prngState ^= t_prngState >> 27;
+    return t_prngState * 0x2545F4914F6CDD1Dull;
+}
+
+static int64_t draw_bytes_until_sample(size_t interval)
+{
+    // uniform in (0, 1]
+    double u = ((prng_next() >> 11) + 1u) * 0x1.0p-53;
+    double bytes = -log(u) * interval;
+    return bytes < (double)INT64_MAX / 2 ? (int64_t)bytes : INT64_MAX / 2;
+}
+
+static void set_insert(uintptr_t addr)
+{
+    size_t bucket = bucket_of(addr);
+    sampled_node_t *node = slab_alloc_malloc(&g_nodeAlloc);
+    if (!node) {
+        log_err("alloc_sampling: cannot track sampled allocation %p",
+                (void *)addr);
+        return;
+    }
+    node->addr = addr;
+    pthread_mutex_lock(lock_of(bucket));
+    node->next =
+        atomic_load_explicit(&g_buckets[bucket], memory_order_relaxed);
+    atomic_store_explicit(&g_buckets[bucket], node, memory_order_release);
+    pthread_mutex_unlock(lock_of(bucket));
+}
+
+static bool set_remove(uintptr_t addr)
+{
+    size_t bucket = bucket_of(addr);
+    // free of an allocation happens after alloc_sampling_sample(), so the insert
+    // is visible; inserts of other addresses might be missed, which is fine
+    if (!atomic_load_explicit(&g_buckets[bucket], memory_order_acquire))
+        return false;
+    sampled_node_t *found = NULL;
+    pthread_mutex_lock(lock_of(bucket));
+    sampled_node_t *prev = NULL;
+    sampled_node_t *node =
+        atomic_load_explicit(&g_buckets[bucket], memory_order_relaxed);
+    for (; node; prev = node, node = node->next) {
+        if (node->addr == addr) {
+            found = node;
+            if (prev)
+                prev->next = node->next;
+            else
+                atomic_store_explicit(&g_buckets[bucket], node->next,
+                                      memory_order_relaxed);
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock_of(bucket));
+    if (found)
+        slab_alloc_free(found);
+    return found;
+}
+
+MEMKIND_EXPORT void alloc_sampling_set_interval(size_t interval)
+{
+    (void)pthread_once(&g_initOnce, alloc_sampling_once);
+    atomic_store(&g_interval, interval);
+    for (size_t bucket = 0u; bucket < HOTNESS_ALLOC_SAMPLE_BUCKETS;
+         ++bucket) {
+        pthread_mutex_lock(lock_of(bucket));
+        sampled_node_t *node =
+            atomic_load_explicit(&g_buckets[bucket], memory_order_relaxed);
+        atomic_store_explicit(&g_buckets[bucket], NULL, memory_order_relaxed);
+        pthread_mutex_unlock(lock_of(bucket));
+        while (node) {
+            sampled_node_t *next = node->next;
+            slab_alloc_free(node);
+            node = next;
+        }
+    }
+}
+
+MEMKIND_EXPORT size_t alloc_sampling_get_interval(void)
+{
+    return atomic_load_explicit(&g_interval, memory_order_relaxed);
+}
+
+MEMKIND_EXPORT bool alloc_sampling_sample(void *addr, size_t size,
+                                          float *weight)
+{
+    size_t interval = atomic_load_explicit(&g_interval, memory_order_relaxed);
+    if (!interval) {
+        *weight = 1.f;
+        return true;
+    }
+    // countdown of a new thread is drawn at its first allocation
+    if (!t_prngState)
+        t_bytesUntilSample = draw_bytes_until_sample(interval);
+    t_bytesUntilSample -= (int64_t)size;
+    if (t_bytesUntilSample > 0)
+        return false;
+    // exponential distribution is memoryless - the remainder of an
+    // overshoot is not carried over
+    t_bytesUntilSample = draw_bytes_until_sample(interval);
+
+    // inverse of sampling probability 1 - exp(-size / interval)
+    double bytes = size ? (double)size : 1.0;
+    *weight = (float)(-1.0 / expm1(-bytes / interval));
+    set_insert((uintptr_t)addr);
+    return true;
+}
+
+MEMKIND_EXPORT bool alloc_sampling_forget(void *addr)
+{
+    if (!atomic_load_explicit(&g_interval, memory_order_relaxed))
+        return true;
+    return set_remove((uintptr_t)addr);
+}
@@ -1,4 +1,7 @@
 #include <memkind/internal/memkind_memtier.h>
+#include <memkind/internal/memkind_private.h>
+#include <memkind/internal/bthash.h>
+#include <memkind/internal/exec_maps.h>
 
 #include <stdbool.h>
 #include <stdlib.h>
@@ -11,218 +14,51 @@
 #include <pthread.h>
 #include <assert.h>
 
-// SIMD instructions
-#include "mmintrin.h"
-#include "xmmintrin.h"
-#include "emmintrin.h"
-#include "immintrin.h"
 
+#ifndef MEMKIND_EXPORT
+#define MEMKIND_EXPORT __attribute__((visibility("default")))
+#endif
 
-#define ARRAYSZ(x) (sizeof(x)/sizeof((x)[0]))
-
-static void __attribute__((aligned(64))) *start[1024];
-static void __attribute__((aligned(64))) *end[1024];
-static int nm;
 static void *stack0;
 static void *stack_start, *stack_end;
-static void *pthread_start, *pthread_end; // hax!
 
 static thread_local uint64_t stack_size;
 static thread_local void* stack_bottom=NULL; // TODO should probably be initialized to sth else
 /// @pre stack_top >= stack_bottom
 static thread_local void* stack_top=NULL; // TODO should probably be initialized to sth else
 
-// TODO test this function
-static void preprocess_maps(void) {
-    // the maps are already sorted; potential for optimisation: merge regions
-    int inew=0;
-    for (int i=0; i<nm-1; ++i) {
-        // check if ith region can be merged with i+1th region
-        bool can_be_merged = end[inew]==start[i+1];
-        if (can_be_merged) {
-            end[inew]=end[i+1];
-        } else {
-            ++inew;
-        }
-
-        //printf("map: start %p end %p\n", start[i], end[i]);
-    }
-    if (nm>0) {
-        nm=inew+1;
-    }
-}
-
-void read_maps(void)
+MEMKIND_EXPORT void read_maps(void)
 {
     FILE *f = fopen("/proc/self/maps", "r");
+    void *map_start, *map_end;
     char exec;
     int inode;
 
-    nm=0;
-    while (fscanf(f, "%p-%p %*c%*c%cp %*x %*x:%*x %d", &start[nm], &end[nm], &exec, &inode) == 4)
+    while (fscanf(f, "%p-%p %*c%*c%cp %*x %*x:%*x %d", &map_start, &map_end, &exec, &inode) == 4)
     {
         char *file = 0;
         size_t dummy = 0;
         if (getline(&file, &dummy, f)) ;
         if (strstr(file, "[stack]")) {
-            stack_start = start[nm];
-            stack_end = start[nm];
-            stack0 = end[nm];
+            stack_start = map_start;
+            stack_end = map_start;
+            stack0 = map_end;
         }
-        if (exec != 'x')
-            continue;
-        if (strstr(file, "libpthread"))
-            pthread_start = start[nm], pthread_end = end[nm];
-        if (nm++ >= ARRAYSZ(start))
-            break;
+        free(file);
     }
     fclose(f);
-    preprocess_maps();
-}
-// TODO end condition is kind of weak;
-// apart from that, there are multiple entries for libpthread - currently,
-// only the last one is taken into account, all others are ignored
-
-
-static bool backtrace_unwinded(const void* addr, size_t idx) {
-    return /* addr == __libc_csu_init || */ /* idx > 2 || */ (addr >= pthread_start && addr < pthread_end);
-}
-
-#if CUSTOM_BACKTRACE
-
-/// Find highest start idx that lies before @p ptr
-/// @pre ptr >= start[0] && ptr < end[nm]
-static int binsearch_start(const void *ptr) {
-    // bstart always "lies before ptr", bend: sometimes
-    int bstart=0, bend=nm-1;
-    while (bstart != bend) {
-        int mid = (bstart+bend)/2;
-        if (ptr >= start[mid]) {
-            if (bstart == mid) {
-                // check if bend is still ok
-                if (ptr >= start[bend])
-                    bstart=bend;
-                break;
-            }
-            bstart = mid;
-        } else {
-            bend = mid;
-        }
-    }
-    return bstart;
+    // executable mappings are taken from the dynamic loader
+    (void)exec_maps_refresh(true);
 }
 
-/// Find lowest end idx that lies after @p ptr
-/// @pre ptr >= start[0] && ptr < end[nm]
-static int binsearch_end(const void *ptr) {
-    // bend always "lies after ptr", bstart: never
-    int bstart=0, bend=nm-1;
-    while (bstart != bend) {
-        int mid = (bstart+bend)/2;
-        if (ptr < end[mid]) {
-            bend = mid;
-        } else {
-            if (bstart == mid) {
-                // bstart is not ok, bend is ok; no additional action required
-                break;
-            }
-            bstart = mid;
-        }
-    }
-    return bend;
-}
-
-#if LIB_BINSEARCH
-/// @pre  addr < start[0] || addr >= end[nm-1]
-static int find_region_idx(void *addr)
+MEMKIND_EXPORT bool bthash_refresh_maps(void)
 {
-    if (addr < start[0] || addr >= end[nm-1])
-        return -1;
-    int bstart = binsearch_start(addr);
-    int bend = binsearch_end(addr);
-    if (bstart == bend) {
-        return bstart;
-    }
-    return -1;
+    return exec_maps_refresh(false);
 }
-#elif SIMD_INSTRUCTIONS
-/// @pre  addr < start[0] || addr >= end[nm-1]
-/// @return 1 on successful find, -1 on failure
-static bool check_region(void *addr)
-{
-    if (addr < start[0] || addr >= end[nm-1])
-        return false;
-    bool found=false;
-    int simd_iterations = (nm/8)*8;
-    int simd_x3_iterations = (nm/24)*24; // pipeline calculations for peak flops
-    // TODO handle the nasty bool casting hack better (corner cases - overflow casted to false!)
-//     int regular_iterations = nm%8;
-    // TODO try to optimize
-    // load addr to register
-
-    void  __attribute__((aligned(64)))*extended_addr[]={
-        //
-        addr,
-        addr,
-        addr,
-        addr,
-        addr,
-        addr,
-        addr,
-        addr,
-    };
-//     __m512i addr_reg =_mm_load_si512((__m512i*)extended_addr);
-    __m512i *addr_reg_ptr =(__m512i*)extended_addr;
-    for (int i0=0, i1=8, i2=16; i0<simd_x3_iterations; i0+=24, i1+=24, i2+=24) {
-        // load 1
-//         __m512i a = _mm_load_si512((__m512i*)&start[i]);
-//         __m512i b = _mm_load_si512((__m512i*)&end[i]);
-        __m512i *a0 = (__m512i*)&start[i0];
-        __m512i *b0 = (__m512i*)&end[i0];
-        __m512i *a1 = (__m512i*)&start[i1];
-        __m512i *b1 = (__m512i*)&end[i1];
-        __m512i *a2 = (__m512i*)&start[i2];
-        __m512i *b2 = (__m512i*)&end[i2];
-        // load 2
-        __mmask8 mask_gt0 = _mm512_cmpge_epu64_mask (*addr_reg_ptr, *a0);
-        __mmask8 mask_all0 = _mm512_mask_cmplt_epu64_mask (mask_gt0, *addr_reg_ptr, *b0);
-        __mmask8 mask_gt1 = _mm512_cmpge_epu64_mask (*addr_reg_ptr, *a1);
-        __mmask8 mask_all1 = _mm512_mask_cmplt_epu64_mask (mask_gt1, *addr_reg_ptr, *b1);
-        __mmask8 mask_gt2 = _mm512_cmpge_epu64_mask (*addr_reg_ptr, *a2);
-        __mmask8 mask_all2 = _mm512_mask_cmplt_epu64_mask (mask_gt2, *addr_reg_ptr, *b2);
-        // unload
-//         uint8_t mask_unloaded = mask_all; // TODO find corresponding "store" operation
-//         _mm_store
-        found = ( found || mask_all0 || mask_all1 || mask_all2);
-    }
-    for (int i=simd_x3_iterations; i<simd_iterations; i+=8) {
-        // load 1
-//         __m512i a = _mm_load_si512((__m512i*)&start[i]);
-//         __m512i b = _mm_load_si512((__m512i*)&end[i]);
-        __m512i *a = (__m512i*)&start[i];
-        __m512i *b = (__m512i*)&end[i];
-        // load 2
-        __mmask8 mask_gt = _mm512_cmpge_epu64_mask (*addr_reg_ptr, *a);
-        __mmask8 mask_all = _mm512_mask_cmplt_epu64_mask (mask_gt, *addr_reg_ptr, *b);
-        // unload
-//         uint8_t mask_unloaded = mask_all; // TODO find corresponding "store" operation
-//         _mm_store
-        found = ( found || mask_all );
-    }
-    // handle the remainder
-    for (int i=simd_iterations; i<nm; ++i) {
-        found = ( found || (addr >= start[i] && addr < end[i]) );
-    }
-    // TODO loop over nm and perform the operation below
-    // addr >= start && addr < end // this operation, but in vector terms
-    // __mmask8 _mm512_mask_cmpge_epu64_mask (__mmask8 k1, __m512i a, __m512i b)
-    // __mmask8 _mm512_cmpgt_epu64_mask (__m512i a, __m512i b)
-    // __mmask8 _mm512_mask_cmplt_epu64_mask (__mmask8 k1, __m512i a, __m512i b)
-    // __mmask8 _mm512_mask_cmplt_epu64_mask (__mmask8 k1, __m512i a, __m512i b)
-
-    return found;
+
+static bool backtrace_unwinded(const exec_maps_t *maps, const void* addr, size_t idx) {
+    return /* addr == __libc_csu_init || */ /* idx > 2 || */ exec_maps_is_terminal(maps, addr);
 }
-#endif
 
 static bool is_on_stack(const void* ptr) {
     return ptr >= stack_start && ptr < stack_end;
@@ -254,7 +90,7 @@ static inline uint64_t update_hash(uint64_t h, uint64_t k, uint64_t M, uint64_t
     return h;
 }
 
-void bthash_set_stack_range(void *p1, void *p2) {
+MEMKIND_EXPORT void bthash_set_stack_range(void *p1, void *p2) {
     if (p1 && p2) {
         if (p1>=p2) {
             stack_top = p1;
@@ -281,7 +117,7 @@ void bthash_set_stack_range(void *p1, void *p2) {
     }
 }
 
-uint64_t bthash(uint64_t size)
+MEMKIND_EXPORT uint64_t bthash_stack_scan(uint64_t size)
 {
     // MurmurHash2 by Austin Appleby, public domain.
     const uint64_t M = 0xc6a4a7935bd1e995ULL;
@@ -289,6 +125,7 @@ uint64_t bthash(uint64_t size)
     uint64_t h = size ^ M;
 
     h = update_hash(h, stack_size, M, R);
+    const exec_maps_t *maps = exec_maps_get();
 
     // can we directly obtain stack pointer?
 //     void *stock_ptr = __builtin_frame_address(0);
@@ -321,25 +158,13 @@ uint64_t bthash(uint64_t size)
 //         assert(is_on_stack(sp));
 //         sp_counter++;
         void *addr=*sp; // dereference value at stack; assume that the dereferenced value is a void pointer
-#if LIB_BINSEARCH
-        if (find_region_idx(addr) != -1) {
-#elif SIMD_INSTRUCTIONS
-        if (check_region(addr)) {
-#else
-        int s;
-        // take addr and compare it with
-        for (s=0; s<nm; s++) // iterate through all mapped regions
-            if (start[s] > addr) // find the region the addr belongs to
-                break;
-        if (s-- && addr < end[s]) // make sure the address was found and that it belongs to the mapped area
-        {
-#endif
+        uint64_t site;
+        if (exec_maps_lookup(maps, addr, &site)) {
             // if yes, use the address for hash calculation
-            if (backtrace_unwinded((void*)addr, 0))
+            if (backtrace_unwinded(maps, addr, 0))
                 break;  // end hash calculation
 
-            uint64_t k = (uintptr_t)addr;
-            h = update_hash(h, k, M, R);
+            h = update_hash(h, site, M, R);
         }
     }
 #if FINALIZE_HASH
@@ -352,9 +177,7 @@ uint64_t bthash(uint64_t size)
     return h;
 }
 
-#else
-
-uint64_t bthash(uint64_t size)
+MEMKIND_EXPORT uint64_t bthash_backtrace(uint64_t size)
 {
     // MurmurHash2 by Austin Appleby, public domain.
     const uint64_t M = 0xc6a4a7935bd1e995ULL;
@@ -376,21 +199,18 @@ uint64_t bthash(uint64_t size)
     backtrace_in_progress=true;
     int bt_size = backtrace(sp, SP_SIZE);
     backtrace_in_progress=false;
+    const exec_maps_t *maps = exec_maps_get();
     for (int i = 0; i<bt_size; i++)
     {
         void *addr = sp[i];
-        int s;
-        // take addr and compare it with
-        for (s=0; s<nm; s++) // iterate through all mapped regions
-            if (start[s] > addr) // find the region the addr belongs to
-                break;
-        if (s-- && addr < end[s]) // make sure the address was found and that it belongs to the mapped area
+        uint64_t site;
+        if (exec_maps_lookup(maps, addr, &site)) // make sure the address belongs to the mapped area
         {
             // if yes, use the address for hash calculation
-            if (backtrace_unwinded((void*)addr, i))
+            if (backtrace_unwinded(maps, addr, i))
                 break;  // end hash calculation
 
-            uint64_t k = (uintptr_t)addr;
+            uint64_t k = site;
             k *= M;
             k ^= k >> R;
             k *= M;
@@ -409,4 +229,127 @@ uint64_t bthash(uint64_t size)
     return h;
 }
 
+// Frame pointer unwinding
+//
+// Only return addresses stored in frame records are used, so stale stack
+// words do not influence the hash. Classification of return addresses
+// (does it lie in an executable mapping, should unwinding stop there)
+// requires a search through mapped regions - its result is memoized
+// in a per-thread, direct-mapped table.
+
+typedef struct ret_addr_memo {
+    const void *addr;
+    uint64_t key;        // pre-mixed hash key of the site of addr
+    unsigned generation; // generation of exec maps the entry was computed for
+    bool valid;          // addr lies in executable mapping
+    bool terminal;       // unwinding should stop at addr
+} ret_addr_memo_t;
+
+static thread_local ret_addr_memo_t ret_addr_memo[BTHASH_MEMO_ENTRIES];
+static thread_local void *fp_stack_low=NULL;
+static thread_local void *fp_stack_high=NULL;
+static thread_local bool fp_stack_initialized=false;
+
+static void init_fp_stack_bounds(void)
+{
+    // pthread_getattr_np might allocate - recursive calls see empty bounds
+    fp_stack_initialized = true;
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr))
+        return;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        fp_stack_low = addr;
+        fp_stack_high = (char *)addr + size;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static const ret_addr_memo_t *ret_addr_lookup(const exec_maps_t *maps,
+                                              const void *addr,
+                                              unsigned generation)
+{
+    const uint64_t M = 0xc6a4a7935bd1e995ULL;
+    const int R = 47;
+    uintptr_t a = (uintptr_t)addr;
+    ret_addr_memo_t *memo =
+        &ret_addr_memo[(a ^ (a >> 10)) & (BTHASH_MEMO_ENTRIES - 1)];
+    if (memo->addr != addr || memo->generation != generation) {
+        uint64_t k = 0u;
+        memo->valid = exec_maps_lookup(maps, addr, &k);
+        k *= M;
+        k ^= k >> R;
+        k *= M;
+        memo->addr = addr;
+        memo->key = k;
+        memo->generation = generation;
+        memo->terminal = backtrace_unwinded(maps, addr, 0);
+    }
+    return memo;
+}
+
+MEMKIND_EXPORT uint64_t bthash_frame_pointers(uint64_t size)
+{
+    // MurmurHash2 by Austin Appleby, public domain.
+    const uint64_t M = 0xc6a4a7935bd1e995ULL;
+    const int R = 47;
+    uint64_t h = size ^ M;
+
+    if (MEMKIND_UNLIKELY(!fp_stack_initialized))
+        init_fp_stack_bounds();
+    const exec_maps_t *maps = exec_maps_get();
+    unsigned generation = exec_maps_generation(maps);
+
+    // chain is broken when a frame record lies outside the stack (alternate
+    // stack, unknown bounds or garbage in the frame pointer register), does
+    // not hold a code address or does not lie above the previous one - the
+    // hash is computed from backtrace() then, which uses unwind tables
+    void **fp = __builtin_frame_address(0);
+    if ((void *)fp < fp_stack_low)
+        return bthash_backtrace(size);
+    for (int depth = 0; depth < BTHASH_FRAME_DEPTH; ++depth) {
+        // frame record: [0] - caller's frame pointer, [1] - return address
+        if (((uintptr_t)fp & 7u) || (void *)(fp + 2) > fp_stack_high)
+            return bthash_backtrace(size);
+        const ret_addr_memo_t *memo = ret_addr_lookup(maps, fp[1], generation);
+        if (!memo->valid)
+            return bthash_backtrace(size);
+        if (memo->terminal)
+            break;
+        h ^= memo->key;
+        h *= M;
+        void **next = fp[0];
+        // outermost frame (_start, thread entry) clears the frame pointer
+        if (!next)
+            break;
+        // stack grows down - callers' frames lie at higher addresses
+        if (next <= fp)
+            return bthash_backtrace(size);
+        fp = next;
+    }
+
+#if FINALIZE_HASH
+    // Enable if we want "random" hash values.
+    h ^= h >> R;
+    h *= M;
+    h ^= h >> R;
+#else
+    (void)R;
+#endif
+
+    return h;
+}
+
+MEMKIND_EXPORT uint64_t bthash(uint64_t size)
+{
+#if BTHASH_METHOD == BTHASH_FRAME_POINTERS
+    return bthash_frame_pointers(size);
+#elif BTHASH_METHOD == BTHASH_STACK_SCAN
+    return bthash_stack_scan(size);
+#elif BTHASH_METHOD == BTHASH_BACKTRACE
+    return bthash_backtrace(size);
+#else
+#error "Unknown bthash method!"
 #endif
+}
@@ -46,12 +46,20 @@
  * free.  Any synchronization with reads would kill their speed, thus
  * instead we have a remove count.  The grace period is DELETED_LIFE,
  * after which any read will notice staleness and restart its work.
+ *
+ * Readers inside a qsbr read-side section (see qsbr.h) additionally never
+ * see a node or leaf reused: once out of the DELETED_LIFE ring, they are
+ * retired and return to the pool only after all such readers went
+ * quiescent.  This also covers values - a reader that found a leaf may use
+ * its value until it goes quiescent, as long as the owner of the value
+ * defers its freeing the same way.
  */
 #include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
 
 #include "memkind/internal/critnib.h"
+#include "memkind/internal/qsbr.h"
 // This file was taken from https://github.com/kilobyte/critnib
 // relevant contents of pmdk-compat.h were pasted here,
 // the file was not preserved as a whole
@@ -164,10 +172,6 @@ struct critnib_leaf {
 struct critnib {
 	struct critnib_node *root;
 
-	/* pool of freed nodes: singly linked list, next at child[0] */
-	struct critnib_node *deleted_node;
-	struct critnib_leaf *deleted_leaf;
-
 	/* nodes removed but not yet eligible for reuse */
 	struct critnib_node *pending_del_nodes[DELETED_LIFE];
 	struct critnib_leaf *pending_del_leaves[DELETED_LIFE];
@@ -267,130 +271,121 @@ critnib_new(void)
 	return c;
 }
 
-/*
- * internal: delete_node -- recursively free (to malloc) a subtree
- */
-static void
-delete_node(struct critnib_node *__restrict n)
-{
-	if (!is_leaf(n)) {
-		for (int i = 0; i < SLNODES; i++) {
-			if (n->child[i])
-				delete_node(n->child[i]);
-		}
-
-		slab_alloc_free(n);
-	} else {
-		slab_alloc_free(to_leaf(n));
-	}
-}
-
 /*
  * critnib_delete -- destroy and free a critnib struct
  */
 void
 critnib_delete(struct critnib *c)
 {
-	if (c->root)
-		delete_node(c->root);
-    slab_alloc_destroy(&c->allocator_leaves);
-    slab_alloc_destroy(&c->allocator_nodes);
+	/*
+	 * all nodes and leaves - live, deleted and pending - come from
+	 * the two slab allocators, destroying them releases whole tree
+	 */
+	qsbr_forget(c);
+	slab_alloc_destroy(&c->allocator_leaves);
+	slab_alloc_destroy(&c->allocator_nodes);
 	util_mutex_destroy(&c->mutex);
 
-	for (struct critnib_node *m = c->deleted_node; m; ) {
-		struct critnib_node *mm = m->child[0];
-		slab_alloc_free(m);
-		m = mm;
-	}
-
-	for (struct critnib_leaf *k = c->deleted_leaf; k; ) {
-		struct critnib_leaf *kk = k->value;
-		slab_alloc_free(k);
-		k = kk;
-	}
-
-	for (int i = 0; i < DELETED_LIFE; i++) {
-		slab_alloc_free(c->pending_del_nodes[i]);
-		slab_alloc_free(c->pending_del_leaves[i]);
-	}
-
 	jemk_free(c);
 }
 
 /*
- * internal: free_node -- free (to internal pool, not malloc) a node.
+ * critnib_release_free_memory -- return memory of freed nodes and leaves
+ * to the OS, see slab_alloc_release_free_chunks()
+ */
+size_t
+critnib_release_free_memory(struct critnib *c)
+{
+	return slab_alloc_release_free_chunks(&c->allocator_leaves) +
+		slab_alloc_release_free_chunks(&c->allocator_nodes);
+}
+
+/*
+ * internal: free_node -- free (to the slab allocator, not malloc) a node.
  *
  * We cannot free them to malloc as a stalled reader thread may still walk
  * through such nodes; it will notice the result being bogus but only after
- * completing the walk, thus we need to ensure any freed nodes still point
- * to within the critnib structure.
+ * completing the walk.  Slab memory stays mapped until critnib_delete() --
+ * a freed node is reused as another node of this critnib or reads as zeros
+ * once its chunk is released, in both cases the walk ends within the
+ * critnib structure.
  */
 static void
 free_node(struct critnib *__restrict c, struct critnib_node *__restrict n)
 {
+	(void)c;
 	if (!n)
 		return;
 
 	ASSERT(!is_leaf(n));
-	n->child[0] = c->deleted_node;
-	c->deleted_node = n;
+	slab_alloc_free(n);
 }
 
 /*
- * internal: alloc_node -- allocate a node from our pool or from malloc
+ * internal: alloc_node -- allocate a node from the slab allocator
  */
 static struct critnib_node *
 alloc_node(struct critnib *__restrict c)
 {
-	if (!c->deleted_node) {
-		struct critnib_node *n = slab_alloc_malloc(&c->allocator_nodes);
-		if (n == NULL)
-			ERR("!Malloc");
-
-		return n;
-	}
-
-	struct critnib_node *n = c->deleted_node;
-
-	c->deleted_node = n->child[0];
-	VALGRIND_ANNOTATE_NEW_MEMORY(n, sizeof(*n));
+	struct critnib_node *n = slab_alloc_malloc(&c->allocator_nodes);
+	if (n == NULL)
+		ERR("!Malloc");
 
 	return n;
 }
 
 /*
- * internal: free_leaf -- free (to internal pool, not malloc) a leaf.
+ * internal: free_leaf -- free (to the slab allocator, not malloc) a leaf.
  *
  * See free_node().
  */
 static void
 free_leaf(struct critnib *__restrict c, struct critnib_leaf *__restrict k)
 {
+	(void)c;
 	if (!k)
 		return;
 
-	k->value = c->deleted_leaf;
-	c->deleted_leaf = k;
+	slab_alloc_free(k);
 }
 
 /*
- * internal: alloc_leaf -- allocate a leaf from our pool or from malloc
+ * internal: recycle_node -- qsbr callback, free a node
  */
-static struct critnib_leaf *
-alloc_leaf(struct critnib *__restrict c)
+static void
+recycle_node(void *ptr, void *arg)
 {
-	if (!c->deleted_leaf) {
-		struct critnib_leaf *k = slab_alloc_malloc(&c->allocator_leaves);
-		if (k == NULL)
-			ERR("!Malloc");
+	free_node(arg, ptr);
+}
 
-		return k;
-	}
+/*
+ * internal: recycle_leaf -- qsbr callback, free a leaf
+ */
+static void
+recycle_leaf(void *ptr, void *arg)
+{
+	free_leaf(arg, ptr);
+}
 
-	struct critnib_leaf *k = c->deleted_leaf;
+/*
+ * internal: retire -- free a node/leaf after grace period
+ */
+static void
+retire(struct critnib *__restrict c, void *ptr, qsbr_free_fn recycle)
+{
+	if (ptr)
+		qsbr_retire(ptr, recycle, c);
+}
 
-	c->deleted_leaf = k->value;
-	VALGRIND_ANNOTATE_NEW_MEMORY(k, sizeof(*k));
+/*
+ * internal: alloc_leaf -- allocate a leaf from the slab allocator
+ */
+static struct critnib_leaf *
+alloc_leaf(struct critnib *__restrict c)
+{
+	struct critnib_leaf *k = slab_alloc_malloc(&c->allocator_leaves);
+	if (k == NULL)
+		ERR("!Malloc");
 
 	return k;
 }
@@ -515,8 +510,8 @@ critnib_remove(struct critnib *c, word key)
 		goto not_found;
 
 	word del = util_fetch_and_add64(&c->remove_count, 1) % DELETED_LIFE;
-	free_node(c, c->pending_del_nodes[del]);
-	free_leaf(c, c->pending_del_leaves[del]);
+	retire(c, c->pending_del_nodes[del], recycle_node);
+	retire(c, c->pending_del_leaves[del], recycle_leaf);
 	c->pending_del_nodes[del] = NULL;
 	c->pending_del_leaves[del] = NULL;
 
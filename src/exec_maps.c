@@ -0,0 +1,470 @@
+#include <memkind/internal/exec_maps.h>
+#include <memkind/internal/memkind_memtier.h>
+#include <memkind/internal/memkind_log.h>
+#include <memkind/internal/qsbr.h>
+
+#include "jemalloc/jemalloc.h"
+
+#include <elf.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if EXEC_MAPS_SEARCH == EXEC_MAPS_SEARCH_AVX2 || \
+    EXEC_MAPS_SEARCH == EXEC_MAPS_SEARCH_AVX512
+#include "immintrin.h"
+#endif
+
+#ifndef MEMKIND_EXPORT
+#define MEMKIND_EXPORT __attribute__((visibility("default")))
+#endif
+
+#define EXEC_MAPS_ALIGNMENT 64
+// SIMD searches process this many intervals at once;
+// arrays are padded with EXEC_MAPS_PADDING
+#define EXEC_MAPS_VECTOR 8
+// signed compare (AVX2) has to treat padding as the highest address
+#define EXEC_MAPS_PADDING ((uintptr_t)INTPTR_MAX)
+
+struct exec_maps {
+    unsigned generation;
+    size_t count;
+    // code of libpthread - unwinding ends there
+    uintptr_t pthreadStart;
+    uintptr_t pthreadEnd;
+    // sorted, non-overlapping intervals [start, end)
+    uintptr_t *start;
+    uintptr_t *end;
+    // site of address a in interval i is a + delta[i], see exec_maps_lookup()
+    uint64_t *delta;
+    // the same intervals in Eytzinger (BFS) order, 1-indexed
+    uintptr_t *eytzStart;
+    uintptr_t *eytzEnd;
+    uint64_t *eytzDelta;
+};
+
+typedef struct exec_range {
+    uintptr_t start;
+    uintptr_t end;
+    uint64_t delta;
+} exec_range_t;
+
+typedef struct exec_ranges {
+    exec_range_t *ranges;
+    size_t count;
+    size_t capacity;
+    uintptr_t pthreadStart;
+    uintptr_t pthreadEnd;
+    bool failed;
+} exec_ranges_t;
+
+typedef struct loader_counters {
+    unsigned long long adds;
+    unsigned long long subs;
+} loader_counters_t;
+
+static const exec_maps_t g_emptyMaps = {0};
+static exec_maps_t *g_maps = NULL;
+static pthread_mutex_t g_refreshMutex = PTHREAD_MUTEX_INITIALIZER;
+static loader_counters_t g_counters = {0, 0};
+// set by a failed exec_maps_lookup(); rebuild trigger when the loader does
+// not provide counters
+static bool g_lookupMissed = false;
+
+static int read_loader_counters(struct dl_phdr_info *info, size_t size,
+                                void *data)
+{
+    loader_counters_t *counters = data;
+    if (size < offsetof(struct dl_phdr_info, dlpi_subs) +
+            sizeof(info->dlpi_subs)) {
+        // counters not supported - rebuild on lookup miss
+        counters->adds = counters->subs = 0;
+    } else {
+        counters->adds = info->dlpi_adds;
+        counters->subs = info->dlpi_subs;
+    }
+    return 1; // counters are the same for all objects
+}
+
+static uint64_t hash_bytes(const void *data, size_t len)
+{
+    // FNV-1a, then MurmurHash3 finalizer - keys of objects are far apart
+    const unsigned char *bytes = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#define NOTE_ALIGN(n) (((n) + 3u) & ~(size_t)3u)
+
+// key of a loaded object that does not depend on where it is loaded: hash
+// of its GNU build-id, or of its path if it has none (main program: "")
+static uint64_t object_key(const struct dl_phdr_info *info)
+{
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_NOTE)
+            continue;
+        const char *note = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+        const char *notes_end = note + phdr->p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= notes_end) {
+            const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)note;
+            const char *name = note + sizeof(ElfW(Nhdr));
+            const char *desc = name + NOTE_ALIGN(nhdr->n_namesz);
+            note = desc + NOTE_ALIGN(nhdr->n_descsz);
+            if (note > notes_end)
+                break;
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4u &&
+                !memcmp(name, "GNU", 4u))
+                return hash_bytes(desc, nhdr->n_descsz);
+        }
+    }
+    const char *path = info->dlpi_name ? info->dlpi_name : "";
+    return hash_bytes(path, strlen(path));
+}
+
+static int collect_ranges(struct dl_phdr_info *info, size_t size, void *data)
+{
+    exec_ranges_t *ranges = data;
+    uint64_t delta = 0u;
+    bool keyed = false;
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X) ||
+            phdr->p_memsz == 0)
+            continue;
+        if (ranges->count == ranges->capacity) {
+            size_t capacity = ranges->capacity ? 2 * ranges->capacity : 64;
+            exec_range_t *new_ranges =
+                jemk_realloc(ranges->ranges, capacity * sizeof(exec_range_t));
+            if (!new_ranges) {
+                ranges->failed = true;
+                return 1;
+            }
+            ranges->ranges = new_ranges;
+            ranges->capacity = capacity;
+        }
+        if (!keyed) {
+            delta = object_key(info) - info->dlpi_addr;
+            keyed = true;
+        }
+        exec_range_t *range = &ranges->ranges[ranges->count++];
+        range->start = info->dlpi_addr + phdr->p_vaddr;
+        range->end = range->start + phdr->p_memsz;
+        range->delta = delta;
+        if (info->dlpi_name && strstr(info->dlpi_name, "libpthread")) {
+            ranges->pthreadStart = range->start;
+            ranges->pthreadEnd = range->end;
+        }
+    }
+    return 0;
+}
+
+static void sort_ranges(exec_range_t *ranges, size_t count)
+{
+    // objects are reported mostly in address order - insertion sort is
+    // close to linear and does not allocate
+    for (size_t i = 1; i < count; ++i) {
+        exec_range_t range = ranges[i];
+        size_t j = i;
+        for (; j > 0 && ranges[j - 1].start > range.start; --j)
+            ranges[j] = ranges[j - 1];
+        ranges[j] = range;
+    }
+}
+
+// ranges of different objects are not merged - they map to different sites
+static size_t merge_ranges(exec_range_t *ranges, size_t count)
+{
+    if (count == 0)
+        return 0;
+    size_t merged = 0;
+    for (size_t i = 1; i < count; ++i) {
+        exec_range_t range = ranges[i];
+        if (range.start <= ranges[merged].end &&
+            range.delta == ranges[merged].delta) {
+            if (range.end > ranges[merged].end)
+                ranges[merged].end = range.end;
+            continue;
+        }
+        // overlap of different objects - the first one keeps it
+        if (range.start < ranges[merged].end)
+            range.start = ranges[merged].end;
+        if (range.start < range.end)
+            ranges[++merged] = range;
+    }
+    return merged + 1;
+}
+
+static size_t eytzinger_fill(exec_maps_t *maps, const exec_range_t *sorted,
+                             size_t i, size_t k)
+{
+    if (k <= maps->count) {
+        i = eytzinger_fill(maps, sorted, i, 2 * k);
+        maps->eytzStart[k] = sorted[i].start;
+        maps->eytzEnd[k] = sorted[i].end;
+        maps->eytzDelta[k] = sorted[i].delta;
+        ++i;
+        i = eytzinger_fill(maps, sorted, i, 2 * k + 1);
+    }
+    return i;
+}
+
+static exec_maps_t *exec_maps_create(const exec_ranges_t *ranges,
+                                     unsigned generation)
+{
+    size_t count = ranges->count;
+    size_t padded = (count + EXEC_MAPS_VECTOR - 1) / EXEC_MAPS_VECTOR *
+        EXEC_MAPS_VECTOR;
+    // header, then sorted arrays (padded) and 1-indexed Eytzinger arrays
+    size_t header =
+        (sizeof(exec_maps_t) + EXEC_MAPS_ALIGNMENT - 1) &
+        ~((size_t)EXEC_MAPS_ALIGNMENT - 1);
+    size_t size = header + (3 * padded + 3 * (count + 1)) * sizeof(uintptr_t);
+    exec_maps_t *maps = NULL;
+    if (jemk_posix_memalign((void **)&maps, EXEC_MAPS_ALIGNMENT, size))
+        return NULL;
+
+    maps->generation = generation;
+    maps->count = count;
+    maps->pthreadStart = ranges->pthreadStart;
+    maps->pthreadEnd = ranges->pthreadEnd;
+    maps->start = (uintptr_t *)((char *)maps + header);
+    maps->end = maps->start + padded;
+    maps->delta = (uint64_t *)(maps->end + padded);
+    maps->eytzStart = (uintptr_t *)(maps->delta + padded);
+    maps->eytzEnd = maps->eytzStart + count + 1;
+    maps->eytzDelta = (uint64_t *)(maps->eytzEnd + count + 1);
+    for (size_t i = 0; i < padded; ++i) {
+        maps->start[i] = i < count ? ranges->ranges[i].start : EXEC_MAPS_PADDING;
+        maps->end[i] = i < count ? ranges->ranges[i].end : EXEC_MAPS_PADDING;
+        maps->delta[i] = i < count ? ranges->ranges[i].delta : 0u;
+    }
+    maps->eytzStart[0] = maps->eytzEnd[0] = 0;
+    maps->eytzDelta[0] = 0;
+    eytzinger_fill(maps, ranges->ranges, 0, 1);
+    return maps;
+}
+
+// ranges of a rebuild triggered by a lookup miss are usually the same -
+// the missed address was not code
+static bool exec_maps_equal(const exec_maps_t *maps,
+                            const exec_ranges_t *ranges)
+{
+    if (maps->count != ranges->count)
+        return false;
+    for (size_t i = 0; i < ranges->count; ++i)
+        if (maps->start[i] != ranges->ranges[i].start ||
+            maps->end[i] != ranges->ranges[i].end ||
+            maps->delta[i] != ranges->ranges[i].delta)
+            return false;
+    return true;
+}
+
+static void exec_maps_reclaim(void *ptr, void *arg)
+{
+    (void)arg;
+    jemk_free(ptr);
+}
+
+MEMKIND_EXPORT const exec_maps_t *exec_maps_get(void)
+{
+    const exec_maps_t *maps = __atomic_load_n(&g_maps, __ATOMIC_ACQUIRE);
+    return maps ? maps : &g_emptyMaps;
+}
+
+MEMKIND_EXPORT bool exec_maps_refresh(bool force)
+{
+    pthread_mutex_lock(&g_refreshMutex);
+    loader_counters_t counters = {0, 0};
+    (void)dl_iterate_phdr(read_loader_counters, &counters);
+    bool missed = __atomic_exchange_n(&g_lookupMissed, false, __ATOMIC_RELAXED);
+    bool changed = counters.adds == 0
+        ? missed
+        : counters.adds != g_counters.adds || counters.subs != g_counters.subs;
+    if (!force && !changed && g_maps) {
+        pthread_mutex_unlock(&g_refreshMutex);
+        return false;
+    }
+
+    exec_ranges_t ranges;
+    memset(&ranges, 0, sizeof(ranges));
+    (void)dl_iterate_phdr(collect_ranges, &ranges);
+    exec_maps_t *maps = NULL;
+    bool same = false;
+    if (!ranges.failed) {
+        sort_ranges(ranges.ranges, ranges.count);
+        ranges.count = merge_ranges(ranges.ranges, ranges.count);
+        same = !force && g_maps && exec_maps_equal(g_maps, &ranges);
+        if (!same)
+            maps = exec_maps_create(&ranges,
+                                    g_maps ? g_maps->generation + 1 : 1);
+    }
+    jemk_free(ranges.ranges);
+    if (same) {
+        g_counters = counters;
+        pthread_mutex_unlock(&g_refreshMutex);
+        return false;
+    }
+    if (!maps) {
+        log_err("exec maps: allocation failed, keeping previous table");
+        pthread_mutex_unlock(&g_refreshMutex);
+        return false;
+    }
+
+    // publish - readers may still use the previous table until they pass
+    // through a quiescent state
+    exec_maps_t *old = g_maps;
+    __atomic_store_n(&g_maps, maps, __ATOMIC_RELEASE);
+    if (old)
+        qsbr_retire(old, exec_maps_reclaim, NULL);
+    g_counters = counters;
+    pthread_mutex_unlock(&g_refreshMutex);
+    return true;
+}
+
+MEMKIND_EXPORT void exec_maps_fini(void)
+{
+    pthread_mutex_lock(&g_refreshMutex);
+    // tables retired earlier are freed by qsbr_reclaim()
+    exec_maps_t *maps = __atomic_exchange_n(&g_maps, NULL, __ATOMIC_ACQ_REL);
+    jemk_free(maps);
+    memset(&g_counters, 0, sizeof(g_counters));
+    g_lookupMissed = false;
+    pthread_mutex_unlock(&g_refreshMutex);
+}
+
+#if EXEC_MAPS_SEARCH == EXEC_MAPS_SEARCH_LINEAR
+
+static size_t count_ends_le(const exec_maps_t *maps, uintptr_t addr)
+{
+    size_t i = 0;
+    while (i < maps->count && maps->end[i] <= addr)
+        ++i;
+    return i;
+}
+
+#elif EXEC_MAPS_SEARCH == EXEC_MAPS_SEARCH_BINARY
+
+static size_t count_ends_le(const exec_maps_t *maps, uintptr_t addr)
+{
+    size_t lo = 0, hi = maps->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (maps->end[mid] <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+#elif EXEC_MAPS_SEARCH == EXEC_MAPS_SEARCH_AVX2
+
+#ifndef __AVX2__
+#error "EXEC_MAPS_SEARCH_AVX2 requires AVX2 support"
+#endif
+static size_t count_ends_le(const exec_maps_t *maps, uintptr_t addr)
+{
+    __m256i a = _mm256_set1_epi64x((long long)addr);
+    size_t i = 0;
+    for (; i < maps->count; i += 4) {
+        __m256i e = _mm256_load_si256((const __m256i *)&maps->end[i]);
+        int gt = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(e, a)));
+        // ends are sorted - first greater one ends the search
+        if (gt)
+            return i + __builtin_ctz(gt);
+    }
+    return maps->count;
+}
+
+#elif EXEC_MAPS_SEARCH == EXEC_MAPS_SEARCH_AVX512
+
+#ifndef __AVX512F__
+#error "EXEC_MAPS_SEARCH_AVX512 requires AVX-512 support"
+#endif
+static size_t count_ends_le(const exec_maps_t *maps, uintptr_t addr)
+{
+    __m512i a = _mm512_set1_epi64((long long)addr);
+    size_t i = 0;
+    for (; i < maps->count; i += 8) {
+        __m512i e = _mm512_load_si512((const void *)&maps->end[i]);
+        __mmask8 gt = _mm512_cmpgt_epu64_mask(e, a);
+        if (gt)
+            return i + __builtin_ctz(gt);
+    }
+    return maps->count;
+}
+
+#elif EXEC_MAPS_SEARCH != EXEC_MAPS_SEARCH_EYTZINGER
+#error "Unknown exec maps search method!"
+#endif
+
+static inline bool exec_maps_find(const exec_maps_t *maps, uintptr_t a,
+                                  uint64_t *delta)
+{
+#if EXEC_MAPS_SEARCH == EXEC_MAPS_SEARCH_EYTZINGER
+    // find first interval with end > addr; branchless descent,
+    // k ends up encoding the path - strip trailing "right" turns
+    size_t k = 1;
+    while (k <= maps->count) {
+        __builtin_prefetch(&maps->eytzEnd[16 * k]);
+        k = 2 * k + (maps->eytzEnd[k] <= a);
+    }
+    k >>= __builtin_ffsl(~k);
+    *delta = maps->eytzDelta[k];
+    return k != 0 && maps->eytzStart[k] <= a;
+#else
+    size_t idx = count_ends_le(maps, a);
+    if (idx >= maps->count || maps->start[idx] > a)
+        return false;
+    *delta = maps->delta[idx];
+    return true;
+#endif
+}
+
+MEMKIND_EXPORT bool exec_maps_contains(const exec_maps_t *maps,
+                                       const void *addr)
+{
+    uint64_t delta;
+    return exec_maps_find(maps, (uintptr_t)addr, &delta);
+}
+
+MEMKIND_EXPORT bool exec_maps_lookup(const exec_maps_t *maps,
+                                     const void *addr, uint64_t *site)
+{
+    uint64_t delta;
+    if (!exec_maps_find(maps, (uintptr_t)addr, &delta)) {
+        // store only once - lookups run on every allocation
+        if (!__atomic_load_n(&g_lookupMissed, __ATOMIC_RELAXED))
+            __atomic_store_n(&g_lookupMissed, true, __ATOMIC_RELAXED);
+        return false;
+    }
+    *site = (uintptr_t)addr + delta;
+    return true;
+}
+
+MEMKIND_EXPORT bool exec_maps_is_terminal(const exec_maps_t *maps,
+                                          const void *addr)
+{
+    uintptr_t a = (uintptr_t)addr;
+    return a >= maps->pthreadStart && a < maps->pthreadEnd;
+}
+
+MEMKIND_EXPORT unsigned exec_maps_generation(const exec_maps_t *maps)
+{
+    return maps->generation;
+}
+
+MEMKIND_EXPORT size_t exec_maps_count(const exec_maps_t *maps)
+{
+    return maps->count;
+}
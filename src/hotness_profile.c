@@ -0,0 +1,130 @@
+#include "memkind/internal/hotness_profile.h"
+#include "memkind/internal/memkind_log.h"
+#include "memkind/internal/tachanka.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef MEMKIND_EXPORT
+#define MEMKIND_EXPORT __attribute__((visibility("default")))
+#endif
+
+typedef struct profile_writer {
+    FILE *file;
+    uint64_t count;
+    bool failed;
+} profile_writer_t;
+
+static int write_type(const struct ttype *t, void *arg)
+{
+    profile_writer_t *writer = arg;
+    // types never touched have the initial hotness only
+    if (!t->t0)
+        return 0;
+    hotness_profile_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.hash = t->hash;
+    entry.total_size = t->total_size;
+    entry.f = t->f;
+#if HOTNESS_POLICY == HOTNESS_POLICY_EXPONENTIAL_COEFFS
+    memcpy(entry.coeffs, t->hotness_history_coeffs, sizeof(entry.coeffs));
+#endif
+    if (fwrite(&entry, sizeof(entry), 1u, writer->file) != 1u) {
+        writer->failed = true;
+        return 1;
+    }
+    writer->count++;
+    return 0;
+}
+
+MEMKIND_EXPORT int hotness_profile_save(const char *path)
+{
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid()) >=
+        (int)sizeof(tmp_path)) {
+        log_err("Hotness profile path is too long: %s", path);
+        return -1;
+    }
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        log_err("Cannot create hotness profile %s", tmp_path);
+        return -1;
+    }
+
+    hotness_profile_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HOTNESS_PROFILE_MAGIC, sizeof(header.magic));
+    header.version = HOTNESS_PROFILE_VERSION;
+    header.policy = HOTNESS_POLICY;
+    header.coeffs = EXPONENTIAL_COEFFS_NUMBER;
+    tachanka_stats_t stats;
+    tachanka_get_stats(&stats);
+    header.thresholds = stats.thresholds;
+    for (size_t i = 0; i < stats.thresholds; ++i) {
+        header.thresh[i] = stats.thresh[i];
+        if (stats.thresh_valid[i])
+            header.thresh_valid |= 1u << i;
+    }
+
+    // count is known at the end - header is written again
+    profile_writer_t writer = {file, 0u, false};
+    writer.failed = fwrite(&header, sizeof(header), 1u, file) != 1u;
+    if (!writer.failed)
+        tachanka_iter_types(write_type, &writer);
+    header.count = writer.count;
+    if (!writer.failed)
+        writer.failed = fseek(file, 0, SEEK_SET) ||
+            fwrite(&header, sizeof(header), 1u, file) != 1u;
+    // the previous profile is replaced only by a complete one
+    if (fclose(file) || writer.failed || rename(tmp_path, path)) {
+        log_err("Cannot write hotness profile %s", path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+MEMKIND_EXPORT ptrdiff_t hotness_profile_load(const char *path,
+                                              uint64_t timestamp)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return -1;
+    hotness_profile_header_t header;
+    if (fread(&header, sizeof(header), 1u, file) != 1u ||
+        memcmp(header.magic, HOTNESS_PROFILE_MAGIC, sizeof(header.magic)) ||
+        header.version != HOTNESS_PROFILE_VERSION) {
+        log_err("%s is not a hotness profile", path);
+        fclose(file);
+        return -1;
+    }
+    // hotness of other policies is not comparable
+    if (header.policy != HOTNESS_POLICY ||
+        header.coeffs != EXPONENTIAL_COEFFS_NUMBER ||
+        header.thresholds > HOTNESS_MAX_THRESHOLDS) {
+        log_err("Hotness profile %s was saved with other configuration",
+                path);
+        fclose(file);
+        return -1;
+    }
+
+    ptrdiff_t loaded = 0;
+    hotness_profile_entry_t entry;
+    for (uint64_t i = 0; i < header.count; ++i) {
+        if (fread(&entry, sizeof(entry), 1u, file) != 1u) {
+            log_err("Hotness profile %s is truncated", path);
+            break;
+        }
+        tachanka_preload_type(entry.hash, entry.f, entry.coeffs, timestamp);
+        ++loaded;
+    }
+    fclose(file);
+
+    bool thresh_valid[HOTNESS_MAX_THRESHOLDS];
+    for (uint32_t i = 0; i < header.thresholds; ++i)
+        thresh_valid[i] = header.thresh_valid & (1u << i);
+    tachanka_set_thresholds(header.thresholds, header.thresh, thresh_valid);
+    return loaded;
+}
@@ -0,0 +1,159 @@
+#include "memkind/internal/hotness_stats.h"
+#include "memkind/internal/memkind_log.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef MEMKIND_EXPORT
+#define MEMKIND_EXPORT __attribute__((visibility("default")))
+#endif
+
+// attempts of a reader to get a snapshot between updates
+#define HOTNESS_STATS_READ_RETRIES 1000u
+
+static hotness_stats_t *g_statsPage = NULL;
+// process that created g_statsPage - the page is inherited on fork
+static pid_t g_statsPid = 0;
+static atomic_bool g_statsEnabled = false;
+
+static void stats_path(char *path, size_t len, pid_t pid)
+{
+    snprintf(path, len, HOTNESS_STATS_PATH, (int)pid);
+}
+
+static void stats_release(void)
+{
+    if (!g_statsPage)
+        return;
+    atomic_store(&g_statsEnabled, false);
+    munmap(g_statsPage, sizeof(hotness_stats_t));
+    g_statsPage = NULL;
+    // page of the parent stays with the parent
+    if (g_statsPid == getpid()) {
+        char path[PATH_MAX];
+        stats_path(path, sizeof(path), g_statsPid);
+        unlink(path);
+    }
+}
+
+MEMKIND_EXPORT int hotness_stats_open(void)
+{
+    stats_release();
+    pid_t pid = getpid();
+    char path[PATH_MAX];
+    stats_path(path, sizeof(path), pid);
+    // /dev/shm is shared by all users - a file left there under the name of
+    // this pid (e.g. a symlink planted by someone else) is never reused
+    unlink(path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                  0600);
+    if (fd < 0) {
+        log_err("Cannot create hotness stats page %s", path);
+        return -1;
+    }
+    hotness_stats_t *page = MAP_FAILED;
+    if (!ftruncate(fd, sizeof(hotness_stats_t)))
+        page = mmap(NULL, sizeof(hotness_stats_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        log_err("Cannot map hotness stats page %s", path);
+        unlink(path);
+        return -1;
+    }
+    // file is zeroed by ftruncate; magic is written last, so readers do
+    // not accept a page without header
+    page->version = HOTNESS_STATS_VERSION;
+    page->size = sizeof(hotness_stats_t);
+    page->pid = pid;
+    __atomic_store_n(&page->magic, HOTNESS_STATS_MAGIC, __ATOMIC_RELEASE);
+    g_statsPage = page;
+    g_statsPid = pid;
+    atomic_store(&g_statsEnabled, true);
+    return 0;
+}
+
+MEMKIND_EXPORT void hotness_stats_close(void)
+{
+    stats_release();
+}
+
+MEMKIND_EXPORT bool hotness_stats_enabled(void)
+{
+    return atomic_load_explicit(&g_statsEnabled, memory_order_relaxed);
+}
+
+MEMKIND_EXPORT void hotness_stats_publish(const hotness_stats_t *stats)
+{
+    if (!hotness_stats_enabled())
+        return;
+    hotness_stats_t *page = g_statsPage;
+    uint64_t sequence = __atomic_load_n(&page->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->sequence, sequence + 1u, __ATOMIC_RELAXED);
+    // odd sequence is visible before any of the stores below
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    // header is not touched
+    const size_t body = offsetof(hotness_stats_t, timestamp);
+    memcpy((char *)page + body, (const char *)stats + body,
+           sizeof(hotness_stats_t) - body);
+    __atomic_store_n(&page->sequence, sequence + 2u, __ATOMIC_RELEASE);
+}
+
+MEMKIND_EXPORT const hotness_stats_t *hotness_stats_map(pid_t pid)
+{
+    char path[PATH_MAX];
+    stats_path(path, sizeof(path), pid);
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    hotness_stats_t *page = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size >= (off_t)sizeof(hotness_stats_t))
+        page = mmap(NULL, sizeof(hotness_stats_t), PROT_READ, MAP_SHARED,
+                    fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+        return NULL;
+    // newer writers append fields - their pages are accepted
+    if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) !=
+            HOTNESS_STATS_MAGIC ||
+        page->version < HOTNESS_STATS_VERSION ||
+        page->size < sizeof(hotness_stats_t)) {
+        munmap(page, sizeof(hotness_stats_t));
+        return NULL;
+    }
+    return page;
+}
+
+MEMKIND_EXPORT void hotness_stats_unmap(const hotness_stats_t *page)
+{
+    munmap((void *)page, sizeof(hotness_stats_t));
+}
+
+MEMKIND_EXPORT int hotness_stats_read(const hotness_stats_t *page,
+                                      hotness_stats_t *snapshot)
+{
+    for (unsigned i = 0u; i < HOTNESS_STATS_READ_RETRIES; ++i) {
+        uint64_t sequence =
+            __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1u) {
+            sched_yield();
+            continue;
+        }
+        memcpy(snapshot, page, sizeof(*snapshot));
+        // copy is complete before the sequence is checked again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->sequence, __ATOMIC_RELAXED) == sequence) {
+            snapshot->sequence = sequence;
+            return 0;
+        }
+    }
+    return -1;
+}
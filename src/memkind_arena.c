@@ -144,6 +144,111 @@ struct memkind *get_kind_by_arena(unsigned arena_ind)
     return arena_registry_g[arena_ind];
 }
 
+// Address map: arena of each 2 MB chunk of address space that is fully
+// mapped by extent hooks of one arena, so that the kind of a pointer is
+// found with one load instead of jemalloc rtree lookup. Arena of memory is
+// fixed when extent hooks map it; arena hooks never unmap (dalloc opts out),
+// pmem hooks remove their extents from the map before unmapping them.
+// Chunks shared with other mappings (not counted) or with other arenas are
+// left to jemk_arenalookupx().
+// Table covers 47-bit user address space; it is reserved at first use and
+// its pages are committed on first write.
+#define KIND_MAP_CHUNK_SHIFT  21
+#define KIND_MAP_CHUNKS       (1UL << (47 - KIND_MAP_CHUNK_SHIFT))
+// mapped part of a chunk is counted in 4 KB units (extents are page aligned)
+#define KIND_MAP_UNIT_SHIFT   12
+#define KIND_MAP_CHUNK_UNITS  (1U << (KIND_MAP_CHUNK_SHIFT - KIND_MAP_UNIT_SHIFT))
+// entry: arena index + 1 (0 - none) in low bits, mapped units in high bits
+#define KIND_MAP_ARENA_MASK   0xffffU
+#define KIND_MAP_MIXED        KIND_MAP_ARENA_MASK
+#define KIND_MAP_UNITS_SHIFT  16
+
+static uint32_t *kind_map = NULL;
+static pthread_once_t kind_map_once = PTHREAD_ONCE_INIT;
+
+static void kind_map_init(void)
+{
+    void *map = mmap(NULL, KIND_MAP_CHUNKS * sizeof(uint32_t),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        log_err("Address map of kinds could not be reserved.");
+        return;
+    }
+    __atomic_store_n(&kind_map, (uint32_t *)map, __ATOMIC_RELEASE);
+}
+
+/// add (@p add) or remove mapped range [@p addr, @p addr + @p size)
+/// of @p arena_ind to/from kind map
+static void kind_map_update(void *addr, size_t size, unsigned arena_ind,
+                            bool add)
+{
+    uint32_t *map = __atomic_load_n(&kind_map, __ATOMIC_ACQUIRE);
+    if (!map || arena_ind >= MALLOCX_ARENA_MAX)
+        return;
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + size;
+    while (start < end) {
+        uintptr_t chunk = start >> KIND_MAP_CHUNK_SHIFT;
+        if (chunk >= KIND_MAP_CHUNKS)
+            return;
+        uintptr_t chunk_end = (chunk + 1) << KIND_MAP_CHUNK_SHIFT;
+        uintptr_t stop = chunk_end < end ? chunk_end : end;
+        uint32_t units = (stop - start) >> KIND_MAP_UNIT_SHIFT;
+        uint32_t old = __atomic_load_n(&map[chunk], __ATOMIC_RELAXED);
+        uint32_t entry;
+        do {
+            uint32_t old_units = old >> KIND_MAP_UNITS_SHIFT;
+            uint32_t old_arena = old & KIND_MAP_ARENA_MASK;
+            if (add) {
+                uint32_t arena = (old_arena == 0 || old_arena == arena_ind + 1)
+                    ? arena_ind + 1
+                    : KIND_MAP_MIXED;
+                entry = ((old_units + units) << KIND_MAP_UNITS_SHIFT) | arena;
+            } else {
+                // hooks might release memory they did not map (e.g. arena
+                // base allocated before hooks were set) - units only get
+                // undercounted, so chunk is never taken as fully mapped;
+                // chunk is free for other arenas when nothing is mapped
+                entry = old_units <= units
+                    ? 0
+                    : ((old_units - units) << KIND_MAP_UNITS_SHIFT) |
+                        old_arena;
+            }
+        } while (!__atomic_compare_exchange_n(&map[chunk], &old, entry, true,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+        start = stop;
+    }
+}
+
+void memkind_arena_map_extent(void *addr, size_t size, unsigned arena_ind)
+{
+    pthread_once(&kind_map_once, kind_map_init);
+    kind_map_update(addr, size, arena_ind, true);
+}
+
+void memkind_arena_unmap_extent(void *addr, size_t size, unsigned arena_ind)
+{
+    kind_map_update(addr, size, arena_ind, false);
+}
+
+/// @return arena of @p ptr: one load for chunks fully mapped by one arena,
+/// jemalloc rtree lookup otherwise
+static inline unsigned arena_lookup(const void *ptr)
+{
+    uintptr_t chunk = (uintptr_t)ptr >> KIND_MAP_CHUNK_SHIFT;
+    uint32_t *map = __atomic_load_n(&kind_map, __ATOMIC_ACQUIRE);
+    if (MEMKIND_LIKELY(map && chunk < KIND_MAP_CHUNKS)) {
+        uint32_t entry = __atomic_load_n(&map[chunk], __ATOMIC_RELAXED);
+        uint32_t arena = entry & KIND_MAP_ARENA_MASK;
+        if ((entry >> KIND_MAP_UNITS_SHIFT) == KIND_MAP_CHUNK_UNITS &&
+            arena != KIND_MAP_MIXED)
+            return arena - 1;
+    }
+    return (unsigned)jemk_arenalookupx(ptr);
+}
+
 // Allocates size bytes aligned to alignment. Returns NULL if allocation fails.
 static void *alloc_aligned_slow(size_t size, size_t alignment,
                                 struct memkind *kind)
@@ -206,6 +311,7 @@ void *arena_extent_alloc(extent_hooks_t *extent_hooks, void *new_addr,
 
     *zero = true;
     *commit = true;
+    memkind_arena_map_extent(addr, size, arena_ind);
 
     return addr;
 }
@@ -220,9 +326,21 @@ void *arena_extent_alloc_hugetlb(extent_hooks_t *extent_hooks, void *new_addr,
                               commit, arena_ind);
 }
 
+// notified about ranges of extents that are purged or deallocated - they
+// hold no live allocations
+static void (*extent_release_hook)(void *addr, size_t size) = NULL;
+
+void memkind_arena_set_extent_release_hook(void (*hook)(void *addr,
+                                                        size_t size))
+{
+    extent_release_hook = hook;
+}
+
 bool arena_extent_dalloc(extent_hooks_t *extent_hooks, void *addr, size_t size,
                          bool committed, unsigned arena_ind)
 {
+    if (extent_release_hook)
+        extent_release_hook(addr, size);
     return true;
 }
 
@@ -243,12 +361,16 @@ bool arena_extent_purge_hog_memory(extent_hooks_t *extent_hooks, void *addr,
                                    size_t size, size_t offset, size_t length,
                                    unsigned arena_ind)
 {
+    if (extent_release_hook)
+        extent_release_hook(addr + offset, length);
     return true;
 }
 
 bool arena_extent_purge(extent_hooks_t *extent_hooks, void *addr, size_t size,
                         size_t offset, size_t length, unsigned arena_ind)
 {
+    if (extent_release_hook)
+        extent_release_hook(addr + offset, length);
     int err = madvise(addr + offset, length, MADV_DONTNEED);
     return (err != 0);
 }
@@ -448,13 +570,26 @@ MEMKIND_EXPORT struct memkind *memkind_arena_detect_kind(void *ptr)
         return NULL;
     }
 
-    struct memkind *kind = get_kind_by_arena((unsigned)jemk_arenalookupx(ptr));
+    unsigned arena = arena_lookup(ptr);
+    // jemalloc does not know the pointer (e.g. it was already released)
+    struct memkind *kind =
+        arena < MALLOCX_ARENA_MAX ? get_kind_by_arena(arena) : NULL;
     /* if no kind was associated with arena it means that allocation doesn't
        come from jemk_*allocx API - it is jemk_*alloc API (MEMKIND_DEFAULT) */
 
     return (kind) ? kind : MEMKIND_DEFAULT;
 }
 
+MEMKIND_EXPORT struct memkind *memkind_arena_detect_kind_lookup(void *ptr)
+{
+    if (!ptr) {
+        return NULL;
+    }
+
+    struct memkind *kind = get_kind_by_arena((unsigned)jemk_arenalookupx(ptr));
+    return (kind) ? kind : MEMKIND_DEFAULT;
+}
+
 static inline int get_tcache_flag(unsigned partition, size_t size)
 {
 
@@ -652,6 +787,240 @@ MEMKIND_EXPORT int memkind_arena_posix_memalign(struct memkind *kind,
     return err;
 }
 
+// Arena classes - separate sets of arenas of a kind, selected by the caller
+// instead of get_arena(), so that allocations of different classes never
+// share pages. Class arenas use extent hooks of the kind (default ones for
+// MEMKIND_DEFAULT) and are never destroyed - allocations might outlive
+// their user.
+// max number of class arenas of all kinds
+#define MEMKIND_ARENA_CLASS_SLOTS 256
+
+static pthread_mutex_t class_arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned class_arena_zero[MEMKIND_MAX_KIND];
+static unsigned class_arena_count[MEMKIND_MAX_KIND];
+// position of arena among all class arenas + 1, 0 - not a class arena
+static unsigned class_arena_slot[MALLOCX_ARENA_MAX];
+static unsigned class_arena_slots = 0;
+static pthread_key_t class_tcache_key;
+static pthread_once_t class_tcache_once = PTHREAD_ONCE_INIT;
+
+static void class_tcache_finalize(void *args)
+{
+    unsigned *tcache_map = args;
+    for (unsigned i = 0; i < MEMKIND_ARENA_CLASS_SLOTS; i++) {
+        if (tcache_map[i] != 0) {
+            jemk_mallctl("tcache.destroy", NULL, NULL, (void *)&tcache_map[i],
+                         sizeof(unsigned));
+        }
+    }
+    jemk_free(tcache_map);
+}
+
+static void class_tcache_key_create(void)
+{
+    if (pthread_key_create(&class_tcache_key, class_tcache_finalize))
+        log_err("Could not create key for tcache of arena classes.");
+}
+
+MEMKIND_EXPORT int memkind_arena_create_classes(struct memkind *kind,
+                                                unsigned classes)
+{
+    int err = 0;
+    extent_hooks_t *hooks = NULL;
+    size_t hooks_size = sizeof(hooks);
+
+    if (classes == 0 || kind->partition >= MEMKIND_MAX_KIND)
+        return MEMKIND_ERROR_INVALID;
+    pthread_once(&kind->init_once, kind->ops->init_once);
+    pthread_once(&class_tcache_once, class_tcache_key_create);
+    if (kind->arena_map_len) {
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "arena.%u.extent_hooks", kind->arena_zero);
+        err = jemk_mallctl(cmd, (void *)&hooks, &hooks_size, NULL, 0);
+        if (err)
+            return MEMKIND_ERROR_RUNTIME;
+    }
+
+    if (pthread_mutex_lock(&class_arenas_lock) != 0)
+        assert(0 && "failed to acquire mutex");
+    if (class_arena_count[kind->partition]) {
+        // already created, arenas cannot be destroyed
+        err = class_arena_count[kind->partition] == classes
+            ? 0
+            : MEMKIND_ERROR_INVALID;
+        goto exit;
+    }
+    if (class_arena_slots + classes > MEMKIND_ARENA_CLASS_SLOTS) {
+        log_err("Too many arena classes.");
+        err = MEMKIND_ERROR_INVALID;
+        goto exit;
+    }
+    if (pthread_mutex_lock(&arena_registry_write_lock) != 0)
+        assert(0 && "failed to acquire mutex");
+    unsigned arena_zero = UINT_MAX;
+    size_t unsigned_size = sizeof(unsigned int);
+    for (unsigned i = 0; i < classes; i++) {
+        unsigned arena_index;
+        err = jemk_mallctl("arenas.create", (void *)&arena_index,
+                           &unsigned_size, NULL, 0);
+        if (err) {
+            log_err("Could not create arena.");
+            err = MEMKIND_ERROR_ARENAS_CREATE;
+            break;
+        }
+        // arenas are created with consecutive indices, as in
+        // memkind_arena_create_map()
+        if (arena_zero > arena_index)
+            arena_zero = arena_index;
+        if (hooks) {
+            char cmd[64];
+            snprintf(cmd, sizeof(cmd), "arena.%u.extent_hooks", arena_index);
+            err = jemk_mallctl(cmd, NULL, NULL, (void *)&hooks,
+                               sizeof(extent_hooks_t *));
+            if (err)
+                break;
+            arena_registry_g[arena_index] = kind;
+        }
+        class_arena_slot[arena_index] = ++class_arena_slots;
+    }
+    if (pthread_mutex_unlock(&arena_registry_write_lock) != 0)
+        assert(0 && "failed to release mutex");
+    if (!err) {
+        class_arena_zero[kind->partition] = arena_zero;
+        class_arena_count[kind->partition] = classes;
+    }
+
+exit:
+    if (pthread_mutex_unlock(&class_arenas_lock) != 0)
+        assert(0 && "failed to release mutex");
+    return err;
+}
+
+MEMKIND_EXPORT unsigned memkind_arena_get_classes(struct memkind *kind)
+{
+    return kind->partition < MEMKIND_MAX_KIND
+        ? class_arena_count[kind->partition]
+        : 0;
+}
+
+// explicit tcache per thread and class arena - tcache is filled only from
+// its arena and class allocations are freed only to the tcache of their
+// arena, so that objects of other arenas are never handed out
+static inline int get_class_tcache_flag(unsigned arena, size_t size)
+{
+    if (size > TCACHE_MAX)
+        return MALLOCX_TCACHE_NONE;
+    unsigned *tcache_map = pthread_getspecific(class_tcache_key);
+    if (MEMKIND_UNLIKELY(tcache_map == NULL)) {
+        tcache_map = jemk_calloc(MEMKIND_ARENA_CLASS_SLOTS, sizeof(unsigned));
+        if (tcache_map == NULL)
+            return MALLOCX_TCACHE_NONE;
+        pthread_setspecific(class_tcache_key, (void *)tcache_map);
+    }
+    unsigned *tcache = &tcache_map[class_arena_slot[arena] - 1];
+    if (MEMKIND_UNLIKELY(*tcache == 0)) {
+        size_t unsigned_size = sizeof(unsigned);
+        int err =
+            jemk_mallctl("tcache.create", (void *)tcache, &unsigned_size, NULL,
+                         0);
+        if (err) {
+            log_err("Could not acquire tcache, err=%d", err);
+            return MALLOCX_TCACHE_NONE;
+        }
+    }
+    return MALLOCX_TCACHE(*tcache);
+}
+
+/// @return arena of class @p cls of @p kind, UINT_MAX if kind has no classes
+static inline unsigned get_class_arena(struct memkind *kind, unsigned cls)
+{
+    unsigned count = memkind_arena_get_classes(kind);
+    if (!count)
+        return UINT_MAX;
+    return class_arena_zero[kind->partition] + cls % count;
+}
+
+MEMKIND_EXPORT void *memkind_arena_class_malloc(struct memkind *kind,
+                                                unsigned cls, size_t size)
+{
+    unsigned arena = get_class_arena(kind, cls);
+    if (arena == UINT_MAX)
+        return memkind_malloc(kind, size);
+    if (MEMKIND_UNLIKELY(size_out_of_bounds(size)))
+        return NULL;
+    return jemk_mallocx_check(size, MALLOCX_ARENA(arena) |
+                                  get_class_tcache_flag(arena, size));
+}
+
+MEMKIND_EXPORT void *memkind_arena_class_calloc(struct memkind *kind,
+                                                unsigned cls, size_t num,
+                                                size_t size)
+{
+    unsigned arena = get_class_arena(kind, cls);
+    if (arena == UINT_MAX)
+        return memkind_calloc(kind, num, size);
+    if (MEMKIND_UNLIKELY(size_out_of_bounds(num) ||
+                         size_out_of_bounds(size)))
+        return NULL;
+    if (num > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return jemk_mallocx_check(num * size, MALLOCX_ARENA(arena) | MALLOCX_ZERO |
+                                  get_class_tcache_flag(arena, num * size));
+}
+
+MEMKIND_EXPORT int memkind_arena_class_posix_memalign(struct memkind *kind,
+                                                      unsigned cls,
+                                                      void **memptr,
+                                                      size_t alignment,
+                                                      size_t size)
+{
+    unsigned arena = get_class_arena(kind, cls);
+    if (arena == UINT_MAX)
+        return memkind_posix_memalign(kind, memptr, alignment, size);
+    *memptr = NULL;
+    int err = memkind_posix_check_alignment(kind, alignment);
+    if (MEMKIND_UNLIKELY(err))
+        return err;
+    if (MEMKIND_UNLIKELY(size_out_of_bounds(size)))
+        return 0;
+    int errno_before = errno;
+    *memptr = jemk_mallocx_check(size, MALLOCX_ALIGN(alignment) |
+                                     MALLOCX_ARENA(arena) |
+                                     get_class_tcache_flag(arena, size));
+    errno = errno_before;
+    return *memptr ? 0 : ENOMEM;
+}
+
+MEMKIND_EXPORT bool memkind_arena_class_free(void *ptr)
+{
+    if (!ptr || !class_arena_slots)
+        return false;
+    unsigned arena = arena_lookup(ptr);
+    if (arena >= MALLOCX_ARENA_MAX || !class_arena_slot[arena])
+        return false;
+    // arena lock is taken only when the tcache is flushed
+    jemk_dallocx(ptr,
+                 get_class_tcache_flag(arena, jemk_malloc_usable_size(ptr)));
+    return true;
+}
+
+MEMKIND_EXPORT void *memkind_arena_class_realloc(struct memkind *kind,
+                                                 void *ptr, size_t size)
+{
+    if (ptr && size && class_arena_slots) {
+        unsigned arena = arena_lookup(ptr);
+        // allocation stays in its class
+        if (arena < MALLOCX_ARENA_MAX && class_arena_slot[arena])
+            return jemk_rallocx_check(ptr, size, MALLOCX_ARENA(arena) |
+                                          get_class_tcache_flag(arena, size));
+    }
+    if (size == 0 && memkind_arena_class_free(ptr))
+        return NULL;
+    return memkind_realloc(kind, ptr, size);
+}
+
 MEMKIND_EXPORT int memkind_bijective_get_arena(struct memkind *kind,
                                                unsigned int *arena, size_t size)
 {
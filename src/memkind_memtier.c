@@ -1,16 +1,26 @@
 // SPDX-License-Identifier: BSD-2-Clause
 /* Copyright (C) 2021 Intel Corporation. */
 
+#include <memkind/internal/alloc_sampling.h>
+#include <memkind/internal/hotness_profile.h>
+#include <memkind/internal/hotness_stats.h>
 #include <memkind/internal/memkind_arena.h>
 #include <memkind/internal/memkind_log.h>
 #include <memkind/internal/bthash.h>
 #include <memkind/internal/memkind_memtier.h>
 #include <memkind/internal/pebs.h>
 #include <memkind/internal/tachanka.h>
+#include <memkind/internal/page_migration.h>
+#include <memkind/internal/qsbr.h>
+#include <memkind/internal/sample_source.h>
+#include <memkind/internal/sample_trace.h>
 
 #include "config.h"
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
+#include <numa.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -108,7 +118,13 @@
 double old_time_window_hotness_weight;
 double pebs_freq_hz;
 double sampling_interval;
-unsigned long long hotness_measure_window;
+unsigned long long pebs_ring_pages = MMAP_DATA_SIZE;
+bool pebs_per_cpu = PEBS_PER_CPU_DEFAULT;
+unsigned long long pebs_consumer_threads = PEBS_CONSUMER_THREADS_DEFAULT;
+int hotness_sample_source = SAMPLE_SOURCE_AUTO;
+double pebs_overhead_target = DEFAULT_HOTNESS_PEBS_OVERHEAD;
+unsigned long long pebs_type_samples = DEFAULT_HOTNESS_PEBS_TYPE_SAMPLES;
+unsigned long long hotness_measure_window = DEFAULT_HOTNESS_MEASURE_WINDOW;
 
 // Macro to get number of thresholds from parent object
 #define THRESHOLD_NUM(obj) ((obj->cfg_size) - 1)
@@ -156,6 +172,8 @@ struct memtier_memory {
     float thres_degree; // % of threshold change in case of update
     int hot_tier_id;                     // ID of "hot" tier
     int cold_tier_id;                     // ID of "cold" tier
+    int hotness_tier_ids[HOTNESS_MAX_TIERS]; // tier IDs ordered by hotness,
+                                             // hottest first
 
     // memtier_memory operations
     memkind_t (*get_kind)(struct memtier_memory *memory, size_t size, uint64_t *data);
@@ -164,12 +182,33 @@ struct memtier_memory {
 };
 // clang-format on
 
-#define THREAD_BUCKETS  (256U)
-// #define FLUSH_THRESHOLD (51200)
-#define FLUSH_THRESHOLD (0)
+// Allocation statistics
+//
+// Each thread gets its own bucket of counters (assigned round-robin on first
+// use; buckets are shared only when more than THREAD_BUCKETS threads exist),
+// bucket is padded to cache line, so that malloc/free on different threads
+// do not touch shared cache lines. Bucket is folded into g_alloc_size when
+// its absolute value exceeds FLUSH_THRESHOLD and, for data hotness policy
+// tiers, on every PEBS thread cycle (memtier_flush_alloc_size).
+//
+// Staleness bound: g_alloc_size[kind] differs from the real value by at most
+// min(threads, THREAD_BUCKETS) * FLUSH_THRESHOLD bytes (12.5MiB per kind for
+// 256 threads); data hotness tiers additionally are not older than
+// 1/HOTNESS_PEBS_THREAD_FREQUENCY seconds. Static ratio policy works on
+// these bounded-staleness values; memtier_kind_allocated_size() folds all
+// buckets of given kind before returning, while
+// memtier_kind_allocated_size_unflushed() returns the bounded-staleness value.
 #define MEMKIND_TOTAL_IDX (MEMKIND_MAX_KIND)
+#define ALLOC_SIZE_BUCKET_ALIGNMENT (64U)
 
-static MEMKIND_ATOMIC long long t_alloc_size[MEMKIND_MAX_KIND][THREAD_BUCKETS];
+struct alloc_size_bucket {
+    MEMKIND_ATOMIC long long size[MEMKIND_MAX_KIND];
+} __attribute__((aligned(ALLOC_SIZE_BUCKET_ALIGNMENT)));
+
+static struct alloc_size_bucket t_alloc_size[THREAD_BUCKETS];
+// number of buckets ever assigned to threads
+static MEMKIND_ATOMIC unsigned g_alloc_size_buckets=0;
+static thread_local unsigned t_bucket_id=THREAD_BUCKETS;
 // MEMKIND_MAX_KIND+1 for MEMKIND_TOTAL_IDX
 static MEMKIND_ATOMIC size_t g_alloc_size[MEMKIND_MAX_KIND+1];
 
@@ -177,8 +216,46 @@ static MEMKIND_ATOMIC size_t g_alloc_size[MEMKIND_MAX_KIND+1];
 // have different hot tier ID; right now, we permit creating multiple memories,
 // but we keep one, global hotTierId, g_hotTotalDesiredRatio
 // and statistics (t_alloc_size and g_alloc_size)!
-static MEMKIND_ATOMIC size_t g_totalTiers=0; // TODO use it for stats acquisition
+static MEMKIND_ATOMIC size_t g_totalTiers=0; // number of data hotness tiers
 static MEMKIND_ATOMIC size_t g_hotTierId=0;
+// kind of the hottest tier
+static memkind_t g_hotKind=NULL;
+// see HOTNESS_ARENA_CLUSTERS, 0 - arena classes are not used
+static unsigned g_arenaClusters = 0u;
+// see HOTNESS_PROFILE, empty - hotness is not persisted
+static char g_profilePath[PATH_MAX] = "";
+// see HOTNESS_CONTROLLER_FEED_FORWARD
+static double g_controllerFeedForward = DEFAULT_HOTNESS_CONTROLLER_FEED_FORWARD;
+// arena class of the last data hotness decision of the thread, consumed by
+// the allocation that follows it
+static thread_local unsigned t_arenaClass = 0u;
+
+// class 0 holds allocations of types without a decision
+static inline unsigned arena_class_of(uint64_t hash, int tier)
+{
+    return tier < 0 || !g_arenaClusters
+        ? 0u
+        : 1u + (unsigned)((hash ^ (hash >> 32)) % g_arenaClusters);
+}
+
+static inline unsigned take_arena_class(void)
+{
+    unsigned cls = t_arenaClass;
+    t_arenaClass = 0u;
+    return cls;
+}
+
+static inline void memtier_kind_release(memkind_t kind, void *ptr)
+{
+    // allocations from class arenas go to tcaches of their arenas
+    if (!g_arenaClusters || !memkind_arena_class_free(ptr))
+        memkind_free(kind, ptr);
+}
+// partitions of tier kinds ordered by hotness (hottest first),
+// used to index g_alloc_size
+static MEMKIND_ATOMIC size_t g_tierPartitions[HOTNESS_MAX_TIERS];
+// desired ratio of (size of i+1 hottest tiers)/(total size)
+static MEMKIND_ATOMIC double g_tierTotalDesiredRatios[HOTNESS_MAX_THRESHOLDS];
 static MEMKIND_ATOMIC double g_hotTotalDesiredRatio=0;
 static MEMKIND_ATOMIC double g_hotTotalActualRatio=0;
 static MEMKIND_ATOMIC size_t g_totalSize=0;
@@ -201,67 +278,154 @@ void memtier_reset_size(unsigned kind_id)
 {
     unsigned bucket_id;
     for (bucket_id = 0; bucket_id < THREAD_BUCKETS; ++bucket_id) {
-        memkind_atomic_set(t_alloc_size[kind_id][bucket_id], 0);
+        memkind_atomic_set(t_alloc_size[bucket_id].size[kind_id], 0);
     }
     memkind_atomic_set(g_alloc_size[kind_id], 0);
 }
 
-// SplitMix64 hash
-static inline unsigned t_hash_64(void)
+static inline unsigned get_bucket_id(void)
+{
+    if (MEMKIND_UNLIKELY(t_bucket_id == THREAD_BUCKETS)) {
+        unsigned bucket_id =
+            memkind_atomic_increment(g_alloc_size_buckets, 1);
+        t_bucket_id = bucket_id & (THREAD_BUCKETS - 1);
+    }
+    return t_bucket_id;
+}
+
+static inline unsigned get_used_buckets(void)
 {
-    uint64_t x = (uint64_t)pthread_self();
-    x += 0x9e3779b97f4a7c15;
-    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
-    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
-    return (x ^ (x >> 31)) & (THREAD_BUCKETS - 1);
+    unsigned used_buckets;
+    memkind_atomic_get(g_alloc_size_buckets, used_buckets);
+    return used_buckets < THREAD_BUCKETS ? used_buckets : THREAD_BUCKETS;
+}
+
+// migrated blocks are transferred back to their kind on free, after the
+// allocator has already subtracted them from it - g_alloc_size of a single
+// partition might be transiently "negative" and is read as 0 then
+static inline size_t partition_alloc_size(size_t partition)
+{
+    size_t size;
+    memkind_atomic_get(g_alloc_size[partition], size);
+    return (long long)size < 0 ? 0u : size;
 }
 
 static void update_actual_ratios(size_t total_size) {
-    double hot_tier_size = g_alloc_size[g_hotTierId];
-        if (hot_tier_size>total_size)
+    size_t thresh_count = g_totalTiers > 1 ? g_totalTiers - 1 : 1;
+    double tiers_size[HOTNESS_MAX_THRESHOLDS];
+    double desired[HOTNESS_MAX_THRESHOLDS];
+    double actual[HOTNESS_MAX_THRESHOLDS];
+    double cumulative_size = 0;
+    size_t i;
+    for (i = 0; i < thresh_count; ++i) {
+        cumulative_size += partition_alloc_size(g_tierPartitions[i]);
+        tiers_size[i] = cumulative_size;
+    }
+        if (cumulative_size>total_size)
             // handle race condition gracefully, without repetitions
             // and mutexes; this code should not have visible, negative effect
             // TODO make sure it's ok!
-            total_size = hot_tier_size;
+            total_size = cumulative_size;
         g_totalSize=total_size;
-        g_hotTotalActualRatio=hot_tier_size/total_size;
+        for (i = 0; i < thresh_count; ++i) {
+            desired[i] = g_tierTotalDesiredRatios[i];
+            actual[i] = tiers_size[i]/total_size;
+        }
+        g_hotTotalActualRatio=actual[0];
 
-        tachanka_set_dram_total_ratio(
-            g_hotTotalDesiredRatio, g_hotTotalActualRatio);
+        tachanka_set_tier_total_ratios(thresh_count, desired, actual);
 }
 
-static inline void
-apply_temporary_buffer_alloc_size(size_t kind_id,size_t bucket_id)
+/// @return total size after the update
+static inline size_t apply_alloc_size(size_t kind_id, long long size_f)
 {
     // please note that size_f might be negative
-    long long size_f =
-        memkind_atomic_get_and_zeroing(t_alloc_size[kind_id][bucket_id]);
     memkind_atomic_increment(g_alloc_size[kind_id], size_f);
     size_t old_total_size = memkind_atomic_increment(
         g_alloc_size[MEMKIND_TOTAL_IDX], size_f);
     // total_size is, by definition, positive
-    size_t total_size = (size_t)(size_f + (long long)old_total_size);
-    update_actual_ratios(total_size);
+    return (size_t)(size_f + (long long)old_total_size);
+}
+
+static inline void
+apply_temporary_buffer_alloc_size(size_t kind_id,size_t bucket_id)
+{
+    long long size_f =
+        memkind_atomic_get_and_zeroing(t_alloc_size[bucket_id].size[kind_id]);
+    update_actual_ratios(apply_alloc_size(kind_id, size_f));
+}
+
+/// fold all buckets of @p kind_id into g_alloc_size
+/// @return size of @p kind_id after the update
+static size_t flush_alloc_size(size_t kind_id)
+{
+    long long size_all = 0;
+    unsigned bucket_id;
+    unsigned used_buckets = get_used_buckets();
+
+    for (bucket_id = 0; bucket_id < used_buckets; ++bucket_id) {
+        size_all += memkind_atomic_get_and_zeroing(
+            t_alloc_size[bucket_id].size[kind_id]);
+    }
+    size_t size_ret =
+        memkind_atomic_increment(g_alloc_size[kind_id], size_all);
+    memkind_atomic_increment(g_alloc_size[MEMKIND_TOTAL_IDX], size_all);
+    return (size_ret + size_all);
 }
 
 static inline void increment_alloc_size(unsigned kind_id, size_t size)
 {
-    unsigned bucket_id = t_hash_64();
+    unsigned bucket_id = get_bucket_id();
     long long old_talloc =
-        memkind_atomic_increment(t_alloc_size[kind_id][bucket_id], size);
-    if ((old_talloc + size) > FLUSH_THRESHOLD)
+        memkind_atomic_increment(t_alloc_size[bucket_id].size[kind_id], size);
+    if ((old_talloc + (long long)size) > FLUSH_THRESHOLD)
         apply_temporary_buffer_alloc_size(kind_id, bucket_id);
 }
 
 static inline void decrement_alloc_size(unsigned kind_id, size_t size)
 {
-    unsigned bucket_id = t_hash_64();
+    unsigned bucket_id = get_bucket_id();
     long long old_talloc =
-        memkind_atomic_decrement(t_alloc_size[kind_id][bucket_id], size);
+        memkind_atomic_decrement(t_alloc_size[bucket_id].size[kind_id], size);
     if ((old_talloc - (long long)size) < -FLUSH_THRESHOLD)
         apply_temporary_buffer_alloc_size(kind_id, bucket_id);
 }
 
+MEMKIND_EXPORT void memtier_flush_alloc_size(void)
+{
+    size_t tiers = g_totalTiers;
+    if (tiers == 0)
+        return;
+    for (size_t i = 0; i < tiers; ++i)
+        flush_alloc_size(g_tierPartitions[i]);
+    update_actual_ratios(g_alloc_size[MEMKIND_TOTAL_IDX]);
+}
+
+MEMKIND_EXPORT void memtier_policy_data_hotness_transfer_size(bool to_hot,
+                                                              size_t size)
+{
+    size_t tiers = g_totalTiers;
+    if (tiers < 2)
+        return;
+    size_t hot_partition = g_tierPartitions[0];
+    size_t cold_partition = g_tierPartitions[tiers - 1];
+    size_t src = to_hot ? cold_partition : hot_partition;
+    size_t dst = to_hot ? hot_partition : cold_partition;
+    // total size does not change; the counters wrap around rather than
+    // saturate to keep their sum exact, see partition_alloc_size()
+    memkind_atomic_decrement(g_alloc_size[src], size);
+    memkind_atomic_increment(g_alloc_size[dst], size);
+    update_actual_ratios(g_alloc_size[MEMKIND_TOTAL_IDX]);
+}
+
+MEMKIND_EXPORT size_t memtier_policy_data_hotness_get_tier_sizes(size_t *sizes)
+{
+    size_t tiers = g_totalTiers;
+    for (size_t i = 0; i < tiers; ++i)
+        sizes[i] = partition_alloc_size(g_tierPartitions[i]);
+    return tiers;
+}
+
 static memkind_t memtier_single_get_kind(struct memtier_memory *memory,
                                          size_t size, uint64_t *data)
 {
@@ -303,12 +467,13 @@ memtier_policy_dynamic_threshold_get_kind(struct memtier_memory *memory,
 }
 
 /// @p size for debugging purposes
-static Hotness_e memtier_policy_data_hotness_calculate_hotness_type(uint64_t hash, size_t size)
+/// @return index of tier ordered by hotness (0 - hottest), -1 if unknown
+static int memtier_policy_data_hotness_calculate_tier(uint64_t hash, size_t size)
 {
     // TODO this requires more data
     // Currently, "ranking" and "tachanka" are de-facto singletons
     // can we deal with it?
-    Hotness_e hotness = tachanka_get_hotness_type_hash(hash);
+    int tier = tachanka_get_tier_hash_cached(hash);
 
     // DEBUG
 #if PRINT_POLICY_LOG_STATISTICS_INFO
@@ -358,11 +523,14 @@ static Hotness_e memtier_policy_data_hotness_calculate_hotness_type(uint64_t has
 #endif //PRINT_POLICY_BACKTRACE_INFO
     }
 
+    // hottest tier is counted as "hot", all other tiers as "cold"
+    Hotness_e hotness = tier < 0 ? HOTNESS_NOT_FOUND :
+        tier == 0 ? HOTNESS_HOT : HOTNESS_COLD;
     ++hotness_counter[hotness];
     hotness_alloc_counter[hotness] += size;
 #endif // PRINT_POLICY_LOG_STATISTICS_INFO
 
-    return hotness;
+    return tier;
 }
 
 static thread_local void *stack_bottom=NULL;
@@ -400,38 +568,36 @@ memtier_policy_data_hotness_get_kind(struct memtier_memory *memory, size_t size,
 //     int ret = pthread_once(&stack_bottom_init, initialize_stack_bottom);
 //     assert(ret == 0);
     bthash_set_stack_range(stack_top, stack_bottom);
+    // one read-side section for the exec maps table and tachanka lookups
+    qsbr_online();
     *data = bthash(size);
     // TODO support for multiple tiers could be added
     // instead of bool (,mis hot), an index of memory tier could be returned
 //     int dest_tier = memtier_policy_data_hotness_is_hot(*data) ?
 //         memory->hot_tier_id : 1 - memory->hot_tier_id;
 // memtier_policy_static_ratio_get_kind();
-    Hotness_e hotness = memtier_policy_data_hotness_calculate_hotness_type(*data, size);
+    int tier = memtier_policy_data_hotness_calculate_tier(*data, size);
+    qsbr_offline();
     //char buf[128];
     //if (write(1, buf, sprintf(buf, "hash %016zx size %zd is %s\n", *data, size,
     //               memtier_policy_data_hotness_is_hot(*data) ? "♨": "❄")));
 
-    switch (hotness) {
-        case HOTNESS_COLD:
-            dest_tier = memory->cold_tier_id;
-            break;
-        case HOTNESS_NOT_FOUND:
+    t_arenaClass = arena_class_of(*data, tier);
+    if (tier < 0) {
 #if FALLBACK_TO_STATIC
 #if PRINT_POLICY_LOG_FALLBACK_TO_STATIC
-            log_info("fallback to static!!!");
+        log_info("fallback to static!!!");
 #endif
-            return memtier_policy_static_ratio_get_kind(memory, size, NULL);
+        return memtier_policy_static_ratio_get_kind(memory, size, NULL);
 #else
-            dest_tier = memory->hot_tier_id;
+        tier = 0;
 #endif
-            break; // unreachable
-        case HOTNESS_HOT:
-            dest_tier = memory->hot_tier_id;
-            break;
-        default:
-            log_fatal("critnib: invalid hotness enum val");
-            exit(-1);
     }
+    if (tier >= (int)memory->cfg_size) {
+        log_fatal("critnib: invalid tier index %d", tier);
+        exit(-1);
+    }
+    dest_tier = memory->hotness_tier_ids[tier];
 
     return memory->cfg[dest_tier].kind;
 }
@@ -444,6 +610,11 @@ memtier_policy_data_hotness_post_alloc(uint64_t hash, void *addr, size_t size,
     // second here - this could be easily optimized
 //     register_block(hash, addr, size);
 //     touch(addr, 0, 1 /*called from malloc*/);
+    if (tachanka_run_alloc(hash, addr, is_hot))
+        return;
+    float weight;
+    if (!alloc_sampling_sample(addr, size, &weight))
+        return;
 
     EventEntry_t entry = {
         .type = EVENT_CREATE_ADD,
@@ -452,6 +623,7 @@ memtier_policy_data_hotness_post_alloc(uint64_t hash, void *addr, size_t size,
             .address = addr,
             .size = size,
             .isHot = is_hot,
+            .weight = weight,
         },
     };
 
@@ -901,6 +1073,28 @@ static int parse_ull(const char *str, unsigned long long *dest)
 
 extern pthread_t pebs_thread;
 
+/// @return NUMA node used by @p kind, -1 if it cannot be determined
+/// @note kinds without mbind nodemask (e.g. MEMKIND_DEFAULT) rely on
+/// the first touch policy - node of the current CPU is used for them
+static int memtier_kind_get_numa_node(memkind_t kind)
+{
+    if (kind->ops->get_mbind_nodemask) {
+        nodemask_t nodemask;
+        struct bitmask nodemask_bm = {NUMA_NUM_NODES, nodemask.n};
+        int ret = kind->ops->get_mbind_nodemask(kind, nodemask.n,
+                                                NUMA_NUM_NODES);
+        if (ret)
+            return -1;
+        for (int node = 0; node < numa_num_configured_nodes(); ++node) {
+            if (numa_bitmask_isbitset(&nodemask_bm, node))
+                return node;
+        }
+        return -1;
+    }
+    int cpu = sched_getcpu();
+    return cpu < 0 ? -1 : numa_node_of_cpu(cpu);
+}
+
 static struct memtier_memory *
 builder_hot_create_memory(struct memtier_builder *builder)
 {
@@ -960,47 +1154,272 @@ builder_hot_create_memory(struct memtier_builder *builder)
             abort();
         }
     }
+    pebs_ring_pages = MMAP_DATA_SIZE;
+    env_var = memkind_get_env("PEBS_RING_PAGES");
+    if (env_var) {
+        ret = parse_ull(env_var, &pebs_ring_pages);
+        // perf requires 2^n data pages
+        if (ret || pebs_ring_pages == 0 ||
+            (pebs_ring_pages & (pebs_ring_pages - 1))) {
+            log_fatal("Wrong value of PEBS_RING_PAGES: %s", env_var);
+            abort();
+        }
+    }
+    pebs_per_cpu = PEBS_PER_CPU_DEFAULT;
+    env_var = memkind_get_env("PEBS_PER_CPU");
+    if (env_var) {
+        unsigned long long per_cpu;
+        ret = parse_ull(env_var, &per_cpu);
+        if (ret || per_cpu > 1) {
+            log_fatal("Wrong value of PEBS_PER_CPU: %s", env_var);
+            abort();
+        }
+        pebs_per_cpu = per_cpu;
+    }
+    pebs_consumer_threads = PEBS_CONSUMER_THREADS_DEFAULT;
+    env_var = memkind_get_env("PEBS_CONSUMER_THREADS");
+    if (env_var) {
+        ret = parse_ull(env_var, &pebs_consumer_threads);
+        if (ret || pebs_consumer_threads == 0 ||
+            pebs_consumer_threads > PEBS_CONSUMER_THREADS_MAX) {
+            log_fatal("Wrong value of PEBS_CONSUMER_THREADS: %s", env_var);
+            abort();
+        }
+    }
+    pebs_overhead_target = DEFAULT_HOTNESS_PEBS_OVERHEAD;
+    env_var = memkind_get_env("HOTNESS_PEBS_OVERHEAD");
+    if (env_var) {
+        ret = parse_double(env_var, &pebs_overhead_target);
+        if (ret || pebs_overhead_target < 0 || pebs_overhead_target > 1) {
+            log_fatal("Wrong value of HOTNESS_PEBS_OVERHEAD: %s", env_var);
+            abort();
+        }
+    }
+    pebs_type_samples = DEFAULT_HOTNESS_PEBS_TYPE_SAMPLES;
+    env_var = memkind_get_env("HOTNESS_PEBS_TYPE_SAMPLES");
+    if (env_var) {
+        ret = parse_ull(env_var, &pebs_type_samples);
+        if (ret) {
+            log_fatal("Wrong value of HOTNESS_PEBS_TYPE_SAMPLES: %s",
+                      env_var);
+            abort();
+        }
+    }
+    g_controllerFeedForward = DEFAULT_HOTNESS_CONTROLLER_FEED_FORWARD;
+    env_var = memkind_get_env("HOTNESS_CONTROLLER_FEED_FORWARD");
+    if (env_var) {
+        ret = parse_double(env_var, &g_controllerFeedForward);
+        if (ret || g_controllerFeedForward < 0 ||
+            g_controllerFeedForward > 1) {
+            log_fatal("Wrong value of HOTNESS_CONTROLLER_FEED_FORWARD: %s",
+                      env_var);
+            abort();
+        }
+    }
     log_info("sampling_interval = %.1f", sampling_interval);
+    log_info("pebs_overhead_target = %.4f, pebs_type_samples = %llu",
+             pebs_overhead_target, pebs_type_samples);
     log_info("pebs_freq_hz = %.1f", pebs_freq_hz);
+    log_info("controller_feed_forward = %.2f", g_controllerFeedForward);
+    log_info("pebs_ring_pages = %llu, pebs_per_cpu = %d, "
+             "pebs_consumer_threads = %llu",
+             pebs_ring_pages, pebs_per_cpu, pebs_consumer_threads);
     log_info("hotness_measure_window = %llu", hotness_measure_window);
+    env_var = memkind_get_env("HOTNESS_SAMPLE_SOURCE");
+    hotness_sample_source =
+        sample_source_parse(env_var ? env_var : DEFAULT_HOTNESS_SAMPLE_SOURCE);
+    if (hotness_sample_source < 0) {
+        log_fatal("Wrong value of HOTNESS_SAMPLE_SOURCE: %s", env_var);
+        abort();
+    }
+    unsigned long long idle_page_budget =
+        DEFAULT_HOTNESS_IDLE_PAGE_SCAN_BUDGET;
+    env_var = memkind_get_env("HOTNESS_IDLE_PAGE_SCAN_BUDGET");
+    if (env_var) {
+        ret = parse_ull(env_var, &idle_page_budget);
+        if (ret || idle_page_budget == 0) {
+            log_fatal("Wrong value of HOTNESS_IDLE_PAGE_SCAN_BUDGET: %s",
+                      env_var);
+            abort();
+        }
+    }
+    sample_source_idle_page_set_budget(idle_page_budget);
+    log_info("sample_source = %d, idle_page_scan_budget = %llu",
+             hotness_sample_source, idle_page_budget);
+    unsigned long long migration_budget = DEFAULT_HOTNESS_MIGRATION_BUDGET;
+    env_var = memkind_get_env("HOTNESS_MIGRATION_BUDGET");
+    if (env_var) {
+        ret = parse_ull(env_var, &migration_budget);
+        if (ret) {
+            log_fatal("Wrong value of HOTNESS_MIGRATION_BUDGET: %s", env_var);
+            abort();
+        }
+    }
     log_info("old_time_window_hotness_weight = %.1f",
              old_time_window_hotness_weight);
+    log_info("migration_budget = %llu", migration_budget);
+    int tracking_granularity = DEFAULT_HOTNESS_TRACKING_GRANULARITY;
+    env_var = memkind_get_env("HOTNESS_TRACKING_GRANULARITY");
+    if (env_var) {
+        if (!strcmp(env_var, "block")) {
+            tracking_granularity = HOTNESS_TRACKING_BLOCK;
+        } else if (!strcmp(env_var, "run")) {
+            tracking_granularity = HOTNESS_TRACKING_RUN;
+        } else {
+            log_fatal("Wrong value of HOTNESS_TRACKING_GRANULARITY: %s",
+                      env_var);
+            abort();
+        }
+    }
+    log_info("tracking_granularity = %s",
+             tracking_granularity == HOTNESS_TRACKING_RUN ? "run" : "block");
+    unsigned long long alloc_sample_interval =
+        DEFAULT_HOTNESS_ALLOC_SAMPLE_INTERVAL;
+    env_var = memkind_get_env("HOTNESS_ALLOC_SAMPLE_INTERVAL");
+    if (env_var) {
+        ret = parse_ull(env_var, &alloc_sample_interval);
+        if (ret) {
+            log_fatal("Wrong value of HOTNESS_ALLOC_SAMPLE_INTERVAL: %s",
+                      env_var);
+            abort();
+        }
+    }
+    log_info("alloc_sample_interval = %llu", alloc_sample_interval);
+    unsigned long long arena_clusters = DEFAULT_HOTNESS_ARENA_CLUSTERS;
+    env_var = memkind_get_env("HOTNESS_ARENA_CLUSTERS");
+    if (env_var) {
+        ret = parse_ull(env_var, &arena_clusters);
+        if (ret || arena_clusters > HOTNESS_ARENA_CLUSTERS_MAX) {
+            log_fatal("Wrong value of HOTNESS_ARENA_CLUSTERS: %s", env_var);
+            abort();
+        }
+    }
+    log_info("arena_clusters = %llu", arena_clusters);
+
+    // record input of hotness pipeline for offline replay
+    env_var = memkind_get_env("HOTNESS_TRACE_FILE");
+    if (env_var) {
+        if (sample_trace_open(env_var)) {
+            log_fatal("Cannot record sample trace to HOTNESS_TRACE_FILE: %s",
+                      env_var);
+            abort();
+        }
+        log_info("hotness trace file = %s", env_var);
+    }
+    unsigned long long stats_page = DEFAULT_HOTNESS_STATS_PAGE;
+    env_var = memkind_get_env("HOTNESS_STATS_PAGE");
+    if (env_var) {
+        ret = parse_ull(env_var, &stats_page);
+        if (ret || stats_page > 1) {
+            log_fatal("Wrong value of HOTNESS_STATS_PAGE: %s", env_var);
+            abort();
+        }
+    }
+    // statistics are not essential - continue without them
+    if (stats_page && hotness_stats_open())
+        stats_page = 0;
+    log_info("stats_page = %llu", stats_page);
+    // hotness of allocation sites is loaded from and saved to this file
+    g_profilePath[0] = '\0';
+    env_var = memkind_get_env("HOTNESS_PROFILE");
+    if (env_var) {
+        if (strlen(env_var) >= sizeof(g_profilePath)) {
+            log_fatal("Wrong value of HOTNESS_PROFILE: %s", env_var);
+            abort();
+        }
+        strcpy(g_profilePath, env_var);
+        log_info("hotness profile = %s", g_profilePath);
+    }
 
     tachanka_init(old_time_window_hotness_weight, RANKING_BUFFER_SIZE_ELEMENTS);
+    // thresholds are calculated once per PEBS thread cycle
+    tachanka_set_controller_params(pebs_freq_hz, g_controllerFeedForward);
+    tachanka_set_tracking_granularity(tracking_granularity);
+    alloc_sampling_set_interval(alloc_sample_interval);
+    // runs whose extents are purged hold no live objects
+    memkind_arena_set_extent_release_hook(
+        tracking_granularity == HOTNESS_TRACKING_RUN ? tachanka_run_release
+                                                     : NULL);
+    if (g_profilePath[0]) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        // missing profile is expected in the first run
+        ptrdiff_t types = hotness_profile_load(
+            g_profilePath, now.tv_sec * 1000000000ull + now.tv_nsec);
+        log_info("hotness profile: %td types loaded", types < 0 ? 0 : types);
+    }
     pebs_init(getpid());
 
     struct memtier_memory *memory =
         memtier_memory_init(builder->cfg_size, false, true);
-    memory->hot_tier_id = -1;
 
-    if (memory->cfg_size != 2) {
+    if (memory->cfg_size < 2 || memory->cfg_size > HOTNESS_MAX_TIERS) {
         log_fatal("Incorrect number of tiers for data hotness policy");
         exit(-1);
     }
 
-    double ratio_sum = builder->cfg[0].kind_ratio + builder->cfg[1].kind_ratio;
+    double ratio_sum = 0;
+    for (i = 0; i < memory->cfg_size; ++i)
+        ratio_sum += builder->cfg[i].kind_ratio;
 
-    // TODO requires cleanup
+    // tiers are ordered by hotness in the order they were added;
+    // for two tiers, MEMKIND_DEFAULT is always the hot one (compatibility)
     for (i = 0; i < memory->cfg_size; ++i) {
         memory->cfg[i].kind = builder->cfg[i].kind;
         memory->cfg[i].kind_ratio =
             builder->cfg[i].kind_ratio / ratio_sum;
-        if (memory->cfg[i].kind == MEMKIND_DEFAULT) {
-            memory->hot_tier_id = i; // the usage of this variable might cause some confusion...
-            memory->cold_tier_id = 1-i;
-        }
+        memory->hotness_tier_ids[i] = i;
     }
-
-    if (memory->hot_tier_id == -1) {
-        log_fatal("No tier suitable for HOT memory defined.");
-        exit(-1);
+    if (memory->cfg_size == 2 && memory->cfg[1].kind == MEMKIND_DEFAULT) {
+        memory->hotness_tier_ids[0] = 1;
+        memory->hotness_tier_ids[1] = 0;
     }
+    // the usage of these variables might cause some confusion...
+    memory->hot_tier_id = memory->hotness_tier_ids[0];
+    memory->cold_tier_id = memory->hotness_tier_ids[memory->cfg_size - 1];
+
     double hot_total_ratio=memory->cfg[memory->hot_tier_id].kind_ratio;
     // FIXME multiple memories,
     // but only single g_hotTierId and g_hotTotalDesiredRatio!
     g_hotTotalDesiredRatio = hot_total_ratio;
     g_hotTierId = memory->hot_tier_id;
+    g_hotKind = memory->cfg[memory->hot_tier_id].kind;
+    size_t thresh_count = memory->cfg_size - 1;
+    double tier_total_ratio = 0;
+    for (i = 0; i < memory->cfg_size; ++i) {
+        int tier_id = memory->hotness_tier_ids[i];
+        g_tierPartitions[i] = memory->cfg[tier_id].kind->partition;
+        if (i < thresh_count) {
+            tier_total_ratio += memory->cfg[tier_id].kind_ratio;
+            g_tierTotalDesiredRatios[i] = tier_total_ratio;
+        }
+    }
     g_totalTiers = memory->cfg_size;
+    if (arena_clusters) {
+        for (i = 0; i < memory->cfg_size; ++i) {
+            if (memkind_arena_create_classes(memory->cfg[i].kind,
+                                             arena_clusters + 1u)) {
+                log_fatal("Cannot create %llu arena clusters for kind %s",
+                          arena_clusters, memory->cfg[i].kind->name);
+                abort();
+            }
+        }
+    }
+    g_arenaClusters = arena_clusters;
+#if HOTNESS_MIGRATION_ENABLED
+    if (memory->cfg_size == 2) {
+        page_migration_init(
+            memtier_kind_get_numa_node(memory->cfg[memory->hot_tier_id].kind),
+            memtier_kind_get_numa_node(memory->cfg[memory->cold_tier_id].kind),
+            migration_budget);
+    } else {
+        if (migration_budget)
+            log_err("Page migration supports only two tiers, disabled");
+        page_migration_init(-1, -1, 0u);
+    }
+#else
+    (void)migration_budget;
+#endif
 #if PRINT_POLICY_CREATE_MEMORY_INFO
     struct timespec t;
     ret = clock_gettime(CLOCK_MONOTONIC, &t);
@@ -1012,7 +1431,11 @@ builder_hot_create_memory(struct memtier_builder *builder)
         hot_total_ratio, t.tv_sec, t.tv_nsec);
 #endif
 
-    tachanka_set_dram_total_ratio(hot_total_ratio, hot_total_ratio);
+    double tier_total_ratios[HOTNESS_MAX_THRESHOLDS];
+    for (i = 0; i < thresh_count; ++i)
+        tier_total_ratios[i] = g_tierTotalDesiredRatios[i];
+    tachanka_set_tier_total_ratios(thresh_count, tier_total_ratios,
+                                   tier_total_ratios);
 
     // EDIT prepare fallback to static - calculate ratios differently
     double temp = memory->cfg[0].kind_ratio;
@@ -1156,7 +1579,17 @@ memtier_builder_construct_memtier_memory(struct memtier_builder *builder)
 
 MEMKIND_EXPORT void memtier_delete_memtier_memory(struct memtier_memory *memory)
 {
+    memkind_arena_set_extent_release_hook(NULL);
+    // class arenas stay - allocations made from them might be still alive
+    g_arenaClusters = 0u;
     pebs_fini(); // TODO conditional - only if pebs started
+    // ranking is not updated anymore
+    if (g_profilePath[0]) {
+        (void)hotness_profile_save(g_profilePath);
+        g_profilePath[0] = '\0';
+    }
+    sample_trace_close();
+    hotness_stats_close();
 
 #if PRINT_POLICY_DELETE_MEMORY_INFO
     struct timespec t;
@@ -1193,7 +1626,7 @@ MEMKIND_EXPORT void *memtier_malloc(struct memtier_memory *memory, size_t size)
 
     memkind_t kind = memory->get_kind(memory, size, &data);
     ptr = memtier_kind_malloc(kind, size);
-    bool is_hot = kind == MEMKIND_DEFAULT;
+    bool is_hot = kind == g_hotKind;
     memory->post_alloc(data, ptr, size, is_hot);
     memory->update_cfg(memory);
     print_memory_statistics(memory);
@@ -1217,7 +1650,9 @@ MEMKIND_EXPORT void *memtier_kind_malloc(memkind_t kind, size_t size)
 //         counter=0u;
 //     }
 
-    void *ptr = memkind_malloc(kind, size);
+    void *ptr = g_arenaClusters
+        ? memkind_arena_class_malloc(kind, take_arena_class(), size)
+        : memkind_malloc(kind, size);
     increment_alloc_size(kind->partition, jemk_malloc_usable_size(ptr));
 #ifdef MEMKIND_DECORATION_ENABLED
     if (memtier_kind_malloc_post)
@@ -1247,7 +1682,7 @@ MEMKIND_EXPORT void *memtier_calloc(struct memtier_memory *memory, size_t num,
 
     memkind_t kind = memory->get_kind(memory, size, &data);
     ptr = memtier_kind_calloc(kind, num, size);
-    bool is_hot = kind == MEMKIND_DEFAULT;
+    bool is_hot = kind == g_hotKind;
     memory->post_alloc(data, ptr, size, is_hot);
     memory->update_cfg(memory);
     print_memory_statistics(memory);
@@ -1258,7 +1693,9 @@ MEMKIND_EXPORT void *memtier_calloc(struct memtier_memory *memory, size_t num,
 MEMKIND_EXPORT void *memtier_kind_calloc(memkind_t kind, size_t num,
                                          size_t size)
 {
-    void *ptr = memkind_calloc(kind, num, size);
+    void *ptr = g_arenaClusters
+        ? memkind_arena_class_calloc(kind, take_arena_class(), num, size)
+        : memkind_calloc(kind, num, size);
     increment_alloc_size(kind->partition, jemk_malloc_usable_size(ptr));
 
 #ifdef MEMKIND_DECORATION_ENABLED
@@ -1268,39 +1705,22 @@ MEMKIND_EXPORT void *memtier_kind_calloc(memkind_t kind, size_t num,
     return ptr;
 }
 
-MEMKIND_EXPORT void *memtier_realloc(struct memtier_memory *memory, void *ptr,
-                                     size_t size)
-{
-    // reallocate inside same kind
-    if (ptr) {
-        struct memkind *kind = memkind_detect_kind(ptr);
-        ptr = memtier_kind_realloc(kind, ptr, size);
-        memory->update_cfg(memory);
-
-        if (size!=0)
-            print_memory_statistics(memory);
-        // NOTE: new ptr == NULL if size == 0
-        return ptr;
-    }
-
-    if (size == 0) {
-        return NULL;
-    }
-
-    return memtier_malloc(memory, size);
-}
-
-MEMKIND_EXPORT void *memtier_kind_realloc(memkind_t kind, void *ptr,
-                                          size_t size)
+// @p target - kind the block is moved to if it cannot be resized in place,
+// @p hash - type of the block, 0 if not known
+static void *memtier_kind_realloc_to(memkind_t kind, memkind_t target,
+                                     void *ptr, size_t size, uint64_t hash)
 {
-    bool is_hot = kind == MEMKIND_DEFAULT;
+    bool is_hot = kind == g_hotKind;
     if (size == 0 && ptr != NULL) {
+        // nothing is allocated - decision must not leak to the next call
+        (void)take_arena_class();
 #ifdef MEMKIND_DECORATION_ENABLED
         if (memtier_kind_free_pre)
             memtier_kind_free_pre(&ptr);
 #endif
         size_t old_size = jemk_malloc_usable_size(ptr);
-        if (pol == MEMTIER_POLICY_DATA_HOTNESS) {
+        if (pol == MEMTIER_POLICY_DATA_HOTNESS &&
+            !tachanka_run_free(ptr, old_size) && alloc_sampling_forget(ptr)) {
     //      unregister_block(ptr);
             EventEntry_t entry = {
                 .type = EVENT_DESTROY_REMOVE,
@@ -1333,7 +1753,7 @@ MEMKIND_EXPORT void *memtier_kind_realloc(memkind_t kind, void *ptr,
 #endif
         }
         decrement_alloc_size(kind->partition, old_size);
-        memkind_free(kind, ptr);
+        memtier_kind_release(kind, ptr);
         return NULL;
     } else if (ptr == NULL) {
         if (pol == MEMTIER_POLICY_DATA_HOTNESS) {
@@ -1367,30 +1787,75 @@ MEMKIND_EXPORT void *memtier_kind_realloc(memkind_t kind, void *ptr,
         }
         return memtier_kind_malloc(kind, size);
     }
-    decrement_alloc_size(kind->partition, jemk_malloc_usable_size(ptr));
-
-    void *n_ptr = memkind_realloc(kind, ptr, size);
+    size_t old_size = jemk_malloc_usable_size(ptr);
+    decrement_alloc_size(kind->partition, old_size);
+
+    // consumed even if the block stays where it is
+    unsigned cls = take_arena_class();
+    void *n_ptr = NULL;
+    // block has to be moved anyway - copy is placed in the target kind
+    if (target != kind && jemk_xallocx(ptr, size, 0, 0) < size) {
+        n_ptr = g_arenaClusters
+            ? memkind_arena_class_malloc(target, cls, size)
+            : memkind_malloc(target, size);
+        if (n_ptr) {
+            memcpy(n_ptr, ptr, old_size < size ? old_size : size);
+            memtier_kind_release(kind, ptr);
+            kind = target;
+            is_hot = kind == g_hotKind;
+        }
+    }
+    // allocation from a class arena stays in it
+    if (!n_ptr)
+        n_ptr = g_arenaClusters ? memkind_arena_class_realloc(kind, ptr, size)
+                                : memkind_realloc(kind, ptr, size);
     if (pol == MEMTIER_POLICY_DATA_HOTNESS) {
-        // TODO this case is incorrect - we should have a different type and a new hash...
-//         size_t old_size = jemk_malloc_usable_size(ptr);
         EventEntry_t entry = {
             .type = EVENT_REALLOC,
             .data.reallocData = {
                 .addressOld = ptr,
                 .addressNew = n_ptr,
-//                 .sizeOld = old_size,
+                .hash = hash,
                 .sizeNew = size,
                 .isHot = is_hot,
             }
         };
 
+        // small allocations are tracked in page runs and unsampled ones are
+        // not tracked at all, only the one tracked as a separate block
+        // needs an event
+        bool old_block =
+            !tachanka_run_free(ptr, old_size) && alloc_sampling_forget(ptr);
+        float weight = 0.f;
+        bool new_block = !tachanka_run_alloc(hash, n_ptr, is_hot) &&
+            alloc_sampling_sample(n_ptr, size, &weight);
+        entry.data.reallocData.weight = weight;
+        if (!old_block && new_block) {
+            entry.type = EVENT_CREATE_ADD;
+            entry.data.createAddData = (EventDataCreateAdd){
+                .hash = hash,
+                .address = n_ptr,
+                .size = size,
+                .isHot = is_hot,
+                .weight = weight,
+            };
+        } else if (old_block && !new_block) {
+            entry.type = EVENT_DESTROY_REMOVE;
+            entry.data.destroyRemoveData = (EventDataDestroyRemove){
+                .address = ptr,
+                .size = old_size,
+            };
+        }
+
 #if CHECK_ADDED_SIZE
         if (size == 0) {
             log_info("memtier_kind_realloc size == 0");
         }
 #endif
 
-        bool success = tachanka_ranking_event_push(&entry);
+        bool success = true;
+        if (old_block || new_block)
+            success = tachanka_ranking_event_push(&entry);
 #if PRINT_POLICY_LOG_STATISTICS_INFO
         if (success) {
             g_successful_adds++;
@@ -1412,6 +1877,59 @@ MEMKIND_EXPORT void *memtier_kind_realloc(memkind_t kind, void *ptr,
     return n_ptr;
 }
 
+// moves the block to the tier of its type, if it has to be moved anyway
+static void *memtier_policy_data_hotness_realloc(struct memtier_memory *memory,
+                                                 memkind_t kind, void *ptr,
+                                                 size_t size)
+{
+    uint64_t hash;
+    memkind_t target;
+    if (tachanka_get_addr_hash(ptr, &hash)) {
+        // type of the block was decided on its allocation, current hotness
+        // of that type decides again
+        target = kind;
+        int tier = tachanka_get_tier_hash_cached(hash);
+        t_arenaClass = arena_class_of(hash, tier);
+        if (tier >= 0 && tier < (int)memory->cfg_size)
+            target = memory->cfg[memory->hotness_tier_ids[tier]].kind;
+    } else {
+        // block is not tracked (yet) - realloc call site is its type
+        target = memory->get_kind(memory, size, &hash);
+    }
+    return memtier_kind_realloc_to(kind, target, ptr, size, hash);
+}
+
+MEMKIND_EXPORT void *memtier_realloc(struct memtier_memory *memory, void *ptr,
+                                     size_t size)
+{
+    if (ptr) {
+        struct memkind *kind = memkind_detect_kind(ptr);
+        // other policies reallocate inside same kind
+        ptr = pol == MEMTIER_POLICY_DATA_HOTNESS && size
+            ? memtier_policy_data_hotness_realloc(memory, kind, ptr, size)
+            : memtier_kind_realloc(kind, ptr, size);
+        memory->update_cfg(memory);
+
+        if (size!=0)
+            print_memory_statistics(memory);
+        // NOTE: new ptr == NULL if size == 0
+        return ptr;
+    }
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    return memtier_malloc(memory, size);
+}
+
+MEMKIND_EXPORT void *memtier_kind_realloc(memkind_t kind, void *ptr,
+                                          size_t size)
+{
+    return memtier_kind_realloc_to(kind, kind, ptr, size, 0u);
+}
+
+
 MEMKIND_EXPORT int memtier_posix_memalign(struct memtier_memory *memory,
                                           void **memptr, size_t alignment,
                                           size_t size)
@@ -1419,7 +1937,7 @@ MEMKIND_EXPORT int memtier_posix_memalign(struct memtier_memory *memory,
     uint64_t data = 0;
     memkind_t kind = memory->get_kind(memory, size, &data);
     int ret = memtier_kind_posix_memalign(kind, memptr, alignment, size);
-    bool is_hot = kind == MEMKIND_DEFAULT;
+    bool is_hot = kind == g_hotKind;
     memory->post_alloc(data, *memptr, size, is_hot);
     memory->update_cfg(memory);
 
@@ -1430,7 +1948,10 @@ MEMKIND_EXPORT int memtier_kind_posix_memalign(memkind_t kind, void **memptr,
                                                size_t alignment, size_t size)
 {
     // TODO: hotness
-    int res = memkind_posix_memalign(kind, memptr, alignment, size);
+    int res = g_arenaClusters
+        ? memkind_arena_class_posix_memalign(kind, take_arena_class(), memptr,
+                                             alignment, size)
+        : memkind_posix_memalign(kind, memptr, alignment, size);
     increment_alloc_size(kind->partition, jemk_malloc_usable_size(*memptr));
 #ifdef MEMKIND_DECORATION_ENABLED
     if (memtier_kind_posix_memalign_post)
@@ -1464,7 +1985,9 @@ MEMKIND_EXPORT void memtier_kind_free(memkind_t kind, void *ptr)
 #if PRINT_POLICY_LOG_STATISTICS_INFO
     g_memtier_free_called++;
 #endif
-    if (pol == MEMTIER_POLICY_DATA_HOTNESS) {
+    size_t size = jemk_malloc_usable_size(ptr);
+    if (pol == MEMTIER_POLICY_DATA_HOTNESS && !tachanka_run_free(ptr, size) &&
+        alloc_sampling_forget(ptr)) {
         // TODO offload to PEBS (ranking_queue) !!! Currently contains race conditions
 //         unregister_block(ptr);
 
@@ -1491,25 +2014,18 @@ MEMKIND_EXPORT void memtier_kind_free(memkind_t kind, void *ptr)
         (void)success;
 #endif
     }
-    decrement_alloc_size(kind->partition, jemk_malloc_usable_size(ptr));
-    memkind_free(kind, ptr);
+    decrement_alloc_size(kind->partition, size);
+    memtier_kind_release(kind, ptr);
 }
 
 MEMKIND_EXPORT size_t memtier_kind_allocated_size(memkind_t kind)
 {
-    size_t size_ret;
-    long long size_all = 0;
-    long long size;
-    unsigned bucket_id;
+    return flush_alloc_size(kind->partition);
+}
 
-    for (bucket_id = 0; bucket_id < THREAD_BUCKETS; ++bucket_id) {
-        size = memkind_atomic_get_and_zeroing(
-            t_alloc_size[kind->partition][bucket_id]);
-        size_all += size;
-    }
-    size_ret =
-        memkind_atomic_increment(g_alloc_size[kind->partition], size_all);
-    return (size_ret + size_all);
+MEMKIND_EXPORT size_t memtier_kind_allocated_size_unflushed(memkind_t kind)
+{
+    return partition_alloc_size(kind->partition);
 }
 
 MEMKIND_EXPORT double
@@ -69,6 +69,7 @@ void *pmem_extent_alloc(extent_hooks_t *extent_hooks, void *new_addr,
     if (addr != MAP_FAILED) {
         *zero = true;
         *commit = true;
+        memkind_arena_map_extent(addr, size, arena_ind);
 
         /* XXX - check alignment */
     } else {
@@ -109,8 +110,11 @@ bool pmem_extent_dalloc(extent_hooks_t *extent_hooks, void *addr, size_t size,
             abort();
         }
     }
+    // range might be mapped again by anyone as soon as it is unmapped
+    memkind_arena_unmap_extent(addr, size, arena_ind);
     if (munmap(addr, size) == -1) {
         log_err("munmap failed!");
+        memkind_arena_map_extent(addr, size, arena_ind);
         return true;
     }
     return false;
@@ -156,6 +160,7 @@ bool pmem_extent_merge(extent_hooks_t *extent_hooks, void *addr_a,
 void pmem_extent_destroy(extent_hooks_t *extent_hooks, void *addr, size_t size,
                          bool committed, unsigned arena_ind)
 {
+    memkind_arena_unmap_extent(addr, size, arena_ind);
     if (munmap(addr, size) == -1) {
         log_err("munmap failed!");
     }
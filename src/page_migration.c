@@ -0,0 +1,123 @@
+#include <memkind/internal/page_migration.h>
+#include <memkind/internal/memkind_memtier.h>
+#include <memkind/internal/memkind_log.h>
+
+#include <numa.h>
+#include <numaif.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef MEMKIND_EXPORT
+#define MEMKIND_EXPORT __attribute__((visibility("default")))
+#endif
+
+// move_pages() is called with chunks of at most this many pages
+#define PAGE_MIGRATION_CHUNK_PAGES 512
+
+static int g_hotNode = -1;
+static int g_coldNode = -1;
+static size_t g_budget = 0u;
+static size_t g_pageSize = 4096u;
+static page_migration_stats_t g_stats;
+
+MEMKIND_EXPORT void page_migration_init(int hot_node, int cold_node,
+                                        size_t budget)
+{
+    g_hotNode = hot_node;
+    g_coldNode = cold_node;
+    g_budget = budget;
+    g_pageSize = sysconf(_SC_PAGESIZE);
+    memset(&g_stats, 0, sizeof(g_stats));
+    if (budget && (hot_node < 0 || cold_node < 0)) {
+        log_err("PAGE MIGRATION: unknown NUMA node [hot %d, cold %d], "
+                "migration disabled", hot_node, cold_node);
+        g_budget = 0u;
+    }
+#if PRINT_PAGE_MIGRATION_INFO
+    log_info("PAGE MIGRATION: hot node %d, cold node %d, budget %zu",
+             g_hotNode, g_coldNode, g_budget);
+#endif
+}
+
+MEMKIND_EXPORT bool page_migration_enabled(void)
+{
+    return g_budget > 0u;
+}
+
+MEMKIND_EXPORT size_t page_migration_get_budget(void)
+{
+    return g_budget;
+}
+
+MEMKIND_EXPORT size_t page_migration_get_page_size(void)
+{
+    return g_pageSize;
+}
+
+MEMKIND_EXPORT size_t page_migration_movable_size(const void *addr,
+                                                  size_t size)
+{
+    // align inwards - only pages that belong exclusively to this block
+    uintptr_t first = ((uintptr_t)addr + g_pageSize - 1) & ~(g_pageSize - 1);
+    uintptr_t last = ((uintptr_t)addr + size) & ~(g_pageSize - 1);
+    return last > first ? last - first : 0u;
+}
+
+MEMKIND_EXPORT size_t page_migration_move(void *addr, size_t size, bool to_hot)
+{
+    int node = to_hot ? g_hotNode : g_coldNode;
+    if (node < 0)
+        return 0u;
+
+    size_t movable = page_migration_movable_size(addr, size);
+    if (!movable)
+        return 0u;
+    uintptr_t first = ((uintptr_t)addr + g_pageSize - 1) & ~(g_pageSize - 1);
+
+    void *pages[PAGE_MIGRATION_CHUNK_PAGES];
+    int nodes[PAGE_MIGRATION_CHUNK_PAGES];
+    int status[PAGE_MIGRATION_CHUNK_PAGES];
+    size_t moved_pages = 0u;
+    size_t total_pages = movable / g_pageSize;
+
+    for (size_t done = 0u; done < total_pages;) {
+        size_t count = total_pages - done;
+        if (count > PAGE_MIGRATION_CHUNK_PAGES)
+            count = PAGE_MIGRATION_CHUNK_PAGES;
+        for (size_t i = 0; i < count; ++i) {
+            pages[i] = (void *)(first + (done + i) * g_pageSize);
+            nodes[i] = node;
+        }
+        long ret = numa_move_pages(0, count, pages, nodes, status,
+                                   MPOL_MF_MOVE);
+        if (ret < 0) {
+#if PRINT_PAGE_MIGRATION_INFO
+            log_info("PAGE MIGRATION: move_pages() failed: %m");
+#endif
+            g_stats.failedPages += count;
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                if (status[i] == node)
+                    ++moved_pages;
+                else
+                    ++g_stats.failedPages;
+            }
+        }
+        done += count;
+    }
+
+    size_t moved = moved_pages * g_pageSize;
+    g_stats.movedBytes += moved;
+    return moved;
+}
+
+MEMKIND_EXPORT void page_migration_cycle_done(void)
+{
+    ++g_stats.cycles;
+}
+
+MEMKIND_EXPORT void page_migration_get_stats(page_migration_stats_t *stats)
+{
+    *stats = g_stats;
+}
@@ -5,10 +5,20 @@
 #include <memkind/internal/memkind_private.h>
 #include <memkind/internal/memkind_memtier.h>
 #include <memkind/internal/memkind_log.h>
+#include <memkind/internal/ranking_event_rings.h>
+#include <memkind/internal/bthash.h>
+#include <memkind/internal/sample_source.h>
+#include <memkind/internal/sample_trace.h>
+#include <memkind/internal/qsbr.h>
+#include <memkind/internal/hotness_stats.h>
+
+#include "jemalloc/jemalloc.h"
 
 #include <assert.h>
+#include <math.h>
+#include <numa.h>
+#include <stdatomic.h>
 
-#define rmb() asm volatile("lfence":::"memory")
 
 typedef enum {
     THREAD_INIT,
@@ -18,8 +28,49 @@ typedef enum {
 
 pthread_t pebs_thread;
 ThreadState_t thread_state = THREAD_INIT;
-int pebs_fd;
-static char *pebs_mmap;
+
+// PEBS event with its ring buffer
+typedef struct pebs_ring {
+    int fd;
+    int cpu;  // -1: event of the whole process
+    int node; // numa node of cpu
+    char *mmap;
+} pebs_ring_t;
+
+// drains a contiguous range of rings; consumer 0 is the PEBS monitor thread,
+// others are woken up once per cycle
+typedef struct pebs_consumer {
+    pthread_t thread;
+    size_t first_ring;
+    size_t rings_count;
+    tachanka_touch_aggregator_t *aggregator;
+    tachanka_touch_sample_t touches[PEBS_TOUCH_BATCH_ENTRIES];
+    size_t touches_count;
+    __u64 last_timestamp;
+    // statistics, see pebs_get_stats()
+    _Atomic size_t samples;
+    _Atomic size_t lost;
+    _Atomic size_t lost_records;
+    _Atomic uint64_t busy_ns;
+} pebs_consumer_t;
+
+static pebs_ring_t *g_rings = NULL;
+static size_t g_ringsCount = 0u;
+static size_t g_ringPages = MMAP_DATA_SIZE;
+static pebs_consumer_t *g_consumers = NULL;
+static size_t g_consumersCount = 0u;
+static tachanka_touch_aggregator_t *g_aggregators[PEBS_CONSUMER_THREADS_MAX];
+static pthread_barrier_t g_cycleStart;
+static pthread_barrier_t g_cycleEnd;
+static bool g_consumersStop = false;
+// sampling period of rings and its adaptation state, see
+// pebs_adapt_period()
+static uint64_t g_period = 0u;
+static double g_overhead = 0.;
+static uint64_t g_periodTimestamp = 0u;
+static pebs_stats_t g_periodStats;
+// source of touches, NULL if none works
+static const sample_source_t *g_source = NULL;
 
 #if CHECK_ADDED_SIZE
 extern size_t g_total_ranking_size;
@@ -33,10 +84,14 @@ static size_t g_queue_counter_realloc=0;
 static size_t g_queue_counter_callback=0;
 static size_t g_queue_counter_free=0;
 static size_t g_queue_counter_touch=0;
+static size_t g_queue_counter_run=0;
 extern struct ttype ttypes[];
 
 static bool shouldProcessTouches=true;
 
+// live statistics, accumulated by the monitor thread between publications
+static hotness_stats_t g_stats;
+
 // static uint64_t timespec_diff_millis(const struct timespec *tnew, const struct timespec *told) {
 //     uint64_t diff_s = tnew->tv_sec - told->tv_sec;
 //     uint64_t tnew_ns = tnew->tv_nsec;
@@ -82,22 +137,302 @@ static int display_hotness(int nt)
 }
 #endif
 
-void *pebs_monitor(void *state)
+// ranking events are recorded in the order of processing - replay does not
+// have to restore the order of events of different threads
+static void trace_event(const EventEntry_t *event)
 {
-    ThreadState_t* pthread_state = state;
+    sample_trace_record_t record = {.timestamp = event->timestamp};
+    switch (event->type) {
+        case EVENT_CREATE_ADD:
+            record.type = SAMPLE_TRACE_ALLOC;
+            record.hash = event->data.createAddData.hash;
+            record.addr = (uintptr_t)event->data.createAddData.address;
+            record.size = event->data.createAddData.size;
+            record.is_hot = event->data.createAddData.isHot;
+            record.weight = event->data.createAddData.weight;
+            break;
+        case EVENT_DESTROY_REMOVE:
+            record.type = SAMPLE_TRACE_FREE;
+            record.addr = (uintptr_t)event->data.destroyRemoveData.address;
+            break;
+        case EVENT_REALLOC:
+            record.type = SAMPLE_TRACE_REALLOC;
+            record.addr = (uintptr_t)event->data.reallocData.addressOld;
+            record.new_addr = (uintptr_t)event->data.reallocData.addressNew;
+            record.hash = event->data.reallocData.hash;
+            record.size = event->data.reallocData.sizeNew;
+            record.is_hot = event->data.reallocData.isHot;
+            record.weight = event->data.reallocData.weight;
+            break;
+        case EVENT_TOUCH:
+            record.type = SAMPLE_TRACE_TOUCH;
+            record.timestamp = event->data.touchData.timestamp;
+            record.addr = (uintptr_t)event->data.touchData.address;
+            break;
+        default:
+            // touch callbacks and run updates cannot be replayed
+            return;
+    }
+    sample_trace_write(&record);
+}
 
-    double period_ms = 1000 / pebs_freq_hz;
-    struct timespec tv_period;
-    timespec_millis_to_timespec(period_ms, &tv_period);
+static void process_event(const EventEntry_t *event)
+{
+    if (sample_trace_enabled())
+        trace_event(event);
+    switch (event->type) {
+        case EVENT_CREATE_ADD:
+            g_queue_counter_malloc++;
+            break;
+        case EVENT_DESTROY_REMOVE:
+            g_queue_counter_free++;
+            break;
+        case EVENT_REALLOC:
+            g_queue_counter_realloc++;
+            break;
+        case EVENT_SET_TOUCH_CALLBACK:
+            g_queue_counter_callback++;
+            break;
+        case EVENT_TOUCH:
+            g_queue_counter_touch++;
+            break;
+        case EVENT_RUN_UPDATE:
+        case EVENT_RUN_RELEASE:
+            g_queue_counter_run++;
+            break;
+    }
+    if (hotness_stats_enabled()) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        tachanka_ranking_event_process(event);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ull +
+            end.tv_nsec - start.tv_nsec;
+        if (event->type < HOTNESS_STATS_EVENT_TYPES)
+            g_stats.event_latency[event->type]
+                                 [hotness_stats_latency_bucket(ns)]++;
+    } else {
+        tachanka_ranking_event_process(event);
+    }
+    g_queue_pop_counter++;
+
+#if CHECK_ADDED_SIZE
+    log_info("EVENT end g_total_ranking_size %ld g_total_critnib_size %ld",
+        g_total_ranking_size, g_total_critnib_size);
+#endif
+}
 
-    // set low priority
+static void pebs_set_low_priority(void)
+{
     int policy;
     struct sched_param param;
     pthread_getschedparam(pthread_self(), &policy, &param);
     param.sched_priority = sched_get_priority_min(policy);
     pthread_setschedparam(pthread_self(), policy, &param);
+}
+
+// copies @p size bytes at @p pos of ring data; records might wrap around
+// the end of ring
+static void pebs_ring_read(const pebs_ring_t *ring, __u64 pos, void *dst,
+                           size_t size)
+{
+    size_t data_size = g_ringPages * getpagesize();
+    const char *data = ring->mmap + getpagesize();
+    size_t offset = pos & (data_size - 1);
+    size_t first = size < data_size - offset ? size : data_size - offset;
+    memcpy(dst, data + offset, first);
+    memcpy((char *)dst + first, data, size - first);
+}
+
+static void pebs_consumer_flush_touches(pebs_consumer_t *consumer)
+{
+    // aggregator reorders touches - record them first
+    if (consumer->touches_count && sample_trace_enabled())
+        sample_trace_write_touches(consumer->touches, consumer->touches_count);
+    if (consumer->touches_count)
+        (void)tachanka_touch_aggregator_add(consumer->aggregator,
+                                            consumer->touches,
+                                            consumer->touches_count);
+    consumer->touches_count = 0u;
+}
+
+static void pebs_ring_drain(pebs_ring_t *ring, pebs_consumer_t *consumer)
+{
+    struct perf_event_mmap_page *metadata =
+        (struct perf_event_mmap_page *)ring->mmap;
+    // must be read before data
+    __u64 head = __atomic_load_n(&metadata->data_head, __ATOMIC_ACQUIRE);
+    __u64 tail = metadata->data_tail;
+    size_t samples = 0u, lost = 0u, lost_records = 0u;
+
+#if PRINT_PEBS_NEW_DATA_INFO
+    if (tail < head)
+        log_info("PEBS: new data to process on cpu %d!", ring->cpu);
+#endif
+    while (tail < head) {
+        struct perf_event_header header;
+        pebs_ring_read(ring, tail, &header, sizeof(header));
+        if (header.size == 0)
+            break;
+        switch (header.type) {
+            case PERF_RECORD_SAMPLE: {
+                // content of this struct is defined by
+                // "pe.sample_type = PERF_SAMPLE_ADDR | PERF_SAMPLE_TIME"
+                // in pebs_init(): timestamp, acessed address
+                __u64 body[2];
+                pebs_ring_read(ring, tail + sizeof(header), body,
+                               sizeof(body));
+                __u64 timestamp = body[0];
+                __u64 addr = body[1];
+                ++samples;
+                if (timestamp > consumer->last_timestamp)
+                    consumer->last_timestamp = timestamp;
+                // touches are applied after all rings are drained,
+                // aggregated per type - see tachanka_touch_aggregator_add()
+                if (shouldProcessTouches) {
+                    tachanka_touch_sample_t *touch =
+                        &consumer->touches[consumer->touches_count];
+                    touch->addr = (void *)addr;
+                    touch->timestamp = timestamp;
+                    if (++consumer->touches_count == PEBS_TOUCH_BATCH_ENTRIES)
+                        pebs_consumer_flush_touches(consumer);
+                }
+#if PRINT_PEBS_TOUCH_INFO
+                log_info("PEBS touch(): cpu: %d, tail: %llu, head: %llu "
+                         "t: %llu addr: %llx", ring->cpu, tail, head,
+                         timestamp, addr);
+#endif
+                break;
+            }
+            case PERF_RECORD_LOST: {
+                // id, number of lost samples
+                __u64 body[2];
+                pebs_ring_read(ring, tail + sizeof(header), body,
+                               sizeof(body));
+                lost += body[1];
+                ++lost_records;
+                break;
+            }
+            default:
+                break;
+        }
+        tail += header.size;
+    }
+    // data must be read before it is released to the kernel
+    __atomic_store_n(&metadata->data_tail, head, __ATOMIC_RELEASE);
+    ioctl(ring->fd, PERF_EVENT_IOC_REFRESH, 0);
+
+    atomic_fetch_add_explicit(&consumer->samples, samples,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&consumer->lost, lost, memory_order_relaxed);
+    atomic_fetch_add_explicit(&consumer->lost_records, lost_records,
+                              memory_order_relaxed);
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void pebs_consumer_drain(pebs_consumer_t *consumer)
+{
+    uint64_t start = thread_cpu_ns();
+    for (size_t i = 0; i < consumer->rings_count; ++i)
+        pebs_ring_drain(&g_rings[consumer->first_ring + i], consumer);
+    pebs_consumer_flush_touches(consumer);
+    atomic_fetch_add_explicit(&consumer->busy_ns, thread_cpu_ns() - start,
+                              memory_order_relaxed);
+}
+
+static void *pebs_consumer_thread(void *arg)
+{
+    pebs_consumer_t *consumer = arg;
+    pebs_set_low_priority();
+    while (1) {
+        pthread_barrier_wait(&g_cycleStart);
+        if (g_consumersStop)
+            break;
+        pebs_consumer_drain(consumer);
+        pthread_barrier_wait(&g_cycleEnd);
+    }
+    return NULL;
+}
+
+static void pebs_publish_stats(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t timestamp = now.tv_sec * 1000000000ull + now.tv_nsec;
+    double seconds =
+        g_stats.timestamp ? (timestamp - g_stats.timestamp) / 1e9 : 0.;
+
+    size_t tier_sizes[HOTNESS_MAX_TIERS];
+    g_stats.tiers = memtier_policy_data_hotness_get_tier_sizes(tier_sizes);
+    for (size_t i = 0; i < g_stats.tiers; ++i)
+        g_stats.tier_size[i] = tier_sizes[i];
+    g_stats.hot_total_desired_ratio =
+        memtier_kind_get_actual_hot_to_total_desired_ratio();
+    g_stats.hot_total_actual_ratio =
+        memtier_kind_get_actual_hot_to_total_allocated_ratio();
+
+    tachanka_stats_t tachanka_stats;
+    tachanka_get_stats(&tachanka_stats);
+    g_stats.thresholds = tachanka_stats.thresholds;
+    for (size_t i = 0; i < tachanka_stats.thresholds; ++i) {
+        g_stats.thresh[i] = tachanka_stats.thresh[i];
+        g_stats.thresh_valid[i] = tachanka_stats.thresh_valid[i];
+        g_stats.controller_error[i] = tachanka_stats.controller_error[i];
+        g_stats.controller_integral[i] =
+            tachanka_stats.controller_integral[i];
+    }
+    g_stats.types = tachanka_stats.types;
+    g_stats.blocks = tachanka_stats.blocks;
+    if (g_stats.cycles % HOTNESS_STATS_PURITY_INTERVAL == 0u)
+        g_stats.page_purity = tachanka_get_page_purity();
+
+    ranking_event_rings_stats_t rings_stats;
+    ranking_event_rings_get_stats(&rings_stats);
+    g_stats.event_rings = rings_stats.rings;
+    g_stats.events_pushed = rings_stats.pushed;
+    g_stats.events_overflowed = rings_stats.overflowed;
+    g_stats.events_dropped = rings_stats.dropped;
+    g_stats.events_popped = rings_stats.popped;
+    // counters are read one by one - popped might be ahead
+    size_t queued = rings_stats.pushed + rings_stats.overflowed;
+    g_stats.event_queue_depth =
+        queued > rings_stats.popped ? queued - rings_stats.popped : 0u;
+
+    pebs_stats_t pebs_stats;
+    pebs_get_stats(&pebs_stats);
+    if (seconds > 0.) {
+        g_stats.pebs_samples_per_second =
+            (pebs_stats.samples - g_stats.pebs_samples) / seconds;
+        g_stats.pebs_lost_per_second =
+            (pebs_stats.lost - g_stats.pebs_lost) / seconds;
+    }
+    g_stats.pebs_samples = pebs_stats.samples;
+    g_stats.pebs_lost = pebs_stats.lost;
+    g_stats.pebs_dropped = pebs_stats.dropped;
+    g_stats.pebs_period = pebs_stats.period;
+    g_stats.pebs_overhead = pebs_stats.overhead;
+
+    g_stats.cycles++;
+    g_stats.timestamp = timestamp;
+    hotness_stats_publish(&g_stats);
+}
+
+void *pebs_monitor(void *state)
+{
+    ThreadState_t* pthread_state = state;
+
+    double period_ms = 1000 / pebs_freq_hz;
+    struct timespec tv_period;
+    timespec_millis_to_timespec(period_ms, &tv_period);
+
+    pebs_set_low_priority();
 
-    __u64 last_head = 0;
 #if PRINT_PEBS_BASIC_INFO
     int cur_tid = syscall(SYS_gettid);
 #endif
@@ -131,9 +466,6 @@ void *pebs_monitor(void *state)
             return NULL;
         }
 
-        // must call this before read from data head
-		rmb();
-
 #if PRINT_PEBS_STATS_ON_COUNTER_OVERFLOW_INFO
         {
             static uint64_t counter = 0;
@@ -150,237 +482,73 @@ void *pebs_monitor(void *state)
                     "time [seconds, nanoseconds]: [%ld, %ld]",
                     interval, g_queue_pop_counter, t.tv_sec, t.tv_nsec);
                 log_info("g_queue_counter_malloc: %lu, g_queue_counter_realloc: %lu, "
-                    "g_queue_counter_callback: %lu, g_queue_counter_free: %lu, g_queue_counter_touch: %lu",
+                    "g_queue_counter_callback: %lu, g_queue_counter_free: %lu, g_queue_counter_touch: %lu, "
+                    "g_queue_counter_run: %lu",
                     g_queue_counter_malloc, g_queue_counter_realloc, g_queue_counter_callback,
-                    g_queue_counter_free, g_queue_counter_touch);
+                    g_queue_counter_free, g_queue_counter_touch, g_queue_counter_run);
+                ranking_event_rings_stats_t rings_stats;
+                ranking_event_rings_get_stats(&rings_stats);
+                log_info("event rings: %zu, pushed: %zu, overflowed: %zu, "
+                    "dropped: %zu, popped: %zu", rings_stats.rings,
+                    rings_stats.pushed, rings_stats.overflowed,
+                    rings_stats.dropped, rings_stats.popped);
+                pebs_stats_t pebs_stats;
+                pebs_get_stats(&pebs_stats);
+                log_info("pebs rings: %zu, consumers: %zu, samples: %zu, "
+                    "lost: %zu (records: %zu), dropped: %zu",
+                    pebs_stats.rings, pebs_stats.consumers,
+                    pebs_stats.samples, pebs_stats.lost,
+                    pebs_stats.lost_records, pebs_stats.dropped);
+                log_info("page purity: %.3f", tachanka_get_page_purity());
                 counter=0u;
             }
         }
 #endif
 
-        EventEntry_t event;
-        bool pop_success;
-        for (int i=0; i<HOTNESS_RANKING_EVENT_ITERATIONS_PER_CYCLE; ++i) {
-            pop_success = tachanka_ranking_event_pop(&event);
-            if (!pop_success)
+        static EventEntry_t events[RANKING_EVENT_BATCH_ENTRIES];
+        for (size_t popped = 0; popped < HOTNESS_RANKING_EVENT_ITERATIONS_PER_CYCLE;) {
+            size_t count = tachanka_ranking_event_pop_batch(
+                events, RANKING_EVENT_BATCH_ENTRIES);
+            for (size_t i = 0; i < count; ++i)
+                process_event(&events[i]);
+            popped += count;
+            if (count < RANKING_EVENT_BATCH_ENTRIES)
                 break;
-            switch (event.type) {
-                case EVENT_CREATE_ADD: {
-                    EventDataCreateAdd *data = &event.data.createAddData;
-#if PRINT_PEBS_EVENT_INFO
-                    log_debug("EVENT_CREATE_ADD, address %p, size %lu",
-                              data->address, data->size);
-#endif
-                    register_block(data->hash, data->address, data->size, data->isHot);
-                    register_block_in_ranking(data->address, data->size);
-                    g_queue_counter_malloc++;
-                    break;
-                }
-                case EVENT_DESTROY_REMOVE: {
-                    EventDataDestroyRemove *data =
-                        &event.data.destroyRemoveData;
-#if PRINT_PEBS_EVENT_INFO
-                    log_debug("EVENT_DESTROY_REMOVE, address %p",
-                              data->address);
-#endif
-                    // REMOVE THE BLOCK FROM RANKING!!!
-                    // TODO remove all the exclamation marks and clean up once this is done
-                    unregister_block(data->address);
-                    g_queue_counter_free++;
-                    break;
-                }
-                case EVENT_REALLOC: {
-                    EventDataRealloc *data = &event.data.reallocData;
-#if PRINT_PEBS_EVENT_INFO
-                    log_debug("EVENT_REALLOC, address [old->new]: %p -> %p,"
-                        " size [old -> new]: %lu -> %lu", data->addressOld,
-                        data->addressNew, data->sizeOld, data->sizeNew);
-#endif
-                    unregister_block(data->addressOld);
-//                     realloc_block(data->addressOld, data->addressNew, data->sizeNew);
-                    register_block(0u /* FIXME hash should not be zero !!! */, data->addressNew, data->sizeNew, data->isHot);
-                    register_block_in_ranking(data->addressNew, data->sizeNew);
-                    g_queue_counter_realloc++;
-                    break;
-                }
-                case EVENT_SET_TOUCH_CALLBACK: {              
-#if PRINT_PEBS_EVENT_INFO
-                    log_debug("EVENT_SET_TOUCH_CALLBACK");
-#endif
-                    EventDataSetTouchCallback *data = &event.data.touchCallbackData;
-                    tachanka_set_touch_callback(data->address,
-                                                data->callback,
-                                                data->callbackArg);
-                    g_queue_counter_callback++;
-                    break;
-                }
-                // WARNING the touches that come from pebs are executed in-place
-                // this event was added to make the code testable (UT)
-                case EVENT_TOUCH: {
-                    int fromMalloc = 0; // false
-                    EventDataTouch *data = &event.data.touchData;
-                    touch(data->address, data->timestamp, fromMalloc);
-                    g_queue_counter_touch++;
-                    break;
-                }
-                default: {
-                    log_fatal("PEBS: event queue - case not implemented!");
-                    exit(-1);
-                }
-            }
-            g_queue_pop_counter++;
-
-#if CHECK_ADDED_SIZE
-        log_info("EVENT end g_total_ranking_size %ld g_total_critnib_size %ld", 
-            g_total_ranking_size, g_total_critnib_size);
-#endif
         }
 
-        struct perf_event_mmap_page* pebs_metadata =
-            (struct perf_event_mmap_page*)pebs_mmap;
-
-        if (last_head < pebs_metadata->data_head) {
-#if PRINT_PEBS_NEW_DATA_INFO
-            log_info("PEBS: new data to process!");
-#endif
-            int samples = 0;
-            __u64 timestamp = 0;
-
-            while (last_head < pebs_metadata->data_head) {
-	            char *data_mmap = pebs_mmap + getpagesize() +
-                    last_head % (MMAP_DATA_SIZE * getpagesize());
-
-                struct perf_event_header *event =
-                    (struct perf_event_header *)data_mmap;
-
-//  {    static uint64_t counter=0;
-//     const uint64_t interval=10;
-//     if (++counter > interval) {
-//         struct timespec t;
-//         int ret = clock_gettime(CLOCK_MONOTONIC, &t);
-//         if (ret != 0) {
-//             printf("ASSERT PEBS EVENT COUNTER FAILURE!\n");
-//         }
-//         assert(ret == 0);
-//         printf("pebs event counter 10 hit, [seconds, nanoseconds]: [%ld, %ld]\n",
-//             t.tv_sec, t.tv_nsec);
-//         counter=0u;
-//     }
-// }
-                switch (event->type) {
-                    case PERF_RECORD_SAMPLE:
-                    {
-                        // content of this struct is defined by
-                        // "pe.sample_type = PERF_SAMPLE_ADDR | PERF_SAMPLE_TIME"
-                        // in pebs_init()
-                        timestamp = *(__u64*)(data_mmap + sizeof(struct perf_event_header));
-                        // 'addr' is the acessed address
-                        __u64 addr = *(__u64*)(data_mmap + sizeof(struct perf_event_header) + sizeof(__u64));
-
-                        // TODO - is this a global or per-core timestamp?
-                        // If per-core, this could lead to some problems
-
-// {    static uint64_t counter=0;
-//     const uint64_t interval=10;
-//     if (++counter > interval) {
-//         struct timespec t;
-//         int ret = clock_gettime(CLOCK_MONOTONIC, &t);
-//         if (ret != 0) {
-//             printf("ASSERT PEBS TOUCH COUNTER FAILURE!\n");
-//         }
-//         assert(ret == 0);
-//         printf("pebs touch counter 10 hit, [seconds, nanoseconds]: [%ld, %ld]\n",
-//             t.tv_sec, t.tv_nsec);
-//         counter=0u;
-//     }
-// }
-//                         printf("touches, timestamp: [%llu], from malloc [0]\n", timestamp);
-
-                        // defer touch after corresponding malloc - put it onto queue
-                        EventEntry_t entry = {
-                            .type = EVENT_TOUCH,
-                            .data.touchData = {
-                                .address = (void*)addr,
-                                .timestamp = timestamp,
-                            },
-                        };
-
-                        // copy is performed, passing pointer to stack is ok
-                        // losing single malloc should not cause issues,
-                        // so we are just ignoring buffer overflows
-//                         (void)tachanka_ranking_event_push(&entry); // TODO
-                        if (shouldProcessTouches)
-                            touch(entry.data.touchData.address,
-                                entry.data.touchData.timestamp, 0 /*called from malloc*/);
-                                g_queue_counter_touch++;
-
-//                         touch((void*)addr, timestamp, 0 /* from malloc */);
-//                         printf("touched, timestamp: [%llu], from malloc [0]\n", timestamp);
+        // ranking events are processed even without a sample source
+        if (g_source)
+            (void)g_source->collect();
 
 #if PEBS_LOG_TO_FILE
-                        // DEBUG
-                        sprintf(buf, "last: %llu, head: %llu t: %llu addr: %llx\n",
-                            last_head, pebs_metadata->data_head,
-                            timestamp, addr);
-                        //if (write(log_file, buf, strlen(buf))) ;
-#endif
-
-#if PRINT_PEBS_TOUCH_INFO
-                        log_info("PEBS touch(): last: %llu, head: %llu t: %llu addr: %llx",
-                            last_head, pebs_metadata->data_head,
-                            timestamp, addr);
-#endif
-                    }
-                    break;
-                default:
-                    break;
-                };
-
-                last_head += event->size;
-                data_mmap += event->size;
-                samples++;
-            }
-
-#if RANKING_TOUCH_ALL
-            // Touch every ttype object to update hotness
-            if (timestamp > 0) {
-                tachanka_ranking_touch_all(timestamp, 0);
-            }
+        bp = buf;
+        critnib_iter(hash_to_type, display_hotness);
+        bp += sprintf(bp, "\n");
+        if (write(log_file, buf, bp - buf));
 #endif
 
-#if PRINT_PEBS_SAMPLES_NUM_INFO
-            log_info("PEBS: processed %d samples", samples);
-#endif
-
-#if PEBS_LOG_TO_FILE
-            bp = buf;
-            critnib_iter(hash_to_type, display_hotness);
-            bp += sprintf(bp, "\n");
-            if (write(log_file, buf, bp - buf));
-#endif
+        // pick up objects loaded with dlopen() since the last cycle
+        (void)bthash_refresh_maps();
+        memtier_flush_alloc_size();
+        if (sample_trace_enabled()) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            sample_trace_record_t record = {
+                .type = SAMPLE_TRACE_CYCLE,
+                .timestamp = now.tv_sec * 1000000000ull + now.tv_nsec};
+            sample_trace_write(&record);
         }
-
-		ioctl(pebs_fd, PERF_EVENT_IOC_REFRESH, 0);
-        last_head = pebs_metadata->data_head;
-        pebs_metadata->data_tail = pebs_metadata->data_head;
         tachanka_update_threshold();
-
-//         ret = clock_gettime(CLOCK_MONOTONIC, &ctime);
-//         if (ret != 0) {
-//             printf("ASSERT_CLOCK_GETTIME_FAILURE!\n");
-//             assert(ret!=0);
-//         }
-//         uint64_t diff_ms = timespec_diff_millis(&ctime, &ptime);
-//         if ()
-//
-//         usleep(1000*(diff_ms-period_ms))
-//         if (diff_ms > period_ms) {
-//             warning:
-//         }
-//         ptime = ctime;
-
-// 		sleep(1); // TODO analysis depends on event number; better solution: const 1 Hz, with low priority
-//         usleep(1000);
+        if (hotness_stats_enabled())
+            pebs_publish_stats();
+#if HOTNESS_MIGRATION_ENABLED
+        tachanka_migrate_blocks();
+#endif
+        // metadata removed by events of this and previous cycles
+        (void)qsbr_reclaim();
+#if METADATA_RELEASE_ENABLED
+        (void)tachanka_release_free_memory();
+#endif
 
         struct timespec temp;
         ret = clock_gettime(CLOCK_MONOTONIC, &temp);
@@ -404,13 +572,182 @@ void *pebs_monitor(void *state)
     return NULL;
 }
 
-void pebs_init(pid_t pid)
+// opens one event for the process or one per cpu; cpus that fail
+// (e.g. offline) are skipped
+static void pebs_open_rings(struct perf_event_attr *pe, pid_t pid)
 {
-    // TODO add code that writes to /proc/sys/kernel/perf_event_paranoid ?
+    long cpus = pebs_per_cpu ? sysconf(_SC_NPROCESSORS_CONF) : 1;
+    if (cpus < 1)
+        cpus = 1;
+    g_ringPages = pebs_ring_pages;
+    g_rings = jemk_calloc(cpus, sizeof(g_rings[0]));
+    if (!g_rings) {
+        log_fatal("PEBS: rings allocation failed!");
+        exit(-1);
+    }
+    g_ringsCount = 0u;
+    size_t map_size = (1 + g_ringPages) * getpagesize();
+    for (long i = 0; i < cpus; ++i) {
+        int cpu = pebs_per_cpu ? i : -1; // -1: on any CPU
+        int group_fd = -1;               // use single event group
+        unsigned long flags = 0;
+        int fd = perf_event_open(pe, pid, cpu, group_fd, flags);
+        if (fd == -1)
+            continue;
+        char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+        if (map == MAP_FAILED) {
+            log_err("PEBS: mmap of %zu bytes ring failed for cpu %d",
+                    map_size, cpu);
+            close(fd);
+            continue;
+        }
+        pebs_ring_t *ring = &g_rings[g_ringsCount++];
+        ring->fd = fd;
+        ring->cpu = cpu;
+        ring->node = cpu >= 0 ? numa_node_of_cpu(cpu) : 0;
+        ring->mmap = map;
+        // keep rings of a node next to each other - they are drained by
+        // the same consumer
+        for (pebs_ring_t *r = ring; r > g_rings && r[-1].node > r->node;
+             --r) {
+            pebs_ring_t temp = r[-1];
+            r[-1] = r[0];
+            r[0] = temp;
+        }
+    }
+}
 
+static void pebs_start_consumers(void)
+{
+    g_consumersCount = pebs_consumer_threads;
+    if (g_consumersCount > g_ringsCount)
+        g_consumersCount = g_ringsCount ? g_ringsCount : 1;
+    g_consumers = jemk_calloc(g_consumersCount, sizeof(g_consumers[0]));
+    if (!g_consumers) {
+        log_fatal("PEBS: consumers allocation failed!");
+        exit(-1);
+    }
+    g_consumersStop = false;
+    for (size_t i = 0; i < g_consumersCount; ++i) {
+        pebs_consumer_t *consumer = &g_consumers[i];
+        consumer->first_ring = i * g_ringsCount / g_consumersCount;
+        consumer->rings_count =
+            (i + 1) * g_ringsCount / g_consumersCount - consumer->first_ring;
+        consumer->aggregator = tachanka_touch_aggregator_create();
+        g_aggregators[i] = consumer->aggregator;
+    }
+    if (g_consumersCount > 1) {
+        pthread_barrier_init(&g_cycleStart, NULL, g_consumersCount);
+        pthread_barrier_init(&g_cycleEnd, NULL, g_consumersCount);
+        for (size_t i = 1; i < g_consumersCount; ++i)
+            pthread_create(&g_consumers[i].thread, NULL,
+                           &pebs_consumer_thread, &g_consumers[i]);
+    }
+}
+
+// @pre pebs monitor thread is stopped
+static void pebs_stop_consumers(void)
+{
+    if (g_consumersCount > 1) {
+        g_consumersStop = true;
+        pthread_barrier_wait(&g_cycleStart);
+        for (size_t i = 1; i < g_consumersCount; ++i)
+            pthread_join(g_consumers[i].thread, NULL);
+        pthread_barrier_destroy(&g_cycleStart);
+        pthread_barrier_destroy(&g_cycleEnd);
+    }
+    for (size_t i = 0; i < g_consumersCount; ++i)
+        tachanka_touch_aggregator_destroy(g_consumers[i].aggregator);
+    jemk_free(g_consumers);
+    g_consumers = NULL;
+    g_consumersCount = 0u;
+}
+
+MEMKIND_EXPORT uint64_t pebs_period_adapt(const pebs_period_input_t *in)
+{
+    double period = in->period;
+    if (in->seconds <= 0.)
+        return in->period;
+    double next;
+    if (in->lost) {
+        // rings overflow between cycles
+        next = period * HOTNESS_PEBS_PERIOD_STEP;
+    } else if (!in->samples) {
+        // cost cannot be measured - sample more if samples are needed
+        next = in->wanted_rate > 0. ? period / HOTNESS_PEBS_PERIOD_STEP
+                                    : period;
+    } else {
+        double rate = in->samples / in->seconds;
+        // CPU time too short to measure makes the budget unlimited
+        double cost_ns = (double)in->busy_ns / in->samples;
+        double budget_rate = in->overhead_target * 1e9 / cost_ns;
+        double target =
+            in->wanted_rate < budget_rate ? in->wanted_rate : budget_rate;
+        next = target > 0. ? period * rate / target
+                           : period * HOTNESS_PEBS_PERIOD_STEP;
+    }
+    if (next > period * HOTNESS_PEBS_PERIOD_STEP)
+        next = period * HOTNESS_PEBS_PERIOD_STEP;
+    if (next < period / HOTNESS_PEBS_PERIOD_STEP)
+        next = period / HOTNESS_PEBS_PERIOD_STEP;
+    if (next > HOTNESS_PEBS_PERIOD_MAX)
+        next = HOTNESS_PEBS_PERIOD_MAX;
+    if (next < HOTNESS_PEBS_PERIOD_MIN)
+        next = HOTNESS_PEBS_PERIOD_MIN;
+    return (uint64_t)next;
+}
+
+// measures samples and CPU time of the last cycle and reprograms the
+// period of rings; called by the monitor thread after consumers are done
+static void pebs_adapt_period(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t timestamp = now.tv_sec * 1000000000ull + now.tv_nsec;
+    pebs_stats_t stats;
+    pebs_get_stats(&stats);
+    if (!g_periodTimestamp) {
+        g_periodTimestamp = timestamp;
+        g_periodStats = stats;
+        return;
+    }
+    pebs_period_input_t in = {
+        .period = g_period,
+        .seconds = (timestamp - g_periodTimestamp) / 1e9,
+        .samples = stats.samples - g_periodStats.samples,
+        .lost = stats.lost - g_periodStats.lost,
+        .busy_ns = stats.busy_ns - g_periodStats.busy_ns,
+        .overhead_target = pebs_overhead_target,
+    };
+    g_periodTimestamp = timestamp;
+    g_periodStats = stats;
+    if (in.seconds > 0.)
+        g_overhead = in.busy_ns / 1e9 / in.seconds;
+    if (pebs_overhead_target <= 0.)
+        return;
+
+    tachanka_stats_t tachanka_stats;
+    tachanka_get_stats(&tachanka_stats);
+    in.wanted_rate = (double)tachanka_stats.types * pebs_type_samples /
+        (hotness_measure_window / 1e9);
+    uint64_t period = pebs_period_adapt(&in);
+    if (fabs((double)period - g_period) <
+        g_period * HOTNESS_PEBS_PERIOD_HYSTERESIS)
+        return;
 #if PRINT_PEBS_BASIC_INFO
-    log_info("PEBS: init");
+    log_info("PEBS: period %lu -> %lu, %.0f samples/s, overhead %.4f",
+             g_period, period, in.samples / in.seconds, g_overhead);
 #endif
+    for (size_t i = 0; i < g_ringsCount; ++i)
+        if (ioctl(g_rings[i].fd, PERF_EVENT_IOC_PERIOD, &period))
+            log_err("PEBS: cannot set period of ring %zu", i);
+    g_period = period;
+}
+
+static int pebs_source_start(pid_t pid)
+{
+    // TODO add code that writes to /proc/sys/kernel/perf_event_paranoid ?
 
     struct perf_event_attr pe;
     memset(&pe, 0, sizeof(struct perf_event_attr));
@@ -418,8 +755,8 @@ void pebs_init(pid_t pid)
     // NOTE: code bellow requires link to libpfm
     int ret = pfm_initialize();
     if (ret != PFM_SUCCESS) {
-        log_fatal("PEBS: pfm_initialize() failed!");
-        exit(-1);
+        log_err("PEBS: pfm_initialize() failed!");
+        return -1;
     }
 
     pfm_perf_encode_arg_t arg;
@@ -451,52 +788,168 @@ void pebs_init(pid_t pid)
     pe.exclude_kernel = 1;
     pe.exclude_hv = 1;
     pe.wakeup_events = 1;
+    // per-cpu event of a process has to follow all of its threads
+    pe.inherit = pebs_per_cpu;
 
     // NOTE: pid is passed as an argument to this func
     //pid_t pid = 0;            // measure current process
+    pebs_open_rings(&pe, pid);
+    if (g_ringsCount == 0)
+    {
+        log_err("PEBS: PEBS NOT SUPPORTED!");
+        jemk_free(g_rings);
+        g_rings = NULL;
+        return -1;
+    }
+    pebs_start_consumers();
+    g_period = pe.sample_period;
+    g_overhead = 0.;
+    g_periodTimestamp = 0u;
+
+    for (size_t i = 0; i < g_ringsCount; ++i) {
+        ioctl(g_rings[i].fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(g_rings[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return 0;
+}
 
-    int cpu = -1;               // .. on any CPU
-    int group_fd = -1;          // use single event group
-    unsigned long flags = 0;
-    pebs_fd = perf_event_open(&pe, pid, cpu, group_fd, flags);
+static void pebs_source_stop(void)
+{
+    for (size_t i = 0; i < g_ringsCount; ++i)
+        ioctl(g_rings[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+    pebs_stop_consumers();
+
+    size_t map_size = (1 + g_ringPages) * getpagesize();
+    for (size_t i = 0; i < g_ringsCount; ++i) {
+        munmap(g_rings[i].mmap, map_size);
+        close(g_rings[i].fd);
+    }
+    jemk_free(g_rings);
+    g_rings = NULL;
+    g_ringsCount = 0u;
+}
 
-    if (pebs_fd != -1) {
-        int mmap_pages = 1 + MMAP_DATA_SIZE;
-        int map_size = mmap_pages * getpagesize();
-        pebs_mmap = mmap(NULL, map_size,
-                        PROT_READ | PROT_WRITE, MAP_SHARED, pebs_fd, 0);
+// touches of PEBS samples, drained by consumers in parallel; ranking events
+// are not processed meanwhile, so blocks cannot be freed
+static size_t pebs_source_collect(void)
+{
+#if PRINT_PEBS_SAMPLES_NUM_INFO
+    pebs_stats_t stats_before;
+    pebs_get_stats(&stats_before);
+#endif
+    if (g_consumersCount > 1)
+        pthread_barrier_wait(&g_cycleStart);
+    pebs_consumer_drain(&g_consumers[0]);
+    if (g_consumersCount > 1)
+        pthread_barrier_wait(&g_cycleEnd);
+    uint64_t flush_start = thread_cpu_ns();
+    size_t types_touched =
+        tachanka_touch_aggregators_flush(g_aggregators, g_consumersCount);
+    atomic_fetch_add_explicit(&g_consumers[0].busy_ns,
+                              thread_cpu_ns() - flush_start,
+                              memory_order_relaxed);
+    pebs_adapt_period();
 
-#if PRINT_PEBS_BASIC_INFO
-        log_info("PEBS: thread start");
+#if RANKING_TOUCH_ALL
+    __u64 timestamp = 0;
+    for (size_t i = 0; i < g_consumersCount; ++i)
+        if (g_consumers[i].last_timestamp > timestamp)
+            timestamp = g_consumers[i].last_timestamp;
+    // Touch every ttype object to update hotness
+    if (timestamp > 0) {
+        tachanka_ranking_touch_all(timestamp, 0);
+    }
+#endif
+
+#if PRINT_PEBS_SAMPLES_NUM_INFO
+    pebs_stats_t stats_after;
+    pebs_get_stats(&stats_after);
+    if (stats_after.samples != stats_before.samples)
+        log_info("PEBS: processed %zu samples, %zu type updates",
+                 stats_after.samples - stats_before.samples, types_touched);
 #endif
 
-        thread_state = THREAD_RUNNING;
-        pthread_create(&pebs_thread, NULL, &pebs_monitor, (void*)&thread_state);
+    return types_touched;
+}
 
-        ioctl(pebs_fd, PERF_EVENT_IOC_RESET, 0);
-        ioctl(pebs_fd, PERF_EVENT_IOC_ENABLE, 0);
+static const sample_source_t sample_source_pebs = {
+    .name = "pebs",
+    .start = pebs_source_start,
+    .stop = pebs_source_stop,
+    .collect = pebs_source_collect,
+};
+
+static const sample_source_t *sample_source_get(int id)
+{
+    switch (id) {
+        case SAMPLE_SOURCE_PEBS:
+            return &sample_source_pebs;
+        case SAMPLE_SOURCE_IDLE_PAGE:
+            return &sample_source_idle_page;
+        case SAMPLE_SOURCE_SYNTHETIC:
+            return &sample_source_synthetic;
     }
-    else
-    {
-        log_err("PEBS: PEBS NOT SUPPORTED! continuing without pebs!");
+    return NULL;
+}
+
+// picks and starts the source of touches; without one, types are placed
+// by static ratio
+static const sample_source_t *pebs_start_source(pid_t pid)
+{
+    if (hotness_sample_source == SAMPLE_SOURCE_NONE)
+        return NULL;
+    if (hotness_sample_source == SAMPLE_SOURCE_AUTO) {
+        // PEBS is precise, idle page tracking works on any CPU
+        static const int AUTO_SOURCES[] = {SAMPLE_SOURCE_PEBS,
+                                           SAMPLE_SOURCE_IDLE_PAGE};
+        for (size_t i = 0; i < sizeof(AUTO_SOURCES) / sizeof(AUTO_SOURCES[0]);
+             ++i) {
+            const sample_source_t *source = sample_source_get(AUTO_SOURCES[i]);
+            if (!source->start(pid))
+                return source;
+        }
+    } else {
+        const sample_source_t *source =
+            sample_source_get(hotness_sample_source);
+        if (!source->start(pid))
+            return source;
     }
+    log_err("PEBS: no sample source started! continuing without touches!");
+    return NULL;
+}
+
+void pebs_init(pid_t pid)
+{
+#if PRINT_PEBS_BASIC_INFO
+    log_info("PEBS: init");
+#endif
+
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_source = pebs_start_source(pid);
+
+#if PRINT_PEBS_BASIC_INFO
+    log_info("PEBS: thread start, source: %s, rings: %zu, consumers: %zu",
+             g_source ? g_source->name : "none", g_ringsCount,
+             g_consumersCount);
+#endif
+
+    // thread is started regardless of the sample source - it is the only
+    // consumer of ranking events
+    thread_state = THREAD_RUNNING;
+    pthread_create(&pebs_thread, NULL, &pebs_monitor, (void*)&thread_state);
 }
 
 void pebs_fini()
 {
     // finish only if the thread is running
     if (thread_state == THREAD_RUNNING) {
-        ioctl(pebs_fd, PERF_EVENT_IOC_DISABLE, 0);
-
         // TODO - use mutex?
         thread_state = THREAD_FINISHED;
         void* ret;
         pthread_join(pebs_thread, &ret);
-
-        int mmap_pages = 1 + MMAP_DATA_SIZE;
-        munmap(pebs_mmap, mmap_pages * getpagesize());
-        pebs_mmap = 0;
-        close(pebs_fd);
+        if (g_source)
+            g_source->stop();
+        g_source = NULL;
 
 #if PRINT_PEBS_BASIC_INFO
         log_info("PEBS: thread end");
@@ -504,11 +957,36 @@ void pebs_fini()
     }
 }
 
+MEMKIND_EXPORT void pebs_get_stats(pebs_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->rings = g_ringsCount;
+    stats->consumers = g_consumersCount;
+    for (size_t i = 0; i < g_consumersCount; ++i) {
+        pebs_consumer_t *consumer = &g_consumers[i];
+        stats->samples +=
+            atomic_load_explicit(&consumer->samples, memory_order_relaxed);
+        stats->lost +=
+            atomic_load_explicit(&consumer->lost, memory_order_relaxed);
+        stats->lost_records += atomic_load_explicit(&consumer->lost_records,
+                                                    memory_order_relaxed);
+        stats->dropped +=
+            tachanka_touch_aggregator_dropped(consumer->aggregator);
+        stats->busy_ns +=
+            atomic_load_explicit(&consumer->busy_ns, memory_order_relaxed);
+    }
+    stats->period = g_period;
+    stats->overhead = g_overhead;
+}
+
 MEMKIND_EXPORT void pebs_fork(pid_t pid)
 {
 #if PRINT_PEBS_BASIC_INFO
     log_info("PEBS: fork: %i", pid);
 #endif
+    // page inherited from the parent belongs to the parent
+    if (hotness_stats_enabled() && hotness_stats_open())
+        log_err("PEBS: hotness stats are not published after fork");
     pebs_init(pid);
 }
 
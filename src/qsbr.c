@@ -0,0 +1,229 @@
+#include "memkind/internal/qsbr.h"
+#include "memkind/internal/memkind_log.h"
+
+#include "jemalloc/jemalloc.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+#include "threads.h"
+
+#ifndef MEMKIND_EXPORT
+#define MEMKIND_EXPORT __attribute__((visibility("default")))
+#endif
+
+#define QSBR_CACHE_LINE 64
+#define QSBR_OFFLINE    0u
+
+typedef struct qsbr_thread {
+    // global epoch observed by the thread, QSBR_OFFLINE when quiescent;
+    // written by the owner only, read by qsbr_reclaim()
+    _Alignas(QSBR_CACHE_LINE) atomic_uint_fast64_t epoch;
+    atomic_bool used; // owned by a live thread
+    struct qsbr_thread *next;
+} qsbr_thread_t;
+
+typedef struct qsbr_retired {
+    void *ptr;
+    qsbr_free_fn free_fn;
+    void *arg;
+    uint64_t epoch; // global epoch at retirement
+} qsbr_retired_t;
+
+typedef struct qsbr_list {
+    qsbr_retired_t *entries;
+    size_t count;
+    size_t capacity;
+} qsbr_list_t;
+
+// registry of per-thread records; records are never freed, records of
+// exited threads are reused
+static _Atomic(qsbr_thread_t *) g_threads = NULL;
+static atomic_uint_fast64_t g_epoch = 1u;
+static pthread_key_t g_threadKey;
+static pthread_once_t g_threadKeyOnce = PTHREAD_ONCE_INIT;
+
+// retired objects in retirement order - epochs are non-decreasing
+static pthread_mutex_t g_retiredMutex = PTHREAD_MUTEX_INITIALIZER;
+static qsbr_list_t g_retired = {NULL, 0u, 0u};
+// serializes reclaimers, protects g_reclaimed
+static pthread_mutex_t g_reclaimMutex = PTHREAD_MUTEX_INITIALIZER;
+static qsbr_list_t g_reclaimed = {NULL, 0u, 0u};
+
+static thread_local qsbr_thread_t *t_thread = NULL;
+static thread_local unsigned t_depth = 0u;
+
+static void thread_release(void *arg)
+{
+    qsbr_thread_t *rec = arg;
+    atomic_store_explicit(&rec->epoch, QSBR_OFFLINE, memory_order_release);
+    atomic_store_explicit(&rec->used, false, memory_order_release);
+    t_thread = NULL;
+}
+
+static void thread_key_create(void)
+{
+    if (pthread_key_create(&g_threadKey, thread_release)) {
+        log_fatal("qsbr: pthread_key_create() failed");
+        exit(-1);
+    }
+}
+
+static qsbr_thread_t *thread_register(void)
+{
+    qsbr_thread_t *rec = atomic_load(&g_threads);
+    for (; rec; rec = rec->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&rec->used, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&rec->used, &expected, true))
+            break;
+    }
+    if (!rec) {
+        if (jemk_posix_memalign((void **)&rec, QSBR_CACHE_LINE,
+                                sizeof(*rec))) {
+            log_fatal("qsbr: cannot allocate thread record");
+            exit(-1);
+        }
+        memset(rec, 0, sizeof(*rec));
+        atomic_store(&rec->used, true);
+        qsbr_thread_t *head = atomic_load(&g_threads);
+        do {
+            rec->next = head;
+        } while (!atomic_compare_exchange_weak(&g_threads, &head, rec));
+    }
+    // pthread_setspecific() might allocate - and re-enter through malloc
+    t_thread = rec;
+    (void)pthread_once(&g_threadKeyOnce, thread_key_create);
+    (void)pthread_setspecific(g_threadKey, rec);
+    return rec;
+}
+
+MEMKIND_EXPORT void qsbr_online(void)
+{
+    if (t_depth++)
+        return;
+    qsbr_thread_t *rec = t_thread ? t_thread : thread_register();
+    atomic_store_explicit(
+        &rec->epoch, atomic_load_explicit(&g_epoch, memory_order_acquire),
+        memory_order_relaxed);
+    // pairs with the fence in qsbr_reclaim(): either reclaimer sees this
+    // thread online, or this thread sees all unlinks made before the
+    // reclaimer's fence
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+MEMKIND_EXPORT void qsbr_offline(void)
+{
+    if (--t_depth)
+        return;
+    atomic_store_explicit(&t_thread->epoch, QSBR_OFFLINE,
+                          memory_order_release);
+}
+
+MEMKIND_EXPORT void qsbr_quiescent(void)
+{
+    // moving forward only - reclaimer seeing the old value is conservative
+    atomic_store_explicit(
+        &t_thread->epoch, atomic_load_explicit(&g_epoch, memory_order_acquire),
+        memory_order_release);
+}
+
+static bool list_reserve(qsbr_list_t *list, size_t count)
+{
+    if (count <= list->capacity)
+        return true;
+    size_t capacity = list->capacity ? list->capacity : 64u;
+    while (capacity < count)
+        capacity *= 2u;
+    qsbr_retired_t *entries =
+        jemk_realloc(list->entries, capacity * sizeof(qsbr_retired_t));
+    if (!entries)
+        return false;
+    list->entries = entries;
+    list->capacity = capacity;
+    return true;
+}
+
+MEMKIND_EXPORT void qsbr_retire(void *ptr, qsbr_free_fn free_fn, void *arg)
+{
+    pthread_mutex_lock(&g_retiredMutex);
+    if (!list_reserve(&g_retired, g_retired.count + 1u)) {
+        // leaking is the only safe option
+        pthread_mutex_unlock(&g_retiredMutex);
+        log_err("qsbr: cannot retire %p, memory is leaked", ptr);
+        return;
+    }
+    // epoch is read after ptr was unlinked - readers that observed a later
+    // epoch cannot reach ptr anymore
+    g_retired.entries[g_retired.count++] = (qsbr_retired_t){
+        ptr, free_fn, arg, atomic_load_explicit(&g_epoch, memory_order_acquire)};
+    pthread_mutex_unlock(&g_retiredMutex);
+}
+
+MEMKIND_EXPORT size_t qsbr_reclaim(void)
+{
+    if (pthread_mutex_trylock(&g_reclaimMutex))
+        return 0u;
+
+    atomic_fetch_add(&g_epoch, 1u);
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t min_epoch = UINT64_MAX;
+    qsbr_thread_t *rec = atomic_load(&g_threads);
+    for (; rec; rec = rec->next) {
+        uint64_t epoch =
+            atomic_load_explicit(&rec->epoch, memory_order_acquire);
+        if (epoch != QSBR_OFFLINE && epoch < min_epoch)
+            min_epoch = epoch;
+    }
+
+    // every online thread entered its section at or after min_epoch -
+    // objects retired before it are unreachable
+    pthread_mutex_lock(&g_retiredMutex);
+    size_t count = 0u;
+    while (count < g_retired.count &&
+           g_retired.entries[count].epoch < min_epoch)
+        ++count;
+    if (count && list_reserve(&g_reclaimed, count)) {
+        memcpy(g_reclaimed.entries, g_retired.entries,
+               count * sizeof(qsbr_retired_t));
+        g_retired.count -= count;
+        memmove(g_retired.entries, g_retired.entries + count,
+                g_retired.count * sizeof(qsbr_retired_t));
+    } else {
+        count = 0u;
+    }
+    pthread_mutex_unlock(&g_retiredMutex);
+
+    // free functions might take locks of the owners, which retire under
+    // their locks - so they are called without g_retiredMutex
+    for (size_t i = 0u; i < count; ++i) {
+        qsbr_retired_t *entry = &g_reclaimed.entries[i];
+        entry->free_fn(entry->ptr, entry->arg);
+    }
+    pthread_mutex_unlock(&g_reclaimMutex);
+    return count;
+}
+
+MEMKIND_EXPORT size_t qsbr_pending(void)
+{
+    pthread_mutex_lock(&g_retiredMutex);
+    size_t count = g_retired.count;
+    pthread_mutex_unlock(&g_retiredMutex);
+    return count;
+}
+
+MEMKIND_EXPORT void qsbr_forget(void *arg)
+{
+    // waits for reclaim in progress, which might hold entries with arg
+    pthread_mutex_lock(&g_reclaimMutex);
+    pthread_mutex_lock(&g_retiredMutex);
+    size_t kept = 0u;
+    for (size_t i = 0u; i < g_retired.count; ++i)
+        if (g_retired.entries[i].arg != arg)
+            g_retired.entries[kept++] = g_retired.entries[i];
+    g_retired.count = kept;
+    pthread_mutex_unlock(&g_retiredMutex);
+    pthread_mutex_unlock(&g_reclaimMutex);
+}
@@ -79,14 +79,22 @@ thread_local int recursion_counter::counter=0;
 
 using namespace std;
 
+typedef struct ranking_histogram ranking_histogram_t;
+
 struct ranking {
-    std::atomic<thresh_t> hotThreshold;
+    // thresholds[i] separates tier i from tier i+1 (tiers ordered by hotness)
+    std::atomic<thresh_t> thresholds[HOTNESS_MAX_THRESHOLDS];
+    int backend;
+    // RANKING_BACKEND_WRE
     wre_tree_t *entries;
+    // RANKING_BACKEND_HISTOGRAM
+    ranking_histogram_t *histogram;
     slab_alloc_t aggHotAlloc;
     std::mutex mutex;
     double oldWeight;
     double newWeight;
-    ranking_controller controller;
+    // one controller per tier boundary
+    ranking_controller controllers[HOTNESS_MAX_THRESHOLDS];
 };
 
 typedef struct AggregatedHotness {
@@ -103,7 +111,8 @@ static bool is_hotter_agg_hot(const void *a, const void *b)
     return a_hot > b_hot;
 }
 
-static void ranking_create_internal(ranking_t **ranking, double old_weight);
+static void ranking_create_internal(ranking_t **ranking, double old_weight,
+                                    int backend);
 static void ranking_destroy_internal(ranking_t *ranking);
 // static void ranking_add_internal(ranking_t *ranking, const struct tblock *block);
 static void ranking_add_internal(ranking_t *ranking, double hotness, size_t size);
@@ -121,8 +130,15 @@ static void
 ranking_remove_internal(ranking_t *ranking, double hotness, size_t size);
 static thresh_t ranking_get_hot_threshold_internal(ranking_t *ranking);
 static thresh_t
+ranking_calculate_threshold_internal(ranking_t *ranking, size_t boundary,
+                                     double dram_total_ratio,
+                                     double dram_total_used_ratio);
+static thresh_t
 ranking_calculate_hot_threshold_dram_total_internal(
     ranking_t *ranking, double dram_total_ratio, double dram_total_used_ratio);
+static void ranking_calculate_thresholds_total_internal(
+    ranking_t *ranking, size_t thresh_count, const double *tier_total_ratios,
+    const double *tier_total_used_ratios, thresh_t *thresh);
 static thresh_t
 ranking_calculate_hot_threshold_dram_pmem_internal(
     ranking_t *ranking, double dram_pmem_ratio, double dram_pmem_used_ratio);
@@ -163,12 +179,234 @@ static double ranking_dequantify_hotness(quantified_hotness_t quantified_hotness
 #endif
 }
 
-#include <limits>
+// Log-bucketed histogram backend (RANKING_BACKEND_HISTOGRAM)
+//
+// Bucket is taken directly from the IEEE 754 representation of hotness:
+// biased exponent and RANKING_HISTOGRAM_SUB_BUCKETS_LOG2 highest mantissa
+// bits, which are monotonic in hotness - no log() is needed and a bucket is
+// at most 1/2^RANKING_HISTOGRAM_SUB_BUCKETS_LOG2 of its lower bound wide.
+// Each bucket keeps total size and sum of size*hotness; their ratio
+// represents the bucket in threshold calculation - exact if all entries in
+// the bucket have the same hotness. QUANTIFICATION_ENABLED does not apply,
+// buckets are the quantification.
+//
+// Add/remove update a bucket in O(1). Sizes are also kept in a Fenwick tree,
+// hottest bucket first, updated in O(log buckets) only when size moves to
+// another bucket; threshold for a ratio is a prefix-sum search in it,
+// interpolated between the found bucket and the next colder one,
+// like wre_find_weighted_interpolated() does between tree nodes.
+
+#define HISTOGRAM_MANTISSA_SHIFT (52 - RANKING_HISTOGRAM_SUB_BUCKETS_LOG2)
+#define HISTOGRAM_MIN_KEY                                                      \
+    ((uint64_t)(1023 + RANKING_HISTOGRAM_MIN_EXP)                              \
+     << RANKING_HISTOGRAM_SUB_BUCKETS_LOG2)
+#define HISTOGRAM_MAX_KEY                                                      \
+    ((uint64_t)(1023 + RANKING_HISTOGRAM_MAX_EXP)                              \
+     << RANKING_HISTOGRAM_SUB_BUCKETS_LOG2)
+// one bucket for each key, plus the first (below range) and the last one
+#define HISTOGRAM_BUCKETS ((size_t)(HISTOGRAM_MAX_KEY - HISTOGRAM_MIN_KEY + 2))
+
+struct ranking_histogram {
+    size_t total;
+    size_t sizes[HISTOGRAM_BUCKETS];
+    double hotnessSums[HISTOGRAM_BUCKETS];
+    // 1-based; bucket b is at position HISTOGRAM_BUCKETS - b
+    size_t fenwick[HISTOGRAM_BUCKETS + 1];
+};
+
+static constexpr size_t highest_pow2(size_t n, size_t pow = 1)
+{
+    return pow * 2 > n ? pow : highest_pow2(n, pow * 2);
+}
+
+static const size_t HISTOGRAM_FENWICK_TOP = highest_pow2(HISTOGRAM_BUCKETS);
+
+static inline size_t histogram_bucket(double hotness)
+{
+    // also catches negative hotness and NaN
+    if (!(hotness > 0))
+        return 0;
+    uint64_t bits;
+    memcpy(&bits, &hotness, sizeof(bits));
+    uint64_t key = bits >> HISTOGRAM_MANTISSA_SHIFT;
+    if (key < HISTOGRAM_MIN_KEY)
+        return 0;
+    if (key >= HISTOGRAM_MAX_KEY)
+        return HISTOGRAM_BUCKETS - 1;
+    return key - HISTOGRAM_MIN_KEY + 1;
+}
+
+/// @pre 0 < @p bucket < HISTOGRAM_BUCKETS
+static inline double histogram_bucket_low(size_t bucket)
+{
+    uint64_t bits = (bucket - 1 + HISTOGRAM_MIN_KEY)
+        << HISTOGRAM_MANTISSA_SHIFT;
+    double low;
+    memcpy(&low, &bits, sizeof(low));
+    return low;
+}
+
+static inline double histogram_mean(const ranking_histogram_t *hist,
+                                    size_t bucket)
+{
+    double mean = hist->hotnessSums[bucket] / hist->sizes[bucket];
+    // rounding errors should not move the mean out of its bucket
+    double low = bucket > 0 ? histogram_bucket_low(bucket) : 0.;
+    double high = bucket < HISTOGRAM_BUCKETS - 1
+        ? histogram_bucket_low(bucket + 1)
+        : std::numeric_limits<double>::max();
+    return std::min(std::max(mean, low), high);
+}
+
+/// @p delta might be "negative" - unsigned arithmetic wraps around
+static inline void histogram_fenwick_add(ranking_histogram_t *hist,
+                                         size_t bucket, size_t delta)
+{
+    for (size_t i = HISTOGRAM_BUCKETS - bucket; i <= HISTOGRAM_BUCKETS;
+         i += i & (~i + 1))
+        hist->fenwick[i] += delta;
+}
+
+/// @return bucket that holds the @p target-th unit of size, counting from
+/// the hottest one; @p before is set to the size of all hotter buckets
+/// @pre 0 < @p target <= total size
+static size_t histogram_find_bucket(const ranking_histogram_t *hist,
+                                    size_t target, size_t *before)
+{
+    size_t pos = 0, acc = 0;
+    for (size_t step = HISTOGRAM_FENWICK_TOP; step; step >>= 1) {
+        if (pos + step <= HISTOGRAM_BUCKETS &&
+            acc + hist->fenwick[pos + step] < target) {
+            pos += step;
+            acc += hist->fenwick[pos];
+        }
+    }
+    *before = acc;
+    return HISTOGRAM_BUCKETS - (pos + 1);
+}
+
+/// @return size of buckets at positions 1..@p pos (the hottest ones)
+static inline size_t histogram_fenwick_prefix(const ranking_histogram_t *hist,
+                                              size_t pos)
+{
+    size_t sum = 0;
+    for (size_t i = pos; i > 0; i -= i & (~i + 1))
+        sum += hist->fenwick[i];
+    return sum;
+}
+
+static ranking_histogram_t *histogram_create(void)
+{
+    ranking_histogram_t *hist =
+        (ranking_histogram_t *)jemk_calloc(1, sizeof(ranking_histogram_t));
+    if (!hist) {
+        log_fatal("ranking histogram allocation failed!");
+        exit(-1);
+    }
+    return hist;
+}
+
+static void histogram_add(ranking_histogram_t *hist, double hotness,
+                          size_t size)
+{
+    if (size == 0)
+        return;
+    size_t bucket = histogram_bucket(hotness);
+    hist->sizes[bucket] += size;
+    hist->hotnessSums[bucket] += hotness * size;
+    hist->total += size;
+    histogram_fenwick_add(hist, bucket, size);
+}
+
+/// @return size actually removed - @p size, limited to the size of bucket
+static size_t histogram_remove(ranking_histogram_t *hist, double hotness,
+                               size_t size)
+{
+    size_t bucket = histogram_bucket(hotness);
+    size_t removed = std::min(size, hist->sizes[bucket]);
+    if (removed == 0)
+        return 0;
+    hist->sizes[bucket] -= removed;
+    // sum of an emptied bucket is reset, rounding errors do not accumulate
+    hist->hotnessSums[bucket] = hist->sizes[bucket]
+        ? hist->hotnessSums[bucket] - hotness * removed
+        : 0.;
+    hist->total -= removed;
+    histogram_fenwick_add(hist, bucket, -removed);
+    return removed;
+}
+
+/// @brief move @p size from @p old_hotness to @p new_hotness, as much as
+/// can be removed - same as remove + add, but Fenwick tree is not updated
+/// if the bucket does not change
+static void histogram_move(ranking_histogram_t *hist, double old_hotness,
+                           double new_hotness, size_t size)
+{
+    size_t old_bucket = histogram_bucket(old_hotness);
+    size_t new_bucket = histogram_bucket(new_hotness);
+    if (old_bucket != new_bucket) {
+        histogram_add(hist, new_hotness,
+                      histogram_remove(hist, old_hotness, size));
+        return;
+    }
+    size_t moved = std::min(size, hist->sizes[old_bucket]);
+    hist->hotnessSums[old_bucket] += (new_hotness - old_hotness) * moved;
+}
+
+static thresh_t histogram_find_threshold(const ranking_histogram_t *hist,
+                                         double ratio)
+{
+    thresh_t thresh = {0., false};
+    if (hist->total == 0)
+        return thresh;
+    double target = std::min(std::max(ratio, 0.), 1.) * hist->total;
+    size_t unit = std::min(std::max((size_t)ceil(target), (size_t)1),
+                           hist->total);
+    size_t before;
+    size_t bucket = histogram_find_bucket(hist, unit, &before);
+    double left = histogram_mean(hist, bucket);
+#if INTERPOLATED_THRESH
+    double percentage =
+        std::min((target - before) / hist->sizes[bucket], 1.);
+    size_t after = before + hist->sizes[bucket];
+    if (after == hist->total) {
+        // coldest bucket - as in wre backend, threshold is valid only at
+        // its very end
+        if (percentage < 1)
+            return thresh;
+        thresh.threshVal = left;
+    } else {
+        size_t right_before;
+        double right = histogram_mean(
+            hist, histogram_find_bucket(hist, after + 1, &right_before));
+        thresh.threshVal = left + (right - left) * percentage;
+    }
+#else
+    thresh.threshVal = left;
+#endif
+    thresh.threshValid = true;
+    return thresh;
+}
+
+/// weighted CDF: ratio of size that is at least as hot as @p thresh
+static double histogram_hot_ratio(const ranking_histogram_t *hist,
+                                  thresh_t thresh)
+{
+    if (hist->total == 0 || !thresh.threshValid)
+        return 0.;
+    size_t bucket = histogram_bucket(thresh.threshVal);
+    size_t hot = histogram_fenwick_prefix(hist, HISTOGRAM_BUCKETS - bucket - 1);
+    // the whole bucket has its mean hotness
+    if (hist->sizes[bucket] &&
+        histogram_mean(hist, bucket) >= thresh.threshVal)
+        hot += hist->sizes[bucket];
+    return (double)hot / hist->total;
+}
 
 // TODO should probably be static; exported only for tests
 MEMKIND_EXPORT double
-ranking_update_coeffs(double *hotness_history_coeffs, double seconds_diff,
-                      double add_hotness) {
+ranking_update_coeffs_pow(double *hotness_history_coeffs, double seconds_diff,
+                          double add_hotness) {
     assert(seconds_diff >= 0 && "timestamps are not monotonic!");
     double ret = 0;
     for (size_t i=0; i<EXPONENTIAL_COEFFS_NUMBER; ++i) {
@@ -194,6 +432,170 @@ ranking_update_coeffs(double *hotness_history_coeffs, double seconds_diff,
     return ret;
 }
 
+// exp(x) for x <= 0, without branches:
+//  x = k*ln(2) + r, |r| <= ln(2)/2; exp(x) = 2^k * exp(r),
+//  exp(r) - Taylor series up to r^12 (relative error < 2e-16),
+//  2^k - built directly in exponent bits
+// k is obtained by adding EXP_ROUND_SHIFT: its low mantissa bits are then
+// equal to k + 1023 (biased exponent), so no float->int conversion is needed
+// Arguments below EXP_MIN_ARG (exp would be subnormal) give 0
+static const double EXP_LOG2E = 1.4426950408889634;
+static const double EXP_LN2_HI = 6.93147180369123816490e-01;
+static const double EXP_LN2_LO = 1.90821492927058770002e-10;
+static const double EXP_ROUND_SHIFT = 0x1.8p52 + 1023.;
+static const double EXP_MIN_ARG = -708.;
+static const double EXP_POLY[] = {
+    1. / 479001600, 1. / 39916800, 1. / 3628800, 1. / 362880, 1. / 40320,
+    1. / 5040,      1. / 720,      1. / 120,     1. / 24,     1. / 6,
+    1. / 2,         1.,            1.};
+
+#define EXP_POLY_DEGREE (sizeof(EXP_POLY) / sizeof(EXP_POLY[0]) - 1)
+
+static inline double ranking_fast_exp_neg(double x)
+{
+    double t = x * EXP_LOG2E + EXP_ROUND_SHIFT;
+    double k = t - EXP_ROUND_SHIFT;
+    double r = x - k * EXP_LN2_HI;
+    r = r - k * EXP_LN2_LO;
+    double p = EXP_POLY[0];
+    for (size_t i = 1; i <= EXP_POLY_DEGREE; ++i)
+        p = p * r + EXP_POLY[i];
+    uint64_t bits;
+    memcpy(&bits, &t, sizeof(bits));
+    bits <<= 52;
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return x < EXP_MIN_ARG ? 0. : p * scale;
+}
+
+#if EXPONENTIAL_COEFFS_UPDATE == EXPONENTIAL_COEFFS_UPDATE_FAST_EXP && \
+    defined(__AVX2__) && defined(__FMA__)
+#define EXPONENTIAL_COEFFS_AVX2 1
+#else
+#define EXPONENTIAL_COEFFS_AVX2 0
+#endif
+
+#if EXPONENTIAL_COEFFS_AVX2
+#include <immintrin.h>
+
+// same as ranking_fast_exp_neg, 4 arguments at once
+static inline __m256d ranking_fast_exp_neg_avx2(__m256d x)
+{
+    const __m256d shift = _mm256_set1_pd(EXP_ROUND_SHIFT);
+    __m256d t = _mm256_fmadd_pd(x, _mm256_set1_pd(EXP_LOG2E), shift);
+    __m256d k = _mm256_sub_pd(t, shift);
+    __m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(EXP_LN2_HI), x);
+    r = _mm256_fnmadd_pd(k, _mm256_set1_pd(EXP_LN2_LO), r);
+    __m256d p = _mm256_set1_pd(EXP_POLY[0]);
+    for (size_t i = 1; i <= EXP_POLY_DEGREE; ++i)
+        p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_POLY[i]));
+    __m256d scale =
+        _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(t), 52));
+    __m256d underflow =
+        _mm256_cmp_pd(x, _mm256_set1_pd(EXP_MIN_ARG), _CMP_LT_OQ);
+    return _mm256_andnot_pd(underflow, _mm256_mul_pd(p, scale));
+}
+
+// applies samples to coeffs kept in a register; overflow saturates to
+// MAX_DBL, as in ranking_update_coeffs_pow
+static inline double
+ranking_update_coeffs_avx2(double *hotness_history_coeffs,
+                           const double *seconds_diffs,
+                           const double *add_hotness, size_t count)
+{
+    static_assert(EXPONENTIAL_COEFFS_NUMBER == 4,
+                  "AVX2 kernel keeps all coeffs in a single register");
+    const __m256d max_dbl =
+        _mm256_set1_pd(std::numeric_limits<double>::max());
+    const __m256d log_vals = _mm256_loadu_pd(EXPONENTIAL_COEFFS_LOG_VALS);
+    const __m256d compensation =
+        _mm256_loadu_pd(EXPONENTIAL_COEFFS_CONMPENSATION_COEFFS);
+    __m256d coeffs = _mm256_loadu_pd(hotness_history_coeffs);
+    for (size_t i = 0; i < count; ++i) {
+        assert(seconds_diffs[i] >= 0 && "timestamps are not monotonic!");
+        assert(add_hotness[i] >= 0);
+        __m256d decay = ranking_fast_exp_neg_avx2(
+            _mm256_mul_pd(_mm256_set1_pd(seconds_diffs[i]), log_vals));
+        coeffs = _mm256_fmadd_pd(
+            coeffs, decay,
+            _mm256_mul_pd(compensation, _mm256_set1_pd(add_hotness[i])));
+        coeffs = _mm256_min_pd(coeffs, max_dbl);
+    }
+    _mm256_storeu_pd(hotness_history_coeffs, coeffs);
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(coeffs),
+                             _mm256_extractf128_pd(coeffs, 1));
+    sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+    return std::min(_mm_cvtsd_f64(sum), std::numeric_limits<double>::max());
+}
+#endif
+
+static inline double
+ranking_update_coeffs_fast_exp(double *hotness_history_coeffs,
+                               const double *seconds_diffs,
+                               const double *add_hotness, size_t count)
+{
+#if EXPONENTIAL_COEFFS_AVX2
+    return ranking_update_coeffs_avx2(hotness_history_coeffs, seconds_diffs,
+                                      add_hotness, count);
+#else
+    const double MAX_DBL = std::numeric_limits<double>::max();
+    double coeffs[EXPONENTIAL_COEFFS_NUMBER];
+    memcpy(coeffs, hotness_history_coeffs, sizeof(coeffs));
+    for (size_t i = 0; i < count; ++i) {
+        assert(seconds_diffs[i] >= 0 && "timestamps are not monotonic!");
+        assert(add_hotness[i] >= 0);
+        for (size_t j = 0; j < EXPONENTIAL_COEFFS_NUMBER; ++j) {
+            double decay = ranking_fast_exp_neg(
+                seconds_diffs[i] * EXPONENTIAL_COEFFS_LOG_VALS[j]);
+            coeffs[j] = std::min(
+                coeffs[j] * decay +
+                    EXPONENTIAL_COEFFS_CONMPENSATION_COEFFS[j] *
+                        add_hotness[i],
+                MAX_DBL);
+        }
+    }
+    memcpy(hotness_history_coeffs, coeffs, sizeof(coeffs));
+    double ret = 0;
+    for (size_t j = 0; j < EXPONENTIAL_COEFFS_NUMBER; ++j)
+        ret += coeffs[j];
+    return std::min(ret, MAX_DBL);
+#endif
+}
+
+// TODO should probably be static; exported only for tests
+MEMKIND_EXPORT double
+ranking_update_coeffs(double *hotness_history_coeffs, double seconds_diff,
+                      double add_hotness) {
+#if EXPONENTIAL_COEFFS_UPDATE == EXPONENTIAL_COEFFS_UPDATE_POW
+    return ranking_update_coeffs_pow(hotness_history_coeffs, seconds_diff,
+                                     add_hotness);
+#elif EXPONENTIAL_COEFFS_UPDATE == EXPONENTIAL_COEFFS_UPDATE_FAST_EXP
+    return ranking_update_coeffs_fast_exp(hotness_history_coeffs,
+                                          &seconds_diff, &add_hotness, 1);
+#else
+#error "Unknown exponential coeffs update method!"
+#endif
+}
+
+MEMKIND_EXPORT double
+ranking_update_coeffs_batch(double *hotness_history_coeffs,
+                            const double *seconds_diffs,
+                            const double *add_hotness, size_t count)
+{
+#if EXPONENTIAL_COEFFS_UPDATE == EXPONENTIAL_COEFFS_UPDATE_POW
+    double ret = 0;
+    for (size_t i = 0; i < count; ++i)
+        ret = ranking_update_coeffs_pow(hotness_history_coeffs,
+                                        seconds_diffs[i], add_hotness[i]);
+    return ret;
+#elif EXPONENTIAL_COEFFS_UPDATE == EXPONENTIAL_COEFFS_UPDATE_FAST_EXP
+    return ranking_update_coeffs_fast_exp(hotness_history_coeffs,
+                                          seconds_diffs, add_hotness, count);
+#else
+#error "Unknown exponential coeffs update method!"
+#endif
+}
+
 // old touch entry definition - as described in design doc
 static void
 ranking_touch_entry_internal(ranking_t *ranking, struct ttype *entry,
@@ -268,10 +670,17 @@ ranking_touch_entry_internal(ranking_t *ranking, struct ttype *entry,
 }
 
 
-void ranking_create_internal(ranking_t **ranking, double old_weight)
+void ranking_create_internal(ranking_t **ranking, double old_weight,
+                             int backend)
 {
     *ranking = (ranking_t *)jemk_malloc(sizeof(ranking_t));
-    wre_create(&(*ranking)->entries, is_hotter_agg_hot);
+    (*ranking)->backend = backend;
+    (*ranking)->entries = NULL;
+    (*ranking)->histogram = NULL;
+    if (backend == RANKING_BACKEND_HISTOGRAM)
+        (*ranking)->histogram = histogram_create();
+    else
+        wre_create(&(*ranking)->entries, is_hotter_agg_hot);
     // placement new for mutex
     // mutex is already inside a structure, so alignment should be ok
     (void)new ((void *)(&(*ranking)->mutex)) std::mutex();
@@ -280,12 +689,19 @@ void ranking_create_internal(ranking_t **ranking, double old_weight)
 //     thresh_t init_thresh;
 //     init_thresh.threshVal = 0.;
 //     init_thresh.threshValid = false;
-    (*ranking)->hotThreshold = { 0., false };
     (*ranking)->oldWeight = old_weight;
     (*ranking)->newWeight = 1 - old_weight;
-    ranking_controller_init_ranking_controller(
-        &(*ranking)->controller, 0.5 /* unknown at this point */,
-        CONTROLLER_PROPORTIONAL_GAIN, CONTROLLER_INTEGRAL_GAIN);
+    for (size_t i = 0; i < HOTNESS_MAX_THRESHOLDS; ++i) {
+        (*ranking)->thresholds[i] = { 0., false };
+        ranking_controller_init_ranking_controller(
+            &(*ranking)->controllers[i], 0.5 /* unknown at this point */,
+            CONTROLLER_PROPORTIONAL_GAIN, CONTROLLER_INTEGRAL_GAIN);
+        ranking_controller_set_limits(&(*ranking)->controllers[i],
+                                      CONTROLLER_MAX_STEP,
+                                      CONTROLLER_TRACKING_LIMIT,
+                                      CONTROLLER_TRACKING_WINDOW,
+                                      DEFAULT_HOTNESS_CONTROLLER_FEED_FORWARD);
+    }
     assert(ret == 0 && "slab allocator initialization failed!");
 }
 
@@ -294,18 +710,20 @@ void ranking_destroy_internal(ranking_t *ranking)
     // explicit destructor call for mutex
     // which was created with placement new
     ranking->mutex.~mutex();
+    if (ranking->entries)
+        wre_destroy(ranking->entries);
+    jemk_free(ranking->histogram);
     slab_alloc_destroy(&ranking->aggHotAlloc);
     jemk_free(ranking);
 }
 
 static thresh_t ranking_get_hot_threshold_internal(ranking_t *ranking)
 {
-    return ranking->hotThreshold;
+    return ranking->thresholds[0];
 }
 
-thresh_t
-ranking_calculate_hot_threshold_dram_total_internal(
-    ranking_t *ranking, double dram_total_ratio, double dram_total_used_ratio)
+static thresh_t ranking_find_threshold_wre(ranking_t *ranking,
+                                           double dram_total_ratio)
 {
 #if CHECK_ADDED_SIZE
     // only for asserts
@@ -314,25 +732,6 @@ ranking_calculate_hot_threshold_dram_total_internal(
     wre_clone(&temp_cpy, ranking->entries);
 #endif
 
-#if RANKING_CONTROLLER_ENABLED
-    // TODO add tests for this one?
-    ranking_controller_set_expected_dram_total(&ranking->controller,
-                                               dram_total_ratio);
-    double fixed_dram_total_ratio =
-        ranking_controller_calculate_fixed_thresh(&ranking->controller,
-                                                  dram_total_used_ratio);
-#if PRINT_ADJUSTED_RATIO_INFO
-    uint32_t counter=0;
-    if (++counter > PRINT_RATIO_ADJUSTED_INTERVAL) {
-        log_info("controller: ratio adjusted [%f to %f]",
-            dram_total_ratio, fixed_dram_total_ratio);
-        counter = 0;
-    }
-#endif
-    dram_total_ratio = fixed_dram_total_ratio;
-
-#endif
-
     bool result_valid = false;
 #if INTERPOLATED_THRESH
     wre_interpolated_result_t ret = wre_find_weighted_interpolated(
@@ -368,13 +767,6 @@ ranking_calculate_hot_threshold_dram_total_internal(
             ranking_dequantify_hotness(agg_hot->quantifiedHotness);
         thresh.threshValid = true;
     }
-    // set thresh even if invalid - static ratio fallback should happen
-    // in this situation
-    ranking->hotThreshold = thresh;
-
-    // TODO remove this!!!
-    //     printf("wre: threshold_dram_total_internal\n");
-    // EOF TODO
 #if CHECK_ADDED_SIZE
     // only for asserts
     size_t after_size = wre_calculate_total_size(ranking->entries);
@@ -382,9 +774,79 @@ ranking_calculate_hot_threshold_dram_total_internal(
     wre_destroy(temp_cpy);
 #endif
 
+    return thresh;
+}
+
+/// calculate threshold between tiers @p boundary and @p boundary + 1;
+/// @p dram_total_ratio and @p dram_total_used_ratio are cumulative ratios
+/// of all tiers up to (and including) @p boundary
+static thresh_t
+ranking_calculate_threshold_internal(ranking_t *ranking, size_t boundary,
+                                     double dram_total_ratio,
+                                     double dram_total_used_ratio)
+{
+#if RANKING_CONTROLLER_ENABLED
+    ranking_controller *controller = &ranking->controllers[boundary];
+    ranking_controller_set_expected_dram_total(controller, dram_total_ratio);
+    // feed-forward needs the ratio selected by the threshold in force;
+    // wre backend cannot tell it cheaply - the threshold was found for
+    // the last controller output
+    double fixed_dram_total_ratio =
+        ranking->backend == RANKING_BACKEND_HISTOGRAM
+        ? ranking_controller_calculate_fixed_thresh_ff(
+              controller, dram_total_used_ratio,
+              histogram_hot_ratio(ranking->histogram,
+                                  ranking->thresholds[boundary]))
+        : ranking_controller_calculate_fixed_thresh(controller,
+                                                    dram_total_used_ratio);
+#if PRINT_ADJUSTED_RATIO_INFO
+    uint32_t counter=0;
+    if (++counter > PRINT_RATIO_ADJUSTED_INTERVAL) {
+        log_info("controller: ratio adjusted [%f to %f]",
+            dram_total_ratio, fixed_dram_total_ratio);
+        counter = 0;
+    }
+#endif
+    dram_total_ratio = fixed_dram_total_ratio;
+
+#endif
+
+    if (ranking->backend == RANKING_BACKEND_HISTOGRAM)
+        return histogram_find_threshold(ranking->histogram, dram_total_ratio);
+    return ranking_find_threshold_wre(ranking, dram_total_ratio);
+}
+
+static thresh_t
+ranking_calculate_hot_threshold_dram_total_internal(
+    ranking_t *ranking, double dram_total_ratio, double dram_total_used_ratio)
+{
+    // set thresh even if invalid - static ratio fallback should happen
+    // in this situation
+    ranking->thresholds[0] = ranking_calculate_threshold_internal(
+        ranking, 0, dram_total_ratio, dram_total_used_ratio);
+
     return ranking_get_hot_threshold_internal(ranking);
 }
 
+static void ranking_calculate_thresholds_total_internal(
+    ranking_t *ranking, size_t thresh_count, const double *tier_total_ratios,
+    const double *tier_total_used_ratios, thresh_t *thresh)
+{
+    assert(thresh_count <= HOTNESS_MAX_THRESHOLDS);
+    for (size_t i = 0; i < thresh_count; ++i) {
+        thresh[i] = ranking_calculate_threshold_internal(
+            ranking, i, tier_total_ratios[i], tier_total_used_ratios[i]);
+        // controllers work independently and might cross the thresholds;
+        // tier i+1 cannot be hotter than tier i
+        if (i > 0 && thresh[i].threshValid && thresh[i-1].threshValid &&
+            thresh[i].threshVal > thresh[i-1].threshVal)
+            thresh[i].threshVal = thresh[i-1].threshVal;
+        // set thresh even if invalid - static ratio fallback should happen
+        // in this situation
+        ranking->thresholds[i] = thresh[i];
+    }
+}
+
 static thresh_t
 ranking_calculate_hot_threshold_dram_pmem_internal(
     ranking_t *ranking, double dram_pmem_ratio, double dram_pmem_used_ratio)
@@ -421,6 +883,10 @@ ranking_calculate_hot_threshold_dram_pmem_internal(
 
 void ranking_add_internal(ranking_t *ranking, double hotness, size_t size)
 {
+    if (ranking->backend == RANKING_BACKEND_HISTOGRAM) {
+        histogram_add(ranking->histogram, hotness, size);
+        return;
+    }
     AggregatedHotness temp;
     // only hotness matters for lookup // TODO: rrudnick ????
     temp.quantifiedHotness = ranking_quantify_hotness(hotness);
@@ -547,6 +1013,18 @@ void ranking_remove_internal(ranking_t *ranking, double hotness, size_t size)
         return;
     }
 
+    if (ranking->backend == RANKING_BACKEND_HISTOGRAM) {
+        size_t removed = histogram_remove(ranking->histogram, hotness, size);
+        // nothing removed is the equivalent of node not found in wre
+        if (removed && removed < size) {
+            log_fatal("ranking_remove_internal: tried to remove more than added (%lu vs %lu)!", size, removed);
+#if CRASH_ON_BLOCK_NOT_FOUND
+            assert(false && "attempt to remove non-existent data!");
+#endif
+        }
+        return;
+    }
+
     AggregatedHotness temp;
     // only hotness matters for lookup
     temp.quantifiedHotness = ranking_quantify_hotness(hotness);
@@ -615,6 +1093,12 @@ void ranking_remove_internal(ranking_t *ranking, double hotness, size_t size)
 static void ranking_touch_internal(ranking_t *ranking, struct ttype *entry,
                                    uint64_t timestamp, double add_hotness)
 {
+    if (ranking->backend == RANKING_BACKEND_HISTOGRAM) {
+        double old_f = entry->f;
+        ranking_touch_entry_internal(ranking, entry, timestamp, add_hotness);
+        histogram_move(ranking->histogram, old_f, entry->f, entry->total_size);
+        return;
+    }
 #if CHECK_ADDED_SIZE
     // only for asserts
     size_t temp0_size = wre_calculate_total_size(ranking->entries);
@@ -642,11 +1126,82 @@ static void ranking_touch_internal(ranking_t *ranking, struct ttype *entry,
 #endif
 }
 
+// applies samples [begin, end) of a single entry
+static void ranking_touch_entry_batch_internal(
+    ranking_t *ranking, struct ttype *entry,
+    const ranking_touch_sample_t *begin, const ranking_touch_sample_t *end)
+{
+#if HOTNESS_POLICY == HOTNESS_POLICY_EXPONENTIAL_COEFFS
+    // seconds_diff and add_hotness are passed to the kernel in chunks
+    const size_t CHUNK = 64;
+    double seconds_diffs[CHUNK];
+    double add_hotness[CHUNK];
+    while (begin != end) {
+        size_t count = std::min(CHUNK, size_t(end - begin));
+        for (size_t i = 0; i < count; ++i, ++begin) {
+            if (entry->touchCb)
+                entry->touchCb(entry->touchCbArg);
+            assert(begin->add_hotness >= 0);
+            seconds_diffs[i] = (begin->timestamp - entry->t0) / 1000000000.0;
+            add_hotness[i] = begin->add_hotness;
+            entry->t0 = begin->timestamp;
+        }
+        entry->f = ranking_update_coeffs_batch(
+            entry->hotness_history_coeffs, seconds_diffs, add_hotness, count);
+    }
+#else
+    for (; begin != end; ++begin)
+        ranking_touch_entry_internal(ranking, entry, begin->timestamp,
+                                     begin->add_hotness);
+#endif
+}
+
+static void
+ranking_touch_batch_internal(ranking_t *ranking,
+                             const ranking_touch_sample_t *samples,
+                             size_t count)
+{
+    assert(std::is_sorted(samples, samples + count,
+                          [](const ranking_touch_sample_t &a,
+                             const ranking_touch_sample_t &b) {
+                              return a.entry != b.entry
+                                  ? a.entry < b.entry
+                                  : a.timestamp < b.timestamp;
+                          }) &&
+           "samples are not sorted!");
+    size_t i = 0;
+    while (i < count) {
+        struct ttype *entry = samples[i].entry;
+        size_t j = i + 1;
+        while (j < count && samples[j].entry == entry)
+            ++j;
+        if (ranking->backend == RANKING_BACKEND_HISTOGRAM) {
+            double old_f = entry->f;
+            ranking_touch_entry_batch_internal(ranking, entry, samples + i,
+                                               samples + j);
+            histogram_move(ranking->histogram, old_f, entry->f,
+                           entry->total_size);
+        } else {
+            size_t removed = ranking_remove_internal_relaxed(ranking, entry);
+            ranking_touch_entry_batch_internal(ranking, entry, samples + i,
+                                               samples + j);
+            ranking_add_internal(ranking, entry->f, removed);
+        }
+        i = j;
+    }
+}
+
 //--------public function implementation---------
 
 MEMKIND_EXPORT void ranking_create(ranking_t **ranking, double old_weight)
 {
-    ranking_create_internal(ranking, old_weight);
+    ranking_create_internal(ranking, old_weight, RANKING_BACKEND);
+}
+
+MEMKIND_EXPORT void ranking_create_backend(ranking_t **ranking,
+                                           double old_weight, int backend)
+{
+    ranking_create_internal(ranking, old_weight, backend);
 }
 
 MEMKIND_EXPORT void ranking_destroy(ranking_t *ranking)
@@ -672,6 +1227,67 @@ ranking_calculate_hot_threshold_dram_total(ranking_t *ranking,
         ranking, dram_total_ratio, dram_total_used_ratio);
 }
 
+MEMKIND_EXPORT void ranking_calculate_thresholds_total(
+    ranking_t *ranking, size_t thresh_count, const double *tier_total_ratios,
+    const double *tier_total_used_ratios, thresh_t *thresh)
+{
+    RANKING_LOCK_GUARD(ranking);
+    ranking_calculate_thresholds_total_internal(
+        ranking, thresh_count, tier_total_ratios, tier_total_used_ratios,
+        thresh);
+}
+
+MEMKIND_EXPORT void ranking_get_thresholds(ranking_t *ranking,
+                                           thresh_t *thresh,
+                                           size_t thresh_count)
+{
+    // no need for lock
+    assert(thresh_count <= HOTNESS_MAX_THRESHOLDS);
+    for (size_t i = 0; i < thresh_count; ++i)
+        thresh[i] = ranking->thresholds[i];
+}
+
+MEMKIND_EXPORT void ranking_set_thresholds(ranking_t *ranking,
+                                           const thresh_t *thresh,
+                                           size_t thresh_count)
+{
+    RANKING_LOCK_GUARD(ranking);
+    assert(thresh_count <= HOTNESS_MAX_THRESHOLDS);
+    for (size_t i = 0; i < thresh_count; ++i)
+        ranking->thresholds[i] = thresh[i];
+}
+
+MEMKIND_EXPORT void ranking_set_controller_params(ranking_t *ranking,
+                                                  double freq_hz,
+                                                  double feed_forward)
+{
+    RANKING_LOCK_GUARD(ranking);
+    assert(freq_hz > 0);
+    // integral gain and rate limit are per calculation: scheduled so that
+    // response in seconds does not depend on calculation frequency
+    for (size_t i = 0; i < HOTNESS_MAX_THRESHOLDS; ++i) {
+        ranking_controller *controller = &ranking->controllers[i];
+        ranking_controller_set_gains(
+            controller, CONTROLLER_PROPORTIONAL_GAIN,
+            CONTROLLER_INTEGRAL_GAIN_PER_SECOND / freq_hz);
+        ranking_controller_set_limits(
+            controller, CONTROLLER_MAX_RATE_PER_SECOND / freq_hz,
+            CONTROLLER_TRACKING_LIMIT,
+            CONTROLLER_TRACKING_WINDOW_SECONDS * freq_hz, feed_forward);
+    }
+}
+
+MEMKIND_EXPORT void ranking_get_controllers(ranking_t *ranking,
+                                            ranking_controller *controllers,
+                                            size_t count)
+{
+    // no need for lock - controllers are updated by the thread that
+    // calculates thresholds only
+    assert(count <= HOTNESS_MAX_THRESHOLDS);
+    for (size_t i = 0; i < count; ++i)
+        controllers[i] = ranking->controllers[i];
+}
+
 MEMKIND_EXPORT thresh_t
 ranking_calculate_hot_threshold_dram_pmem(ranking_t *ranking,
                                           double dram_pmem_ratio,
@@ -728,6 +1344,14 @@ MEMKIND_EXPORT void ranking_touch(ranking_t *ranking, struct ttype *entry,
     ranking_touch_internal(ranking, entry, timestamp, add_hotness);
 }
 
+MEMKIND_EXPORT void
+ranking_touch_batch(ranking_t *ranking, const ranking_touch_sample_t *samples,
+                    size_t count)
+{
+    RANKING_LOCK_GUARD(ranking);
+    ranking_touch_batch_internal(ranking, samples, count);
+}
+
 MEMKIND_EXPORT void ranking_set_touch_callback(ranking_t *ranking,
                                                tachanka_touch_callback cb,
                                                void *arg, struct ttype *type)
@@ -738,8 +1362,10 @@ MEMKIND_EXPORT void ranking_set_touch_callback(ranking_t *ranking,
     type->touchCbArg = arg;
 }
 
-size_t ranking_calculate_total_size(ranking_t *ranking)
+MEMKIND_EXPORT size_t ranking_calculate_total_size(ranking_t *ranking)
 {
+    if (ranking->backend == RANKING_BACKEND_HISTOGRAM)
+        return ranking->histogram->total;
     return wre_calculate_total_size(ranking->entries);
 }
 
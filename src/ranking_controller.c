@@ -1,6 +1,8 @@
 #include "memkind/internal/ranking_controller.h"
 #include "memkind/internal/memkind_memtier.h"
 
+#include <math.h>
+
 #ifndef MEMKIND_EXPORT
 #define MEMKIND_EXPORT __attribute__((visibility("default")))
 #endif
@@ -9,9 +11,21 @@
 MEMKIND_EXPORT void ranking_controller_init_ranking_controller(
     ranking_controller *controller, double expected_dram_total,
     double proportional_term, double integral_term) {
+    controller->error = 0;
     controller->integrated_error = 0;
     controller->proportional = proportional_term;
     controller->integral = integral_term;
+    controller->output = NAN;
+    controller->correction = 0;
+    controller->maxStep = 0;
+    controller->trackingLimit = 0;
+    controller->trackingWindow = 0;
+    controller->feedForward = 0;
+    controller->lagCalculations = 0;
+    controller->probeFound = 0;
+    controller->probeRanked = 0;
+    controller->probeIntegratedError = 0;
+    controller->placementStuck = false;
     ranking_controller_set_expected_dram_total(
         controller, expected_dram_total);
 }
@@ -23,9 +37,99 @@ ranking_controller_set_expected_dram_total(ranking_controller *controller,
     controller->coldTierSize = 1-expected_dram_total;
 }
 
+MEMKIND_EXPORT void
+ranking_controller_set_gains(ranking_controller *controller,
+                             double proportional_term, double integral_term) {
+    // keep integral*integrated_error, output does not jump
+    if (integral_term != 0)
+        controller->integrated_error *= controller->integral / integral_term;
+    else
+        controller->integrated_error = 0;
+    controller->proportional = proportional_term;
+    controller->integral = integral_term;
+}
+
+MEMKIND_EXPORT void
+ranking_controller_set_limits(ranking_controller *controller,
+                              double max_step, double tracking_limit,
+                              double tracking_window, double feed_forward) {
+    controller->maxStep = max_step;
+    controller->trackingLimit = tracking_limit;
+    controller->trackingWindow = tracking_window;
+    controller->feedForward = feed_forward;
+}
+
+/// @return true if placement follows the threshold, i.e. error can be
+/// integrated; might restore integrated_error from before the window
+static bool controller_tracking(ranking_controller *controller,
+                                double found_dram_total,
+                                double ranked_dram_total) {
+    double placement_error = found_dram_total - ranked_dram_total;
+    if (controller->trackingLimit <= 0 ||
+        fabs(placement_error) <= controller->trackingLimit) {
+        controller->lagCalculations = 0;
+        controller->placementStuck = false;
+        return true;
+    }
+    if (controller->placementStuck)
+        return false;
+    // data being moved - placement catches up within the window
+    if (controller->lagCalculations < controller->trackingWindow) {
+        if (++controller->lagCalculations >= controller->trackingWindow) {
+            controller->probeFound = found_dram_total;
+            controller->probeRanked = ranked_dram_total;
+            controller->probeIntegratedError = controller->integrated_error;
+        }
+        return false;
+    }
+    // difference is steady - it is integrated, as long as used ratio
+    // follows the changes of ranked one; otherwise (hot tier exhausted)
+    // integral is restored, it would only overshoot the ratio once
+    // placement recovers
+    double ranked_change = ranked_dram_total - controller->probeRanked;
+    double found_change = found_dram_total - controller->probeFound;
+    if (fabs(ranked_change) > controller->trackingLimit &&
+        (ranked_change > 0 ? found_change : -found_change) <
+            fabs(ranked_change) / 2) {
+        controller->placementStuck = true;
+        controller->integrated_error = controller->probeIntegratedError;
+        return false;
+    }
+    return true;
+}
+
+/// restrict @p out to closed range <0,1> and its correction of
+/// @p expected to maxStep from the last one
+static double controller_limit(const ranking_controller *controller,
+                               double expected, double out) {
+    if (controller->maxStep > 0 && !isnan(controller->output)) {
+        double correction = out - expected;
+        if (correction > controller->correction + controller->maxStep)
+            out = expected + controller->correction + controller->maxStep;
+        else if (correction < controller->correction - controller->maxStep)
+            out = expected + controller->correction - controller->maxStep;
+    }
+    if (out > 1.0)
+        out = 1.0;
+    else if (out < 0)
+        out = 0.0;
+    return out;
+}
+
 MEMKIND_EXPORT double
 ranking_controller_calculate_fixed_thresh(ranking_controller *controller,
                                           double found_dram_total) {
+    // threshold in force was calculated for the last output
+    double ranked_dram_total = isnan(controller->output)
+        ? found_dram_total : controller->output;
+    return ranking_controller_calculate_fixed_thresh_ff(
+        controller, found_dram_total, ranked_dram_total);
+}
+
+MEMKIND_EXPORT double
+ranking_controller_calculate_fixed_thresh_ff(ranking_controller *controller,
+                                             double found_dram_total,
+                                             double ranked_dram_total) {
 #if CONTROLLER_TRANSFORM_ENABLED
     // case: found thresh too low
     // |---a----------|--------b--------------|
@@ -53,9 +157,11 @@ ranking_controller_calculate_fixed_thresh(ranking_controller *controller,
     // double d = 1-found_ratio; // unused
     double t=a-c;
 
-    if (a == c && a == 0)
+    if (a == c && a == 0) {
         // corner case - the formula below gives 0/0 (indeterminate form)
-        return found_dram_total; // no need to fix ratio
+        controller->correction = 0;
+        return controller->output = found_dram_total; // no need to fix ratio
+    }
     double e = (t>=0 ? b/a : a/b)*t;
 #else
     double a=controller->coldTierSize;
@@ -63,19 +169,51 @@ ranking_controller_calculate_fixed_thresh(ranking_controller *controller,
     double e=a-c;
 #endif
     // euler forward integration with timestep = 1
-    controller->integrated_error += e;  // it's really this simple
+    controller->error = e;
+    // placement does not follow the threshold (e.g. hot tier is exhausted,
+    // data is being moved) - changing threshold cannot fix that part of
+    // the error; anti-windup: it is not integrated, as its integral would
+    // only overshoot the ratio once placement recovers
+    double placement_error = found_dram_total - ranked_dram_total;
+    bool tracking = controller_tracking(controller, found_dram_total,
+                                        ranked_dram_total);
+    double integrated_error = controller->integrated_error;
+    if (tracking)
+        integrated_error += e;
+    // integral term alone never needs more than the whole range
+    if (controller->integral > 0) {
+        double limit = 1.0 / controller->integral;
+        if (integrated_error > limit)
+            integrated_error = limit;
+        else if (integrated_error < -limit)
+            integrated_error = -limit;
+    }
+    // steady difference (e.g. memory unknown to ranking) is compensated
+    // directly
+    double feed_forward =
+        tracking ? controller->feedForward * placement_error : 0;
 
     double steering_signal =
         e*controller->proportional
-        + controller->integrated_error * controller->integral;
+        + integrated_error * controller->integral;
     double new_inv_thresh = a+ steering_signal;
-    
-    double out = 1.0 - new_inv_thresh;
-    // restrict to values in a closed range <0,1>
-    if (out > 1.0)
-        out = 1.0;
-    else if (out < 0)
-        out = 0.0;
+
+    double raw = 1.0 - new_inv_thresh - feed_forward;
+    double out = controller_limit(controller, 1.0 - a, raw);
+    // anti-windup: when output is limited, error is not integrated if
+    // integration would push it further into the limit (conditional
+    // integration) - otherwise integral grows for the whole time output
+    // is saturated
+    if ((raw > out && e < 0) || (raw < out && e > 0)) {
+        integrated_error = controller->integrated_error;
+        raw = 1.0 - a - feed_forward -
+            (e * controller->proportional +
+             integrated_error * controller->integral);
+        out = controller_limit(controller, 1.0 - a, raw);
+    }
+    controller->integrated_error = integrated_error;
+    controller->output = out;
+    controller->correction = out - (1.0 - a);
 
     return out;
 }
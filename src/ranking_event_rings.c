@@ -0,0 +1,349 @@
+#include "memkind/internal/ranking_event_rings.h"
+#include "memkind/internal/memkind_log.h"
+
+#include "jemalloc/jemalloc.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+#include "threads.h"
+
+#ifndef MEMKIND_EXPORT
+#define MEMKIND_EXPORT __attribute__((visibility("default")))
+#endif
+
+#define EVENT_RING_CACHE_LINE 64
+
+// counters below are written by a single thread only - relaxed load + store
+// is enough and avoids locked instructions on the hot path
+#define COUNTER_INC(counter)                                                   \
+    atomic_store_explicit(                                                     \
+        &(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + 1,\
+        memory_order_relaxed)
+#define COUNTER_GET(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+typedef struct event_ring {
+    // --- consumer cache line
+    _Alignas(EVENT_RING_CACHE_LINE) atomic_size_t head;
+    atomic_size_t popped;
+    // --- producer cache line
+    _Alignas(EVENT_RING_CACHE_LINE) atomic_size_t tail;
+    size_t cachedHead; // last value of head seen by producer
+    atomic_size_t pushed;
+    atomic_size_t overflowed;
+    atomic_size_t dropped;
+    // --- read-mostly
+    _Alignas(EVENT_RING_CACHE_LINE) EventEntry_t *entries;
+    size_t mask;
+    atomic_bool abandoned; // owner thread exited
+    struct event_ring *next;
+} event_ring_t;
+
+typedef struct overflow_node {
+    EventEntry_t event;
+    struct overflow_node *next;
+} overflow_node_t;
+
+// registry of rings; producers only push at head, consumer unlinks
+static _Atomic(event_ring_t *) g_rings = NULL;
+static atomic_size_t g_ringsCount = 0;
+static atomic_size_t g_abandonedCount = 0;
+// LIFO list of overflowed events; consumer takes it as a whole
+static _Atomic(overflow_node_t *) g_overflow = NULL;
+static atomic_size_t g_overflowDropped = 0;
+static atomic_uint g_generation = 0;
+static size_t g_ringEntries = 0;
+static pthread_key_t g_ringKey;
+static pthread_once_t g_ringKeyOnce = PTHREAD_ONCE_INIT;
+
+// statistics of already freed rings
+static atomic_size_t g_retiredPushed = 0;
+static atomic_size_t g_retiredOverflowed = 0;
+static atomic_size_t g_retiredDropped = 0;
+static atomic_size_t g_retiredPopped = 0;
+static atomic_size_t g_overflowPopped = 0;
+
+// consumer state
+static event_ring_t *g_cursor = NULL;
+static overflow_node_t *g_overflowFifo = NULL;
+
+static thread_local event_ring_t *t_ring = NULL;
+static thread_local unsigned t_ringGeneration = 0;
+
+static void ring_abandon(void *arg)
+{
+    event_ring_t *ring = arg;
+    // ring was already freed by ranking_event_rings_fini
+    if (t_ringGeneration != atomic_load(&g_generation))
+        return;
+    atomic_store_explicit(&ring->abandoned, true, memory_order_release);
+    atomic_fetch_add(&g_abandonedCount, 1);
+    t_ring = NULL;
+}
+
+static void ring_key_create(void)
+{
+    if (pthread_key_create(&g_ringKey, ring_abandon)) {
+        log_fatal("event rings: pthread_key_create() failed");
+        exit(-1);
+    }
+}
+
+static event_ring_t *ring_create(void)
+{
+    event_ring_t *ring = NULL;
+    if (jemk_posix_memalign((void **)&ring, EVENT_RING_CACHE_LINE,
+                            sizeof(*ring)))
+        return NULL;
+    memset(ring, 0, sizeof(*ring));
+    ring->entries = jemk_malloc(g_ringEntries * sizeof(EventEntry_t));
+    if (!ring->entries) {
+        jemk_free(ring);
+        return NULL;
+    }
+    ring->mask = g_ringEntries - 1;
+
+    event_ring_t *head = atomic_load(&g_rings);
+    do {
+        ring->next = head;
+    } while (!atomic_compare_exchange_weak(&g_rings, &head, ring));
+    atomic_fetch_add(&g_ringsCount, 1);
+    return ring;
+}
+
+static void ring_free(event_ring_t *ring)
+{
+    atomic_fetch_add(&g_retiredPushed, COUNTER_GET(ring->pushed));
+    atomic_fetch_add(&g_retiredOverflowed, COUNTER_GET(ring->overflowed));
+    atomic_fetch_add(&g_retiredDropped, COUNTER_GET(ring->dropped));
+    atomic_fetch_add(&g_retiredPopped, COUNTER_GET(ring->popped));
+    jemk_free(ring->entries);
+    jemk_free(ring);
+}
+
+static event_ring_t *get_thread_ring(void)
+{
+    unsigned generation = atomic_load_explicit(&g_generation,
+                                               memory_order_relaxed);
+    if (t_ring && t_ringGeneration == generation)
+        return t_ring;
+    t_ring = ring_create();
+    t_ringGeneration = generation;
+    if (t_ring) {
+        (void)pthread_once(&g_ringKeyOnce, ring_key_create);
+        (void)pthread_setspecific(g_ringKey, t_ring);
+    }
+    return t_ring;
+}
+
+static bool ring_push(event_ring_t *ring, const EventEntry_t *event)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - ring->cachedHead > ring->mask) {
+        ring->cachedHead =
+            atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - ring->cachedHead > ring->mask)
+            return false;
+    }
+    ring->entries[tail & ring->mask] = *event;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static size_t ring_pop_batch(event_ring_t *ring, EventEntry_t *events,
+                             size_t max)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t count = tail - head;
+    if (count > max)
+        count = max;
+    for (size_t i = 0; i < count; ++i)
+        events[i] = ring->entries[(head + i) & ring->mask];
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    atomic_store_explicit(&ring->popped, COUNTER_GET(ring->popped) + count,
+                          memory_order_relaxed);
+    return count;
+}
+
+static bool overflow_push(const EventEntry_t *event)
+{
+    overflow_node_t *node = jemk_malloc(sizeof(*node));
+    if (!node)
+        return false;
+    node->event = *event;
+    overflow_node_t *head = atomic_load(&g_overflow);
+    do {
+        node->next = head;
+    } while (!atomic_compare_exchange_weak(&g_overflow, &head, node));
+    return true;
+}
+
+static size_t overflow_pop_batch(EventEntry_t *events, size_t max)
+{
+    if (!g_overflowFifo) {
+        overflow_node_t *lifo = atomic_exchange(&g_overflow, NULL);
+        // reverse - keep push order
+        while (lifo) {
+            overflow_node_t *next = lifo->next;
+            lifo->next = g_overflowFifo;
+            g_overflowFifo = lifo;
+            lifo = next;
+        }
+    }
+    size_t count = 0;
+    while (g_overflowFifo && count < max) {
+        overflow_node_t *node = g_overflowFifo;
+        events[count++] = node->event;
+        g_overflowFifo = node->next;
+        jemk_free(node);
+    }
+    atomic_fetch_add_explicit(&g_overflowPopped, count, memory_order_relaxed);
+    return count;
+}
+
+/// unlink and free empty rings of exited threads
+static void reclaim_abandoned_rings(void)
+{
+    event_ring_t *prev = NULL;
+    event_ring_t *ring = atomic_load(&g_rings);
+    while (ring) {
+        event_ring_t *next = ring->next;
+        bool empty =
+            atomic_load_explicit(&ring->abandoned, memory_order_acquire) &&
+            atomic_load_explicit(&ring->tail, memory_order_acquire) ==
+                atomic_load_explicit(&ring->head, memory_order_relaxed);
+        bool unlinked = false;
+        if (empty) {
+            if (prev) {
+                prev->next = next;
+                unlinked = true;
+            } else {
+                // producers might have pushed a new ring in the meantime
+                event_ring_t *expected = ring;
+                unlinked =
+                    atomic_compare_exchange_strong(&g_rings, &expected, next);
+            }
+        }
+        if (unlinked) {
+            if (g_cursor == ring)
+                g_cursor = next;
+            ring_free(ring);
+            atomic_fetch_sub(&g_ringsCount, 1);
+            atomic_fetch_sub(&g_abandonedCount, 1);
+        } else {
+            prev = ring;
+        }
+        ring = next;
+    }
+}
+
+static void free_all(void)
+{
+    event_ring_t *ring = atomic_exchange(&g_rings, NULL);
+    while (ring) {
+        event_ring_t *next = ring->next;
+        ring_free(ring);
+        ring = next;
+    }
+    overflow_node_t *node = atomic_exchange(&g_overflow, NULL);
+    while (node) {
+        overflow_node_t *next = node->next;
+        jemk_free(node);
+        node = next;
+    }
+    while (g_overflowFifo) {
+        overflow_node_t *next = g_overflowFifo->next;
+        jemk_free(g_overflowFifo);
+        g_overflowFifo = next;
+    }
+    g_cursor = NULL;
+    atomic_store(&g_ringsCount, 0);
+    atomic_store(&g_abandonedCount, 0);
+}
+
+MEMKIND_EXPORT void ranking_event_rings_init(size_t ring_entries)
+{
+    free_all();
+    atomic_store(&g_retiredPushed, 0);
+    atomic_store(&g_retiredOverflowed, 0);
+    atomic_store(&g_retiredDropped, 0);
+    atomic_store(&g_retiredPopped, 0);
+    atomic_store(&g_overflowDropped, 0);
+    atomic_store(&g_overflowPopped, 0);
+    size_t entries = 1;
+    while (entries < ring_entries)
+        entries <<= 1;
+    g_ringEntries = entries;
+    // invalidate thread-local rings of previous initialization
+    atomic_fetch_add(&g_generation, 1);
+}
+
+MEMKIND_EXPORT void ranking_event_rings_fini(void)
+{
+    atomic_fetch_add(&g_generation, 1);
+    free_all();
+}
+
+MEMKIND_EXPORT bool ranking_event_rings_push(const EventEntry_t *event,
+                                             bool must_deliver)
+{
+    event_ring_t *ring = get_thread_ring();
+    if (ring && ring_push(ring, event)) {
+        COUNTER_INC(ring->pushed);
+        return true;
+    }
+    if (must_deliver && overflow_push(event)) {
+        if (ring)
+            COUNTER_INC(ring->overflowed);
+        else
+            atomic_fetch_add(&g_retiredOverflowed, 1);
+        return true;
+    }
+    if (ring)
+        COUNTER_INC(ring->dropped);
+    else
+        atomic_fetch_add(&g_overflowDropped, 1);
+    return false;
+}
+
+MEMKIND_EXPORT size_t ranking_event_rings_pop_batch(EventEntry_t *events,
+                                                    size_t max)
+{
+    if (atomic_load_explicit(&g_abandonedCount, memory_order_relaxed))
+        reclaim_abandoned_rings();
+
+    size_t count = overflow_pop_batch(events, max);
+
+    // round robin - continue from the ring visited last
+    size_t rings = atomic_load(&g_ringsCount);
+    event_ring_t *ring = g_cursor ? g_cursor : atomic_load(&g_rings);
+    for (size_t visited = 0; ring && count < max && visited < rings;
+         ++visited) {
+        count += ring_pop_batch(ring, events + count, max - count);
+        ring = ring->next ? ring->next : atomic_load(&g_rings);
+    }
+    g_cursor = ring;
+
+    return count;
+}
+
+MEMKIND_EXPORT void
+ranking_event_rings_get_stats(ranking_event_rings_stats_t *stats)
+{
+    stats->rings = atomic_load(&g_ringsCount);
+    stats->pushed = atomic_load(&g_retiredPushed);
+    stats->overflowed = atomic_load(&g_retiredOverflowed);
+    stats->dropped = atomic_load(&g_retiredDropped) +
+        atomic_load(&g_overflowDropped);
+    stats->popped = atomic_load(&g_retiredPopped) +
+        atomic_load(&g_overflowPopped);
+    // racy walk - rings are freed only by the consumer
+    for (event_ring_t *ring = atomic_load(&g_rings); ring; ring = ring->next) {
+        stats->pushed += COUNTER_GET(ring->pushed);
+        stats->overflowed += COUNTER_GET(ring->overflowed);
+        stats->dropped += COUNTER_GET(ring->dropped);
+        stats->popped += COUNTER_GET(ring->popped);
+    }
+}
@@ -0,0 +1,339 @@
+#include "memkind/internal/sample_source.h"
+#include "memkind/internal/memkind_log.h"
+#include "memkind/internal/memkind_memtier.h"
+#include "memkind/internal/sample_trace.h"
+#include "memkind/internal/tachanka.h"
+
+#include "jemalloc/jemalloc.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MEMKIND_EXPORT
+#define MEMKIND_EXPORT __attribute__((visibility("default")))
+#endif
+
+#define IDLE_PAGE_BITMAP     "/sys/kernel/mm/page_idle/bitmap"
+#define PAGEMAP_PRESENT      (1ull << 63)
+#define PAGEMAP_PFN_MASK     ((1ull << 55) - 1u)
+// ranges of tracked blocks taken from tachanka at once
+#define IDLE_PAGE_RANGES     256u
+// pagemap entries read with one syscall
+#define IDLE_PAGE_PAGEMAP    512u
+#define IDLE_PAGE_TOUCHES    1024u
+
+static const char *const SOURCE_NAMES[] = {
+    [SAMPLE_SOURCE_AUTO] = "auto",
+    [SAMPLE_SOURCE_PEBS] = "pebs",
+    [SAMPLE_SOURCE_IDLE_PAGE] = "idle_page",
+    [SAMPLE_SOURCE_SYNTHETIC] = "synthetic",
+    [SAMPLE_SOURCE_NONE] = "none",
+};
+
+MEMKIND_EXPORT int sample_source_parse(const char *name)
+{
+    for (int i = 0; i < (int)(sizeof(SOURCE_NAMES) / sizeof(SOURCE_NAMES[0]));
+         ++i)
+        if (!strcmp(name, SOURCE_NAMES[i]))
+            return i;
+    return -1;
+}
+
+static size_t deliver_touches(tachanka_touch_sample_t *samples, size_t count)
+{
+    if (!count)
+        return 0u;
+    // aggregation reorders touches - record them first
+    if (sample_trace_enabled())
+        sample_trace_write_touches(samples, count);
+    return tachanka_touch_batch(samples, count);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// --- idle page tracking ---
+//
+// Every scanned page that is present is marked idle in the bitmap; the
+// kernel clears the mark when the page is accessed. A page found not idle
+// on the next scan was accessed meanwhile (or is scanned for the first
+// time, which is the case of new allocations) and touches every tracked
+// block on it. Pages are scanned in address order of blocks, then of page
+// runs, continuing from the previous cycle, up to the budget per cycle.
+
+static int g_bitmapFd = -1;
+static int g_pagemapFd = -1;
+static size_t g_pageSize = 4096u;
+static size_t g_idlePageBudget = DEFAULT_HOTNESS_IDLE_PAGE_SCAN_BUDGET;
+static uintptr_t g_blockCursor = 0u;
+static uintptr_t g_runCursor = 0u;
+static bool g_scanRuns = false;
+// scan of a block that did not fit in the budget continues from here
+static uintptr_t g_resumeAddr = 0u;
+// result of the last scanned page, which might hold the next block too
+static uintptr_t g_lastPage = UINTPTR_MAX;
+static bool g_lastPageAccessed = false;
+static tachanka_range_t g_ranges[IDLE_PAGE_RANGES];
+static uint64_t g_pagemap[IDLE_PAGE_PAGEMAP];
+static tachanka_touch_sample_t g_idleTouches[IDLE_PAGE_TOUCHES];
+static size_t g_idleTouchesCount = 0u;
+static size_t g_idleTouched = 0u;
+
+MEMKIND_EXPORT void sample_source_idle_page_set_budget(size_t pages)
+{
+    g_idlePageBudget = pages;
+}
+
+static void idle_page_close(void)
+{
+    if (g_bitmapFd >= 0)
+        close(g_bitmapFd);
+    if (g_pagemapFd >= 0)
+        close(g_pagemapFd);
+    g_bitmapFd = -1;
+    g_pagemapFd = -1;
+}
+
+/// @return 1 if page @p pfn was accessed since it was marked idle, 0 if it
+/// was not, -1 on error; the page is marked idle again
+static int idle_page_test_and_mark(uint64_t pfn)
+{
+    off_t offset = (off_t)(pfn / 64u) * sizeof(uint64_t);
+    uint64_t bit = 1ull << (pfn % 64u);
+    uint64_t word;
+    if (pread(g_bitmapFd, &word, sizeof(word), offset) != sizeof(word))
+        return -1;
+    if (word & bit)
+        return 0;
+    // bits that are not set are ignored by the kernel
+    if (pwrite(g_bitmapFd, &bit, sizeof(bit), offset) != sizeof(bit))
+        return -1;
+    return 1;
+}
+
+static int idle_page_start(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/pagemap", (int)pid);
+    g_pagemapFd = open(path, O_RDONLY | O_CLOEXEC);
+    g_bitmapFd = open(IDLE_PAGE_BITMAP, O_RDWR | O_CLOEXEC);
+    if (g_pagemapFd < 0 || g_bitmapFd < 0) {
+        log_err("Idle page tracking: cannot open %s or %s", path,
+                IDLE_PAGE_BITMAP);
+        idle_page_close();
+        return -1;
+    }
+    g_pageSize = sysconf(_SC_PAGESIZE);
+    // page frame numbers are hidden without CAP_SYS_ADMIN - probe them
+    // with a page of this process
+    static volatile uint64_t probe;
+    probe = 1u;
+    uint64_t entry = 0u;
+    int self = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (self >= 0) {
+        off_t offset =
+            (off_t)((uintptr_t)&probe / g_pageSize) * sizeof(entry);
+        if (pread(self, &entry, sizeof(entry), offset) != sizeof(entry))
+            entry = 0u;
+        close(self);
+    }
+    if (!(entry & PAGEMAP_PRESENT) || !(entry & PAGEMAP_PFN_MASK) ||
+        idle_page_test_and_mark(entry & PAGEMAP_PFN_MASK) < 0) {
+        log_err("Idle page tracking: page frame numbers are not available");
+        idle_page_close();
+        return -1;
+    }
+    g_blockCursor = 0u;
+    g_runCursor = 0u;
+    g_scanRuns = false;
+    g_resumeAddr = 0u;
+    g_lastPage = UINTPTR_MAX;
+    g_idleTouchesCount = 0u;
+    return 0;
+}
+
+static void idle_page_stop(void)
+{
+    idle_page_close();
+}
+
+static void idle_page_touch(void *addr, uint64_t timestamp)
+{
+    tachanka_touch_sample_t *touch = &g_idleTouches[g_idleTouchesCount];
+    touch->addr = addr;
+    touch->timestamp = timestamp;
+    if (++g_idleTouchesCount == IDLE_PAGE_TOUCHES) {
+        g_idleTouched += deliver_touches(g_idleTouches, g_idleTouchesCount);
+        g_idleTouchesCount = 0u;
+    }
+}
+
+/// scan pages of @p range from @p from, up to @p budget pages
+/// @return address where the scan stopped, end of range if it is complete
+static uintptr_t idle_page_scan_range(const tachanka_range_t *range,
+                                      uintptr_t from, size_t *budget,
+                                      uint64_t timestamp)
+{
+    uintptr_t end = (uintptr_t)range->addr + range->size;
+    uintptr_t page = from & ~(uintptr_t)(g_pageSize - 1u);
+    while (page < end && *budget) {
+        size_t pages = (end - page + g_pageSize - 1u) / g_pageSize;
+        if (pages > IDLE_PAGE_PAGEMAP)
+            pages = IDLE_PAGE_PAGEMAP;
+        if (pages > *budget)
+            pages = *budget;
+        off_t offset = (off_t)(page / g_pageSize) * sizeof(uint64_t);
+        ssize_t ret =
+            pread(g_pagemapFd, g_pagemap, pages * sizeof(uint64_t), offset);
+        if (ret <= 0)
+            return end; // range is not mapped anymore
+        pages = ret / sizeof(uint64_t);
+        for (size_t i = 0; i < pages; ++i, page += g_pageSize) {
+            bool accessed;
+            if (page == g_lastPage) {
+                // shared with the previous block - already marked idle
+                accessed = g_lastPageAccessed;
+            } else {
+                uint64_t entry = g_pagemap[i];
+                accessed = (entry & PAGEMAP_PRESENT) &&
+                    idle_page_test_and_mark(entry & PAGEMAP_PFN_MASK) > 0;
+                g_lastPage = page;
+                g_lastPageAccessed = accessed;
+            }
+            if (accessed)
+                idle_page_touch(page < (uintptr_t)range->addr ? range->addr
+                                                              : (void *)page,
+                                timestamp);
+        }
+        *budget -= pages;
+    }
+    return page < end ? page : end;
+}
+
+static size_t idle_page_collect(void)
+{
+    size_t budget = g_idlePageBudget;
+    uint64_t timestamp = now_ns();
+    bool runs = tachanka_get_tracking_granularity() == HOTNESS_TRACKING_RUN;
+    g_idleTouched = 0u;
+    g_lastPage = UINTPTR_MAX;
+    while (budget) {
+        uintptr_t *cursor = g_scanRuns ? &g_runCursor : &g_blockCursor;
+        uintptr_t first = *cursor;
+        size_t count = tachanka_get_tracked_ranges(cursor, g_scanRuns,
+                                                   g_ranges, IDLE_PAGE_RANGES);
+        for (size_t i = 0; i < count; ++i) {
+            const tachanka_range_t *range = &g_ranges[i];
+            uintptr_t from = (uintptr_t)range->addr;
+            uintptr_t end = from + range->size;
+            if (from == first && g_resumeAddr > from)
+                from = g_resumeAddr;
+            g_resumeAddr = 0u;
+            uintptr_t stop =
+                idle_page_scan_range(range, from, &budget, timestamp);
+            if (stop < end) {
+                // budget is exhausted - the block is continued next cycle
+                *cursor = (uintptr_t)range->addr;
+                g_resumeAddr = stop;
+                break;
+            }
+        }
+        if (g_resumeAddr)
+            break;
+        if (!*cursor) {
+            // all blocks (and runs) were visited - the sweep is complete
+            bool next_runs = runs && !g_scanRuns;
+            g_scanRuns = next_runs;
+            if (!next_runs)
+                break;
+        }
+    }
+    g_idleTouched += deliver_touches(g_idleTouches, g_idleTouchesCount);
+    g_idleTouchesCount = 0u;
+    return g_idleTouched;
+}
+
+MEMKIND_EXPORT const sample_source_t sample_source_idle_page = {
+    "idle_page", idle_page_start, idle_page_stop, idle_page_collect};
+
+// --- synthetic ---
+
+static pthread_mutex_t g_syntheticMutex = PTHREAD_MUTEX_INITIALIZER;
+// touches pushed since the last collect and the ones being delivered
+static tachanka_touch_sample_t *g_syntheticQueue = NULL;
+static size_t g_syntheticCount = 0u;
+static size_t g_syntheticCapacity = 0u;
+static tachanka_touch_sample_t *g_syntheticBatch = NULL;
+static size_t g_syntheticBatchCapacity = 0u;
+
+MEMKIND_EXPORT void
+sample_source_synthetic_push(const tachanka_touch_sample_t *samples,
+                             size_t count)
+{
+    pthread_mutex_lock(&g_syntheticMutex);
+    if (g_syntheticCount + count > g_syntheticCapacity) {
+        size_t capacity = g_syntheticCapacity ? g_syntheticCapacity : 1024u;
+        while (capacity < g_syntheticCount + count)
+            capacity *= 2u;
+        tachanka_touch_sample_t *queue = jemk_realloc(
+            g_syntheticQueue, capacity * sizeof(tachanka_touch_sample_t));
+        if (!queue) {
+            pthread_mutex_unlock(&g_syntheticMutex);
+            log_err("Synthetic sample source: %zu touches dropped", count);
+            return;
+        }
+        g_syntheticQueue = queue;
+        g_syntheticCapacity = capacity;
+    }
+    memcpy(g_syntheticQueue + g_syntheticCount, samples,
+           count * sizeof(tachanka_touch_sample_t));
+    g_syntheticCount += count;
+    pthread_mutex_unlock(&g_syntheticMutex);
+}
+
+static int synthetic_start(pid_t pid)
+{
+    (void)pid;
+    return 0;
+}
+
+static void synthetic_stop(void)
+{
+    pthread_mutex_lock(&g_syntheticMutex);
+    jemk_free(g_syntheticQueue);
+    jemk_free(g_syntheticBatch);
+    g_syntheticQueue = NULL;
+    g_syntheticBatch = NULL;
+    g_syntheticCount = 0u;
+    g_syntheticCapacity = 0u;
+    g_syntheticBatchCapacity = 0u;
+    pthread_mutex_unlock(&g_syntheticMutex);
+}
+
+static size_t synthetic_collect(void)
+{
+    // buffers are swapped, so that pushes do not wait for tachanka
+    pthread_mutex_lock(&g_syntheticMutex);
+    tachanka_touch_sample_t *batch = g_syntheticQueue;
+    size_t count = g_syntheticCount;
+    size_t capacity = g_syntheticCapacity;
+    g_syntheticQueue = g_syntheticBatch;
+    g_syntheticCapacity = g_syntheticBatchCapacity;
+    g_syntheticCount = 0u;
+    g_syntheticBatch = batch;
+    g_syntheticBatchCapacity = capacity;
+    pthread_mutex_unlock(&g_syntheticMutex);
+    return deliver_touches(batch, count);
+}
+
+MEMKIND_EXPORT const sample_source_t sample_source_synthetic = {
+    "synthetic", synthetic_start, synthetic_stop, synthetic_collect};
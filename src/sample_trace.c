@@ -0,0 +1,400 @@
+#include <memkind/internal/sample_trace.h>
+#include <memkind/internal/tachanka.h>
+#include <memkind/internal/memkind_log.h>
+
+#include "jemalloc/jemalloc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef MEMKIND_EXPORT
+#define MEMKIND_EXPORT __attribute__((visibility("default")))
+#endif
+
+#define SAMPLE_TRACE_BUFFER_SIZE (64u * 1024u)
+#define SAMPLE_TRACE_TYPE_MASK   0x0fu
+#define SAMPLE_TRACE_FLAG_HOT    0x80u
+#define SAMPLE_TRACE_FLAG_WEIGHT 0x40u
+#define SAMPLE_TRACE_FLAG_HASH   0x20u
+
+static inline uint64_t zigzag_encode(uint64_t value, uint64_t prev)
+{
+    int64_t diff = (int64_t)(value - prev);
+    return ((uint64_t)diff << 1) ^ (uint64_t)(diff >> 63);
+}
+
+static inline uint64_t zigzag_decode(uint64_t zz, uint64_t prev)
+{
+    return prev + ((zz >> 1) ^ -(zz & 1u));
+}
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t value)
+{
+    while (value >= 0x80u) {
+        *p++ = (uint8_t)value | 0x80u;
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+/// @return 1 on success, 0 if @p p ends before the varint, -1 if varint
+/// does not fit in 64 bits
+static inline int get_varint(const uint8_t **p, const uint8_t *end,
+                             uint64_t *value)
+{
+    uint64_t result = 0u;
+    for (unsigned shift = 0u; shift < 64u; shift += 7u) {
+        if (*p == end)
+            return 0;
+        uint8_t byte = *(*p)++;
+        // only the lowest bit of the 10th byte is left
+        if (shift == 63u && byte > 1u)
+            return -1;
+        result |= (uint64_t)(byte & 0x7fu) << shift;
+        if (!(byte & 0x80u)) {
+            *value = result;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+MEMKIND_EXPORT size_t sample_trace_encode(sample_trace_codec_t *codec,
+                                          const sample_trace_record_t *record,
+                                          uint8_t *buf)
+{
+    uint8_t *p = buf;
+    bool weighted = (record->type == SAMPLE_TRACE_ALLOC ||
+                     record->type == SAMPLE_TRACE_REALLOC) &&
+        record->weight != 0.f;
+    // hash of ALLOC is always stored
+    bool hashed = record->type == SAMPLE_TRACE_REALLOC && record->hash;
+    *p++ = (uint8_t)record->type |
+        (record->is_hot ? SAMPLE_TRACE_FLAG_HOT : 0u) |
+        (weighted ? SAMPLE_TRACE_FLAG_WEIGHT : 0u) |
+        (hashed ? SAMPLE_TRACE_FLAG_HASH : 0u);
+    if (record->type == SAMPLE_TRACE_TOUCH) {
+        p = put_varint(p, zigzag_encode(record->timestamp,
+                                        codec->last_touch_timestamp));
+        p = put_varint(p, zigzag_encode(record->addr, codec->last_touch_addr));
+        codec->last_touch_timestamp = record->timestamp;
+        codec->last_touch_addr = record->addr;
+        return p - buf;
+    }
+    p = put_varint(p, zigzag_encode(record->timestamp,
+                                    codec->last_event_timestamp));
+    codec->last_event_timestamp = record->timestamp;
+    switch (record->type) {
+        case SAMPLE_TRACE_ALLOC:
+            for (unsigned i = 0u; i < sizeof(record->hash); ++i)
+                *p++ = (uint8_t)(record->hash >> (8u * i));
+            p = put_varint(p, record->addr);
+            p = put_varint(p, record->size);
+            break;
+        case SAMPLE_TRACE_FREE:
+            p = put_varint(p, record->addr);
+            break;
+        case SAMPLE_TRACE_REALLOC:
+            p = put_varint(p, record->addr);
+            p = put_varint(p, record->new_addr);
+            p = put_varint(p, record->size);
+            if (hashed)
+                for (unsigned i = 0u; i < sizeof(record->hash); ++i)
+                    *p++ = (uint8_t)(record->hash >> (8u * i));
+            break;
+        default:
+            break;
+    }
+    if (weighted) {
+        uint32_t bits;
+        memcpy(&bits, &record->weight, sizeof(bits));
+        for (unsigned i = 0u; i < sizeof(bits); ++i)
+            *p++ = (uint8_t)(bits >> (8u * i));
+    }
+    return p - buf;
+}
+
+MEMKIND_EXPORT ptrdiff_t sample_trace_decode(sample_trace_codec_t *codec,
+                                             const uint8_t *buf, size_t len,
+                                             sample_trace_record_t *record)
+{
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + len;
+    uint64_t zz, addr = 0u, new_addr = 0u, size = 0u, hash = 0u;
+    if (p == end)
+        return 0;
+    uint8_t type = *p & SAMPLE_TRACE_TYPE_MASK;
+    bool is_hot = *p & SAMPLE_TRACE_FLAG_HOT;
+    bool weighted = *p & SAMPLE_TRACE_FLAG_WEIGHT;
+    bool hashed = *p++ & SAMPLE_TRACE_FLAG_HASH;
+    float weight = 0.f;
+    int status;
+    if (type < SAMPLE_TRACE_ALLOC || type > SAMPLE_TRACE_CYCLE)
+        return -1;
+    if ((status = get_varint(&p, end, &zz)) <= 0)
+        goto varint_failed;
+    if (type == SAMPLE_TRACE_TOUCH) {
+        uint64_t addr_zz;
+        if ((status = get_varint(&p, end, &addr_zz)) <= 0)
+            goto varint_failed;
+        memset(record, 0, sizeof(*record));
+        record->type = SAMPLE_TRACE_TOUCH;
+        record->timestamp = zigzag_decode(zz, codec->last_touch_timestamp);
+        record->addr = zigzag_decode(addr_zz, codec->last_touch_addr);
+        codec->last_touch_timestamp = record->timestamp;
+        codec->last_touch_addr = record->addr;
+        return p - buf;
+    }
+    switch (type) {
+        case SAMPLE_TRACE_ALLOC:
+            if (end - p < (ptrdiff_t)sizeof(hash))
+                goto incomplete;
+            for (unsigned i = 0u; i < sizeof(hash); ++i)
+                hash |= (uint64_t)*p++ << (8u * i);
+            if ((status = get_varint(&p, end, &addr)) <= 0 ||
+                (status = get_varint(&p, end, &size)) <= 0)
+                goto varint_failed;
+            break;
+        case SAMPLE_TRACE_FREE:
+            if ((status = get_varint(&p, end, &addr)) <= 0)
+                goto varint_failed;
+            break;
+        case SAMPLE_TRACE_REALLOC:
+            if ((status = get_varint(&p, end, &addr)) <= 0 ||
+                (status = get_varint(&p, end, &new_addr)) <= 0 ||
+                (status = get_varint(&p, end, &size)) <= 0)
+                goto varint_failed;
+            if (hashed) {
+                if (end - p < (ptrdiff_t)sizeof(hash))
+                    goto incomplete;
+                for (unsigned i = 0u; i < sizeof(hash); ++i)
+                    hash |= (uint64_t)*p++ << (8u * i);
+            }
+            break;
+        default:
+            break;
+    }
+    if (weighted) {
+        uint32_t bits = 0u;
+        if (end - p < (ptrdiff_t)sizeof(bits))
+            goto incomplete;
+        for (unsigned i = 0u; i < sizeof(bits); ++i)
+            bits |= (uint32_t)*p++ << (8u * i);
+        memcpy(&weight, &bits, sizeof(weight));
+    }
+    record->type = type;
+    record->is_hot = is_hot;
+    record->timestamp = zigzag_decode(zz, codec->last_event_timestamp);
+    record->hash = hash;
+    record->addr = addr;
+    record->new_addr = new_addr;
+    record->size = size;
+    record->weight = weight;
+    codec->last_event_timestamp = record->timestamp;
+    return p - buf;
+
+varint_failed:
+    // overlong varint cannot be completed by more data
+    if (status < 0)
+        return -1;
+incomplete:
+    return len >= SAMPLE_TRACE_RECORD_MAX ? -1 : 0;
+}
+
+// Writer
+//
+// Records are encoded to a buffer under a mutex and written with write(2)
+// when the buffer is full; writers are the PEBS monitor thread and
+// consumer threads, never the malloc path.
+
+static pthread_mutex_t g_traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool g_traceEnabled = false;
+static int g_traceFd = -1;
+static uint8_t *g_traceBuffer = NULL;
+static size_t g_traceBufferUsed = 0u;
+static sample_trace_codec_t g_traceCodec;
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// @pre g_traceMutex is held
+static void trace_buffer_flush(void)
+{
+    if (g_traceBufferUsed &&
+        write_all(g_traceFd, g_traceBuffer, g_traceBufferUsed)) {
+        log_err("Sample trace write failed, recording stopped");
+        atomic_store(&g_traceEnabled, false);
+    }
+    g_traceBufferUsed = 0u;
+}
+
+// @pre g_traceMutex is held
+static void trace_buffer_append(const sample_trace_record_t *record)
+{
+    if (SAMPLE_TRACE_BUFFER_SIZE - g_traceBufferUsed < SAMPLE_TRACE_RECORD_MAX)
+        trace_buffer_flush();
+    g_traceBufferUsed += sample_trace_encode(
+        &g_traceCodec, record, g_traceBuffer + g_traceBufferUsed);
+}
+
+MEMKIND_EXPORT int sample_trace_open(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_err("Cannot create sample trace file %s", path);
+        return -1;
+    }
+    uint8_t header[SAMPLE_TRACE_HEADER_SIZE] = {0};
+    memcpy(header, SAMPLE_TRACE_MAGIC, 8u);
+    for (unsigned i = 0u; i < 4u; ++i)
+        header[8u + i] = (uint8_t)(SAMPLE_TRACE_VERSION >> (8u * i));
+    uint8_t *buffer = jemk_malloc(SAMPLE_TRACE_BUFFER_SIZE);
+    if (!buffer || write_all(fd, header, sizeof(header))) {
+        log_err("Cannot initialize sample trace file %s", path);
+        jemk_free(buffer);
+        close(fd);
+        return -1;
+    }
+    pthread_mutex_lock(&g_traceMutex);
+    g_traceFd = fd;
+    g_traceBuffer = buffer;
+    g_traceBufferUsed = 0u;
+    memset(&g_traceCodec, 0, sizeof(g_traceCodec));
+    atomic_store(&g_traceEnabled, true);
+    pthread_mutex_unlock(&g_traceMutex);
+    return 0;
+}
+
+MEMKIND_EXPORT void sample_trace_close(void)
+{
+    pthread_mutex_lock(&g_traceMutex);
+    if (g_traceFd >= 0) {
+        trace_buffer_flush();
+        atomic_store(&g_traceEnabled, false);
+        close(g_traceFd);
+        jemk_free(g_traceBuffer);
+        g_traceFd = -1;
+        g_traceBuffer = NULL;
+    }
+    pthread_mutex_unlock(&g_traceMutex);
+}
+
+MEMKIND_EXPORT bool sample_trace_enabled(void)
+{
+    return atomic_load_explicit(&g_traceEnabled, memory_order_relaxed);
+}
+
+MEMKIND_EXPORT void sample_trace_write(const sample_trace_record_t *record)
+{
+    pthread_mutex_lock(&g_traceMutex);
+    if (sample_trace_enabled())
+        trace_buffer_append(record);
+    pthread_mutex_unlock(&g_traceMutex);
+}
+
+MEMKIND_EXPORT void
+sample_trace_write_touches(const tachanka_touch_sample_t *samples, size_t count)
+{
+    sample_trace_record_t record = {.type = SAMPLE_TRACE_TOUCH};
+    pthread_mutex_lock(&g_traceMutex);
+    for (size_t i = 0; i < count && sample_trace_enabled(); ++i) {
+        record.timestamp = samples[i].timestamp;
+        record.addr = (uintptr_t)samples[i].addr;
+        trace_buffer_append(&record);
+    }
+    pthread_mutex_unlock(&g_traceMutex);
+}
+
+// Reader
+
+struct sample_trace_reader {
+    int fd;
+    sample_trace_codec_t codec;
+    size_t begin;
+    size_t end;
+    bool eof;
+    uint8_t buffer[SAMPLE_TRACE_BUFFER_SIZE];
+};
+
+MEMKIND_EXPORT sample_trace_reader_t *sample_trace_reader_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    uint8_t header[SAMPLE_TRACE_HEADER_SIZE];
+    uint32_t version = 0u;
+    if (read(fd, header, sizeof(header)) != sizeof(header) ||
+        memcmp(header, SAMPLE_TRACE_MAGIC, 8u))
+        goto error;
+    for (unsigned i = 0u; i < 4u; ++i)
+        version |= (uint32_t)header[8u + i] << (8u * i);
+    if (version != SAMPLE_TRACE_VERSION)
+        goto error;
+    sample_trace_reader_t *reader = jemk_calloc(1, sizeof(*reader));
+    if (!reader)
+        goto error;
+    reader->fd = fd;
+    return reader;
+
+error:
+    close(fd);
+    return NULL;
+}
+
+MEMKIND_EXPORT int sample_trace_reader_next(sample_trace_reader_t *reader,
+                                            sample_trace_record_t *record)
+{
+    while (1) {
+        ptrdiff_t used = sample_trace_decode(
+            &reader->codec, reader->buffer + reader->begin,
+            reader->end - reader->begin, record);
+        if (used > 0) {
+            reader->begin += used;
+            return 1;
+        }
+        if (used < 0)
+            return -1;
+        if (reader->eof)
+            // trailing, incomplete record is an error
+            return reader->begin == reader->end ? 0 : -1;
+        memmove(reader->buffer, reader->buffer + reader->begin,
+                reader->end - reader->begin);
+        reader->end -= reader->begin;
+        reader->begin = 0u;
+        ssize_t got = read(reader->fd, reader->buffer + reader->end,
+                           sizeof(reader->buffer) - reader->end);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (got == 0)
+            reader->eof = true;
+        reader->end += got;
+    }
+}
+
+MEMKIND_EXPORT void sample_trace_reader_close(sample_trace_reader_t *reader)
+{
+    if (!reader)
+        return;
+    close(reader->fd);
+    jemk_free(reader);
+}
@@ -1,11 +1,19 @@
 #include "memkind/internal/slab_allocator.h"
+#include "memkind/internal/memkind_log.h"
 
+#include "jemalloc/jemalloc.h"
 #include "pthread.h"
 #include "assert.h"
+#include "numa.h"
+#include "sched.h"
 #include "stdbool.h"
 #include "stdint.h"
 #include "stddef.h"
+#include "stdlib.h"
 #include "string.h"
+#include "sys/mman.h"
+#include "threads.h"
+#include "unistd.h"
 
 #include "stdatomic.h"
 
@@ -16,6 +24,49 @@
 #define MEMKIND_EXPORT __attribute__((visibility("default")))
 #endif
 
+#define DEPOT_INDEX_MASK 0xffffffffu
+#define DEPOT_VERSION_ONE (1ull << 32)
+
+// state of a thread cache: generation << 2 | one of below;
+// generation is incremented on every release, so that the previous owner
+// cannot take the cache back
+#define THREAD_CACHE_FREE  0u // in the pool
+#define THREAD_CACHE_OWNED 1u // used by a thread
+#define THREAD_CACHE_BUSY  2u // owner flushes it to the depot
+#define THREAD_CACHE_STATE(gen, state) (((gen) << 2) | (state))
+
+/// Magazines of a single thread for a single allocator
+///
+/// Owner thread uses the cache without synchronization. The cache is
+/// registered in the allocator - the allocator takes over caches of live
+/// threads when it is destroyed. Caches are never freed: a thread that
+/// exits might try to release a cache already taken over and reused.
+typedef struct slab_thread_cache {
+    atomic_uint_fast64_t state;
+    slab_alloc_t *alloc;
+    unsigned depot;
+    size_t loadedCount;
+    freelist_node_meta_t *loaded;
+    size_t previousCount;
+    freelist_node_meta_t *previous;
+    struct slab_thread_cache *next; // in allocator list or in the pool
+} slab_thread_cache_t;
+
+typedef struct thread_cache_entry {
+    uint64_t allocId;
+    uint_fast64_t state; // owned state of cache
+    slab_thread_cache_t *cache;
+} thread_cache_entry_t;
+
+static atomic_uint_fast64_t g_nextAllocId = 1u;
+static pthread_mutex_t g_cachePoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static slab_thread_cache_t *g_cachePool = NULL;
+static pthread_key_t g_threadKey;
+static pthread_once_t g_threadKeyOnce = PTHREAD_ONCE_INIT;
+
+static thread_local thread_cache_entry_t t_caches[SLAB_ALLOC_THREAD_CACHES];
+static thread_local bool t_keySet = false;
+
 // -------- static functions --------------------------------------------------
 
 static freelist_node_meta_t *slab_alloc_addr_to_node_meta_(void *addr) {
@@ -30,58 +81,148 @@ static void *slab_alloc_node_meta_to_addr_(freelist_node_meta_t *meta) {
 
 #ifdef USE_LOCKLESS
 
-static void slab_alloc_glob_freelist_push_(void *addr) {
-    freelist_node_meta_t *meta = slab_alloc_addr_to_node_meta_(addr);
-    slab_alloc_t *alloc = meta->allocator;
+static uint64_t slab_alloc_meta_to_index_(slab_alloc_t *alloc,
+                                          freelist_node_meta_t *meta) {
+    if (!meta)
+        return 0u;
+    // might be called with garbage read by a stale pop - result is discarded
+    return (((uint8_t*)meta) - ((uint8_t*)alloc->mappedMemory.area)) /
+        alloc->elementSize + 1u;
+}
+
+static freelist_node_meta_t *slab_alloc_index_to_meta_(slab_alloc_t *alloc,
+                                                       uint64_t index) {
+    if (!index)
+        return NULL;
+    return (freelist_node_meta_t*)(((uint8_t*)alloc->mappedMemory.area) +
+        (index - 1u) * alloc->elementSize);
+}
+
+static void slab_alloc_depot_init_(slab_depot_t *depot) {
+    atomic_init(&depot->top, 0u);
+}
+
+static void slab_alloc_depot_destroy_(slab_depot_t *depot) {
+    (void)depot;
+}
+
+static void slab_alloc_depot_push_(slab_alloc_t *alloc, slab_depot_t *depot,
+                                   freelist_node_meta_t *magazine) {
+    uint64_t index = slab_alloc_meta_to_index_(alloc, magazine);
+    uint64_t top = atomic_load_explicit(&depot->top, memory_order_relaxed);
+    uint64_t new_top;
     do {
-        meta->next = alloc->globFreelist.freelist;
-    } while (false == atomic_compare_exchange_weak(&alloc->globFreelist.freelist, &meta->next, meta));
+        magazine->nextMagazine =
+            slab_alloc_index_to_meta_(alloc, top & DEPOT_INDEX_MASK);
+        new_top = ((top & ~(uint64_t)DEPOT_INDEX_MASK) + DEPOT_VERSION_ONE) |
+            index;
+    } while (false == atomic_compare_exchange_weak_explicit(&depot->top, &top,
+                new_top, memory_order_release, memory_order_relaxed));
 }
 
-static void *slab_alloc_glob_freelist_pop_(slab_alloc_t *alloc) {
-    freelist_node_meta_t *meta = NULL;
+static freelist_node_meta_t *slab_alloc_depot_pop_(slab_alloc_t *alloc,
+                                                   slab_depot_t *depot) {
+    uint64_t top = atomic_load_explicit(&depot->top, memory_order_acquire);
+    freelist_node_meta_t *magazine;
+    uint64_t new_top;
     do {
-        meta = alloc->globFreelist.freelist;
-        if (!meta)
-            break;
-    } while (false == atomic_compare_exchange_weak(&alloc->globFreelist.freelist, &meta, meta->next));
+        magazine = slab_alloc_index_to_meta_(alloc, top & DEPOT_INDEX_MASK);
+        if (!magazine)
+            return NULL;
+        // magazine might be already popped and reused by another thread -
+        // then version has changed and compare exchange fails
+        new_top = ((top & ~(uint64_t)DEPOT_INDEX_MASK) + DEPOT_VERSION_ONE) |
+            slab_alloc_meta_to_index_(alloc, magazine->nextMagazine);
+    } while (false == atomic_compare_exchange_weak_explicit(&depot->top, &top,
+                new_top, memory_order_acquire, memory_order_acquire));
 
-    return meta ? slab_alloc_node_meta_to_addr_(meta) : NULL;
+    return magazine;
+}
+
+static freelist_node_meta_t *slab_alloc_depot_take_all_(slab_alloc_t *alloc,
+                                                        slab_depot_t *depot) {
+    uint64_t top = atomic_load_explicit(&depot->top, memory_order_acquire);
+    while (false == atomic_compare_exchange_weak_explicit(&depot->top, &top,
+                (top & ~(uint64_t)DEPOT_INDEX_MASK) + DEPOT_VERSION_ONE,
+                memory_order_acquire, memory_order_acquire));
+
+    return slab_alloc_index_to_meta_(alloc, top & DEPOT_INDEX_MASK);
 }
 
 #else
 
-static void slab_alloc_glob_freelist_lock_(slab_alloc_t *alloc) {
-    int ret = pthread_mutex_lock(&alloc->globFreelist.mutex);
-    assert(ret == 0 && "mutex lock failed!");
+static void slab_alloc_depot_init_(slab_depot_t *depot) {
+    depot->top = NULL;
+    int ret = pthread_mutex_init(&depot->mutex, NULL);
+    assert(ret == 0 && "mutex init failed!");
+}
+
+static void slab_alloc_depot_destroy_(slab_depot_t *depot) {
+    int ret = pthread_mutex_destroy(&depot->mutex);
+    assert(ret == 0 && "mutex destruction failed!");
 }
 
-static void slab_alloc_glob_freelist_unlock_(slab_alloc_t *alloc) {
-    int ret = pthread_mutex_unlock(&alloc->globFreelist.mutex);
+static void slab_alloc_depot_push_(slab_alloc_t *alloc, slab_depot_t *depot,
+                                   freelist_node_meta_t *magazine) {
+    (void)alloc;
+    int ret = pthread_mutex_lock(&depot->mutex);
+    assert(ret == 0 && "mutex lock failed!");
+    magazine->nextMagazine = depot->top;
+    depot->top = magazine;
+    ret = pthread_mutex_unlock(&depot->mutex);
     assert(ret == 0 && "mutex unlock failed!");
 }
 
-static void slab_alloc_glob_freelist_push_(void *addr) {
-    freelist_node_meta_t *meta = slab_alloc_addr_to_node_meta_(addr);
-    slab_alloc_t *alloc = meta->allocator;
-    slab_alloc_glob_freelist_lock_(alloc);
-    meta->next = alloc->globFreelist.freelist;
-    alloc->globFreelist.freelist = meta;
-    slab_alloc_glob_freelist_unlock_(alloc);
+static freelist_node_meta_t *slab_alloc_depot_pop_(slab_alloc_t *alloc,
+                                                   slab_depot_t *depot) {
+    (void)alloc;
+    int ret = pthread_mutex_lock(&depot->mutex);
+    assert(ret == 0 && "mutex lock failed!");
+    freelist_node_meta_t *magazine = depot->top;
+    if (magazine)
+        depot->top = magazine->nextMagazine;
+    ret = pthread_mutex_unlock(&depot->mutex);
+    assert(ret == 0 && "mutex unlock failed!");
+
+    return magazine;
 }
 
-static void *slab_alloc_glob_freelist_pop_(slab_alloc_t *alloc) {
-    slab_alloc_glob_freelist_lock_(alloc);
-    freelist_node_meta_t *meta = alloc->globFreelist.freelist;
-    if (meta)
-        alloc->globFreelist.freelist = alloc->globFreelist.freelist->next;
-    slab_alloc_glob_freelist_unlock_(alloc);
+static freelist_node_meta_t *slab_alloc_depot_take_all_(slab_alloc_t *alloc,
+                                                        slab_depot_t *depot) {
+    (void)alloc;
+    int ret = pthread_mutex_lock(&depot->mutex);
+    assert(ret == 0 && "mutex lock failed!");
+    freelist_node_meta_t *magazines = depot->top;
+    depot->top = NULL;
+    ret = pthread_mutex_unlock(&depot->mutex);
+    assert(ret == 0 && "mutex unlock failed!");
 
-    return meta ? slab_alloc_node_meta_to_addr_(meta) : NULL;
+    return magazines;
 }
 
 #endif
 
+static void slab_alloc_depot_put_(slab_alloc_t *alloc, unsigned depot,
+                                  freelist_node_meta_t *magazine,
+                                  size_t count) {
+    atomic_fetch_add_explicit(&alloc->depotElements, count,
+                              memory_order_relaxed);
+    slab_alloc_depot_push_(alloc, &alloc->depots[depot], magazine);
+}
+
+/// @return magazine from the depot of @p depot, or from any other depot
+static freelist_node_meta_t *slab_alloc_depots_pop_(slab_alloc_t *alloc,
+                                                    unsigned depot) {
+    for (size_t i = 0; i < alloc->depotsCount; ++i) {
+        size_t idx = (depot + i) % alloc->depotsCount;
+        freelist_node_meta_t *magazine =
+            slab_alloc_depot_pop_(alloc, &alloc->depots[idx]);
+        if (magazine)
+            return magazine;
+    }
+    return NULL;
+}
+
 static size_t slab_alloc_fetch_increment_used_(slab_alloc_t *alloc) {
     // the value is never atomically decreased, only thing we need is
     return atomic_fetch_add_explicit(&alloc->used, 1u, memory_order_relaxed);
@@ -89,6 +230,8 @@ static size_t slab_alloc_fetch_increment_used_(slab_alloc_t *alloc) {
 
 static freelist_node_meta_t *slab_alloc_create_meta_(slab_alloc_t *alloc) {
     size_t free_idx = slab_alloc_fetch_increment_used_(alloc);
+    // depot stores element index + 1 on 32 bits
+    assert(free_idx < DEPOT_INDEX_MASK);
     size_t meta_offset = alloc->elementSize*free_idx;
 
     // TODO handle failure gracefully instead of die - in biary_alloc
@@ -101,6 +244,184 @@ static freelist_node_meta_t *slab_alloc_create_meta_(slab_alloc_t *alloc) {
     return ret;
 }
 
+// elements belong to the chunk their metadata starts in
+static size_t slab_alloc_chunk_first_(slab_alloc_t *alloc, size_t chunk) {
+    return (chunk * SLAB_ALLOC_CHUNK_SIZE + alloc->elementSize - 1) /
+        alloc->elementSize;
+}
+
+static freelist_node_meta_t *slab_alloc_element_(slab_alloc_t *alloc,
+                                                 size_t idx) {
+    return (freelist_node_meta_t *)(((uint8_t *)alloc->mappedMemory.area) +
+        idx * alloc->elementSize);
+}
+
+static size_t slab_alloc_element_chunk_(slab_alloc_t *alloc,
+                                        freelist_node_meta_t *meta) {
+    return (((uint8_t *)meta) - ((uint8_t *)alloc->mappedMemory.area)) /
+        SLAB_ALLOC_CHUNK_SIZE;
+}
+
+/// @brief put elements of a released chunk back to the depot
+/// @return false if there is no released chunk (or release is in progress)
+static bool slab_alloc_revive_chunk_(slab_alloc_t *alloc, unsigned depot) {
+    if (!atomic_load_explicit(&alloc->releasedCount, memory_order_relaxed))
+        return false;
+    if (pthread_mutex_trylock(&alloc->chunksMutex))
+        return false;
+    size_t released = atomic_load(&alloc->releasedCount);
+    if (!released) {
+        pthread_mutex_unlock(&alloc->chunksMutex);
+        return false;
+    }
+    size_t chunk = alloc->releasedChunks[released - 1];
+    atomic_store(&alloc->releasedCount, released - 1);
+    alloc->chunks[chunk].released = 0u;
+    size_t first = slab_alloc_chunk_first_(alloc, chunk);
+    size_t end = slab_alloc_chunk_first_(alloc, chunk + 1);
+    alloc->releasedSize -= (end - first) * alloc->elementSize;
+    freelist_node_meta_t *magazine = NULL;
+    size_t count = 0u;
+    for (size_t idx = first; idx < end; ++idx) {
+        freelist_node_meta_t *meta = slab_alloc_element_(alloc, idx);
+        meta->next = magazine;
+        magazine = meta;
+        if (++count == SLAB_ALLOC_MAGAZINE_SIZE) {
+            slab_alloc_depot_put_(alloc, depot, magazine, count);
+            magazine = NULL;
+            count = 0u;
+        }
+    }
+    if (magazine)
+        slab_alloc_depot_put_(alloc, depot, magazine, count);
+    pthread_mutex_unlock(&alloc->chunksMutex);
+    return true;
+}
+
+static unsigned slab_alloc_thread_depot_(slab_alloc_t *alloc) {
+#if SLAB_ALLOC_NUMA_DEPOTS
+    int cpu = sched_getcpu();
+    int node = cpu < 0 ? -1 : numa_node_of_cpu(cpu);
+    return node < 0 ? 0u : (unsigned)node % alloc->depotsCount;
+#else
+    (void)alloc;
+    return 0u;
+#endif
+}
+
+static void slab_alloc_thread_cache_flush_(slab_thread_cache_t *cache) {
+    if (cache->loaded)
+        slab_alloc_depot_put_(cache->alloc, cache->depot, cache->loaded,
+                              cache->loadedCount);
+    if (cache->previous)
+        slab_alloc_depot_put_(cache->alloc, cache->depot, cache->previous,
+                              cache->previousCount);
+    cache->loaded = cache->previous = NULL;
+    cache->loadedCount = cache->previousCount = 0u;
+}
+
+static void slab_alloc_thread_cache_unlink_(slab_alloc_t *alloc,
+                                            slab_thread_cache_t *cache) {
+    slab_thread_cache_t **prev = &alloc->threadCaches;
+    while (*prev != cache)
+        prev = &(*prev)->next;
+    *prev = cache->next;
+}
+
+static void slab_alloc_thread_cache_pool_push_(slab_thread_cache_t *cache) {
+    pthread_mutex_lock(&g_cachePoolMutex);
+    cache->next = g_cachePool;
+    g_cachePool = cache;
+    pthread_mutex_unlock(&g_cachePoolMutex);
+}
+
+/// @brief return magazines of the cache to the depot and the cache to the pool
+/// @note cache might have been already taken over by allocator destruction
+static void slab_alloc_thread_cache_release_(thread_cache_entry_t *entry) {
+    slab_thread_cache_t *cache = entry->cache;
+    uint_fast64_t owned = entry->state;
+    uint_fast64_t gen = owned >> 2;
+    entry->allocId = 0u;
+    entry->cache = NULL;
+    if (!atomic_compare_exchange_strong(&cache->state, &owned,
+            THREAD_CACHE_STATE(gen, THREAD_CACHE_BUSY)))
+        return;
+    // allocator waits in destroy until the cache is unlinked
+    slab_alloc_t *alloc = cache->alloc;
+    slab_alloc_thread_cache_flush_(cache);
+    pthread_mutex_lock(&alloc->threadCachesMutex);
+    slab_alloc_thread_cache_unlink_(alloc, cache);
+    pthread_mutex_unlock(&alloc->threadCachesMutex);
+    atomic_store(&cache->state, THREAD_CACHE_STATE(gen + 1, THREAD_CACHE_FREE));
+    slab_alloc_thread_cache_pool_push_(cache);
+}
+
+static void slab_alloc_thread_exit_(void *arg) {
+    (void)arg;
+    for (size_t i = 0; i < SLAB_ALLOC_THREAD_CACHES; ++i)
+        if (t_caches[i].cache)
+            slab_alloc_thread_cache_release_(&t_caches[i]);
+    t_keySet = false;
+}
+
+static void slab_alloc_thread_key_create_(void) {
+    if (pthread_key_create(&g_threadKey, slab_alloc_thread_exit_)) {
+        log_fatal("slab allocator: pthread_key_create() failed");
+        exit(-1);
+    }
+}
+
+static slab_thread_cache_t *
+slab_alloc_thread_cache_attach_(slab_alloc_t *alloc,
+                                thread_cache_entry_t *entry) {
+    if (entry->cache)
+        slab_alloc_thread_cache_release_(entry);
+
+    pthread_mutex_lock(&g_cachePoolMutex);
+    slab_thread_cache_t *cache = g_cachePool;
+    if (cache)
+        g_cachePool = cache->next;
+    pthread_mutex_unlock(&g_cachePoolMutex);
+    if (!cache) {
+        cache = jemk_malloc(sizeof(*cache));
+        if (!cache) {
+            log_fatal("slab allocator: cannot allocate thread cache");
+            exit(-1);
+        }
+        atomic_init(&cache->state,
+                    THREAD_CACHE_STATE((uint_fast64_t)0u, THREAD_CACHE_FREE));
+    }
+    uint_fast64_t gen = atomic_load(&cache->state) >> 2;
+    cache->alloc = alloc;
+    cache->depot = slab_alloc_thread_depot_(alloc);
+    cache->loaded = cache->previous = NULL;
+    cache->loadedCount = cache->previousCount = 0u;
+    entry->state = THREAD_CACHE_STATE(gen, THREAD_CACHE_OWNED);
+    atomic_store(&cache->state, entry->state);
+    pthread_mutex_lock(&alloc->threadCachesMutex);
+    cache->next = alloc->threadCaches;
+    alloc->threadCaches = cache;
+    pthread_mutex_unlock(&alloc->threadCachesMutex);
+    entry->cache = cache;
+    entry->allocId = alloc->id;
+
+    if (!t_keySet) {
+        // pthread_setspecific() might allocate - and re-enter
+        t_keySet = true;
+        (void)pthread_once(&g_threadKeyOnce, slab_alloc_thread_key_create_);
+        (void)pthread_setspecific(g_threadKey, t_caches);
+    }
+    return cache;
+}
+
+static slab_thread_cache_t *slab_alloc_thread_cache_(slab_alloc_t *alloc) {
+    thread_cache_entry_t *entry =
+        &t_caches[alloc->id & (SLAB_ALLOC_THREAD_CACHES - 1)];
+    if (entry->allocId == alloc->id)
+        return entry->cache;
+    return slab_alloc_thread_cache_attach_(alloc, entry);
+}
+
 // -------- public functions --------------------------------------------------
 
 MEMKIND_EXPORT int slab_alloc_init(slab_alloc_t *alloc, size_t element_size, size_t max_elements) {
@@ -109,32 +430,270 @@ MEMKIND_EXPORT int slab_alloc_init(slab_alloc_t *alloc, size_t element_size, siz
     size_t max_elements_size = max_elements * alloc->elementSize;
     bigary_init(&alloc->mappedMemory, BIGARY_DRAM, max_elements_size);
     alloc->used=0u;
+    alloc->id = atomic_fetch_add(&g_nextAllocId, 1u);
+    alloc->threadCaches = NULL;
+    atomic_init(&alloc->depotElements, 0u);
+    alloc->depotElementsAfterRelease = 0u;
+    alloc->chunks = NULL;
+    alloc->chunksCapacity = 0u;
+    alloc->releasedChunks = NULL;
+    atomic_init(&alloc->releasedCount, 0u);
+    alloc->releasedSize = 0u;
+
+    alloc->depotsCount = 1u;
+#if SLAB_ALLOC_NUMA_DEPOTS
+    int nodes = numa_available() < 0 ? 1 : numa_max_node() + 1;
+    alloc->depotsCount =
+        nodes < SLAB_ALLOC_MAX_DEPOTS ? (size_t)nodes : SLAB_ALLOC_MAX_DEPOTS;
+#endif
+    for (size_t i = 0; i < alloc->depotsCount; ++i)
+        slab_alloc_depot_init_(&alloc->depots[i]);
 
-    int ret = pthread_mutex_init(&alloc->globFreelist.mutex, NULL);
-    alloc->globFreelist.freelist = NULL;
+    int ret = pthread_mutex_init(&alloc->chunksMutex, NULL);
     if (ret != 0)
         return ret;
-
-    return ret;
+    return pthread_mutex_init(&alloc->threadCachesMutex, NULL);
 }
 
 MEMKIND_EXPORT void slab_alloc_destroy(slab_alloc_t *alloc) {
-    int ret = pthread_mutex_destroy(&alloc->globFreelist.mutex);
+    // take over caches of all threads - cached elements are released
+    // with the mapped memory
+    for (;;) {
+        pthread_mutex_lock(&alloc->threadCachesMutex);
+        slab_thread_cache_t *cache = alloc->threadCaches;
+        if (!cache) {
+            pthread_mutex_unlock(&alloc->threadCachesMutex);
+            break;
+        }
+        uint_fast64_t state = atomic_load(&cache->state);
+        if ((state & 3u) == THREAD_CACHE_BUSY) {
+            // exiting owner unlinks it
+            pthread_mutex_unlock(&alloc->threadCachesMutex);
+            sched_yield();
+            continue;
+        }
+        assert((state & 3u) == THREAD_CACHE_OWNED);
+        if (atomic_compare_exchange_strong(&cache->state, &state,
+                THREAD_CACHE_STATE((state >> 2) + 1, THREAD_CACHE_FREE))) {
+            alloc->threadCaches = cache->next;
+            pthread_mutex_unlock(&alloc->threadCachesMutex);
+            slab_alloc_thread_cache_pool_push_(cache);
+        } else {
+            pthread_mutex_unlock(&alloc->threadCachesMutex);
+        }
+    }
+    for (size_t i = 0; i < alloc->depotsCount; ++i)
+        slab_alloc_depot_destroy_(&alloc->depots[i]);
+    int ret = pthread_mutex_destroy(&alloc->threadCachesMutex);
+    ret |= pthread_mutex_destroy(&alloc->chunksMutex);
+    jemk_free(alloc->chunks);
+    jemk_free(alloc->releasedChunks);
     bigary_destroy(&alloc->mappedMemory);
     assert(ret == 0 && "mutex destruction failed");
 }
 
 MEMKIND_EXPORT void *slab_alloc_malloc(slab_alloc_t *alloc) {
-    void *ret = slab_alloc_glob_freelist_pop_(alloc);
-    if (!ret) {
-        freelist_node_meta_t *meta = slab_alloc_create_meta_(alloc);
-        if (meta) // defensive programming
-            ret = slab_alloc_node_meta_to_addr_(meta);
+    slab_thread_cache_t *cache = slab_alloc_thread_cache_(alloc);
+    freelist_node_meta_t *meta = cache->loaded;
+    if (!meta) {
+        if (cache->previousCount) {
+            cache->loaded = cache->previous;
+            cache->loadedCount = cache->previousCount;
+            cache->previous = NULL;
+            cache->previousCount = 0u;
+        } else {
+            cache->loaded = slab_alloc_depots_pop_(alloc, cache->depot);
+            if (!cache->loaded && slab_alloc_revive_chunk_(alloc, cache->depot))
+                cache->loaded = slab_alloc_depots_pop_(alloc, cache->depot);
+            for (freelist_node_meta_t *it = cache->loaded; it; it = it->next)
+                ++cache->loadedCount;
+            atomic_fetch_sub_explicit(&alloc->depotElements,
+                                      cache->loadedCount,
+                                      memory_order_relaxed);
+        }
+        meta = cache->loaded;
     }
-    return ret;
+    if (meta) {
+        cache->loaded = meta->next;
+        --cache->loadedCount;
+        meta->allocator = alloc;
+    } else {
+        meta = slab_alloc_create_meta_(alloc);
+    }
+    return meta ? slab_alloc_node_meta_to_addr_(meta) : NULL;
 }
 
 MEMKIND_EXPORT void slab_alloc_free(void *addr) {
     assert(addr);
-    slab_alloc_glob_freelist_push_(addr);
+    freelist_node_meta_t *meta = slab_alloc_addr_to_node_meta_(addr);
+    slab_thread_cache_t *cache = slab_alloc_thread_cache_(meta->allocator);
+    if (cache->loadedCount == SLAB_ALLOC_MAGAZINE_SIZE) {
+        // full magazine goes to the depot in one step
+        if (cache->previous)
+            slab_alloc_depot_put_(cache->alloc, cache->depot,
+                                  cache->previous, cache->previousCount);
+        cache->previous = cache->loaded;
+        cache->previousCount = cache->loadedCount;
+        cache->loaded = NULL;
+        cache->loadedCount = 0u;
+    }
+    meta->next = cache->loaded;
+    cache->loaded = meta;
+    ++cache->loadedCount;
+}
+
+static int slab_alloc_chunk_cmp_(const void *a, const void *b, void *arg) {
+    slab_chunk_t *chunks = arg;
+    uint32_t live_a = chunks[*(const size_t *)a].live;
+    uint32_t live_b = chunks[*(const size_t *)b].live;
+    return live_a < live_b ? -1 : live_a > live_b;
+}
+
+MEMKIND_EXPORT size_t slab_alloc_release_free_chunks(slab_alloc_t *alloc) {
+    size_t used = atomic_load(&alloc->used);
+    size_t per_chunk = SLAB_ALLOC_CHUNK_SIZE / alloc->elementSize;
+    // chunks with all elements created - later ones are still filled
+    // by slab_alloc_create_meta_()
+    size_t complete = used * alloc->elementSize / SLAB_ALLOC_CHUNK_SIZE;
+    if (!complete)
+        return 0u;
+    pthread_mutex_lock(&alloc->chunksMutex);
+    size_t depot_elements = atomic_load(&alloc->depotElements);
+    size_t min_freed = per_chunk > used / 8u ? per_chunk : used / 8u;
+    if (depot_elements < alloc->depotElementsAfterRelease + min_freed) {
+        pthread_mutex_unlock(&alloc->chunksMutex);
+        return 0u;
+    }
+
+    size_t chunks_no =
+        ((used - 1u) * alloc->elementSize) / SLAB_ALLOC_CHUNK_SIZE + 1u;
+    if (chunks_no > alloc->chunksCapacity) {
+        slab_chunk_t *chunks =
+            jemk_realloc(alloc->chunks, chunks_no * sizeof(slab_chunk_t));
+        size_t *released =
+            jemk_realloc(alloc->releasedChunks, chunks_no * sizeof(size_t));
+        if (chunks)
+            alloc->chunks = chunks;
+        if (released)
+            alloc->releasedChunks = released;
+        if (!chunks || !released) {
+            pthread_mutex_unlock(&alloc->chunksMutex);
+            return 0u;
+        }
+        memset(alloc->chunks + alloc->chunksCapacity, 0,
+               (chunks_no - alloc->chunksCapacity) * sizeof(slab_chunk_t));
+        alloc->chunksCapacity = chunks_no;
+    }
+    // free elements of each chunk, chained; depot they were taken from
+    uint32_t *held = jemk_calloc(chunks_no, sizeof(uint32_t));
+    freelist_node_meta_t **heads =
+        jemk_calloc(chunks_no, sizeof(freelist_node_meta_t *));
+    uint8_t *depots = jemk_malloc(chunks_no);
+    size_t *order = jemk_malloc(chunks_no * sizeof(size_t));
+    if (!held || !heads || !depots || !order) {
+        jemk_free(held);
+        jemk_free(heads);
+        jemk_free(depots);
+        jemk_free(order);
+        pthread_mutex_unlock(&alloc->chunksMutex);
+        return 0u;
+    }
+
+    // elements taken out of depots cannot be allocated by other threads -
+    // a chunk with all its elements here is unused
+    size_t taken = 0u;
+    for (size_t d = 0; d < alloc->depotsCount; ++d) {
+        freelist_node_meta_t *magazine =
+            slab_alloc_depot_take_all_(alloc, &alloc->depots[d]);
+        while (magazine) {
+            freelist_node_meta_t *next_magazine = magazine->nextMagazine;
+            freelist_node_meta_t *meta = magazine;
+            while (meta) {
+                freelist_node_meta_t *next = meta->next;
+                size_t chunk = slab_alloc_element_chunk_(alloc, meta);
+                meta->next = heads[chunk];
+                heads[chunk] = meta;
+                ++held[chunk];
+                depots[chunk] = d;
+                ++taken;
+                meta = next;
+            }
+            magazine = next_magazine;
+        }
+    }
+    atomic_fetch_sub(&alloc->depotElements, taken);
+
+    static size_t page_size;
+    if (!page_size)
+        page_size = sysconf(_SC_PAGESIZE);
+    size_t released_size = 0u;
+    size_t order_no = 0u;
+    for (size_t chunk = 0; chunk < chunks_no; ++chunk) {
+        if (alloc->chunks[chunk].released)
+            continue;
+        size_t first = slab_alloc_chunk_first_(alloc, chunk);
+        size_t end = slab_alloc_chunk_first_(alloc, chunk + 1);
+        if (end > used)
+            end = used;
+        alloc->chunks[chunk].live = end - first - held[chunk];
+        if (!heads[chunk])
+            continue;
+        if (chunk < complete && !alloc->chunks[chunk].live) {
+            // pages shared with elements of neighbouring chunks stay
+            uintptr_t begin = (uintptr_t)slab_alloc_element_(alloc, first);
+            uintptr_t finish = (uintptr_t)slab_alloc_element_(alloc, end);
+            begin = (begin + page_size - 1) & ~(page_size - 1);
+            finish &= ~(page_size - 1);
+            if (begin < finish)
+                (void)madvise((void *)begin, finish - begin, MADV_DONTNEED);
+            alloc->chunks[chunk].released = 1u;
+            alloc->releasedChunks[atomic_load(&alloc->releasedCount)] = chunk;
+            atomic_fetch_add(&alloc->releasedCount, 1u);
+            alloc->releasedSize += (end - first) * alloc->elementSize;
+            released_size += (end - first) * alloc->elementSize;
+            continue;
+        }
+        order[order_no++] = chunk;
+    }
+
+    // densest chunks are pushed last - they are reused first, so that
+    // sparse chunks can become free
+    qsort_r(order, order_no, sizeof(size_t), slab_alloc_chunk_cmp_,
+            alloc->chunks);
+    freelist_node_meta_t *magazines[SLAB_ALLOC_MAX_DEPOTS] = {NULL};
+    size_t counts[SLAB_ALLOC_MAX_DEPOTS] = {0u};
+    for (size_t i = 0; i < order_no; ++i) {
+        size_t chunk = order[i];
+        unsigned d = depots[chunk];
+        freelist_node_meta_t *meta = heads[chunk];
+        while (meta) {
+            freelist_node_meta_t *next = meta->next;
+            meta->next = magazines[d];
+            magazines[d] = meta;
+            if (++counts[d] == SLAB_ALLOC_MAGAZINE_SIZE) {
+                slab_alloc_depot_put_(alloc, d, magazines[d], counts[d]);
+                magazines[d] = NULL;
+                counts[d] = 0u;
+            }
+            meta = next;
+        }
+    }
+    for (unsigned d = 0; d < alloc->depotsCount; ++d)
+        if (magazines[d])
+            slab_alloc_depot_put_(alloc, d, magazines[d], counts[d]);
+    alloc->depotElementsAfterRelease = atomic_load(&alloc->depotElements);
+    pthread_mutex_unlock(&alloc->chunksMutex);
+
+    jemk_free(held);
+    jemk_free(heads);
+    jemk_free(depots);
+    jemk_free(order);
+    return released_size;
+}
+
+MEMKIND_EXPORT size_t slab_alloc_resident_size(slab_alloc_t *alloc) {
+    pthread_mutex_lock(&alloc->chunksMutex);
+    size_t released = alloc->releasedSize;
+    pthread_mutex_unlock(&alloc->chunksMutex);
+    return atomic_load(&alloc->used) * alloc->elementSize - released;
 }
@@ -3,14 +3,18 @@
 #include <memkind/internal/memkind_memtier.h>
 #include <memkind/internal/memkind_log.h>
 #include <memkind/internal/bthash.h>
+#include <memkind/internal/exec_maps.h>
 #include <memkind/internal/critnib.h>
 #include <memkind/internal/tachanka.h>
 #include <memkind/internal/ranking.h>
-#include <memkind/internal/lockless_srmw_queue.h>
+#include <memkind/internal/ranking_event_rings.h>
 #include <memkind/internal/bigary.h>
 #include <memkind/internal/wre_avl_tree.h>
 #include <memkind/internal/slab_allocator.h>
 #include <memkind/internal/heatmap.h>
+#include <memkind/internal/page_migration.h>
+#include <memkind/internal/qsbr.h>
+#include "jemalloc/jemalloc.h"
 
 #include <pthread.h>
 #include <stdint.h>
@@ -22,6 +26,7 @@
 #include <stdatomic.h>
 #include <assert.h>
 #include <string.h>
+#include <threads.h>
 #include "unistd.h"
 #include <fcntl.h>
 #include <signal.h>
@@ -42,15 +47,73 @@
 // struct tblock *tblocks;
 static slab_alloc_t tblock_alloc;
 static slab_alloc_t ttype_alloc;
+// see tachanka_get_stats()
+static _Atomic size_t g_typesCount = 0u;
+static _Atomic size_t g_blocksCount = 0u;
 
 
 
 // TODO (possibly) move elsewhere - make sure multiple rankings are supported!
 static ranking_t *ranking;
-static lq_buffer_t ranking_event_buff;
-static _Atomic double g_dramToTotalDesiredRatio=1.0;
-static _Atomic double g_dramToTotalActualRatio=1.0;
+// cumulative ratios of tiers ordered by hotness, one per tier boundary;
+// element 0 is the dram (hottest tier) to total ratio
+static _Atomic double g_tierToTotalDesiredRatios[HOTNESS_MAX_THRESHOLDS]={1.0};
+static _Atomic double g_tierToTotalActualRatios[HOTNESS_MAX_THRESHOLDS]={1.0};
+static _Atomic size_t g_thresholdsCount=1u;
+// total size of all types, scales hotness of a single touch
+static size_t (*g_totalSizeSource)(void) = memtier_kind_get_total_size;
+// starts at 1 - zeroed cache entries are never valid
+static _Atomic uint64_t g_thresholdEpoch = 1u;
+
+typedef struct tier_cache_entry {
+    uint64_t hash;
+    uint32_t epoch; // lower bits of threshold epoch
+    int32_t tier;
+} tier_cache_entry_t;
+
+static thread_local tier_cache_entry_t g_tierCache[TIER_DECISION_CACHE_ENTRIES];
+
+static void threshold_epoch_bump(void)
+{
+    atomic_fetch_add_explicit(&g_thresholdEpoch, 1u, memory_order_release);
+}
 /*static*/ critnib *hash_to_type, *addr_to_block;
+// page runs of small allocations, HOTNESS_TRACKING_RUN granularity
+static critnib *addr_to_run;
+static _Atomic int g_trackingGranularity = DEFAULT_HOTNESS_TRACKING_GRANULARITY;
+
+// pending size deltas of runs, see tachanka_run_alloc()
+typedef struct run_cache_entry {
+    uintptr_t run; // 0 - empty
+    uint64_t hash;
+    size_t added;
+    size_t removed;
+    bool is_hot;
+} run_cache_entry_t;
+
+static thread_local run_cache_entry_t
+    g_runCache[HOTNESS_TRACKING_RUN_CACHE_ENTRIES];
+// entries of other generation belong to a previous tachanka instance
+static thread_local unsigned g_runCacheThreadGeneration = 0u;
+static _Atomic unsigned g_runCacheGeneration = 1u;
+static pthread_key_t g_runCacheKey;
+static pthread_once_t g_runCacheKeyOnce = PTHREAD_ONCE_INIT;
+// destroy events processed before create events of their blocks,
+// see process_create()
+typedef struct pending_destroy {
+    void *addr;
+    __u64 timestamp;
+} pending_destroy_t;
+
+// FIFO ring in the order of arrival - the first entry is evicted when full
+static pending_destroy_t g_pendingDestroys[RANKING_PENDING_DESTROYS_MAX];
+static size_t g_pendingDestroysHead = 0u;
+static size_t g_pendingDestroysCount = 0u;
+
+// iteration of tachanka_migrate_blocks() continues from these addresses
+// in the next cycle
+static uintptr_t g_migrationCursor = 0u;
+static uintptr_t g_runMigrationCursor = 0u;
 
 #define ADD(var,x) __sync_fetch_and_add(&(var), (x))
 #define SUB(var,x) __sync_fetch_and_sub(&(var), (x))
@@ -80,22 +143,8 @@ static int aggregate_ttypes(uintptr_t key, void *value, void *privdata) {
     return 0;
 }
 
-void register_block(uint64_t hash, void *addr, size_t size, bool is_hot)
+static struct ttype *get_type(uint64_t hash)
 {
-#if CHECK_ADDED_SIZE
-    if (g_total_ranking_size != g_total_critnib_size) {
-        log_info("rank %ld, crit: %ld", g_total_ranking_size, g_total_critnib_size);
-    }
-
-    if (g_total_ranking_size != g_total_critnib_size) 
-    {
-        log_info("g_total_ranking_size != g_total_critnib_size");
-    }
-    assert(g_total_ranking_size == g_total_critnib_size);
-#endif
-
-    //printf("hash: %lu\n", hash);
-
     struct ttype *t = critnib_get(hash_to_type, hash);
     if (!t) {
         t = slab_alloc_malloc(&ttype_alloc);
@@ -115,6 +164,9 @@ void register_block(uint64_t hash, void *addr, size_t size, bool is_hot)
                 log_fatal("Alloc type disappeared?!?");
                 exit(-1);
             }
+        } else {
+            atomic_fetch_add_explicit(&g_typesCount, 1u,
+                                      memory_order_relaxed);
         }
         t->f = EXPONENTIAL_COEFFS_NUMBER*HOTNESS_INITIAL_SINGLE_VALUE;
 #if PRINT_POLICY_LOG_STATISTICS_INFO && PRINT_POLICY_LOG_DETAILED_TYPE_INFO
@@ -123,18 +175,59 @@ void register_block(uint64_t hash, void *addr, size_t size, bool is_hot)
         log_info("new type created, total types: %lu", counter);
 #endif
     } // else: t is ok
+    return t;
+}
 
-    t->num_allocs++;
-    t->total_size+= size;
-    if (is_hot)
-        t->dram_size += size;
+// size the block stands for in its type and ranking
+static inline size_t tblock_accounted_size(const struct tblock *bl)
+{
+    if (bl->weight == 1.f)
+        return bl->size;
+    return (size_t)(bl->size * (double)bl->weight + 0.5);
+}
 
+static struct tblock *new_tblock(struct ttype *t, void *addr, size_t size,
+                                 float weight, bool is_hot)
+{
     struct tblock *bl = slab_alloc_malloc(&tblock_alloc);
 
     bl->addr = addr; // TODO do we need to store addr separately?
     bl->size = size;
     bl->type = t;
     bl->is_hot = is_hot;
+    bl->is_migrated = false;
+    bl->is_run = false;
+    bl->weight = weight;
+    bl->created = 0u;
+    atomic_fetch_add_explicit(&g_blocksCount, 1u, memory_order_relaxed);
+
+    size_t accounted = tblock_accounted_size(bl);
+    t->num_allocs++;
+    t->total_size+= accounted;
+    if (is_hot)
+        t->dram_size += accounted;
+    return bl;
+}
+
+static void register_sampled_block(uint64_t hash, void *addr, size_t size,
+                                   float weight, bool is_hot)
+{
+#if CHECK_ADDED_SIZE
+    if (g_total_ranking_size != g_total_critnib_size) {
+        log_info("rank %ld, crit: %ld", g_total_ranking_size, g_total_critnib_size);
+    }
+
+    if (g_total_ranking_size != g_total_critnib_size) 
+    {
+        log_info("g_total_ranking_size != g_total_critnib_size");
+    }
+    assert(g_total_ranking_size == g_total_critnib_size);
+#endif
+
+    //printf("hash: %lu\n", hash);
+
+    struct ttype *t = get_type(hash);
+    struct tblock *bl = new_tblock(t, addr, size, weight, is_hot);
 
 #if PRINT_CRITNIB_NEW_BLOCK_REGISTERED_INFO
     log_info("New block %d registered: addr %p size %lu type %d", fb, (void*)addr, size, nt);
@@ -156,6 +249,11 @@ void register_block(uint64_t hash, void *addr, size_t size, bool is_hot)
 #endif
 }
 
+void register_block(uint64_t hash, void *addr, size_t size, bool is_hot)
+{
+    register_sampled_block(hash, addr, size, 1.f, is_hot);
+}
+
 void realloc_block(void *addr, void *new_addr, size_t size)
 {
     struct tblock *bl = critnib_remove(addr_to_block, (intptr_t)addr);
@@ -227,6 +325,168 @@ void register_block_in_ranking(void * addr, size_t size)
 #endif
 }
 
+static inline uintptr_t run_of(const void *addr)
+{
+    return (uintptr_t)addr & ~(uintptr_t)(HOTNESS_TRACKING_RUN_SIZE - 1);
+}
+
+static inline char *tblock_end(const struct tblock *bl)
+{
+    return (char *)bl->addr +
+        (bl->is_run ? HOTNESS_TRACKING_RUN_SIZE : bl->size);
+}
+
+typedef struct run_pages {
+    char *next; // start of the part of the run that was not visited yet
+    bool to_hot;
+    size_t moved;
+    size_t movable;
+} run_pages_t;
+
+static void run_pages_move(run_pages_t *pages, char *end)
+{
+    size_t size = end - pages->next;
+    pages->movable += page_migration_movable_size(pages->next, size);
+    pages->moved += page_migration_move(pages->next, size, pages->to_hot);
+}
+
+static int move_run_gap(uintptr_t key, void *value, void *privdata)
+{
+    const struct tblock *bl = value;
+    run_pages_t *pages = privdata;
+    (void)key;
+    if ((char *)bl->addr > pages->next)
+        run_pages_move(pages, bl->addr);
+    if (tblock_end(bl) > pages->next)
+        pages->next = tblock_end(bl);
+    return 0;
+}
+
+// large blocks are tracked on their own, even if they share a run with
+// small allocations - pages of a run are moved without their pages;
+// @p movable is set to the number of bytes that could be moved
+static size_t range_move_pages(char *addr, char *end, bool is_run,
+                               bool to_hot, size_t *movable)
+{
+    if (!is_run) {
+        *movable = page_migration_movable_size(addr, end - addr);
+        return page_migration_move(addr, end - addr, to_hot);
+    }
+    run_pages_t pages = {addr, to_hot, 0u, 0u};
+    const struct tblock *large =
+        critnib_find_le(addr_to_block, (uintptr_t)addr);
+    if (large && tblock_end(large) > pages.next)
+        pages.next = tblock_end(large);
+    critnib_iter(addr_to_block, (uintptr_t)addr, (uintptr_t)end - 1u,
+                 move_run_gap, &pages);
+    if (pages.next < end)
+        run_pages_move(&pages, end);
+    *movable = pages.movable;
+    return pages.moved;
+}
+
+static size_t tblock_move_pages(const struct tblock *bl, bool to_hot,
+                                size_t *movable)
+{
+    return range_move_pages(bl->addr, tblock_end(bl), bl->is_run, to_hot,
+                            movable);
+}
+
+// pages of freed migrated blocks wait for tachanka_migrate_blocks() in a
+// FIFO ring, see release_tblock()
+typedef struct move_back {
+    char *addr;
+    char *end;
+    size_t size; // bytes accounted in the tier the block was moved to
+    bool is_run;
+    bool to_hot;
+} move_back_t;
+
+static move_back_t g_moveBacks[HOTNESS_MIGRATION_MOVE_BACKS_MAX];
+static size_t g_moveBacksHead = 0u;
+static size_t g_moveBacksCount = 0u;
+
+static void move_back_push(const struct tblock *bl)
+{
+    // pages of the oldest one stay where they are, charged to that tier
+    if (g_moveBacksCount == HOTNESS_MIGRATION_MOVE_BACKS_MAX) {
+        g_moveBacksHead =
+            (g_moveBacksHead + 1u) % HOTNESS_MIGRATION_MOVE_BACKS_MAX;
+        --g_moveBacksCount;
+    }
+    move_back_t *entry =
+        &g_moveBacks[(g_moveBacksHead + g_moveBacksCount++) %
+                     HOTNESS_MIGRATION_MOVE_BACKS_MAX];
+    entry->addr = bl->addr;
+    entry->end = tblock_end(bl);
+    entry->size = bl->size;
+    entry->is_run = bl->is_run;
+    entry->to_hot = !bl->is_hot;
+}
+
+/// @return number of bytes of ranges that were visited
+static size_t move_backs_process(size_t budget)
+{
+    size_t used = 0u;
+    while (g_moveBacksCount && used < budget) {
+        move_back_t *entry = &g_moveBacks[g_moveBacksHead];
+        g_moveBacksHead =
+            (g_moveBacksHead + 1u) % HOTNESS_MIGRATION_MOVE_BACKS_MAX;
+        --g_moveBacksCount;
+        size_t movable;
+        size_t moved = range_move_pages(entry->addr, entry->end,
+                                        entry->is_run, entry->to_hot,
+                                        &movable);
+        // size goes back in proportion to the pages that were moved
+        size_t size = movable ?
+            (size_t)((double)entry->size * moved / movable) : entry->size;
+        memtier_policy_data_hotness_transfer_size(entry->to_hot, size);
+        used += entry->end - entry->addr;
+    }
+    return used;
+}
+
+// readers from application threads may still hold the block
+static void tblock_reclaim(void *ptr, void *arg)
+{
+    (void)arg;
+    slab_alloc_free(ptr);
+}
+
+// block has to be already removed from its critnib
+static void release_tblock(struct tblock *bl)
+{
+    struct ttype *t = bl->type;
+    size_t accounted = tblock_accounted_size(bl);
+
+    SUB(t->num_allocs, 1);
+    assert(t->num_allocs >= 0);
+    SUB(t->total_size, accounted);
+    assert(t->total_size >= 0);
+    if (bl->is_hot)
+        SUB(t->dram_size, accounted);
+    assert(t->dram_size >= 0);
+    // memory is released from the kind it was allocated from - its pages
+    // are moved back to the node of that kind in the next migration cycle,
+    // otherwise the arena would reuse them for allocations accounted in the
+    // other tier; move_pages() keeps contents, so the range might be reused
+    // already
+    if (bl->is_migrated)
+        move_back_push(bl);
+
+#if PRINT_CRITNIB_UNREGISTER_BLOCK_INFO
+    log_info("Block unregistered: %d addr %p size %lu type %d h %f", 
+        bln, bl->addr, bl->size, bl->type, t->f);
+#endif
+
+    ranking_remove(ranking, t->f, accounted);
+
+    // block stays intact until the grace period ends - concurrent lookups
+    // see a consistent, just removed block
+    qsbr_retire(bl, tblock_reclaim, &tblock_alloc);
+    atomic_fetch_sub_explicit(&g_blocksCount, 1u, memory_order_relaxed);
+}
+
 void unregister_block(void *addr)
 {
     struct tblock *bl = critnib_remove(addr_to_block, (intptr_t)addr);
@@ -242,32 +502,11 @@ void unregister_block(void *addr)
         return;
     }
 
-    struct ttype *t = bl->type;
-
 #if CHECK_ADDED_SIZE
     g_total_critnib_size -= bl->size;
 #endif
 
-    SUB(t->num_allocs, 1);
-    assert(t->num_allocs >= 0);
-    SUB(t->total_size, bl->size);
-    assert(t->total_size >= 0);
-    if (bl->is_hot)
-        SUB(t->dram_size, bl->size);
-    assert(t->dram_size >= 0);
-    
-#if PRINT_CRITNIB_UNREGISTER_BLOCK_INFO
-    log_info("Block unregistered: %d addr %p size %lu type %d h %f", 
-        bln, (void*)addr, bl->size, bl->type, t->f);
-#endif
-
-    ranking_remove(ranking, t->f, bl->size);
-
-    // TODO is resetting to 0 really necessary?
-    bl->addr = 0;
-    bl->size = 0;
-    bl->type = 0;
-    slab_alloc_free(bl);
+    release_tblock(bl);
 
 #if CHECK_ADDED_SIZE
     if (g_total_ranking_size != g_total_critnib_size) {
@@ -281,23 +520,117 @@ void unregister_block(void *addr)
 #endif
 }
 
-MEMKIND_EXPORT Hotness_e tachanka_get_hotness_type(const void *addr)
+// separate blocks take precedence over runs - a large block might
+// share its first and last run with small allocations
+static struct tblock *find_tblock(const void *addr)
 {
     struct tblock *bl = critnib_find_le(addr_to_block, (uintptr_t)addr);
+    if (bl && (char *)addr < tblock_end(bl))
+        return bl;
+    if (g_trackingGranularity != HOTNESS_TRACKING_RUN)
+        return NULL;
+    return critnib_get(addr_to_run, run_of(addr));
+}
+
+static void register_run(uint64_t hash, void *run, size_t size, bool is_hot,
+                         __u64 timestamp)
+{
+    struct ttype *t = get_type(hash);
+    struct tblock *bl = new_tblock(t, run, size, 1.f, is_hot);
+    bl->is_run = true;
+    bl->created = timestamp;
+    // runs are inserted only by the thread that processes events
+    (void)critnib_insert(addr_to_run, (uintptr_t)run, bl, false);
+    ranking_add(ranking, t->f, size);
+}
 
-    if (!bl || addr >= bl->addr + bl->size)
+static void unregister_run(void *run)
+{
+    struct tblock *bl = critnib_remove(addr_to_run, (uintptr_t)run);
+    if (bl)
+        release_tblock(bl);
+}
+
+static void process_run_update(const EventDataRunUpdate *data,
+                               __u64 timestamp)
+{
+    struct tblock *bl = critnib_get(addr_to_run, (uintptr_t)data->address);
+    if (!bl) {
+        // frees from a run that is not tracked (its update was dropped or
+        // is still on its way from another thread) are lost
+        if (data->added > data->removed)
+            register_run(data->hash, data->address,
+                         data->added - data->removed, data->isHot,
+                         timestamp);
+        return;
+    }
+    struct ttype *t = bl->type;
+    if (data->added && timestamp > bl->created)
+        bl->created = timestamp;
+    if (data->added >= data->removed) {
+        size_t delta = data->added - data->removed;
+        bl->size += delta;
+        ADD(t->total_size, delta);
+        if (bl->is_hot)
+            ADD(t->dram_size, delta);
+        // allocations in migrated run reside in the tier of the run
+        if (bl->is_migrated)
+            memtier_policy_data_hotness_transfer_size(bl->is_hot, delta);
+        ranking_add(ranking, t->f, delta);
+        return;
+    }
+    size_t delta = data->removed - data->added;
+    if (delta >= bl->size) {
+        unregister_run(data->address);
+        return;
+    }
+    bl->size -= delta;
+    SUB(t->total_size, delta);
+    if (bl->is_hot)
+        SUB(t->dram_size, delta);
+    if (bl->is_migrated)
+        memtier_policy_data_hotness_transfer_size(!bl->is_hot, delta);
+    ranking_remove(ranking, t->f, delta);
+}
+
+// drops runs that lie entirely in a range returned to the allocator;
+// heals size of runs whose frees were lost
+static void process_run_release(void *addr, size_t size, __u64 timestamp)
+{
+    uintptr_t end = (uintptr_t)addr + size;
+    uintptr_t run = run_of((char *)addr + HOTNESS_TRACKING_RUN_SIZE - 1);
+    for (; run >= (uintptr_t)addr && run < end &&
+         end - run >= HOTNESS_TRACKING_RUN_SIZE;
+         run += HOTNESS_TRACKING_RUN_SIZE) {
+        struct tblock *bl = critnib_get(addr_to_run, run);
+        // run was allocated from again after the release
+        if (bl && bl->created < timestamp)
+            unregister_run((void *)run);
+    }
+}
+
+MEMKIND_EXPORT Hotness_e tachanka_get_hotness_type(const void *addr)
+{
+    qsbr_online();
+    struct tblock *bl = find_tblock(addr);
+
+    if (!bl) {
+        qsbr_offline();
         return HOTNESS_NOT_FOUND;
+    }
+    // types are never freed, only block has to be protected
     struct ttype *t = bl->type;
+    qsbr_offline();
 
     //printf("get_hotness block %d, type %d hot %g\n", bln, tblocks[bln].type, ttypes[tblocks[bln].type].f);
 
     thresh_t thresh = ranking_get_hot_threshold(ranking);
-    if (!thresh.threshValid || t->f == thresh.threshVal)
+    if (!thresh.threshValid)
         return HOTNESS_NOT_FOUND;
 
-    if (t->f > thresh.threshVal)
+    // type exactly at the threshold is hot, as in migration and tier lookup
+    if (t->f >= thresh.threshVal)
         return HOTNESS_HOT;
-    // (t->f < thresh.threshVal)
     return HOTNESS_COLD;
 }
 
@@ -306,20 +639,148 @@ MEMKIND_EXPORT double tachanka_get_hot_thresh(void)
     return ranking_get_hot_threshold(ranking).threshVal;
 }
 
+MEMKIND_EXPORT int tachanka_get_tier_hash(uint64_t hash)
+{
+    qsbr_online();
+    struct ttype *t = critnib_get(hash_to_type, hash);
+    qsbr_offline();
+    if (!t)
+        return -1;
+    size_t thresh_count = g_thresholdsCount;
+    thresh_t thresh[HOTNESS_MAX_THRESHOLDS];
+    ranking_get_thresholds(ranking, thresh, thresh_count);
+    // thresholds are non-increasing; type at a threshold is at least as hot
+    // as the part of memory above it, as in ranking_calculate_thresholds_total()
+    int tier = 0;
+    for (size_t i = 0; i < thresh_count; ++i) {
+        if (!thresh[i].threshValid)
+            return -1;
+        if (t->f < thresh[i].threshVal)
+            tier = i + 1;
+    }
+    return tier;
+}
+
+MEMKIND_EXPORT int tachanka_get_tier_hash_cached(uint64_t hash)
+{
+#if TIER_DECISION_CACHE_ENABLED
+    // epoch is read before the decision is made - if thresholds change in
+    // the meantime, the entry is already outdated when stored
+    uint32_t epoch =
+        atomic_load_explicit(&g_thresholdEpoch, memory_order_acquire);
+    tier_cache_entry_t *entry =
+        &g_tierCache[(hash ^ (hash >> 32)) & (TIER_DECISION_CACHE_ENTRIES - 1)];
+    if (entry->epoch == epoch && entry->hash == hash)
+        return entry->tier;
+    int tier = tachanka_get_tier_hash(hash);
+    entry->hash = hash;
+    entry->epoch = epoch;
+    entry->tier = tier;
+    return tier;
+#else
+    return tachanka_get_tier_hash(hash);
+#endif
+}
+
+MEMKIND_EXPORT void tachanka_get_stats(tachanka_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->types = atomic_load_explicit(&g_typesCount, memory_order_relaxed);
+    stats->blocks = atomic_load_explicit(&g_blocksCount, memory_order_relaxed);
+    size_t thresh_count = g_thresholdsCount;
+    thresh_t thresh[HOTNESS_MAX_THRESHOLDS];
+    ranking_controller controllers[HOTNESS_MAX_THRESHOLDS];
+    ranking_get_thresholds(ranking, thresh, thresh_count);
+    ranking_get_controllers(ranking, controllers, thresh_count);
+    stats->thresholds = thresh_count;
+    for (size_t i = 0; i < thresh_count; ++i) {
+        stats->thresh[i] = thresh[i].threshVal;
+        stats->thresh_valid[i] = thresh[i].threshValid;
+        stats->controller_error[i] = controllers[i].error;
+        stats->controller_integral[i] = controllers[i].integrated_error;
+    }
+}
+
+typedef struct type_visitor {
+    int (*cb)(const struct ttype *type, void *arg);
+    void *arg;
+} type_visitor_t;
+
+static int visit_type(uintptr_t key, void *value, void *privdata)
+{
+    (void)key;
+    type_visitor_t *visitor = privdata;
+    return visitor->cb(value, visitor->arg);
+}
+
+MEMKIND_EXPORT void
+tachanka_iter_types(int (*cb)(const struct ttype *type, void *arg), void *arg)
+{
+    type_visitor_t visitor = {cb, arg};
+    qsbr_online();
+    critnib_iter(hash_to_type, 0, UINTPTR_MAX, visit_type, &visitor);
+    qsbr_offline();
+}
+
+MEMKIND_EXPORT void tachanka_preload_type(uint64_t hash, double f,
+                                          const double *coeffs,
+                                          __u64 timestamp)
+{
+    qsbr_online();
+    struct ttype *t = get_type(hash);
+    qsbr_offline();
+    if (t->total_size)
+        return;
+    t->f = f;
+    t->t0 = timestamp;
+#if HOTNESS_POLICY == HOTNESS_POLICY_EXPONENTIAL_COEFFS
+    memcpy(t->hotness_history_coeffs, coeffs,
+           sizeof(t->hotness_history_coeffs));
+#else
+    (void)coeffs;
+#endif
+}
+
+MEMKIND_EXPORT void tachanka_set_thresholds(size_t thresh_count,
+                                            const double *thresh,
+                                            const bool *thresh_valid)
+{
+    thresh_t values[HOTNESS_MAX_THRESHOLDS];
+    if (thresh_count > HOTNESS_MAX_THRESHOLDS)
+        thresh_count = HOTNESS_MAX_THRESHOLDS;
+    for (size_t i = 0; i < thresh_count; ++i) {
+        values[i].threshVal = thresh[i];
+        values[i].threshValid = thresh_valid[i];
+    }
+    ranking_set_thresholds(ranking, values, thresh_count);
+    threshold_epoch_bump();
+}
+
+MEMKIND_EXPORT void tachanka_set_controller_params(double freq_hz,
+                                                   double feed_forward)
+{
+    ranking_set_controller_params(ranking, freq_hz, feed_forward);
+}
+
+MEMKIND_EXPORT uint64_t tachanka_get_threshold_epoch(void)
+{
+    return atomic_load_explicit(&g_thresholdEpoch, memory_order_acquire);
+}
+
 MEMKIND_EXPORT Hotness_e tachanka_get_hotness_type_hash(uint64_t hash)
 {
     Hotness_e ret = HOTNESS_NOT_FOUND;
+    qsbr_online();
     struct ttype *t = critnib_get(hash_to_type, hash);
+    qsbr_offline();
     if (t) {
         thresh_t thresh = ranking_get_hot_threshold(ranking);
-        if (!thresh.threshValid || t->f == thresh.threshVal)
+        if (!thresh.threshValid)
             ret = HOTNESS_NOT_FOUND;
-        else if (t->f > thresh.threshVal)
+        else if (t->f >= thresh.threshVal)
             ret = HOTNESS_HOT;
-        else {
-            assert(t->f < thresh.threshVal);
+        else
             ret = HOTNESS_COLD;
-        }
     }
 #if PRINT_POLICY_LOG_DETAILED_TYPE_INFO
     else log_info("not found, hash %lu", hash);
@@ -336,7 +797,7 @@ MEMKIND_EXPORT void touch(void *addr, __u64 timestamp, int from_malloc)
 #if CHECK_ADDED_SIZE
     assert(g_total_ranking_size == ranking_calculate_total_size(ranking));
 #endif
-    struct tblock *bl = critnib_find_le(addr_to_block, (uint64_t)addr);
+    struct tblock *bl = find_tblock(addr);
 #if PRINT_POLICY_LOG_TOUCH_STATISTICS
     static uint64_t all_touches=0;
     static uint64_t successful_touches=0;
@@ -352,16 +813,7 @@ MEMKIND_EXPORT void touch(void *addr, __u64 timestamp, int from_malloc)
 #endif
     if (!bl) {
 #if PRINT_CRITNIB_NOT_FOUND_ON_TOUCH_WARNING
-        log_info("WARNING: Addr %p not in known tachanka range  %p - %p", (char*)addr,
-            (char*)bl->addr, (char*)(bl->addr + bl->size));
-#endif
-        assert(from_malloc == 0);
-        return;
-    }
-    if ((char*)addr >= (char*)(bl->addr + bl->size)) {
-#if PRINT_CRITNIB_NOT_FOUND_ON_TOUCH_WARNING
-        log_info("WARNING: Addr %p not in known tachanka range  %p - %p", (char*)addr,
-            (char*)bl->addr, (char*)(bl->addr + bl->size));
+        log_info("WARNING: Addr %p not in known tachanka range", (char*)addr);
 #endif
         assert(from_malloc == 0);
         return;
@@ -400,10 +852,12 @@ MEMKIND_EXPORT void touch(void *addr, __u64 timestamp, int from_malloc)
 
             // total_size_all_types: factor that accounts for total allocation
             // size; used in order to avoid making hotness **0**
-            size_t total_size_all_types = memtier_kind_get_total_size();
+            // a touch of sampled block stands for weight touches, as its
+            // size does in total_size
+            size_t total_size_all_types = g_totalSizeSource();
             double hotness =
                 HOTNESS_TOUCH_SINGLE_VALUE*total_size_all_types
-                /(double)total_size ;
+                *(double)bl->weight/(double)total_size ;
             ranking_touch(ranking, t, timestamp, hotness);
         }
     }
@@ -434,8 +888,200 @@ MEMKIND_EXPORT void touch(void *addr, __u64 timestamp, int from_malloc)
     //assert(g_total_ranking_size == ranking_calculate_total_size(ranking));
 }
 
+// per-type accumulators of sampled touches, open addressing
+#define TOUCH_AGGREGATES_MAX PEBS_TOUCH_BATCH_ENTRIES
+#define TOUCH_AGGREGATE_SLOTS (2 * TOUCH_AGGREGATES_MAX)
+
+typedef struct touch_aggregate {
+    struct ttype *type;
+    __u64 timestamp;
+    double touches; // sum of weights of touched blocks
+} touch_aggregate_t;
+
+struct tachanka_touch_aggregator {
+    touch_aggregate_t slots[TOUCH_AGGREGATE_SLOTS];
+    size_t used[TOUCH_AGGREGATES_MAX];
+    size_t count;
+    size_t dropped;
+};
+
+// aggregator of tachanka_touch_batch()
+static tachanka_touch_aggregator_t g_touchAggregator;
+// aggregated touches passed to ranking; only used by the thread that
+// applies touches to ranking
+static ranking_touch_sample_t *g_touchFlushSamples = NULL;
+static size_t g_touchFlushCapacity = 0u;
+
+static int touch_sample_cmp(const void *a, const void *b)
+{
+    uintptr_t addr_a = (uintptr_t)((const tachanka_touch_sample_t *)a)->addr;
+    uintptr_t addr_b = (uintptr_t)((const tachanka_touch_sample_t *)b)->addr;
+    return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+static int ranking_touch_sample_cmp(const void *a, const void *b)
+{
+    const ranking_touch_sample_t *sample_a = a;
+    const ranking_touch_sample_t *sample_b = b;
+    uintptr_t type_a = (uintptr_t)sample_a->entry;
+    uintptr_t type_b = (uintptr_t)sample_b->entry;
+    if (type_a != type_b)
+        return (type_a > type_b) - (type_a < type_b);
+    return (sample_a->timestamp > sample_b->timestamp) -
+        (sample_a->timestamp < sample_b->timestamp);
+}
+
+MEMKIND_EXPORT tachanka_touch_aggregator_t *
+tachanka_touch_aggregator_create(void)
+{
+    tachanka_touch_aggregator_t *agg = jemk_calloc(1, sizeof(*agg));
+    if (!agg) {
+        log_fatal("tachanka_touch_aggregator_create: allocation failed!");
+        exit(-1);
+    }
+    return agg;
+}
+
+MEMKIND_EXPORT void
+tachanka_touch_aggregator_destroy(tachanka_touch_aggregator_t *agg)
+{
+    jemk_free(agg);
+}
+
+MEMKIND_EXPORT size_t
+tachanka_touch_aggregator_dropped(const tachanka_touch_aggregator_t *agg)
+{
+    return agg->dropped;
+}
+
+// applies aggregated touches to ranking: one update per type, even if
+// the type was touched in more than one aggregator
+MEMKIND_EXPORT size_t
+tachanka_touch_aggregators_flush(tachanka_touch_aggregator_t **aggs,
+                                 size_t aggs_count)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < aggs_count; ++i)
+        total += aggs[i]->count;
+    if (total > g_touchFlushCapacity) {
+        ranking_touch_sample_t *samples = jemk_realloc(
+            g_touchFlushSamples, total * sizeof(g_touchFlushSamples[0]));
+        if (!samples) {
+            log_fatal("tachanka_touch_aggregators_flush: allocation failed!");
+            exit(-1);
+        }
+        g_touchFlushSamples = samples;
+        g_touchFlushCapacity = total;
+    }
+    size_t total_size_all_types = g_totalSizeSource();
+    size_t count = 0;
+    for (size_t i = 0; i < aggs_count; ++i) {
+        tachanka_touch_aggregator_t *agg = aggs[i];
+        for (size_t j = 0; j < agg->count; ++j) {
+            touch_aggregate_t *slot = &agg->slots[agg->used[j]];
+            size_t total_size = slot->type->total_size;
+            // same hotness per touch as in touch()
+            if (total_size > 0) {
+                double hotness = HOTNESS_TOUCH_SINGLE_VALUE *
+                    total_size_all_types / (double)total_size;
+                g_touchFlushSamples[count].entry = slot->type;
+                g_touchFlushSamples[count].timestamp = slot->timestamp;
+                g_touchFlushSamples[count].add_hotness =
+                    hotness * slot->touches;
+                ++count;
+            }
+            slot->type = NULL;
+        }
+        agg->count = 0u;
+    }
+    qsort(g_touchFlushSamples, count, sizeof(g_touchFlushSamples[0]),
+          ranking_touch_sample_cmp);
+    ranking_touch_batch(ranking, g_touchFlushSamples, count);
+    size_t types = 0;
+    for (size_t i = 0; i < count; ++i)
+        if (i == 0 ||
+            g_touchFlushSamples[i].entry != g_touchFlushSamples[i - 1].entry)
+            ++types;
+    return types;
+}
+
+// false if aggregator is full
+static bool touch_aggregator_add_one(tachanka_touch_aggregator_t *agg,
+                                     struct ttype *type, float weight,
+                                     __u64 timestamp)
+{
+    size_t idx = (size_t)(((uintptr_t)type * 0x9E3779B97F4A7C15ull) >> 32) %
+        TOUCH_AGGREGATE_SLOTS;
+    while (agg->slots[idx].type && agg->slots[idx].type != type)
+        idx = (idx + 1) % TOUCH_AGGREGATE_SLOTS;
+    touch_aggregate_t *slot = &agg->slots[idx];
+    if (!slot->type) {
+        if (agg->count == TOUCH_AGGREGATES_MAX)
+            return false;
+        slot->type = type;
+        slot->timestamp = timestamp;
+        slot->touches = 0.;
+        agg->used[agg->count++] = idx;
+    }
+    if (timestamp > slot->timestamp)
+        slot->timestamp = timestamp;
+    slot->touches += weight;
+    return true;
+}
+
+// when aggregator gets full, it is either flushed (only allowed on the thread
+// that processes ranking events) or remaining samples of new types are dropped
+static size_t touch_aggregator_add(tachanka_touch_aggregator_t *agg,
+                                   tachanka_touch_sample_t *samples,
+                                   size_t count, bool flush_when_full,
+                                   size_t *touched)
+{
+    qsort(samples, count, sizeof(samples[0]), touch_sample_cmp);
+    size_t aggregated = 0u;
+    struct tblock *bl = NULL;
+    for (size_t i = 0; i < count; ++i) {
+        char *addr = samples[i].addr;
+        // samples are sorted - block of previous sample is reused
+        // as long as it covers the address
+        if (!bl || addr >= tblock_end(bl))
+            bl = find_tblock(addr);
+        if (!bl)
+            continue;
+        if (!touch_aggregator_add_one(agg, bl->type, bl->weight,
+                                      samples[i].timestamp)) {
+            if (!flush_when_full) {
+                agg->dropped++;
+                continue;
+            }
+            *touched += tachanka_touch_aggregators_flush(&agg, 1);
+            (void)touch_aggregator_add_one(agg, bl->type, bl->weight,
+                                           samples[i].timestamp);
+        }
+        ++aggregated;
+    }
+    return aggregated;
+}
+
+MEMKIND_EXPORT size_t
+tachanka_touch_aggregator_add(tachanka_touch_aggregator_t *agg,
+                              tachanka_touch_sample_t *samples, size_t count)
+{
+    return touch_aggregator_add(agg, samples, count, false, NULL);
+}
+
+MEMKIND_EXPORT size_t tachanka_touch_batch(tachanka_touch_sample_t *samples,
+                                           size_t count)
+{
+    tachanka_touch_aggregator_t *agg = &g_touchAggregator;
+    size_t touched = 0u;
+    (void)touch_aggregator_add(agg, samples, count, true, &touched);
+    touched += tachanka_touch_aggregators_flush(&agg, 1);
+    return touched;
+}
+
 static bool initialized=false;
-void tachanka_init(double old_window_hotness_weight, size_t event_queue_size)
+MEMKIND_EXPORT void tachanka_init(double old_window_hotness_weight,
+                                  size_t event_queue_size)
 {
 #if CHECK_ADDED_SIZE
     // re-initalize global variables
@@ -451,37 +1097,437 @@ void tachanka_init(double old_window_hotness_weight, size_t event_queue_size)
     read_maps();
 
     addr_to_block = critnib_new();
+    addr_to_run = critnib_new();
     hash_to_type = critnib_new();
 
     ranking_create(&ranking, old_window_hotness_weight);
-    ranking_event_init(&ranking_event_buff, event_queue_size);
+    ranking_event_rings_init(event_queue_size);
+    g_pendingDestroysHead = 0u;
+    g_pendingDestroysCount = 0u;
+    g_moveBacksHead = 0u;
+    g_moveBacksCount = 0u;
+    g_migrationCursor = 0u;
+    g_runMigrationCursor = 0u;
+    atomic_store(&g_typesCount, 0u);
+    atomic_store(&g_blocksCount, 0u);
+    // types and runs of the previous instance are gone
+    threshold_epoch_bump();
+    atomic_fetch_add(&g_runCacheGeneration, 1u);
 
     initialized = true;
 }
 
+MEMKIND_EXPORT void tachanka_set_total_size_source(size_t (*source)(void))
+{
+    g_totalSizeSource = source ? source : memtier_kind_get_total_size;
+}
+
+MEMKIND_EXPORT void tachanka_set_tracking_granularity(int granularity)
+{
+    if (granularity != HOTNESS_TRACKING_BLOCK &&
+        granularity != HOTNESS_TRACKING_RUN) {
+        log_fatal("Incorrect tracking granularity [%d], exiting", granularity);
+        exit(-1);
+    }
+    g_trackingGranularity = granularity;
+}
+
+MEMKIND_EXPORT int tachanka_get_tracking_granularity(void)
+{
+    return g_trackingGranularity;
+}
+
+static void run_cache_entry_flush(run_cache_entry_t *entry)
+{
+    if (!entry->added && !entry->removed)
+        return;
+    EventEntry_t event = {
+        .type = EVENT_RUN_UPDATE,
+        .data.runUpdateData = {
+            .hash = entry->hash,
+            .address = (void *)entry->run,
+            .added = entry->added,
+            .removed = entry->removed,
+            .isHot = entry->is_hot,
+        },
+    };
+    (void)tachanka_ranking_event_push(&event);
+    entry->added = 0u;
+    entry->removed = 0u;
+}
+
+static void run_cache_thread_exit(void *arg)
+{
+    (void)arg;
+    tachanka_run_flush();
+}
+
+static void run_cache_key_create(void)
+{
+    if (pthread_key_create(&g_runCacheKey, run_cache_thread_exit)) {
+        log_fatal("tachanka: pthread_key_create() failed");
+        exit(-1);
+    }
+}
+
+// @p installed is set if entry of another run was evicted
+static run_cache_entry_t *run_cache_get(uintptr_t run, bool *installed)
+{
+    unsigned generation =
+        atomic_load_explicit(&g_runCacheGeneration, memory_order_relaxed);
+    if (g_runCacheThreadGeneration != generation) {
+        memset(g_runCache, 0, sizeof(g_runCache));
+        // pthread_setspecific() might allocate - and re-enter through malloc
+        g_runCacheThreadGeneration = generation;
+        (void)pthread_once(&g_runCacheKeyOnce, run_cache_key_create);
+        // destructor is called for non-NULL values only
+        (void)pthread_setspecific(g_runCacheKey, g_runCache);
+    }
+    size_t idx = (run / HOTNESS_TRACKING_RUN_SIZE) &
+        (HOTNESS_TRACKING_RUN_CACHE_ENTRIES - 1);
+    run_cache_entry_t *entry = &g_runCache[idx];
+    *installed = entry->run != run;
+    if (*installed) {
+        run_cache_entry_flush(entry);
+        entry->run = run;
+    }
+    return entry;
+}
+
+MEMKIND_EXPORT bool tachanka_run_alloc(uint64_t hash, void *addr, bool is_hot)
+{
+    if (g_trackingGranularity != HOTNESS_TRACKING_RUN || !addr)
+        return false;
+    size_t size = jemk_malloc_usable_size(addr);
+    if (size > HOTNESS_TRACKING_RUN_MAX_OBJECT)
+        return false;
+    bool installed;
+    run_cache_entry_t *entry = run_cache_get(run_of(addr), &installed);
+    if (!entry->added) {
+        entry->hash = hash;
+        entry->is_hot = is_hot;
+    }
+    entry->added += size;
+    // new run is registered at once, so that its touches are not lost
+    if (installed ||
+        entry->added + entry->removed >= HOTNESS_TRACKING_RUN_FLUSH_BYTES)
+        run_cache_entry_flush(entry);
+    return true;
+}
+
+MEMKIND_EXPORT bool tachanka_run_free(void *addr, size_t size)
+{
+    if (g_trackingGranularity != HOTNESS_TRACKING_RUN || !addr ||
+        size > HOTNESS_TRACKING_RUN_MAX_OBJECT)
+        return false;
+    bool installed;
+    run_cache_entry_t *entry = run_cache_get(run_of(addr), &installed);
+    entry->removed += size;
+    if (entry->added + entry->removed >= HOTNESS_TRACKING_RUN_FLUSH_BYTES)
+        run_cache_entry_flush(entry);
+    return true;
+}
+
+MEMKIND_EXPORT void tachanka_run_flush(void)
+{
+    if (!initialized || g_runCacheThreadGeneration != g_runCacheGeneration)
+        return;
+    for (size_t i = 0; i < HOTNESS_TRACKING_RUN_CACHE_ENTRIES; ++i)
+        run_cache_entry_flush(&g_runCache[i]);
+}
+
+MEMKIND_EXPORT void tachanka_run_release(void *addr, size_t size)
+{
+    if (g_trackingGranularity != HOTNESS_TRACKING_RUN || !initialized ||
+        size < HOTNESS_TRACKING_RUN_SIZE)
+        return;
+    EventEntry_t event = {
+        .type = EVENT_RUN_RELEASE,
+        .data.runReleaseData = {
+            .address = addr,
+            .size = size,
+        },
+    };
+    (void)tachanka_ranking_event_push(&event);
+}
+
 MEMKIND_EXPORT void tachanka_set_dram_total_ratio(double desired, double actual)
 {
-    check_dram_total_ratio(desired);
-    check_dram_total_ratio(actual);
-    g_dramToTotalDesiredRatio = desired;
-    g_dramToTotalActualRatio = actual;
+    tachanka_set_tier_total_ratios(1u, &desired, &actual);
 }
 
-void tachanka_update_threshold(void)
+MEMKIND_EXPORT void tachanka_set_tier_total_ratios(size_t thresh_count,
+                                                   const double *desired,
+                                                   const double *actual)
+{
+    if (thresh_count == 0u || thresh_count > HOTNESS_MAX_THRESHOLDS) {
+        log_fatal("Incorrect number of tier thresholds [%zu], exiting",
+                  thresh_count);
+        exit(-1);
+    }
+    for (size_t i = 0; i < thresh_count; ++i) {
+        check_dram_total_ratio(desired[i]);
+        check_dram_total_ratio(actual[i]);
+        g_tierToTotalDesiredRatios[i] = desired[i];
+        g_tierToTotalActualRatios[i] = actual[i];
+    }
+    // ratios alone are taken into account by the next threshold update
+    if (g_thresholdsCount != thresh_count) {
+        g_thresholdsCount = thresh_count;
+        threshold_epoch_bump();
+    }
+}
+
+MEMKIND_EXPORT void tachanka_update_threshold(void)
 {
     // where can I take it from ? memkind_memtier! it supports tracking memory for static ratio policy
-    ranking_calculate_hot_threshold_dram_total(
-        ranking, g_dramToTotalDesiredRatio, g_dramToTotalActualRatio);
+    size_t thresh_count = g_thresholdsCount;
+    double desired[HOTNESS_MAX_THRESHOLDS];
+    double actual[HOTNESS_MAX_THRESHOLDS];
+    thresh_t thresh[HOTNESS_MAX_THRESHOLDS];
+    for (size_t i = 0; i < thresh_count; ++i) {
+        desired[i] = g_tierToTotalDesiredRatios[i];
+        actual[i] = g_tierToTotalActualRatios[i];
+    }
+    ranking_calculate_thresholds_total(ranking, thresh_count, desired, actual,
+                                       thresh);
+    threshold_epoch_bump();
 }
 
-void tachanka_destroy(void)
+typedef struct migration_candidates {
+    struct tblock *blocks[HOTNESS_MIGRATION_MAX_BLOCKS_PER_CYCLE];
+    size_t count;
+    size_t size;
+    size_t budget;
+    size_t visited; // blocks and runs, also those that are not candidates
+    size_t page_size;
+    thresh_t thresh;
+    uintptr_t last_addr;
+} migration_candidates_t;
+
+static bool migration_candidates_full(const migration_candidates_t *candidates)
+{
+    return candidates->count == HOTNESS_MIGRATION_MAX_BLOCKS_PER_CYCLE ||
+        candidates->size >= candidates->budget ||
+        candidates->visited == HOTNESS_MIGRATION_MAX_VISITS_PER_CYCLE;
+}
+
+static int collect_migration_candidates(uintptr_t key, void *value,
+                                        void *privdata)
+{
+    struct tblock *bl = value;
+    migration_candidates_t *candidates = privdata;
+    candidates->last_addr = key;
+    ++candidates->visited;
+    double f = bl->type->f;
+    size_t span = tblock_end(bl) - (char *)bl->addr;
+    // blocks smaller than page are never moved, their pages are shared
+    if (span < candidates->page_size ||
+        (f >= candidates->thresh.threshVal) == bl->is_hot)
+        return migration_candidates_full(candidates);
+    candidates->blocks[candidates->count++] = bl;
+    candidates->size += span;
+    return migration_candidates_full(candidates);
+}
+
+static void
+collect_migration_candidates_from(critnib *c, uintptr_t *cursor,
+                                  migration_candidates_t *candidates)
+{
+    candidates->last_addr = UINTPTR_MAX;
+    critnib_iter(c, *cursor, UINTPTR_MAX, collect_migration_candidates,
+                 candidates);
+    if (candidates->last_addr == UINTPTR_MAX ||
+        !migration_candidates_full(candidates))
+        *cursor = 0u; // whole range was visited - wrap around
+    else
+        *cursor = candidates->last_addr + 1u;
+}
+
+typedef struct tracked_ranges {
+    tachanka_range_t *ranges;
+    size_t count;
+    size_t max;
+    uintptr_t last_addr;
+} tracked_ranges_t;
+
+static int collect_tracked_range(uintptr_t key, void *value, void *privdata)
+{
+    const struct tblock *bl = value;
+    tracked_ranges_t *collected = privdata;
+    collected->last_addr = key;
+    collected->ranges[collected->count++] = (tachanka_range_t){
+        bl->addr, tblock_end(bl) - (char *)bl->addr};
+    return collected->count == collected->max;
+}
+
+MEMKIND_EXPORT size_t tachanka_get_tracked_ranges(uintptr_t *cursor,
+                                                  bool runs,
+                                                  tachanka_range_t *ranges,
+                                                  size_t max)
+{
+    if (!max)
+        return 0u;
+    tracked_ranges_t collected = {ranges, 0u, max, UINTPTR_MAX};
+    critnib_iter(runs ? addr_to_run : addr_to_block, *cursor, UINTPTR_MAX,
+                 collect_tracked_range, &collected);
+    if (collected.count < max)
+        *cursor = 0u; // whole range was visited - wrap around
+    else
+        *cursor = collected.last_addr + 1u;
+    return collected.count;
+}
+
+MEMKIND_EXPORT void tachanka_migrate_blocks(void)
+{
+    if (!page_migration_enabled())
+        return;
+    // freed blocks go first - their pages would be reused by the wrong tier
+    size_t budget = page_migration_get_budget();
+    size_t used = move_backs_process(budget);
+    static migration_candidates_t candidates;
+    candidates.count = 0u;
+    candidates.size = 0u;
+    candidates.visited = 0u;
+    candidates.budget = budget > used ? budget - used : 0u;
+    candidates.page_size = page_migration_get_page_size();
+    candidates.thresh = ranking_get_hot_threshold(ranking);
+    if (!candidates.thresh.threshValid)
+        return;
+    if (!candidates.budget) {
+        page_migration_cycle_done();
+        return;
+    }
+    // blocks are unregistered only by the thread that calls this function,
+    // so collected pointers stay valid after critnib_iter returns
+    collect_migration_candidates_from(addr_to_block, &g_migrationCursor,
+                                      &candidates);
+    if (g_trackingGranularity == HOTNESS_TRACKING_RUN &&
+        !migration_candidates_full(&candidates))
+        collect_migration_candidates_from(addr_to_run, &g_runMigrationCursor,
+                                          &candidates);
+
+    for (size_t i = 0; i < candidates.count; ++i) {
+        struct tblock *bl = candidates.blocks[i];
+        bool to_hot = !bl->is_hot;
+        size_t movable;
+        size_t moved = tblock_move_pages(bl, to_hot, &movable);
+        // block and its size change the tier only when all its pages are
+        // there; the others are moved again in the next cycles - pages
+        // already on the destination node count as moved
+        if (moved == 0u || moved < movable)
+            continue;
+        bl->is_hot = to_hot;
+        bl->is_migrated = !bl->is_migrated;
+        if (to_hot)
+            ADD(bl->type->dram_size, tblock_accounted_size(bl));
+        else
+            SUB(bl->type->dram_size, tblock_accounted_size(bl));
+        memtier_policy_data_hotness_transfer_size(to_hot, bl->size);
+    }
+    page_migration_cycle_done();
+}
+
+MEMKIND_EXPORT size_t tachanka_release_free_memory(void)
+{
+    // types are never freed
+    return slab_alloc_release_free_chunks(&tblock_alloc) +
+        critnib_release_free_memory(addr_to_block) +
+        critnib_release_free_memory(addr_to_run) +
+        critnib_release_free_memory(hash_to_type);
+}
+
+typedef struct page_purity {
+    double thresh;
+    uintptr_t page_mask;
+    uintptr_t page;
+    size_t hot;
+    size_t cold;
+    size_t pure_bytes;
+    size_t bytes;
+} page_purity_t;
+
+static void page_purity_flush(page_purity_t *purity)
+{
+    purity->pure_bytes += purity->hot > purity->cold ? purity->hot
+                                                     : purity->cold;
+    purity->bytes += purity->hot + purity->cold;
+    purity->hot = purity->cold = 0u;
+}
+
+static void page_purity_add(page_purity_t *purity, uintptr_t page,
+                            size_t bytes, bool hot)
+{
+    if (page != purity->page) {
+        page_purity_flush(purity);
+        purity->page = page;
+    }
+    if (hot)
+        purity->hot += bytes;
+    else
+        purity->cold += bytes;
+}
+
+// blocks are visited in address order
+static int page_purity_add_block(uintptr_t key, void *value, void *privdata)
+{
+    page_purity_t *purity = privdata;
+    struct tblock *bl = value;
+    bool hot = bl->type->f >= purity->thresh;
+    uintptr_t addr = (uintptr_t)bl->addr;
+    uintptr_t end = addr + bl->size;
+    uintptr_t first_page = addr & purity->page_mask;
+    uintptr_t last_page = (end - 1u) & purity->page_mask;
+    (void)key;
+    if (!bl->size)
+        return 0;
+    if (first_page == last_page) {
+        page_purity_add(purity, first_page, bl->size, hot);
+        return 0;
+    }
+    uintptr_t page_size = ~purity->page_mask + 1u;
+    page_purity_add(purity, first_page, first_page + page_size - addr, hot);
+    // pages in between hold only this block
+    size_t inner = last_page - first_page - page_size;
+    purity->pure_bytes += inner;
+    purity->bytes += inner;
+    page_purity_add(purity, last_page, end - last_page, hot);
+    return 0;
+}
+
+MEMKIND_EXPORT double tachanka_get_page_purity(void)
+{
+    thresh_t thresh = ranking_get_hot_threshold(ranking);
+    if (!thresh.threshValid)
+        return -1.;
+    page_purity_t purity = {
+        .thresh = thresh.threshVal,
+        .page_mask = ~(uintptr_t)(page_migration_get_page_size() - 1u),
+        .page = 0u,
+    };
+    qsbr_online();
+    critnib_iter(addr_to_block, 0, UINTPTR_MAX, page_purity_add_block,
+                 &purity);
+    qsbr_offline();
+    page_purity_flush(&purity);
+    return purity.bytes ? purity.pure_bytes / (double)purity.bytes : -1.;
+}
+
+MEMKIND_EXPORT void tachanka_destroy(void)
 {
     initialized = false;
     ranking_destroy(ranking);
-    ranking_event_destroy(&ranking_event_buff);
+    ranking_event_rings_fini();
 
     critnib_delete(addr_to_block);
+    critnib_delete(addr_to_run);
     critnib_delete(hash_to_type);
+    // retired blocks are released with their allocator
+    qsbr_forget(&tblock_alloc);
+    exec_maps_fini();
+    jemk_free(g_touchFlushSamples);
+    g_touchFlushSamples = NULL;
+    g_touchFlushCapacity = 0u;
 
     slab_alloc_destroy(&ttype_alloc);
     slab_alloc_destroy(&tblock_alloc);
@@ -508,77 +1554,250 @@ MEMKIND_EXPORT double tachanka_get_obj_hotness(int size)
 MEMKIND_EXPORT double tachanka_get_addr_hotness(void *addr)
 {
     double ret = -1;
-    struct tblock *bl = critnib_find_le(addr_to_block, (uintptr_t)addr);
+    qsbr_online();
+    struct tblock *bl = find_tblock(addr);
     if (bl) {
         struct ttype *t = bl->type;
         assert(t);
         ret = t->f;
     }
+    qsbr_offline();
     return ret;
 }
 
+MEMKIND_EXPORT bool tachanka_get_addr_hash(const void *addr, uint64_t *hash)
+{
+    qsbr_online();
+    struct tblock *bl = find_tblock(addr);
+    if (bl)
+        *hash = bl->type->hash;
+    qsbr_offline();
+    return bl;
+}
+
 // MEMKIND_EXPORT double tachanka_set_touch_callback(void *addr, const char *name)
 MEMKIND_EXPORT int tachanka_set_touch_callback(void *addr, tachanka_touch_callback cb, void* arg)
 {
     int ret = -1;
-    struct tblock *bl = critnib_find_le(addr_to_block, (uintptr_t)addr);
-    if (bl) {
-        struct ttype *t = bl->type;
-        assert(t);
+    qsbr_online();
+    struct tblock *bl = find_tblock(addr);
+    struct ttype *t = bl ? bl->type : NULL;
+    qsbr_offline();
+    if (t) {
         ranking_set_touch_callback(ranking, cb, arg, t);
         ret=0;
     }
     return ret;
 }
 
+static __u64 get_event_timestamp(void)
+{
+    struct timespec t;
+    int ret = clock_gettime(CLOCK_MONOTONIC, &t);
+    if (ret != 0) {
+        log_fatal("ASSERT RANKING EVENT CLOCK_GETTIME FAILURE!");
+        exit(-1);
+    }
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
 MEMKIND_EXPORT bool tachanka_ranking_event_push(EventEntry_t *event)
 {
+    // only events ordered by process_create()/process_destroy() and run
+    // updates need the clock - touches carry their own sample timestamp
+    if (event->type != EVENT_TOUCH && event->type != EVENT_SET_TOUCH_CALLBACK)
+        event->timestamp = get_event_timestamp();
+    else
+        event->timestamp = 0u;
 #if OFFLOAD_RANKING_OPS_TO_BACKGROUD_THREAD
     if (initialized == false) {
         log_fatal("push onto non-initialized queue");
         exit(-1);
     }
-    bool ret = ranking_event_push(&ranking_event_buff, event);
+    // losing a free would leave a dangling block in addr_to_block,
+    // other events only make the ranking less accurate
 #if ASSURE_RANKING_DELIVERY
-    while (!ret) {
-        usleep(1000);
-        ret = ranking_event_push(&ranking_event_buff, event);
-    }
+    bool must_deliver = true;
+#else
+    bool must_deliver = event->type == EVENT_DESTROY_REMOVE ||
+        event->type == EVENT_REALLOC || event->type == EVENT_RUN_UPDATE;
 #endif
+    return ranking_event_rings_push(event, must_deliver);
 #else // EXECUTE SYNCRONOUSLY
-    bool ret = true;
-    // TODO looks like a good place for refactor - code duplicated with pebs.c
+    tachanka_ranking_event_process(event);
+    return true;
+#endif
+}
+
+MEMKIND_EXPORT bool tachanka_ranking_event_pop(EventEntry_t *event)
+{
+    return tachanka_ranking_event_pop_batch(event, 1u) == 1u;
+}
+
+MEMKIND_EXPORT size_t tachanka_ranking_event_pop_batch(EventEntry_t *events,
+                                                       size_t max)
+{
+    if (initialized == false) {
+        log_fatal("pop from a non-initialized queue");
+        exit(-1);
+    }
+    return ranking_event_rings_pop_batch(events, max);
+}
+
+// Events of different threads are popped from different rings, so the
+// DESTROY_REMOVE of a block might be processed before its CREATE_ADD (block
+// allocated by one thread and freed by another), and the CREATE_ADD of a
+// reused address - before the DESTROY_REMOVE of its previous owner.
+// Event timestamps are used to restore the order.
+static pending_destroy_t *pending_destroy_at(size_t i)
+{
+    return &g_pendingDestroys[(g_pendingDestroysHead + i) %
+                              RANKING_PENDING_DESTROYS_MAX];
+}
+
+static void pending_destroy_add(void *addr, __u64 timestamp)
+{
+    if (g_pendingDestroysCount == RANKING_PENDING_DESTROYS_MAX) {
+        // evict the first one - its create event was most likely dropped
+        g_pendingDestroysHead =
+            (g_pendingDestroysHead + 1u) % RANKING_PENDING_DESTROYS_MAX;
+        --g_pendingDestroysCount;
+    }
+    pending_destroy_t *pending = pending_destroy_at(g_pendingDestroysCount++);
+    pending->addr = addr;
+    pending->timestamp = timestamp;
+}
+
+/// @return true if block created at @p timestamp was already destroyed
+static bool pending_destroy_consume(void *addr, __u64 timestamp)
+{
+    bool destroyed = false;
+    size_t kept = 0u;
+    // remaining entries are compacted in place, keeping the FIFO order
+    for (size_t i = 0u; i < g_pendingDestroysCount; ++i) {
+        pending_destroy_t *pending = pending_destroy_at(i);
+        bool expired =
+            pending->timestamp + RANKING_PENDING_DESTROY_TIMEOUT < timestamp;
+        if (pending->addr == addr || expired) {
+            // destroy older than create belongs to a previous block
+            // whose create was dropped - forget it as well
+            if (pending->addr == addr && pending->timestamp > timestamp)
+                destroyed = true;
+        } else {
+            *pending_destroy_at(kept++) = *pending;
+        }
+    }
+    g_pendingDestroysCount = kept;
+    return destroyed;
+}
+
+static void process_destroy(void *addr, __u64 timestamp)
+{
+    struct tblock *bl = critnib_get(addr_to_block, (uintptr_t)addr);
+    if (!bl) {
+        pending_destroy_add(addr, timestamp);
+        return;
+    }
+    // block was already re-registered by a newer allocation
+    if (bl->created > timestamp)
+        return;
+    unregister_block(addr);
+}
+
+static void process_create(uint64_t hash, void *addr, size_t size,
+                           float weight, bool is_hot, __u64 timestamp)
+{
+    if (g_pendingDestroysCount && pending_destroy_consume(addr, timestamp))
+        return;
+    struct tblock *bl = critnib_get(addr_to_block, (uintptr_t)addr);
+    if (bl) {
+        // create of an already freed block arrived late
+        if (bl->created > timestamp)
+            return;
+        // destroy of previous block at the same address is still on its way;
+        // it will be ignored because of its timestamp
+        unregister_block(addr);
+    }
+    // events of allocations that are not sampled carry no weight
+    register_sampled_block(hash, addr, size, weight > 0.f ? weight : 1.f,
+                           is_hot);
+    bl = critnib_get(addr_to_block, (uintptr_t)addr);
+    if (!bl)
+        return;
+    bl->created = timestamp;
+    register_block_in_ranking(addr, tblock_accounted_size(bl));
+}
+
+MEMKIND_EXPORT void tachanka_ranking_event_process(const EventEntry_t *event)
+{
     switch (event->type) {
         case EVENT_CREATE_ADD: {
-            EventDataCreateAdd *data = &event->data.createAddData;
-            register_block(data->hash, data->address, data->size);
-            register_block_in_ranking(data->address, data->size);
+            const EventDataCreateAdd *data = &event->data.createAddData;
+#if PRINT_PEBS_EVENT_INFO
+            log_debug("EVENT_CREATE_ADD, address %p, size %lu",
+                      data->address, data->size);
+#endif
+            process_create(data->hash, data->address, data->size,
+                           data->weight, data->isHot, event->timestamp);
             break;
         }
         case EVENT_DESTROY_REMOVE: {
-            EventDataDestroyRemove *data = &event->data.destroyRemoveData;
-            // REMOVE THE BLOCK FROM RANKING!!!
-            // TODO remove all the exclamation marks and clean up once this is done
-            unregister_block(data->address);
+            const EventDataDestroyRemove *data = &event->data.destroyRemoveData;
+#if PRINT_PEBS_EVENT_INFO
+            log_debug("EVENT_DESTROY_REMOVE, address %p", data->address);
+#endif
+            process_destroy(data->address, event->timestamp);
             break;
         }
         case EVENT_REALLOC: {
-            EventDataRealloc *data = &event->data.reallocData;
-            unregister_block(data->addressOld);
-//                     realloc_block(data->addressOld, data->addressNew, data->sizeNew);
-            register_block(0u /* FIXME hash should not be zero !!! */, data->addressNew, data->sizeNew);
-            register_block_in_ranking(data->addressNew, data->sizeNew);
+            const EventDataRealloc *data = &event->data.reallocData;
+#if PRINT_PEBS_EVENT_INFO
+            log_debug("EVENT_REALLOC, address [old->new]: %p -> %p,"
+                " hash %lu, new size %lu", data->addressOld,
+                data->addressNew, data->hash, data->sizeNew);
+#endif
+            // new block keeps type of the old one
+            const struct tblock *bl =
+                critnib_get(addr_to_block, (uintptr_t)data->addressOld);
+            uint64_t hash = bl ? bl->type->hash : data->hash;
+            process_destroy(data->addressOld, event->timestamp);
+//             realloc_block(data->addressOld, data->addressNew, data->sizeNew);
+            process_create(hash, data->addressNew, data->sizeNew, data->weight,
+                           data->isHot, event->timestamp);
             break;
         }
         case EVENT_SET_TOUCH_CALLBACK: {
-            EventDataSetTouchCallback *data = &event->data.touchCallbackData;
-            tachanka_set_touch_callback(data->address,
-                                        data->callback,
+#if PRINT_PEBS_EVENT_INFO
+            log_debug("EVENT_SET_TOUCH_CALLBACK");
+#endif
+            const EventDataSetTouchCallback *data =
+                &event->data.touchCallbackData;
+            tachanka_set_touch_callback(data->address, data->callback,
                                         data->callbackArg);
             break;
         }
+        case EVENT_RUN_UPDATE: {
+            const EventDataRunUpdate *data = &event->data.runUpdateData;
+#if PRINT_PEBS_EVENT_INFO
+            log_debug("EVENT_RUN_UPDATE, run %p, added %lu, removed %lu",
+                      data->address, data->added, data->removed);
+#endif
+            process_run_update(data, event->timestamp);
+            break;
+        }
+        case EVENT_RUN_RELEASE: {
+            const EventDataRunRelease *data = &event->data.runReleaseData;
+#if PRINT_PEBS_EVENT_INFO
+            log_debug("EVENT_RUN_RELEASE, address %p, size %lu",
+                      data->address, data->size);
+#endif
+            process_run_release(data->address, data->size, event->timestamp);
+            break;
+        }
+        // WARNING the touches that come from pebs are executed in-place
+        // this event was added to make the code testable (UT)
         case EVENT_TOUCH: {
-            EventDataTouch *data = &event->data.touchData;
+            const EventDataTouch *data = &event->data.touchData;
             touch(data->address, data->timestamp, 0 /*called from malloc*/);
             break;
         }
@@ -587,18 +1806,6 @@ MEMKIND_EXPORT bool tachanka_ranking_event_push(EventEntry_t *event)
             exit(-1);
         }
     }
-
-#endif
-    return ret;
-}
-
-MEMKIND_EXPORT bool tachanka_ranking_event_pop(EventEntry_t *event)
-{
-    if (initialized == false) {
-        log_fatal("pop from a non-initialized queue");
-        exit(-1);
-    }
-    return ranking_event_pop(&ranking_event_buff, event);
 }
 
 MEMKIND_EXPORT void tachanka_ranking_touch_all(__u64 timestamp, double add_hotness)
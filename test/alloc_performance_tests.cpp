@@ -5,8 +5,15 @@
 #include "allocator_perf_tool/Stats.hpp"
 #include "allocator_perf_tool/TaskFactory.hpp"
 #include "allocator_perf_tool/Thread.hpp"
+#include "allocator_perf_tool/TimerSysTime.hpp"
 #include "common.h"
 
+#include <memkind/internal/memkind_arena.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
 class AllocPerformanceTest: public ::testing::Test
 {
 private:
@@ -1658,3 +1665,51 @@ TEST_F(AllocPerformanceTest,
     run_test(AllocatorTypes::MEMKIND_HBW_PREFERRED, FunctionCalls::REALLOC, 72,
              1572864, 10000);
 }
+
+// Kind detection (e.g. in free() through libmemtier): address map filled by
+// extent hooks against jemalloc rtree lookup (jemk_arenalookupx)
+TEST_F(AllocPerformanceTest, test_TC_MEMKIND_MEMKIND_REGULAR_detect_kind)
+{
+    const size_t ALLOCS = 100000;
+    const size_t REPEATS = 100;
+    if (memkind_check_available(MEMKIND_REGULAR))
+        GTEST_SKIP() << "MEMKIND_REGULAR is not available";
+
+    std::vector<void *> ptrs;
+    for (size_t i = 0; i < ALLOCS; ++i) {
+        void *ptr = memkind_malloc(MEMKIND_REGULAR, 64 << (i % 7));
+        ASSERT_NE(ptr, nullptr);
+        ptrs.push_back(ptr);
+    }
+    for (void *ptr : ptrs) {
+        ASSERT_EQ(memkind_detect_kind(ptr), MEMKIND_REGULAR);
+        ASSERT_EQ(memkind_arena_detect_kind_lookup(ptr), MEMKIND_REGULAR);
+    }
+
+    // pointers are freed in other order than allocated
+    std::shuffle(ptrs.begin(), ptrs.end(), std::mt19937(11));
+    // kinds are accumulated, so that detection is not optimized out
+    uintptr_t acc = 0;
+    TimerSysTime timer;
+    timer.start();
+    for (size_t r = 0; r < REPEATS; ++r)
+        for (void *ptr : ptrs)
+            acc += (uintptr_t)memkind_arena_detect_kind_lookup(ptr);
+    double lookup_time = timer.getElapsedTime();
+    timer.start();
+    for (size_t r = 0; r < REPEATS; ++r)
+        for (void *ptr : ptrs)
+            acc -= (uintptr_t)memkind_detect_kind(ptr);
+    double map_time = timer.getElapsedTime();
+    ASSERT_EQ(acc, 0u);
+
+    for (void *ptr : ptrs)
+        memkind_free(MEMKIND_REGULAR, ptr);
+
+    GTestAdapter::RecordProperty("detect_kind_operations",
+                                 ALLOCS * REPEATS);
+    GTestAdapter::RecordProperty("total_time_spend_on_lookup", lookup_time);
+    GTestAdapter::RecordProperty("total_time_spend_on_address_map", map_time);
+    GTestAdapter::RecordProperty("ref_delta_time_percent",
+                                 (map_time / lookup_time - 1.0) * 100.0);
+}
@@ -7,8 +7,23 @@
 #include <memkind/internal/wre_avl_tree_internal.h>
 #include <memkind/internal/ranking_controller.h>
 #include "memkind/internal/heatmap.h"
-
-
+#include <memkind/internal/page_migration.h>
+#include <memkind/internal/ranking_event_rings.h>
+#include <memkind/internal/bthash.h>
+#include <memkind/internal/exec_maps.h>
+#include <memkind/internal/pebs.h>
+#include <memkind/internal/sample_trace.h>
+#include <memkind/internal/qsbr.h>
+#include <memkind/internal/alloc_sampling.h>
+#include <memkind/internal/memkind_arena.h>
+#include <memkind/internal/hotness_profile.h>
+#include <memkind/internal/hotness_stats.h>
+#include <memkind/internal/sample_source.h>
+
+
+#include <algorithm>
+#include <atomic>
+#include <map>
 #include <random>
 #include <thread>
 #include <vector>
@@ -17,11 +32,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <ucontext.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <dirent.h>
+#include <dlfcn.h>
+#include <numa.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include "common.h"
 #include "zipf.h"
@@ -346,7 +367,8 @@ extern "C" {
 #include "memkind/internal/wre_avl_tree.h"
 }
 
-class RankingTest: public ::testing::Test
+// ranking tests are run against each ranking backend
+class RankingTest: public ::testing::TestWithParam<int>
 {
 protected:
     ranking_t *ranking;
@@ -355,7 +377,7 @@ protected:
 private:
     void SetUp()
     {
-        ranking_create(&ranking, 0.9);
+        ranking_create_backend(&ranking, 0.9, GetParam());
 
         for (size_t i=0; i<BLOCKS_SIZE; ++i) {
             blocks[i].num_allocs=BLOCKS_SIZE-i;
@@ -371,11 +393,15 @@ private:
 };
 constexpr size_t RankingTest::BLOCKS_SIZE;
 
+INSTANTIATE_TEST_CASE_P(Backend, RankingTest,
+                        ::testing::Values(RANKING_BACKEND_WRE,
+                                          RANKING_BACKEND_HISTOGRAM));
+
 double quantify_dequantify(double hotness) {
     return exp(int(log(hotness)));
 }
 
-TEST_F(RankingTest, check_hotness_highest) {
+TEST_P(RankingTest, check_hotness_highest) {
     double RATIO_PMEM_ONLY=0;
     double thresh_highest =
         ranking_calculate_hot_threshold_dram_total(
@@ -404,7 +430,7 @@ TEST_F(RankingTest, check_hotness_highest) {
 #endif
 }
 
-TEST_F(RankingTest, check_hotness_lowest) {
+TEST_P(RankingTest, check_hotness_lowest) {
     double RATIO_DRAM_ONLY=1;
     double thresh_lowest =
         ranking_calculate_hot_threshold_dram_total(
@@ -422,7 +448,7 @@ TEST_F(RankingTest, check_hotness_lowest) {
     }
 }
 
-TEST_F(RankingTest, check_hotness_50_50) {
+TEST_P(RankingTest, check_hotness_50_50) {
     double RATIO_EQUAL=0.5;
     // equal by size
     // total size allocated:
@@ -464,7 +490,36 @@ TEST_F(RankingTest, check_hotness_50_50) {
 #endif
 }
 
-TEST_F(RankingTest, check_hotness_50_50_removed) {
+TEST_P(RankingTest, check_hotness_three_tiers) {
+    // 25% hot, 25% warm, 50% cold
+    const double TIER_TOTAL_RATIOS[] = { 0.25, 0.5 };
+    thresh_t thresh[2];
+    ranking_calculate_thresholds_total(ranking, 2, TIER_TOTAL_RATIOS,
+                                       TIER_TOTAL_RATIOS, thresh);
+    ASSERT_TRUE(thresh[0].threshValid);
+    ASSERT_TRUE(thresh[1].threshValid);
+    ASSERT_GE(thresh[0].threshVal, thresh[1].threshVal);
+#if !QUANTIFICATION_ENABLED
+    // n hottest blocks have size (1.+n)/2*n, 25% of total size: n ~ 50
+    ASSERT_RANGE(thresh[0].threshVal, 48, 51);
+    // same as check_hotness_50_50
+    ASSERT_RANGE(thresh[1].threshVal, 27, 29);
+#endif
+    thresh_t thresh_copy[2];
+    ranking_get_thresholds(ranking, thresh_copy, 2);
+    ASSERT_EQ(thresh_copy[0].threshVal, thresh[0].threshVal);
+    ASSERT_EQ(thresh_copy[1].threshVal, thresh[1].threshVal);
+    ASSERT_EQ(ranking_get_hot_threshold(ranking).threshVal,
+              thresh[0].threshVal);
+
+    // thresholds are non-increasing, even if ratios are not
+    const double TIER_TOTAL_RATIOS_CROSSED[] = { 0.5, 0.25 };
+    ranking_calculate_thresholds_total(ranking, 2, TIER_TOTAL_RATIOS_CROSSED,
+                                       TIER_TOTAL_RATIOS_CROSSED, thresh);
+    ASSERT_EQ(thresh[0].threshVal, thresh[1].threshVal);
+}
+
+TEST_P(RankingTest, check_hotness_50_50_removed) {
     const size_t SUBSIZE=10u;
     for (size_t i=SUBSIZE; i<BLOCKS_SIZE; ++i) {
         ranking_remove(ranking, blocks[i].f, blocks[i].num_allocs);
@@ -506,7 +561,25 @@ TEST_F(RankingTest, check_hotness_50_50_removed) {
 #endif
 }
 
-class RankingTestSameHotness: public ::testing::Test
+TEST_P(RankingTest, check_touch_moves_size) {
+    struct ttype entry = {};
+    entry.total_size = 1000u;
+    ranking_add(ranking, entry.f, entry.total_size);
+    size_t total = ranking_calculate_total_size(ranking);
+    for (uint64_t i=1; i<=100; ++i) {
+        ranking_touch(ranking, &entry, i*1000000u, 1000.);
+    }
+    ASSERT_GT(entry.f, 0);
+    ASSERT_EQ(ranking_calculate_total_size(ranking), total);
+    // whole size of entry was moved to its current hotness
+    ranking_remove(ranking, entry.f, entry.total_size);
+    ASSERT_EQ(ranking_calculate_total_size(ranking), total-entry.total_size);
+    double thresh_lowest = ranking_calculate_hot_threshold_dram_total(
+        ranking, 1, 1).threshVal;
+    ASSERT_EQ(thresh_lowest, 0);
+}
+
+class RankingTestSameHotness: public ::testing::TestWithParam<int>
 {
 protected:
     ranking_t *ranking;
@@ -515,7 +588,7 @@ protected:
 private:
     void SetUp()
     {
-        ranking_create(&ranking, 0.9);
+        ranking_create_backend(&ranking, 0.9, GetParam());
 
         for (size_t i=0; i<BLOCKS_SIZE; ++i) {
             blocks[i].num_allocs=BLOCKS_SIZE-i;
@@ -531,8 +604,12 @@ private:
 };
 constexpr size_t RankingTestSameHotness::BLOCKS_SIZE;
 
+INSTANTIATE_TEST_CASE_P(Backend, RankingTestSameHotness,
+                        ::testing::Values(RANKING_BACKEND_WRE,
+                                          RANKING_BACKEND_HISTOGRAM));
+
 // initialized
-TEST_F(RankingTestSameHotness, check_hotness_highest) {
+TEST_P(RankingTestSameHotness, check_hotness_highest) {
     double RATIO_PMEM_ONLY_TOTAL=0;
     double RATIO_PMEM_ONLY_PMEM=0;
     double thresh_highest = ranking_calculate_hot_threshold_dram_total(
@@ -568,7 +645,7 @@ TEST_F(RankingTestSameHotness, check_hotness_highest) {
 //     ASSERT_EQ(ranking_is_hot(ranking, &blocks[BLOCKS_SIZE-1]), true);
 }
 
-TEST_F(RankingTestSameHotness, check_hotness_lowest) {
+TEST_P(RankingTestSameHotness, check_hotness_lowest) {
     double RATIO_DRAM_ONLY=1;
     double thresh_lowest = ranking_calculate_hot_threshold_dram_total(
         ranking, RATIO_DRAM_ONLY, RATIO_DRAM_ONLY).threshVal;
@@ -583,7 +660,7 @@ TEST_F(RankingTestSameHotness, check_hotness_lowest) {
     }
 }
 
-TEST_F(RankingTestSameHotness, check_hotness_50_50) {
+TEST_P(RankingTestSameHotness, check_hotness_50_50) {
     double RATIO_EQUAL_TOTAL=0.5;
     double RATIO_EQUAL_PMEM=1;
     // when grouped in pairs, we get 150, 148, .., 52
@@ -620,23 +697,27 @@ TEST_F(RankingTestSameHotness, check_hotness_50_50) {
 #else
     ASSERT_RANGE(thresh_equal, 17, 19);
     ASSERT_EQ(thresh_equal, thresh_equal_pmem);
-    for (size_t i=0; i<18; ++i) {
+    // histogram interpolates on exact sizes: 2430 is hotter than 19,
+    // 95 of 112 with hotness 19 are needed - threshold is 18.15;
+    // wre tree gives a lower threshold
+    size_t first_hot = GetParam() == RANKING_BACKEND_HISTOGRAM ? 19 : 18;
+    for (size_t i=0; i<first_hot; ++i) {
         ASSERT_EQ(ranking_is_hot(ranking, &blocks[i]), false);
     }
-    for (size_t i=18; i<50; ++i) {
+    for (size_t i=first_hot; i<50; ++i) {
         ASSERT_EQ(ranking_is_hot(ranking, &blocks[i]), true);
     }
-    for (size_t i=50; i<68; ++i) {
+    for (size_t i=50; i<50+first_hot; ++i) {
         ASSERT_EQ(ranking_is_hot(ranking, &blocks[i]), false);
     }
-    for (size_t i=68; i<100; ++i) {
+    for (size_t i=50+first_hot; i<100; ++i) {
         ASSERT_EQ(ranking_is_hot(ranking, &blocks[i]), true);
     }
     ASSERT_EQ(BLOCKS_SIZE, 100u);
 #endif
 }
 
-TEST_F(RankingTestSameHotness, check_hotness_50_50_removed) {
+TEST_P(RankingTestSameHotness, check_hotness_50_50_removed) {
     const size_t SUBSIZE=10u;
     for (size_t i=SUBSIZE; i<BLOCKS_SIZE; ++i) {
         ranking_remove(ranking, blocks[i].f, blocks[i].num_allocs);
@@ -1262,7 +1343,7 @@ TEST_F(IntegrationHotnessSingleTest, test_random_hotness)
     Hotness_e b_type=mb.GetHotnessType();
     Hotness_e c_type=mc.GetHotnessType();
 
-    ASSERT_EQ(a_type, HOTNESS_NOT_FOUND); // when exactly equal thresh
+    ASSERT_EQ(a_type, HOTNESS_HOT); // when exactly equal thresh
     ASSERT_EQ(b_type, HOTNESS_COLD);
     ASSERT_EQ(c_type, HOTNESS_COLD);
 
@@ -1389,7 +1470,7 @@ TEST_F(IntegrationHotnessSingleTest, test_random_allocation_type)
                 Hotness_e c_type=mc.GetHotnessType();
 
                 ASSERT_EQ(a_type, HOTNESS_HOT);
-                ASSERT_EQ(b_type, HOTNESS_NOT_FOUND);  // exactly at thresh
+                ASSERT_EQ(b_type, HOTNESS_HOT);  // exactly at thresh
                 ASSERT_EQ(c_type, HOTNESS_HOT);
                 break;
             }
@@ -1407,7 +1488,7 @@ TEST_F(IntegrationHotnessSingleTest, test_random_allocation_type)
                 Hotness_e b_type=mb.GetHotnessType();
                 Hotness_e c_type=mc.GetHotnessType();
                 ASSERT_EQ(a_type, HOTNESS_HOT);
-                ASSERT_EQ(b_type, HOTNESS_NOT_FOUND);  // exactly at thresh
+                ASSERT_EQ(b_type, HOTNESS_HOT);  // exactly at thresh
                 ASSERT_EQ(c_type, HOTNESS_HOT);
 
                 memkind_t a_kind = ma.DetectKind();
@@ -1952,6 +2033,166 @@ TEST(SlabAlloc, Alignment) {
     test_slab_alloc_alignment(7, 291);
 }
 
+// Threads allocate, verify and free elements - half of them on another
+// thread, so that magazines travel through depots
+TEST(SlabAlloc, ConcurrentMagazines) {
+    const size_t THREADS = 8;
+    const size_t ROUNDS = 2000;
+    const size_t MAX_LIVE = 4 * SLAB_ALLOC_MAGAZINE_SIZE;
+    slab_alloc_t alloc;
+    ASSERT_EQ(slab_alloc_init(&alloc, sizeof(uint64_t), 0), 0);
+
+    std::mutex exchange_mutex;
+    std::vector<uint64_t *> exchange;
+    std::atomic<size_t> errors(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&, t]() {
+            std::mt19937 gen(t);
+            std::vector<uint64_t *> live;
+            size_t local_errors = 0;
+            for (size_t r = 0; r < ROUNDS; ++r) {
+                size_t count = gen() % MAX_LIVE;
+                for (size_t i = 0; i < count; ++i) {
+                    live.push_back((uint64_t *)slab_alloc_malloc(&alloc));
+                    *live.back() = (t << 32) | i;
+                }
+                for (size_t i = 0; i < count; ++i)
+                    local_errors += *live[i] != ((t << 32) | i);
+                std::shuffle(live.begin(), live.end(), gen);
+                std::vector<uint64_t *> received;
+                {
+                    std::lock_guard<std::mutex> lock(exchange_mutex);
+                    received.swap(exchange);
+                    exchange.assign(live.begin() + count / 2, live.end());
+                }
+                live.resize(count / 2);
+                for (uint64_t *element : live)
+                    slab_alloc_free(element);
+                for (uint64_t *element : received)
+                    slab_alloc_free(element);
+                live.clear();
+            }
+            errors += local_errors;
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    for (uint64_t *element : exchange)
+        slab_alloc_free(element);
+    ASSERT_EQ(errors, 0u);
+
+    // magazines of exited threads are back in the depot -
+    // all elements can be reused without growing the slab
+    size_t used = alloc.used;
+    std::vector<uint64_t *> all(used);
+    for (auto &element : all)
+        element = (uint64_t *)slab_alloc_malloc(&alloc);
+    ASSERT_EQ(alloc.used, used);
+    std::sort(all.begin(), all.end());
+    ASSERT_TRUE(std::adjacent_find(all.begin(), all.end()) == all.end());
+    for (auto element : all)
+        slab_alloc_free(element);
+    slab_alloc_destroy(&alloc);
+}
+
+// Allocator destroyed (and re-created in place) while a thread still holds
+// its cache - thread exit must not touch the new allocator
+TEST(SlabAlloc, DestroyWithThreadCaches) {
+    slab_alloc_t alloc;
+    ASSERT_EQ(slab_alloc_init(&alloc, 8, 0), 0);
+    std::atomic<int> step(0);
+    std::thread thread([&]() {
+        slab_alloc_free(slab_alloc_malloc(&alloc));
+        step = 1;
+        while (step != 2)
+            std::this_thread::yield();
+    });
+    while (step != 1)
+        std::this_thread::yield();
+    slab_alloc_destroy(&alloc);
+    ASSERT_EQ(slab_alloc_init(&alloc, 8, 0), 0);
+    void *element = slab_alloc_malloc(&alloc);
+    step = 2;
+    thread.join();
+    slab_alloc_free(element);
+    ASSERT_EQ(slab_alloc_malloc(&alloc), element);
+    ASSERT_EQ(alloc.used, 1u);
+    slab_alloc_destroy(&alloc);
+}
+
+static bool slab_page_resident(void *addr)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    void *page = (void *)((uintptr_t)addr & ~(uintptr_t)(page_size - 1));
+    unsigned char vec = 0;
+    if (mincore(page, page_size, &vec))
+        return true;
+    return vec & 1;
+}
+
+TEST(SlabAlloc, ReleaseFreeChunks) {
+    const size_t CHUNKS = 16;
+    slab_alloc_t alloc;
+    ASSERT_EQ(slab_alloc_init(&alloc, 48, 0), 0);
+    const size_t ELEMENT_SIZE = 48 + sizeof(freelist_node_meta_t);
+    const size_t ELEMENTS = CHUNKS * SLAB_ALLOC_CHUNK_SIZE / ELEMENT_SIZE;
+    std::vector<uint8_t *> elements(ELEMENTS);
+    for (auto &element : elements) {
+        element = (uint8_t *)slab_alloc_malloc(&alloc);
+        memset(element, 0xab, 48);
+    }
+    ASSERT_EQ(slab_alloc_release_free_chunks(&alloc), 0u);
+
+    // chunk 3 stays half-used; elements freed last stay in thread cache,
+    // so chunk 0 is not free either
+    auto in_chunk = [&](uint8_t *element, size_t chunk) {
+        size_t offset = element - elements[0] + sizeof(freelist_node_meta_t);
+        return offset / SLAB_ALLOC_CHUNK_SIZE == chunk;
+    };
+    std::vector<uint8_t *> kept;
+    for (size_t i = ELEMENTS; i-- > 0;) {
+        if (in_chunk(elements[i], 3) && i % 2)
+            kept.push_back(elements[i]);
+        else
+            slab_alloc_free(elements[i]);
+    }
+    size_t resident = slab_alloc_resident_size(&alloc);
+    size_t released = slab_alloc_release_free_chunks(&alloc);
+    ASSERT_GE(released, (CHUNKS - 3) * SLAB_ALLOC_CHUNK_SIZE);
+    ASSERT_LT(released, (CHUNKS - 1) * SLAB_ALLOC_CHUNK_SIZE);
+    ASSERT_EQ(slab_alloc_resident_size(&alloc), resident - released);
+    ASSERT_FALSE(slab_page_resident(elements[ELEMENTS / 2]));
+    ASSERT_TRUE(slab_page_resident(kept[0]));
+    // nothing new to release
+    ASSERT_EQ(slab_alloc_release_free_chunks(&alloc), 0u);
+
+    // densest chunk with free elements is reused first
+    uint8_t *first = nullptr;
+    std::thread([&]() {
+        first = (uint8_t *)slab_alloc_malloc(&alloc);
+        slab_alloc_free(first);
+    }).join();
+    ASSERT_TRUE(in_chunk(first, 3));
+
+    // released chunks are reused before the slab grows
+    size_t used = alloc.used;
+    std::vector<uint8_t *> reused(ELEMENTS - kept.size());
+    for (auto &element : reused) {
+        element = (uint8_t *)slab_alloc_malloc(&alloc);
+        memset(element, 0xcd, 48);
+    }
+    ASSERT_EQ(alloc.used, used);
+    ASSERT_EQ(slab_alloc_resident_size(&alloc), resident);
+    reused.insert(reused.end(), kept.begin(), kept.end());
+    std::sort(reused.begin(), reused.end());
+    ASSERT_TRUE(std::adjacent_find(reused.begin(), reused.end()) ==
+                reused.end());
+    for (auto element : kept)
+        ASSERT_EQ(element[0], 0xab);
+    slab_alloc_destroy(&alloc);
+}
+
 #define assert_close(a, b) do { \
 const double ACCURACY=1e-9; /* arbitrary value */ \
     double diff = a-b; \
@@ -2058,7 +2299,324 @@ TEST(RankingController, Gain) {
 #endif
 }
 
-// TODO write a test for integral part of controller
+TEST(RankingController, AntiWindup) {
+    ranking_controller controller;
+    ranking_controller_init_ranking_controller(&controller, 0.5, 0, 0.1);
+    double fixed_thresh = 0;
+    // hot tier exhausted for a long time: nothing gets to DRAM
+    for (int i = 0; i < 1000; ++i)
+        fixed_thresh =
+            ranking_controller_calculate_fixed_thresh(&controller, 0);
+    ASSERT_EQ(fixed_thresh, 1.0);
+    // integration stopped when the output saturated
+    assert_close(controller.integrated_error * controller.integral, -0.5);
+    // too much in DRAM: output leaves saturation at once, not after
+    // unwinding 1000 cycles of integrated error
+    fixed_thresh = ranking_controller_calculate_fixed_thresh(&controller, 0.9);
+    assert_close(fixed_thresh, 0.96);
+}
+
+TEST(RankingController, RateLimit) {
+    ranking_controller controller;
+    ranking_controller_init_ranking_controller(&controller, 0.7, 1, 0);
+    ranking_controller_set_limits(&controller, 0.05, 0, 0, 0);
+    // the first output is not limited
+    double fixed_thresh =
+        ranking_controller_calculate_fixed_thresh(&controller, 0.85);
+    assert_close(fixed_thresh, 0.55);
+    fixed_thresh = ranking_controller_calculate_fixed_thresh(&controller, 0.7);
+    assert_close(fixed_thresh, 0.6);
+    fixed_thresh = ranking_controller_calculate_fixed_thresh(&controller, 1);
+    assert_close(fixed_thresh, 0.55);
+    fixed_thresh = ranking_controller_calculate_fixed_thresh(&controller, 1);
+    assert_close(fixed_thresh, 0.5);
+    fixed_thresh = ranking_controller_calculate_fixed_thresh(&controller, 0.7);
+    assert_close(fixed_thresh, 0.55);
+    // change of expected ratio is not limited, only the correction
+    ranking_controller_set_expected_dram_total(&controller, 0.3);
+    fixed_thresh = ranking_controller_calculate_fixed_thresh(&controller, 0.3);
+    assert_close(fixed_thresh, 0.2);
+}
+
+TEST(RankingController, FeedForward) {
+    ranking_controller controller;
+    ranking_controller_init_ranking_controller(&controller, 0.3, 0, 0);
+    double fixed_thresh =
+        ranking_controller_calculate_fixed_thresh_ff(&controller, 0.35, 0.3);
+    assert_close(fixed_thresh, 0.3);
+    ranking_controller_set_limits(&controller, 0, 0, 0, 1);
+    // 0.05 of DRAM is used by memory that ranking does not select
+    fixed_thresh =
+        ranking_controller_calculate_fixed_thresh_ff(&controller, 0.35, 0.3);
+    assert_close(fixed_thresh, 0.25);
+    fixed_thresh =
+        ranking_controller_calculate_fixed_thresh_ff(&controller, 0.3, 0.25);
+    assert_close(fixed_thresh, 0.25);
+}
+
+TEST(RankingController, GainScheduling) {
+    ranking_t *ranking;
+    ranking_create(&ranking, 0.9);
+    ranking_controller controllers[HOTNESS_MAX_THRESHOLDS];
+    ranking_get_controllers(ranking, controllers, HOTNESS_MAX_THRESHOLDS);
+    assert_close(controllers[0].integral, CONTROLLER_INTEGRAL_GAIN);
+    assert_close(controllers[0].maxStep, CONTROLLER_MAX_STEP);
+    ranking_set_controller_params(ranking, 4 * HOTNESS_PEBS_THREAD_FREQUENCY,
+                                  0.5);
+    ranking_get_controllers(ranking, controllers, HOTNESS_MAX_THRESHOLDS);
+    for (size_t i = 0; i < HOTNESS_MAX_THRESHOLDS; ++i) {
+        assert_close(controllers[i].proportional,
+                     CONTROLLER_PROPORTIONAL_GAIN);
+        assert_close(controllers[i].integral, CONTROLLER_INTEGRAL_GAIN / 4);
+        assert_close(controllers[i].maxStep, CONTROLLER_MAX_STEP / 4);
+        assert_close(controllers[i].trackingLimit, CONTROLLER_TRACKING_LIMIT);
+        assert_close(controllers[i].feedForward, 0.5);
+    }
+    ranking_destroy(ranking);
+}
+
+// Step response harness: application with cold objects and a hot working
+// set of variable size, all of equal size; hot objects are allocated in
+// DRAM, then objects migrate between tiers (with a lag) to follow the
+// threshold calculated by the real ranking. DRAM also holds memory unknown
+// to ranking and can be capped (hot tier exhausted).
+static const double STEP_RESPONSE_TARGET = 0.3;
+static const double STEP_RESPONSE_BAND = 0.02;
+
+class ControllerStepResponse: public ::testing::Test
+{
+protected:
+    static constexpr size_t COLD_OBJECTS = 800u;
+    static constexpr size_t HOT_OBJECTS = 800u; // largest hot working set
+    // objects moved in each direction per threshold calculation
+    static constexpr size_t MIGRATIONS_PER_CYCLE = 20u;
+
+    struct Object {
+        double hotness;
+        bool live;
+        bool inDram;
+    };
+
+    struct Response {
+        double settlingSeconds; // until ratio stays within band of target
+        double overshoot;       // beyond target, away from the start
+        double steadyError;     // mean error of the last seconds
+    };
+
+    ranking_t *ranking;
+    // ordered by hotness
+    std::vector<Object> objects;
+    size_t liveObjects;
+    size_t dramObjects;
+    double dramCap;
+    // objects in DRAM unknown to ranking
+    size_t untracked;
+
+    void SetUp()
+    {
+        ranking_create(&ranking, 0.9);
+        objects.resize(COLD_OBJECTS + HOT_OBJECTS);
+        for (size_t i = 0; i < objects.size(); ++i)
+            objects[i] = {i < COLD_OBJECTS ? 1. + i * 1e-3
+                                           : 1000. + i - COLD_OBJECTS,
+                          false, false};
+        liveObjects = 0u;
+        dramObjects = 0u;
+        dramCap = 1.;
+        untracked = 50u;
+        for (size_t i = 0; i < COLD_OBJECTS; ++i)
+            allocate(objects[i]);
+    }
+
+    void TearDown()
+    {
+        ranking_destroy(ranking);
+    }
+
+    size_t dram_cap_objects() const
+    {
+        double cap = dramCap * (liveObjects + untracked) - untracked;
+        return cap > 0 ? (size_t)cap : 0u;
+    }
+
+    void allocate(Object &object)
+    {
+        thresh_t thresh = ranking_get_hot_threshold(ranking);
+        ranking_add(ranking, object.hotness, 1u);
+        object.live = true;
+        ++liveObjects;
+        object.inDram = thresh.threshValid &&
+            object.hotness >= thresh.threshVal &&
+            dramObjects < dram_cap_objects();
+        if (object.inDram)
+            ++dramObjects;
+    }
+
+    void free(Object &object)
+    {
+        ranking_remove(ranking, object.hotness, 1u);
+        if (object.inDram)
+            --dramObjects;
+        object.live = false;
+        object.inDram = false;
+        --liveObjects;
+    }
+
+    void set_hot_working_set(size_t hot)
+    {
+        for (size_t i = 0; i < HOT_OBJECTS; ++i) {
+            Object &object = objects[COLD_OBJECTS + i];
+            if (i < hot && !object.live)
+                allocate(object);
+            else if (i >= hot && object.live)
+                free(object);
+        }
+    }
+
+    double used_ratio() const
+    {
+        return (double)(dramObjects + untracked) / (liveObjects + untracked);
+    }
+
+    void move(Object &object, bool to_dram)
+    {
+        object.inDram = to_dram;
+        if (to_dram)
+            ++dramObjects;
+        else
+            --dramObjects;
+    }
+
+    void migrate(thresh_t thresh)
+    {
+        // other users of the hot tier evict the coldest objects
+        for (size_t i = 0; i < objects.size() &&
+             dramObjects > dram_cap_objects(); ++i)
+            if (objects[i].inDram)
+                move(objects[i], false);
+        // ranking is never empty here - threshold is invalid only when
+        // all of it is wanted in DRAM
+        double threshold = thresh.threshValid ? thresh.threshVal : 0.;
+        size_t demoted = 0u;
+        for (size_t i = 0;
+             i < objects.size() && demoted < MIGRATIONS_PER_CYCLE; ++i) {
+            if (objects[i].inDram && objects[i].hotness < threshold) {
+                move(objects[i], false);
+                ++demoted;
+            }
+        }
+        size_t promoted = 0u;
+        for (size_t i = objects.size(); i-- > 0 &&
+             promoted < MIGRATIONS_PER_CYCLE &&
+             dramObjects < dram_cap_objects();) {
+            if (objects[i].live && !objects[i].inDram &&
+                objects[i].hotness >= threshold) {
+                move(objects[i], true);
+                ++promoted;
+            }
+        }
+    }
+
+    Response run(size_t cycles, double dram_cap = 1.)
+    {
+        double start = used_ratio();
+        dramCap = dram_cap;
+        std::vector<double> ratios;
+        for (size_t c = 0; c < cycles; ++c) {
+            thresh_t thresh = ranking_calculate_hot_threshold_dram_total(
+                ranking, STEP_RESPONSE_TARGET, used_ratio());
+            migrate(thresh);
+            ratios.push_back(used_ratio());
+        }
+        Response response = {0., 0., 0.};
+        size_t settled = 0u;
+        for (size_t c = 0; c < cycles; ++c) {
+            double error = ratios[c] - STEP_RESPONSE_TARGET;
+            if (fabs(error) > STEP_RESPONSE_BAND)
+                settled = c + 1u;
+            double beyond = start < STEP_RESPONSE_TARGET ? error : -error;
+            response.overshoot = std::max(response.overshoot, beyond);
+        }
+        response.settlingSeconds = settled / HOTNESS_PEBS_THREAD_FREQUENCY;
+        size_t tail =
+            std::min(cycles, (size_t)(5 * HOTNESS_PEBS_THREAD_FREQUENCY));
+        for (size_t c = cycles - tail; c < cycles; ++c)
+            response.steadyError +=
+                fabs(ratios[c] - STEP_RESPONSE_TARGET) / tail;
+        return response;
+    }
+
+    static void report(const char *phase, double start,
+                       const Response &response)
+    {
+        printf("%-22s from %.3f: settling %5.1f s, overshoot %.3f, "
+               "steady error %.4f\n", phase, start, response.settlingSeconds,
+               response.overshoot, response.steadyError);
+    }
+
+    void step_response(double feed_forward)
+    {
+        ranking_set_controller_params(ranking, HOTNESS_PEBS_THREAD_FREQUENCY,
+                                      feed_forward);
+        const size_t phase = (size_t)(60 * HOTNESS_PEBS_THREAD_FREQUENCY);
+        printf("feed-forward gain %.1f:\n", feed_forward);
+
+        set_hot_working_set(200u);
+        double start = used_ratio();
+        Response response = run(phase);
+        report("hot set 200", start, response);
+        ASSERT_LE(response.steadyError, STEP_RESPONSE_BAND);
+
+        // a minute of hot tier exhaustion, then it is released
+        run(phase, STEP_RESPONSE_TARGET / 2);
+        start = used_ratio();
+        response = run(phase);
+        report("exhaustion released", start, response);
+        ASSERT_LT(start, STEP_RESPONSE_TARGET - STEP_RESPONSE_BAND);
+        ASSERT_LE(response.overshoot, STEP_RESPONSE_BAND);
+        ASSERT_LE(response.settlingSeconds, 30.);
+        ASSERT_LE(response.steadyError, STEP_RESPONSE_BAND);
+
+        set_hot_working_set(800u);
+        start = used_ratio();
+        response = run(phase);
+        report("hot set 200 -> 800", start, response);
+        ASSERT_LE(response.settlingSeconds, 30.);
+        ASSERT_LE(response.steadyError, STEP_RESPONSE_BAND);
+
+        set_hot_working_set(100u);
+        start = used_ratio();
+        response = run(phase);
+        report("hot set 800 -> 100", start, response);
+        ASSERT_LE(response.settlingSeconds, 30.);
+        ASSERT_LE(response.steadyError, STEP_RESPONSE_BAND);
+    }
+};
+
+TEST_F(ControllerStepResponse, PI)
+{
+    step_response(0.);
+}
+
+TEST_F(ControllerStepResponse, FeedForward)
+{
+    step_response(0.5);
+}
+
+// steady difference between used and ranked ratio larger than tracking
+// limit is integrated once the tracking window passes
+TEST_F(ControllerStepResponse, Untracked)
+{
+    untracked = 300u;
+    set_hot_working_set(200u);
+    double start = used_ratio();
+    Response response = run((size_t)(120 * HOTNESS_PEBS_THREAD_FREQUENCY));
+    report("untracked 300", start, response);
+    ASSERT_GT((double)untracked / (liveObjects + untracked),
+              CONTROLLER_TRACKING_LIMIT);
+    ASSERT_LE(response.settlingSeconds, 60.);
+    ASSERT_LE(response.steadyError, 0.002);
+}
 
 TEST(ExponentialCoeffs, SimpleTest) {
     double values[] = { 1, 1, 1, 1 };
@@ -2110,6 +2668,70 @@ TEST(ExponentialCoeffs, SimpleTest) {
     assert_close_array_picewise(values, t6, 4);
 }
 
+TEST(ExponentialCoeffs, MatchesPow) {
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<double> log_dt(-6, 7);
+    std::uniform_real_distribution<double> add_dist(0, 10);
+    double values[EXPONENTIAL_COEFFS_NUMBER] = { 10, 10, 10, 10 };
+    double expected[EXPONENTIAL_COEFFS_NUMBER] = { 10, 10, 10, 10 };
+    for (int i = 0; i < 100000; ++i) {
+        // covers decays from ~1 to underflow
+        double dt = i % 100 ? pow(10, log_dt(gen)) : 0;
+        double add = add_dist(gen);
+        double ret = ranking_update_coeffs(values, dt, add);
+        double ret_pow = ranking_update_coeffs_pow(expected, dt, add);
+        ASSERT_LE(fabs(ret - ret_pow), 1e-12 * ret_pow);
+        for (size_t j = 0; j < EXPONENTIAL_COEFFS_NUMBER; ++j)
+            ASSERT_LE(fabs(values[j] - expected[j]), 1e-12 * expected[j]);
+    }
+    const double MAX_DBL = std::numeric_limits<double>::max();
+    ASSERT_EQ(ranking_update_coeffs(values, 0, MAX_DBL), MAX_DBL);
+    ASSERT_EQ(values[0], MAX_DBL);
+}
+
+TEST(ExponentialCoeffs, Batch) {
+    std::mt19937 gen(1234);
+    std::uniform_int_distribution<int> type_dist(0, 3);
+    std::uniform_int_distribution<uint64_t> dt_dist(0, 2000000000);
+    std::uniform_real_distribution<double> add_dist(0, 10);
+    ranking_t *ranking;
+    ranking_create(&ranking, 0.9);
+    struct ttype types[2][4] = {};
+    for (auto &row : types)
+        for (auto &type : row)
+            ranking_add(ranking, type.f, 1);
+    uint64_t timestamp = 1;
+    std::vector<ranking_touch_sample_t> samples(1000);
+    for (auto &sample : samples) {
+        int type = type_dist(gen);
+        timestamp += dt_dist(gen);
+        ranking_touch(ranking, &types[0][type], timestamp, add_dist(gen));
+        sample = { &types[1][type], timestamp, 0 };
+    }
+    // same add_hotness sequence
+    gen.seed(1234);
+    for (auto &sample : samples) {
+        type_dist(gen);
+        dt_dist(gen);
+        sample.add_hotness = add_dist(gen);
+    }
+    std::sort(samples.begin(), samples.end(),
+              [](const ranking_touch_sample_t &a,
+                 const ranking_touch_sample_t &b) {
+                  return a.entry != b.entry ? a.entry < b.entry
+                                            : a.timestamp < b.timestamp;
+              });
+    ranking_touch_batch(ranking, samples.data(), samples.size());
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_EQ(types[0][i].t0, types[1][i].t0);
+        ASSERT_LE(fabs(types[0][i].f - types[1][i].f), 1e-12 * types[0][i].f);
+        for (size_t j = 0; j < EXPONENTIAL_COEFFS_NUMBER; ++j)
+            assert_close(types[0][i].hotness_history_coeffs[j],
+                         types[1][i].hotness_history_coeffs[j]);
+    }
+    ranking_destroy(ranking);
+}
+
 TEST(HeatmapAggregator, Basic)
 {
     heatmap_aggregator_t *aggregator = heatmap_aggregator_create();
@@ -2134,3 +2756,1675 @@ TEST(HeatmapAggregator, Basic)
     heatmap_free_info(info);
     heatmap_aggregator_destroy(aggregator);
 }
+
+TEST(PageMigration, MoveWholePages)
+{
+    int node = numa_node_of_cpu(sched_getcpu());
+    ASSERT_GE(node, 0);
+    page_migration_init(node, node, 1u);
+    ASSERT_TRUE(page_migration_enabled());
+
+    const size_t PAGES = 16u;
+    size_t page_size = page_migration_get_page_size();
+    size_t size = PAGES * page_size;
+    char *buf = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(buf, MAP_FAILED);
+    memset(buf, 1, size);
+
+    ASSERT_EQ(page_migration_move(buf, size, true), size);
+    // partial pages at both ends are skipped
+    ASSERT_EQ(page_migration_move(buf + 1, size - 1, false),
+              (PAGES - 1) * page_size);
+    ASSERT_EQ(page_migration_move(buf + 1, page_size, true), 0u);
+    page_migration_cycle_done();
+
+    page_migration_stats_t stats;
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, (2 * PAGES - 1) * page_size);
+    ASSERT_EQ(stats.failedPages, 0u);
+    ASSERT_EQ(stats.cycles, 1u);
+
+    page_migration_init(-1, -1, 0u);
+    ASSERT_FALSE(page_migration_enabled());
+    munmap(buf, size);
+}
+
+TEST(RankingEventRings, Overflow)
+{
+    ranking_event_rings_init(3u); // rounded up to 4
+    EventEntry_t entry;
+    entry.type = EVENT_CREATE_ADD;
+    for (uintptr_t i = 0; i < 4u; ++i) {
+        entry.data.createAddData.address = (void *)i;
+        ASSERT_TRUE(ranking_event_rings_push(&entry, false));
+    }
+    // ring is full - regular event is dropped, must-deliver one is kept
+    ASSERT_FALSE(ranking_event_rings_push(&entry, false));
+    entry.type = EVENT_DESTROY_REMOVE;
+    entry.data.destroyRemoveData.address = (void *)4u;
+    ASSERT_TRUE(ranking_event_rings_push(&entry, true));
+
+    EventEntry_t events[16];
+    ASSERT_EQ(ranking_event_rings_pop_batch(events, 16u), 5u);
+    ASSERT_EQ(events[0].type, EVENT_DESTROY_REMOVE);
+    ASSERT_EQ(events[0].data.destroyRemoveData.address, (void *)4u);
+    for (uintptr_t i = 0; i < 4u; ++i) {
+        ASSERT_EQ(events[i + 1].type, EVENT_CREATE_ADD);
+        ASSERT_EQ(events[i + 1].data.createAddData.address, (void *)i);
+    }
+    ASSERT_EQ(ranking_event_rings_pop_batch(events, 16u), 0u);
+
+    ranking_event_rings_stats_t stats;
+    ranking_event_rings_get_stats(&stats);
+    ASSERT_EQ(stats.rings, 1u);
+    ASSERT_EQ(stats.pushed, 4u);
+    ASSERT_EQ(stats.overflowed, 1u);
+    ASSERT_EQ(stats.dropped, 1u);
+    ASSERT_EQ(stats.popped, 5u);
+    ranking_event_rings_fini();
+}
+
+TEST(RankingEventRings, MultipleProducers)
+{
+    const size_t THREADS = 8u;
+    const uintptr_t EVENTS_PER_THREAD = 100000u;
+    ranking_event_rings_init(64u);
+
+    std::atomic<size_t> finished(0u);
+    std::vector<std::thread> producers;
+    for (size_t t = 0; t < THREADS; ++t) {
+        producers.emplace_back([t, EVENTS_PER_THREAD, &finished]() {
+            EventEntry_t entry;
+            entry.type = EVENT_DESTROY_REMOVE;
+            for (uintptr_t i = 0; i < EVENTS_PER_THREAD; ++i) {
+                entry.data.destroyRemoveData.address =
+                    (void *)(t * EVENTS_PER_THREAD + i);
+                ASSERT_TRUE(ranking_event_rings_push(&entry, true));
+            }
+            finished++;
+        });
+    }
+
+    std::vector<bool> seen(THREADS * EVENTS_PER_THREAD, false);
+    EventEntry_t events[256];
+    size_t popped = 0u;
+    while (true) {
+        bool done = finished == THREADS;
+        size_t count = ranking_event_rings_pop_batch(events, 256u);
+        for (size_t i = 0; i < count; ++i) {
+            uintptr_t idx =
+                (uintptr_t)events[i].data.destroyRemoveData.address;
+            ASSERT_FALSE(seen[idx]);
+            seen[idx] = true;
+        }
+        popped += count;
+        if (done && count == 0u)
+            break;
+    }
+    for (auto &producer : producers)
+        producer.join();
+    ASSERT_EQ(popped, THREADS * EVENTS_PER_THREAD);
+    // rings of finished threads are released
+    ASSERT_EQ(ranking_event_rings_pop_batch(events, 256u), 0u);
+
+    ranking_event_rings_stats_t stats;
+    ranking_event_rings_get_stats(&stats);
+    ASSERT_EQ(stats.rings, 0u);
+    ASSERT_EQ(stats.dropped, 0u);
+    ASSERT_EQ(stats.pushed + stats.overflowed, THREADS * EVENTS_PER_THREAD);
+    ASSERT_EQ(stats.popped, THREADS * EVENTS_PER_THREAD);
+    ranking_event_rings_fini();
+}
+
+__attribute__((noinline)) static uint64_t bthash_site_a(uint64_t size)
+{
+    uint64_t hash = bthash_frame_pointers(size);
+    asm volatile("" : : "r"(hash) : "memory");
+    return hash;
+}
+
+__attribute__((noinline)) static uint64_t bthash_site_b(uint64_t size)
+{
+    uint64_t hash = bthash_frame_pointers(size);
+    asm volatile("" : : "r"(hash) : "memory");
+    return hash;
+}
+
+TEST(Bthash, FramePointersCallSites)
+{
+    read_maps();
+    const int CALLS = 10;
+    uint64_t hash_a[CALLS], hash_b[CALLS], hash_size[CALLS];
+    // each call in a loop comes from the same call site, only stale
+    // stack content changes
+    for (int i = 0; i < CALLS; ++i) {
+        hash_a[i] = bthash_site_a(64u);
+        hash_b[i] = bthash_site_b(64u);
+        hash_size[i] = bthash_site_a(128u);
+    }
+    ASSERT_NE(hash_a[0], hash_b[0]);
+    ASSERT_NE(hash_a[0], hash_size[0]);
+    for (int i = 1; i < CALLS; ++i) {
+        ASSERT_EQ(hash_a[i], hash_a[0]);
+        ASSERT_EQ(hash_b[i], hash_b[0]);
+        ASSERT_EQ(hash_size[i], hash_size[0]);
+    }
+}
+
+static uint64_t g_contextHashes[2][2];
+static ucontext_t g_mainContext;
+
+static void bthash_context_entry(void)
+{
+    // not unrolled - every iteration calls from the same sites
+    for (volatile int i = 0; i < 2; ++i) {
+        g_contextHashes[i][0] = bthash_site_a(64u);
+        g_contextHashes[i][1] = bthash_site_b(64u);
+    }
+}
+
+// frame records outside the thread stack are not trusted - call sites are
+// still told apart, by backtrace()
+TEST(Bthash, FramePointersBrokenChain)
+{
+    read_maps();
+    (void)bthash_site_a(64u); // stack bounds of this thread are known
+    const size_t STACK_SIZE = 1u << 16;
+    std::vector<char> stack(STACK_SIZE);
+    ucontext_t ctx;
+    ASSERT_EQ(getcontext(&ctx), 0);
+    ctx.uc_stack.ss_sp = stack.data();
+    ctx.uc_stack.ss_size = STACK_SIZE;
+    ctx.uc_link = &g_mainContext;
+    makecontext(&ctx, bthash_context_entry, 0);
+    ASSERT_EQ(swapcontext(&g_mainContext, &ctx), 0);
+    ASSERT_NE(g_contextHashes[0][0], g_contextHashes[0][1]);
+    ASSERT_EQ(g_contextHashes[1][0], g_contextHashes[0][0]);
+    ASSERT_EQ(g_contextHashes[1][1], g_contextHashes[0][1]);
+}
+
+TEST(Bthash, ExecMapsDlopen)
+{
+    read_maps();
+    qsbr_online();
+    const exec_maps_t *maps = exec_maps_get();
+    ASSERT_GT(exec_maps_count(maps), 0u);
+    ASSERT_TRUE(exec_maps_contains(maps, (void *)&bthash_frame_pointers));
+    ASSERT_FALSE(exec_maps_contains(maps, (void *)&maps));
+    // nothing was loaded - table is not rebuilt
+    ASSERT_FALSE(bthash_refresh_maps());
+    ASSERT_EQ(exec_maps_get(), maps);
+
+    void *handle = dlopen("libresolv.so.2", RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        qsbr_offline();
+        std::cout << "libresolv.so.2 not available, skipping" << std::endl;
+        return;
+    }
+    void *sym = dlsym(handle, "__res_nquery");
+    if (!sym)
+        sym = dlsym(handle, "res_nquery");
+    ASSERT_NE(sym, nullptr);
+    ASSERT_TRUE(bthash_refresh_maps());
+    const exec_maps_t *new_maps = exec_maps_get();
+    ASSERT_NE(new_maps, maps);
+    ASSERT_GT(exec_maps_generation(new_maps), exec_maps_generation(maps));
+    ASSERT_TRUE(exec_maps_contains(new_maps, sym));
+    // previous table is still valid for readers
+    ASSERT_TRUE(exec_maps_contains(maps, (void *)&bthash_frame_pointers));
+    ASSERT_GT(qsbr_pending(), 0u);
+    qsbr_offline();
+    // ... and freed once they leave read-side sections
+    size_t reclaimed = qsbr_reclaim();
+    reclaimed += qsbr_reclaim();
+    ASSERT_GT(reclaimed, 0u);
+    dlclose(handle);
+}
+
+TEST(Bthash, StableSites)
+{
+    read_maps();
+    const exec_maps_t *maps = exec_maps_get();
+    const void *fn_a = (void *)&bthash_site_a;
+    const void *fn_b = (void *)&bthash_site_b;
+    const void *fn_lib = (void *)&bthash_frame_pointers;
+    uint64_t site_a, site_b, site_lib;
+    ASSERT_TRUE(exec_maps_lookup(maps, fn_a, &site_a));
+    ASSERT_TRUE(exec_maps_lookup(maps, fn_b, &site_b));
+    ASSERT_TRUE(exec_maps_lookup(maps, fn_lib, &site_lib));
+    ASSERT_FALSE(exec_maps_lookup(maps, (void *)&maps, &site_a));
+
+    // site is key of the object plus offset from its load address
+    Dl_info info_a, info_lib;
+    ASSERT_NE(dladdr(fn_a, &info_a), 0);
+    ASSERT_NE(dladdr(fn_lib, &info_lib), 0);
+    ASSERT_NE(info_a.dli_fbase, info_lib.dli_fbase);
+    uint64_t key = site_a - ((uintptr_t)fn_a - (uintptr_t)info_a.dli_fbase);
+    ASSERT_EQ(site_b - ((uintptr_t)fn_b - (uintptr_t)info_a.dli_fbase), key);
+    ASSERT_NE(site_lib -
+                  ((uintptr_t)fn_lib - (uintptr_t)info_lib.dli_fbase),
+              key);
+}
+
+TEST_F(MemkindMemtierHotnessTest, check_touch_batch)
+{
+    const size_t OBJS_NUM = 100;
+    int res = memtier_builder_add_tier(m_builder, MEMKIND_DEFAULT, 1);
+    ASSERT_EQ(0, res);
+    res = memtier_builder_add_tier(m_builder, MEMKIND_REGULAR, 1);
+    ASSERT_EQ(0, res);
+    m_tier_memory = memtier_builder_construct_memtier_memory(m_builder);
+    ASSERT_NE(nullptr, m_tier_memory);
+
+    // two allocation sites - two types of the same total size
+    std::vector<char *> objs_a, objs_b;
+    for (size_t i = 0; i < OBJS_NUM; ++i)
+        objs_a.push_back((char *)memtier_malloc(m_tier_memory, 64));
+    for (size_t i = 0; i < OBJS_NUM; ++i)
+        objs_b.push_back((char *)memtier_malloc(m_tier_memory, 64));
+    sleep(1); // wait for pebs_monitor() to register new blocks
+    // ranking is updated by the test thread - hardware touches would race
+    pebs_set_process_hardware_touches(false);
+
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    __u64 timestamp = t.tv_sec * 1000000000ull + t.tv_nsec;
+    std::vector<tachanka_touch_sample_t> samples;
+    for (size_t i = 0; i < 3 * OBJS_NUM; ++i)
+        samples.push_back({objs_a[i % OBJS_NUM] + i % 64, timestamp + i});
+    for (size_t i = 0; i < OBJS_NUM; ++i)
+        samples.push_back({objs_b[i] + 63, timestamp + i});
+    // not tracked - ignored
+    samples.push_back({(char *)&t, timestamp});
+    std::shuffle(samples.begin(), samples.end(), std::mt19937(1234));
+
+    size_t touched = tachanka_touch_batch(samples.data(), samples.size());
+    double hotness_a = tachanka_get_addr_hotness(objs_a[0]);
+    double hotness_b = tachanka_get_addr_hotness(objs_b[0]);
+    pebs_set_process_hardware_touches(true);
+
+    ASSERT_EQ(touched, 2u);
+    // three times more touches of the first type
+    ASSERT_GT(hotness_a, hotness_b);
+    ASSERT_GT(hotness_b, 0);
+
+    for (size_t i = 0; i < OBJS_NUM; ++i) {
+        memtier_free(objs_a[i]);
+        memtier_free(objs_b[i]);
+    }
+}
+
+TEST_F(MemkindMemtierHotnessTest, check_touch_aggregators)
+{
+    const size_t OBJS_NUM = 100;
+    const size_t THREADS_NUM = 4;
+    int res = memtier_builder_add_tier(m_builder, MEMKIND_DEFAULT, 1);
+    ASSERT_EQ(0, res);
+    res = memtier_builder_add_tier(m_builder, MEMKIND_REGULAR, 1);
+    ASSERT_EQ(0, res);
+    m_tier_memory = memtier_builder_construct_memtier_memory(m_builder);
+    ASSERT_NE(nullptr, m_tier_memory);
+
+    std::vector<char *> objs_a, objs_b;
+    for (size_t i = 0; i < OBJS_NUM; ++i)
+        objs_a.push_back((char *)memtier_malloc(m_tier_memory, 64));
+    for (size_t i = 0; i < OBJS_NUM; ++i)
+        objs_b.push_back((char *)memtier_malloc(m_tier_memory, 64));
+    sleep(1); // wait for pebs_monitor() to register new blocks
+    // ranking is updated by the test thread - hardware touches would race
+    pebs_set_process_hardware_touches(false);
+
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    __u64 timestamp = t.tv_sec * 1000000000ull + t.tv_nsec;
+    // every thread touches type A, only the first one touches type B
+    std::vector<tachanka_touch_aggregator_t *> aggs;
+    std::vector<size_t> aggregated(THREADS_NUM);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREADS_NUM; ++i)
+        aggs.push_back(tachanka_touch_aggregator_create());
+    for (size_t i = 0; i < THREADS_NUM; ++i) {
+        threads.emplace_back([&, i]() {
+            std::vector<tachanka_touch_sample_t> samples;
+            for (size_t j = 0; j < OBJS_NUM; ++j)
+                samples.push_back({objs_a[j], timestamp + j});
+            if (i == 0)
+                for (size_t j = 0; j < OBJS_NUM; ++j)
+                    samples.push_back({objs_b[j], timestamp + j});
+            aggregated[i] = tachanka_touch_aggregator_add(
+                aggs[i], samples.data(), samples.size());
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    size_t touched = tachanka_touch_aggregators_flush(aggs.data(), aggs.size());
+    double hotness_a = tachanka_get_addr_hotness(objs_a[0]);
+    double hotness_b = tachanka_get_addr_hotness(objs_b[0]);
+    pebs_set_process_hardware_touches(true);
+
+    ASSERT_EQ(touched, 2u);
+    ASSERT_EQ(aggregated[0], 2 * OBJS_NUM);
+    for (size_t i = 1; i < THREADS_NUM; ++i)
+        ASSERT_EQ(aggregated[i], OBJS_NUM);
+    ASSERT_GT(hotness_a, hotness_b);
+    ASSERT_GT(hotness_b, 0);
+    for (auto agg : aggs) {
+        ASSERT_EQ(tachanka_touch_aggregator_dropped(agg), 0u);
+        tachanka_touch_aggregator_destroy(agg);
+    }
+
+    for (size_t i = 0; i < OBJS_NUM; ++i) {
+        memtier_free(objs_a[i]);
+        memtier_free(objs_b[i]);
+    }
+}
+
+static bool trace_records_equal(const sample_trace_record_t &a,
+                                const sample_trace_record_t &b)
+{
+    return a.type == b.type && a.is_hot == b.is_hot &&
+        a.timestamp == b.timestamp && a.hash == b.hash && a.addr == b.addr &&
+        a.new_addr == b.new_addr && a.size == b.size && a.weight == b.weight;
+}
+
+TEST(SampleTrace, RoundTrip)
+{
+    std::vector<sample_trace_record_t> records;
+    // timestamps and addresses go backwards as well
+    records.push_back({SAMPLE_TRACE_ALLOC, true, 1000, 0xdeadbeefcafe0123ull,
+                       0x7f0000001000, 0, 64});
+    records.push_back({SAMPLE_TRACE_ALLOC, false, 999, UINT64_MAX,
+                       0x7f0000000000, 0, 1 << 30});
+    records.push_back({SAMPLE_TRACE_TOUCH, false, UINT64_MAX - 5, 0,
+                       0x7f0000001010, 0, 0});
+    records.push_back({SAMPLE_TRACE_TOUCH, false, 5, 0, 0x10, 0, 0});
+    records.push_back({SAMPLE_TRACE_REALLOC, true, 2000, 0, 0x7f0000001000,
+                       0x7f0000002000, 128});
+    records.push_back({SAMPLE_TRACE_ALLOC, false, 2001, 7u, 0x7f0000003000,
+                       0, 48, 85.84f});
+    records.push_back({SAMPLE_TRACE_REALLOC, true, 2002, 0, 0x7f0000003000,
+                       0x7f0000004000, 4096, 1.58f});
+    records.push_back({SAMPLE_TRACE_REALLOC, false, 2003, 0x1234ull,
+                       0x7f0000004000, 0x7f0000005000, 8192, 2.f});
+    records.push_back({SAMPLE_TRACE_CYCLE, false, 3000, 0, 0, 0, 0});
+    records.push_back({SAMPLE_TRACE_FREE, false, 1, 0, UINTPTR_MAX, 0, 0});
+    std::vector<tachanka_touch_sample_t> touches;
+    for (uintptr_t i = 0; i < 100000; ++i)
+        touches.push_back({(void *)(0x7f0000000000 + i * 64), 4000 + i % 7});
+
+    char path[] = "/tmp/memkind_sample_trace_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_NE(fd, -1);
+    close(fd);
+    ASSERT_EQ(sample_trace_open(path), 0);
+    ASSERT_TRUE(sample_trace_enabled());
+    for (auto &record : records)
+        sample_trace_write(&record);
+    sample_trace_write_touches(touches.data(), touches.size());
+    sample_trace_close();
+    ASSERT_FALSE(sample_trace_enabled());
+
+    sample_trace_reader_t *reader = sample_trace_reader_open(path);
+    ASSERT_NE(reader, nullptr);
+    sample_trace_record_t record;
+    for (auto &expected : records) {
+        ASSERT_EQ(sample_trace_reader_next(reader, &record), 1);
+        ASSERT_TRUE(trace_records_equal(record, expected));
+    }
+    for (auto &touch : touches) {
+        ASSERT_EQ(sample_trace_reader_next(reader, &record), 1);
+        ASSERT_EQ(record.type, SAMPLE_TRACE_TOUCH);
+        ASSERT_EQ(record.addr, (uintptr_t)touch.addr);
+        ASSERT_EQ(record.timestamp, touch.timestamp);
+    }
+    ASSERT_EQ(sample_trace_reader_next(reader, &record), 0);
+    sample_trace_reader_close(reader);
+    unlink(path);
+}
+
+TEST(SampleTrace, DecodeIncomplete)
+{
+    sample_trace_record_t record = {SAMPLE_TRACE_REALLOC, false, 1ull << 62,
+                                    0, UINTPTR_MAX, UINTPTR_MAX - 1, 1ull << 40};
+    sample_trace_codec_t encoder = {}, decoder = {};
+    uint8_t buf[SAMPLE_TRACE_RECORD_MAX];
+    size_t size = sample_trace_encode(&encoder, &record, buf);
+    ASSERT_LE(size, SAMPLE_TRACE_RECORD_MAX);
+    sample_trace_record_t decoded;
+    for (size_t len = 0; len < size; ++len)
+        ASSERT_EQ(sample_trace_decode(&decoder, buf, len, &decoded), 0);
+    ASSERT_EQ(sample_trace_decode(&decoder, buf, size, &decoded),
+              (ptrdiff_t)size);
+    ASSERT_TRUE(trace_records_equal(decoded, record));
+    buf[0] = 0x0f; // unknown type
+    ASSERT_EQ(sample_trace_decode(&decoder, buf, size, &decoded), -1);
+
+    // varint with 11 bytes is corrupted, even if the buffer is short
+    uint8_t overlong[12] = {SAMPLE_TRACE_FREE};
+    memset(overlong + 1, 0x80, 11);
+    ASSERT_EQ(sample_trace_decode(&decoder, overlong, 5u, &decoded), 0);
+    ASSERT_EQ(sample_trace_decode(&decoder, overlong, 12u, &decoded), -1);
+    // 10th byte holds only the 64th bit
+    memset(overlong + 1, 0xff, 9);
+    overlong[10] = 0x02;
+    ASSERT_EQ(sample_trace_decode(&decoder, overlong, 11u, &decoded), -1);
+    overlong[10] = 0x01;
+    ASSERT_EQ(sample_trace_decode(&decoder, overlong, 11u, &decoded), 0);
+}
+
+static size_t tier_cache_total_size(void)
+{
+    return 2 * 4096;
+}
+
+TEST(TierDecisionCache, EpochInvalidation)
+{
+    static char blocks[2][4096];
+    const uint64_t HASHES[2] = {0x1234u, 0x5678u};
+    const __u64 TIMESTAMP = 1000000000u;
+    tachanka_init(DEFAULT_OLD_HOTNESS_WINDOW_WEIGHT,
+                  RANKING_BUFFER_SIZE_ELEMENTS);
+    tachanka_set_total_size_source(tier_cache_total_size);
+    for (size_t i = 0; i < 2; ++i) {
+        EventEntry_t event;
+        event.type = EVENT_CREATE_ADD;
+        event.timestamp = TIMESTAMP;
+        event.data.createAddData = {HASHES[i], blocks[i], sizeof(blocks[i]),
+                                    false};
+        tachanka_ranking_event_process(&event);
+    }
+    // thresholds are not calculated yet
+    ASSERT_EQ(tachanka_get_tier_hash_cached(HASHES[0]), -1);
+
+    // first type is touched more often
+    std::vector<tachanka_touch_sample_t> samples;
+    for (size_t i = 0; i < 10; ++i)
+        samples.push_back({blocks[0], TIMESTAMP + i * 1000000u});
+    samples.push_back({blocks[1], TIMESTAMP});
+    tachanka_touch_batch(samples.data(), samples.size());
+    // hottest quarter - threshold lies between both types
+    uint64_t epoch = tachanka_get_threshold_epoch();
+    tachanka_set_dram_total_ratio(0.25, 0.25);
+    tachanka_update_threshold();
+    ASSERT_GT(tachanka_get_threshold_epoch(), epoch);
+    ASSERT_EQ(tachanka_get_tier_hash_cached(HASHES[0]), 0);
+    ASSERT_EQ(tachanka_get_tier_hash_cached(HASHES[1]), 1);
+    // each thread has its own cache
+    int other_thread_tier = -1;
+    std::thread([&]() {
+        other_thread_tier = tachanka_get_tier_hash_cached(HASHES[0]);
+    }).join();
+    ASSERT_EQ(other_thread_tier, 0);
+
+    samples.clear();
+    for (size_t i = 0; i < 100; ++i)
+        samples.push_back({blocks[1], TIMESTAMP + 20000000u + i * 100000u});
+    tachanka_touch_batch(samples.data(), samples.size());
+    ASSERT_EQ(tachanka_get_tier_hash(HASHES[1]), 0);
+    // cached decision is kept until thresholds are recalculated
+    ASSERT_EQ(tachanka_get_tier_hash_cached(HASHES[1]), 1);
+    tachanka_update_threshold();
+    ASSERT_EQ(tachanka_get_tier_hash_cached(HASHES[1]), 0);
+    ASSERT_EQ(tachanka_get_tier_hash_cached(HASHES[0]), 1);
+
+    tachanka_destroy();
+    tachanka_set_total_size_source(NULL);
+}
+
+static void qsbr_count_free(void *ptr, void *arg)
+{
+    (void)ptr;
+    (*(std::atomic<size_t> *)arg)++;
+}
+
+static void qsbr_reclaim_until(std::atomic<size_t> &freed, size_t expected)
+{
+    // reclaim of a concurrent caller (e.g. PEBS thread) is skipped
+    for (int i = 0; i < 1000 && freed < expected; ++i) {
+        qsbr_reclaim();
+        if (freed < expected)
+            usleep(1000);
+    }
+}
+
+TEST(Qsbr, GracePeriod)
+{
+    std::atomic<size_t> freed(0);
+    int objects[3];
+
+    // online thread delays reclamation until it reports quiescence
+    qsbr_online();
+    qsbr_retire(&objects[0], qsbr_count_free, &freed);
+    ASSERT_EQ(qsbr_reclaim(), 0u);
+    ASSERT_EQ(freed, 0u);
+    qsbr_quiescent();
+    qsbr_reclaim_until(freed, 1u);
+    ASSERT_EQ(freed, 1u);
+
+    // nested sections - only the outermost one makes thread quiescent
+    qsbr_retire(&objects[1], qsbr_count_free, &freed);
+    qsbr_online();
+    qsbr_offline();
+    qsbr_reclaim();
+    ASSERT_EQ(freed, 1u);
+    qsbr_offline();
+    qsbr_reclaim_until(freed, 2u);
+    ASSERT_EQ(freed, 2u);
+
+    // thread that exits inside of a section does not block reclamation
+    std::atomic<bool> online(false), exit(false);
+    std::thread reader([&]() {
+        qsbr_online();
+        online = true;
+        while (!exit)
+            std::this_thread::yield();
+    });
+    while (!online)
+        std::this_thread::yield();
+    qsbr_retire(&objects[2], qsbr_count_free, &freed);
+    qsbr_reclaim();
+    ASSERT_EQ(freed, 2u);
+    exit = true;
+    reader.join();
+    qsbr_reclaim_until(freed, 3u);
+    ASSERT_EQ(freed, 3u);
+
+    // forgotten objects are never freed
+    std::atomic<size_t> forgotten(0);
+    qsbr_retire(&objects[0], qsbr_count_free, &forgotten);
+    qsbr_forget(&forgotten);
+    qsbr_reclaim();
+    ASSERT_EQ(forgotten, 0u);
+}
+
+struct QsbrStressObject {
+    static const uint64_t LIVE = 0x1111111111111111u;
+    static const uint64_t DEAD = 0xdeaddeaddeaddeadu;
+    std::atomic<uint64_t> magic;
+};
+
+static void qsbr_poison(void *ptr, void *arg)
+{
+    ((QsbrStressObject *)ptr)->magic = QsbrStressObject::DEAD;
+    (*(std::atomic<size_t> *)arg)++;
+}
+
+// Objects published in slots are replaced and retired by a single writer,
+// reclaimed objects are poisoned - readers must never see a poisoned one.
+// Half of readers enter a section per lookup, the other half stays online
+// and reports quiescence between lookups.
+TEST(Qsbr, RetireStress)
+{
+    const size_t SLOTS = 64;
+    const size_t READERS = 4;
+    const size_t OPERATIONS = 1000000;
+    const size_t CYCLE_OPERATIONS = 64;
+    std::vector<QsbrStressObject *> objects;
+    objects.reserve(OPERATIONS + SLOTS);
+    std::atomic<QsbrStressObject *> slots[SLOTS];
+    for (auto &slot : slots) {
+        objects.push_back(new QsbrStressObject{{QsbrStressObject::LIVE}});
+        slot = objects.back();
+    }
+
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> errors(0), freed(0);
+    std::vector<std::thread> readers;
+    for (size_t r = 0; r < READERS; ++r) {
+        readers.emplace_back([&, r]() {
+            std::mt19937 gen(r);
+            std::uniform_int_distribution<size_t> dist(0, SLOTS - 1);
+            bool stay_online = r % 2;
+            size_t local_errors = 0;
+            if (stay_online)
+                qsbr_online();
+            while (!stop) {
+                if (!stay_online)
+                    qsbr_online();
+                QsbrStressObject *obj = slots[dist(gen)];
+                // hold the object for a while
+                for (int i = 0; i < 16; ++i)
+                    local_errors += obj->magic != QsbrStressObject::LIVE;
+                if (stay_online)
+                    qsbr_quiescent();
+                else
+                    qsbr_offline();
+            }
+            if (stay_online)
+                qsbr_offline();
+            errors += local_errors;
+        });
+    }
+
+    std::mt19937 gen(1234);
+    std::uniform_int_distribution<size_t> dist(0, SLOTS - 1);
+    size_t retired = 0;
+    for (size_t i = 0; i < OPERATIONS; ++i) {
+        objects.push_back(new QsbrStressObject{{QsbrStressObject::LIVE}});
+        QsbrStressObject *old = slots[dist(gen)].exchange(objects.back());
+        qsbr_retire(old, qsbr_poison, &freed);
+        ++retired;
+        if (i % CYCLE_OPERATIONS == CYCLE_OPERATIONS - 1)
+            qsbr_reclaim();
+    }
+    // memory is reclaimed while readers run
+    ASSERT_GT(freed, 0u);
+    stop = true;
+    for (auto &reader : readers)
+        reader.join();
+    qsbr_reclaim_until(freed, retired);
+
+    ASSERT_EQ(errors, 0u);
+    ASSERT_EQ(freed, retired);
+    for (auto obj : objects)
+        delete obj;
+}
+
+static size_t fixed_total_size(void)
+{
+    return 1024 * 64;
+}
+
+// tachanka instance fed directly with events, without memtier and PEBS
+class TachankaTest: public ::testing::Test
+{
+protected:
+    static void create_block(void *addr, size_t size, uint64_t hash,
+                             __u64 timestamp = 1000u, float weight = 0.f)
+    {
+        EventEntry_t event;
+        event.type = EVENT_CREATE_ADD;
+        event.timestamp = timestamp;
+        event.data.createAddData = {hash, addr, size, false, weight};
+        tachanka_ranking_event_process(&event);
+    }
+
+    static void destroy_block(void *addr, __u64 timestamp = 1001u)
+    {
+        EventEntry_t event;
+        event.type = EVENT_DESTROY_REMOVE;
+        event.timestamp = timestamp;
+        event.data.destroyRemoveData = {addr, 0u};
+        tachanka_ranking_event_process(&event);
+    }
+
+    // memory and sample source are released in TearDown(), also when an
+    // assertion ends the test early
+    char *map_buffer(size_t size)
+    {
+        void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED)
+            return nullptr;
+        m_buffer = buf;
+        m_bufferSize = size;
+        return (char *)buf;
+    }
+
+    int start_source(const sample_source_t *source)
+    {
+        int ret = source->start(getpid());
+        if (!ret)
+            m_source = source;
+        return ret;
+    }
+
+private:
+    void *m_buffer;
+    size_t m_bufferSize;
+    const sample_source_t *m_source;
+
+    void SetUp()
+    {
+        m_buffer = nullptr;
+        m_bufferSize = 0u;
+        m_source = nullptr;
+        tachanka_init(DEFAULT_OLD_HOTNESS_WINDOW_WEIGHT,
+                      RANKING_BUFFER_SIZE_ELEMENTS);
+        tachanka_set_total_size_source(fixed_total_size);
+    }
+
+    // global state changed by tests is restored to defaults
+    void TearDown()
+    {
+        if (m_source)
+            m_source->stop();
+        sample_source_idle_page_set_budget(DEFAULT_HOTNESS_IDLE_PAGE_SCAN_BUDGET);
+        tachanka_set_tracking_granularity(DEFAULT_HOTNESS_TRACKING_GRANULARITY);
+        tachanka_destroy();
+        tachanka_set_total_size_source(NULL);
+        page_migration_init(-1, -1, 0u);
+        if (m_buffer)
+            munmap(m_buffer, m_bufferSize);
+    }
+};
+
+// Lookups from many threads run concurrently with registration and removal
+// of blocks, removed blocks are recycled once per "cycle" - as in PEBS thread
+TEST_F(TachankaTest, QsbrLookupStress)
+{
+    const size_t BLOCKS = 1024;
+    const size_t BLOCK_SIZE = 64;
+    const size_t READERS = 4;
+    const size_t OPERATIONS = 2000000;
+    const size_t CYCLE_OPERATIONS = 256;
+    const double INITIAL_HOTNESS =
+        EXPONENTIAL_COEFFS_NUMBER * HOTNESS_INITIAL_SINGLE_VALUE;
+    std::vector<char> memory(BLOCKS * BLOCK_SIZE);
+
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> lookups(0), found(0), errors(0);
+    std::vector<std::thread> readers;
+    for (size_t r = 0; r < READERS; ++r) {
+        readers.emplace_back([&, r]() {
+            std::mt19937 gen(r);
+            std::uniform_int_distribution<size_t> dist(0, BLOCKS - 1);
+            size_t local_lookups = 0, local_found = 0, local_errors = 0;
+            while (!stop) {
+                size_t idx = dist(gen);
+                // no touches - each registered type has initial hotness
+                double hotness =
+                    tachanka_get_addr_hotness(&memory[idx * BLOCK_SIZE]);
+                if (hotness == INITIAL_HOTNESS)
+                    ++local_found;
+                else if (hotness != -1)
+                    ++local_errors;
+                Hotness_e type =
+                    tachanka_get_hotness_type(&memory[idx * BLOCK_SIZE]);
+                if (type == HOTNESS_HOT || type == HOTNESS_COLD)
+                    ++local_errors; // threshold was never calculated
+                ++local_lookups;
+            }
+            lookups += local_lookups;
+            found += local_found;
+            errors += local_errors;
+        });
+    }
+
+    std::mt19937 gen(1234);
+    std::uniform_int_distribution<size_t> dist(0, BLOCKS - 1);
+    std::vector<bool> live(BLOCKS, false);
+    size_t reclaimed = 0;
+    __u64 timestamp = 1000000000u;
+    for (size_t i = 0; i < OPERATIONS; ++i) {
+        size_t idx = dist(gen);
+        EventEntry_t event;
+        event.timestamp = ++timestamp;
+        if (live[idx]) {
+            event.type = EVENT_DESTROY_REMOVE;
+            event.data.destroyRemoveData = {&memory[idx * BLOCK_SIZE], 0};
+        } else {
+            event.type = EVENT_CREATE_ADD;
+            event.data.createAddData = {idx % 16 + 1,
+                                        &memory[idx * BLOCK_SIZE], BLOCK_SIZE,
+                                        false};
+        }
+        live[idx] = !live[idx];
+        tachanka_ranking_event_process(&event);
+        if (i % CYCLE_OPERATIONS == CYCLE_OPERATIONS - 1)
+            reclaimed += qsbr_reclaim();
+    }
+    stop = true;
+    for (auto &reader : readers)
+        reader.join();
+
+    ASSERT_EQ(errors, 0u);
+    ASSERT_GT(found, 0u);
+    ASSERT_GT(lookups, found);
+    // memory is recycled while readers run
+    ASSERT_GT(reclaimed, 0u);
+}
+
+// after a burst of short-lived blocks, metadata memory is returned to the OS
+TEST_F(TachankaTest, QsbrMetadataRelease)
+{
+    const size_t BLOCKS = 1000000;
+    const __u64 TIMESTAMP = 1000000000u;
+    for (size_t i = 0; i < BLOCKS; ++i)
+        create_block((void *)(0x100000000u + i * 64), 64, i % 64 + 1,
+                     TIMESTAMP);
+    ASSERT_EQ(tachanka_release_free_memory(), 0u);
+    for (size_t i = 0; i < BLOCKS; ++i)
+        destroy_block((void *)(0x100000000u + i * 64), TIMESTAMP);
+    // removed blocks and critnib leaves are not free before grace period
+    ASSERT_EQ(tachanka_release_free_memory(), 0u);
+    qsbr_reclaim();
+    // at least tblocks and critnib leaves, 16MB each
+    ASSERT_GT(tachanka_release_free_memory(), 2 * 16 * 1000000u * 9 / 10);
+}
+
+static size_t process_pending_events(void)
+{
+    EventEntry_t events[256];
+    size_t processed = 0u;
+    size_t count;
+    while ((count = tachanka_ranking_event_pop_batch(events, 256u))) {
+        for (size_t i = 0; i < count; ++i)
+            tachanka_ranking_event_process(&events[i]);
+        processed += count;
+    }
+    return processed;
+}
+
+// small allocations are aggregated per page run, with far fewer events
+// than allocations
+TEST_F(TachankaTest, RunAggregation)
+{
+    const size_t OBJECTS = 100000;
+    const size_t OBJECT_SIZE = 64;
+    tachanka_set_tracking_granularity(HOTNESS_TRACKING_RUN);
+    std::vector<void *> objects(OBJECTS);
+    for (auto &object : objects) {
+        object = memkind_malloc(MEMKIND_DEFAULT, OBJECT_SIZE);
+        ASSERT_TRUE(tachanka_run_alloc(1u, object, false));
+    }
+    void *large =
+        memkind_malloc(MEMKIND_DEFAULT, HOTNESS_TRACKING_RUN_MAX_OBJECT + 1);
+    ASSERT_FALSE(tachanka_run_alloc(2u, large, false));
+    ASSERT_FALSE(tachanka_run_free(
+        large, memkind_malloc_usable_size(MEMKIND_DEFAULT, large)));
+    tachanka_run_flush();
+    size_t events = process_pending_events();
+    ASSERT_GT(events, 0u);
+    ASSERT_LT(events * 10, OBJECTS);
+
+    for (auto object : objects)
+        ASSERT_GE(tachanka_get_addr_hotness(object), 0.);
+    std::vector<tachanka_touch_sample_t> samples;
+    for (size_t i = 0; i < OBJECTS; i += 97)
+        samples.push_back({objects[i], 1000000000u});
+    ASSERT_EQ(tachanka_touch_batch(samples.data(), samples.size()), 1u);
+
+    for (auto object : objects)
+        ASSERT_TRUE(tachanka_run_free(
+            object, memkind_malloc_usable_size(MEMKIND_DEFAULT, object)));
+    tachanka_run_flush();
+    events = process_pending_events();
+    ASSERT_LT(events * 10, OBJECTS);
+    for (auto object : objects)
+        ASSERT_EQ(tachanka_get_addr_hotness(object), -1.);
+
+    for (auto object : objects)
+        memkind_free(MEMKIND_DEFAULT, object);
+    memkind_free(MEMKIND_DEFAULT, large);
+}
+
+// runs inside a range returned to the allocator are dropped, unless they
+// were allocated from after the release
+TEST_F(TachankaTest, RunRelease)
+{
+    const uintptr_t BASE = 0x100000000u;
+    tachanka_set_tracking_granularity(HOTNESS_TRACKING_RUN);
+    EventEntry_t event;
+    event.type = EVENT_RUN_UPDATE;
+    for (uintptr_t run = 0; run < 4; ++run) {
+        event.timestamp = 1000u + run;
+        event.data.runUpdateData = {
+            1u, (void *)(BASE + run * HOTNESS_TRACKING_RUN_SIZE), 256u, 0u,
+            false};
+        tachanka_ranking_event_process(&event);
+    }
+    auto tracked = [&](uintptr_t run) {
+        void *addr = (void *)(BASE + run * HOTNESS_TRACKING_RUN_SIZE + 128);
+        return tachanka_get_addr_hotness(addr) >= 0.;
+    };
+    for (uintptr_t run = 0; run < 4; ++run)
+        ASSERT_TRUE(tracked(run));
+
+    // covers runs 1 and 2 fully, run 0 partially; run 2 was updated later
+    event.type = EVENT_RUN_RELEASE;
+    event.timestamp = 1002u;
+    event.data.runReleaseData = {(void *)(BASE + 4096u),
+                                 3 * HOTNESS_TRACKING_RUN_SIZE - 4096u};
+    tachanka_ranking_event_process(&event);
+    ASSERT_TRUE(tracked(0));
+    ASSERT_FALSE(tracked(1));
+    ASSERT_TRUE(tracked(2));
+    ASSERT_TRUE(tracked(3));
+
+    // more bytes freed than tracked - run is dropped
+    event.type = EVENT_RUN_UPDATE;
+    event.timestamp = 1003u;
+    event.data.runUpdateData = {0u, (void *)BASE, 0u, 512u, false};
+    tachanka_ranking_event_process(&event);
+    ASSERT_FALSE(tracked(0));
+
+}
+
+// sum of weighted sizes of sampled allocations estimates size of all of them
+TEST(AllocSampling, Estimate)
+{
+    const size_t INTERVAL = 4096;
+    const size_t OBJECTS = 200000;
+    const uintptr_t BASE = 0x100000000u;
+    alloc_sampling_set_interval(INTERVAL);
+    ASSERT_EQ(alloc_sampling_get_interval(), INTERVAL);
+    double estimate = 0.;
+    size_t total = 0u, sampled = 0u;
+    std::vector<bool> is_sampled(OBJECTS);
+    for (size_t i = 0; i < OBJECTS; ++i) {
+        size_t size = 16u << (i % 8);
+        float weight = 0.f;
+        is_sampled[i] =
+            alloc_sampling_sample((void *)(BASE + i * 4096u), size, &weight);
+        if (is_sampled[i]) {
+            ASSERT_GE(weight, 1.f);
+            estimate += size * (double)weight;
+            ++sampled;
+        }
+        total += size;
+    }
+    ASSERT_GT(sampled, 0u);
+    ASSERT_LT(sampled * 5, OBJECTS);
+    ASSERT_NEAR(estimate / total, 1., 0.05);
+
+    // only sampled allocations are tracked on free
+    for (size_t i = 0; i < OBJECTS; ++i)
+        ASSERT_EQ(alloc_sampling_forget((void *)(BASE + i * 4096u)),
+                  is_sampled[i]);
+    ASSERT_FALSE(alloc_sampling_forget((void *)BASE));
+
+    // large allocations are sampled every time
+    float weight = 0.f;
+    ASSERT_TRUE(alloc_sampling_sample((void *)BASE, 64 * INTERVAL, &weight));
+    ASSERT_FLOAT_EQ(weight, 1.f);
+    ASSERT_TRUE(alloc_sampling_forget((void *)BASE));
+
+    alloc_sampling_set_interval(0u);
+    ASSERT_TRUE(alloc_sampling_sample((void *)BASE, 16u, &weight));
+    ASSERT_FLOAT_EQ(weight, 1.f);
+    ASSERT_TRUE(alloc_sampling_forget((void *)BASE));
+}
+
+// tiers are half-open - type exactly at a threshold goes to the hotter tier
+TEST_F(TachankaTest, TierAtThreshold)
+{
+    double coeffs[EXPONENTIAL_COEFFS_NUMBER] = {};
+    const double F[] = {2., 1., 0.5, 0.25};
+    for (uint64_t i = 0; i < 4u; ++i)
+        tachanka_preload_type(i + 1u, F[i], coeffs, 0u);
+    double ratios[2] = {0.25, 0.5};
+    tachanka_set_tier_total_ratios(2u, ratios, ratios);
+    double thresh[2] = {1., 0.5};
+    bool thresh_valid[2] = {true, true};
+    tachanka_set_thresholds(2u, thresh, thresh_valid);
+    ASSERT_EQ(tachanka_get_tier_hash(1u), 0);
+    ASSERT_EQ(tachanka_get_tier_hash(2u), 0);
+    ASSERT_EQ(tachanka_get_tier_hash(3u), 1);
+    ASSERT_EQ(tachanka_get_tier_hash(4u), 2);
+    thresh_valid[1] = false;
+    tachanka_set_thresholds(2u, thresh, thresh_valid);
+    ASSERT_EQ(tachanka_get_tier_hash(1u), -1);
+
+    tachanka_set_tier_total_ratios(1u, ratios, ratios);
+}
+
+// type exactly at the hot threshold is hot, as in the tier lookup
+TEST_F(TachankaTest, HotnessTypeAtThreshold)
+{
+    const uintptr_t BASE = 0x100000000u;
+    double coeffs[EXPONENTIAL_COEFFS_NUMBER] = {};
+    tachanka_preload_type(1u, 1., coeffs, 0u);
+    tachanka_preload_type(2u, 0.5, coeffs, 0u);
+    create_block((void *)BASE, 256u, 1u);
+    create_block((void *)(BASE + 4096u), 256u, 2u);
+    ASSERT_EQ(tachanka_get_hotness_type_hash(1u), HOTNESS_NOT_FOUND);
+    double thresh = 1.;
+    bool thresh_valid = true;
+    tachanka_set_thresholds(1u, &thresh, &thresh_valid);
+    ASSERT_EQ(tachanka_get_hotness_type_hash(1u), HOTNESS_HOT);
+    ASSERT_EQ(tachanka_get_hotness_type_hash(2u), HOTNESS_COLD);
+    ASSERT_EQ(tachanka_get_hotness_type((void *)BASE), HOTNESS_HOT);
+    ASSERT_EQ(tachanka_get_hotness_type((void *)(BASE + 4096u)),
+              HOTNESS_COLD);
+}
+
+// block of sampled allocation stands for weight allocations - its type is
+// as hot as a type of weight unsampled allocations with the same accesses
+TEST_F(TachankaTest, SampledBlockWeight)
+{
+    const uintptr_t BASE = 0x100000000u;
+    const size_t WEIGHT = 4u;
+    std::vector<tachanka_touch_sample_t> samples;
+    for (size_t i = 0; i < WEIGHT; ++i) {
+        void *addr = (void *)(BASE + i * 4096u);
+        create_block(addr, 256u, 1u);
+        samples.push_back({addr, 1000000000u});
+    }
+    void *sampled = (void *)(BASE + WEIGHT * 4096u);
+    create_block(sampled, 256u, 2u, 1000u, (float)WEIGHT);
+    samples.push_back({sampled, 1000000000u});
+
+    ASSERT_EQ(tachanka_touch_batch(samples.data(), samples.size()), 2u);
+    double hotness = tachanka_get_addr_hotness((void *)BASE);
+    double sampled_hotness = tachanka_get_addr_hotness(sampled);
+    ASSERT_GT(sampled_hotness, 0.);
+    ASSERT_NEAR(hotness / sampled_hotness, 1., 0.01);
+
+    // touches applied one by one give the same hotness
+    for (auto &sample : samples)
+        touch(sample.addr, 2000000000u, 0);
+    ASSERT_NEAR(tachanka_get_addr_hotness((void *)BASE) /
+                tachanka_get_addr_hotness(sampled), 1., 0.01);
+
+    destroy_block(sampled);
+    ASSERT_EQ(tachanka_get_addr_hotness(sampled), -1.);
+}
+
+// pages of a migrated block go back to the node of its kind on free
+TEST_F(TachankaTest, MigratedBlockFree)
+{
+    int node = numa_node_of_cpu(sched_getcpu());
+    ASSERT_GE(node, 0);
+    page_migration_init(node, node, 1u << 20);
+
+    const size_t PAGES = 4u;
+    size_t page_size = page_migration_get_page_size();
+    size_t size = PAGES * page_size;
+    char *buf = map_buffer(size);
+    ASSERT_NE(buf, nullptr);
+    memset(buf, 1, size);
+
+    double coeffs[EXPONENTIAL_COEFFS_NUMBER] = {};
+    tachanka_preload_type(1u, 1000., coeffs, 0u);
+    double thresh = 1.;
+    bool thresh_valid = true;
+    tachanka_set_thresholds(1u, &thresh, &thresh_valid);
+
+    create_block(buf, size, 1u);
+    tachanka_migrate_blocks();
+    page_migration_stats_t stats;
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, size);
+
+    // pages are moved back in the next cycle, not on free
+    destroy_block(buf);
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, size);
+    tachanka_migrate_blocks();
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, 2 * size);
+    ASSERT_EQ(stats.failedPages, 0u);
+}
+
+// move-backs of freed blocks are charged to the per-cycle budget
+TEST_F(TachankaTest, MoveBacksBudget)
+{
+    int node = numa_node_of_cpu(sched_getcpu());
+    ASSERT_GE(node, 0);
+    page_migration_init(node, node, 1u << 20);
+
+    const size_t PAGES = 4u;
+    size_t page_size = page_migration_get_page_size();
+    size_t size = PAGES * page_size;
+
+    char *buf = map_buffer(2 * size);
+    ASSERT_NE(buf, nullptr);
+    memset(buf, 1, 2 * size);
+
+    double coeffs[EXPONENTIAL_COEFFS_NUMBER] = {};
+    tachanka_preload_type(1u, 1000., coeffs, 0u);
+    double thresh = 1.;
+    bool thresh_valid = true;
+    tachanka_set_thresholds(1u, &thresh, &thresh_valid);
+
+    create_block(buf, size, 1u);
+    create_block(buf + size, size, 1u);
+    tachanka_migrate_blocks();
+    page_migration_stats_t stats;
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, 2 * size);
+
+    // budget of a single block
+    page_migration_init(node, node, size);
+    destroy_block(buf);
+    destroy_block(buf + size);
+    tachanka_migrate_blocks();
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, size);
+    tachanka_migrate_blocks();
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, 2 * size);
+    tachanka_migrate_blocks();
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, 2 * size);
+}
+
+// cycle stops after a bounded number of visited blocks, the next one
+// continues from there
+TEST_F(TachankaTest, MigrationVisitsBound)
+{
+    int node = numa_node_of_cpu(sched_getcpu());
+    ASSERT_GE(node, 0);
+    page_migration_init(node, node, 1u << 20);
+
+    const size_t PAGES = 4u;
+    size_t page_size = page_migration_get_page_size();
+    size_t size = PAGES * page_size;
+    char *buf = map_buffer(size);
+    ASSERT_NE(buf, nullptr);
+    memset(buf, 1, size);
+
+    double coeffs[EXPONENTIAL_COEFFS_NUMBER] = {};
+    tachanka_preload_type(1u, 1000., coeffs, 0u);
+    tachanka_preload_type(2u, 0., coeffs, 0u);
+    double thresh = 1.;
+    bool thresh_valid = true;
+    tachanka_set_thresholds(1u, &thresh, &thresh_valid);
+
+    // blocks smaller than page are visited, but never moved; they are
+    // placed below the buffer, so they are visited first
+    char *small = buf - HOTNESS_MIGRATION_MAX_VISITS_PER_CYCLE * 64u;
+    for (size_t i = 0; i < HOTNESS_MIGRATION_MAX_VISITS_PER_CYCLE; ++i)
+        create_block(small + i * 64u, 64u, 2u);
+    create_block(buf, size, 1u);
+
+    tachanka_migrate_blocks();
+    page_migration_stats_t stats;
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, 0u);
+    tachanka_migrate_blocks();
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, size);
+}
+
+// block changes its tier only when all its pages were moved
+TEST_F(TachankaTest, PartialMigration)
+{
+    int node = numa_node_of_cpu(sched_getcpu());
+    ASSERT_GE(node, 0);
+    page_migration_init(node, node, 1u << 20);
+
+    const size_t PAGES = 4u;
+    size_t page_size = page_migration_get_page_size();
+    size_t size = PAGES * page_size;
+    char *buf = map_buffer(size);
+    ASSERT_NE(buf, nullptr);
+    // pages that were never touched are not present - they cannot be moved
+    memset(buf, 1, size / 2);
+
+    double coeffs[EXPONENTIAL_COEFFS_NUMBER] = {};
+    tachanka_preload_type(1u, 1000., coeffs, 0u);
+    double thresh = 1.;
+    bool thresh_valid = true;
+    tachanka_set_thresholds(1u, &thresh, &thresh_valid);
+    create_block(buf, size, 1u);
+
+    page_migration_stats_t stats;
+    for (size_t cycle = 1u; cycle <= 2u; ++cycle) {
+        tachanka_migrate_blocks();
+        page_migration_get_stats(&stats);
+        ASSERT_EQ(stats.movedBytes, cycle * size / 2);
+        ASSERT_EQ(stats.failedPages, cycle * PAGES / 2);
+    }
+    memset(buf, 1, size);
+    tachanka_migrate_blocks();
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, 2 * size);
+    // block is migrated - it is not a candidate anymore
+    tachanka_migrate_blocks();
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, 2 * size);
+}
+
+// pages of a large block that shares a run with small allocations move
+// only with the block
+TEST_F(TachankaTest, RunMigrationSkipsLargeBlocks)
+{
+    const size_t RUN = HOTNESS_TRACKING_RUN_SIZE;
+    int node = numa_node_of_cpu(sched_getcpu());
+    ASSERT_GE(node, 0);
+    page_migration_init(node, node, 1u << 20);
+    char *buf = map_buffer(3 * RUN);
+    ASSERT_NE(buf, nullptr);
+    char *run = (char *)(((uintptr_t)buf + RUN - 1) & ~(uintptr_t)(RUN - 1));
+    memset(run, 1, 2 * RUN);
+
+    tachanka_set_tracking_granularity(HOTNESS_TRACKING_RUN);
+    double coeffs[EXPONENTIAL_COEFFS_NUMBER] = {};
+    tachanka_preload_type(1u, 1000., coeffs, 0u);
+    tachanka_preload_type(2u, 0., coeffs, 0u);
+    double thresh = 1.;
+    bool thresh_valid = true;
+    tachanka_set_thresholds(1u, &thresh, &thresh_valid);
+    EventEntry_t event;
+    event.type = EVENT_RUN_UPDATE;
+    event.timestamp = 1000u;
+    event.data.runUpdateData = {1u, run, 256u, 0u, false};
+    tachanka_ranking_event_process(&event);
+    // cold block covers the second half of the hot run
+    create_block(run + RUN / 2, RUN, 2u);
+
+    tachanka_migrate_blocks();
+    page_migration_stats_t stats;
+    page_migration_get_stats(&stats);
+    ASSERT_EQ(stats.movedBytes, RUN / 2);
+    ASSERT_EQ(stats.failedPages, 0u);
+
+    destroy_block(run + RUN / 2);
+}
+
+// allocations of different classes never share pages; class allocations
+// are freed to tcaches of their arenas and reused only by their class
+TEST(ArenaClasses, Segregation)
+{
+    const size_t OBJECTS = 4096;
+    const size_t PAGE_SIZE = 4096;
+    ASSERT_EQ(memkind_arena_create_classes(MEMKIND_DEFAULT, 2u), 0);
+    // classes are created once
+    ASSERT_EQ(memkind_arena_create_classes(MEMKIND_DEFAULT, 2u), 0);
+    ASSERT_NE(memkind_arena_create_classes(MEMKIND_DEFAULT, 3u), 0);
+    ASSERT_EQ(memkind_arena_get_classes(MEMKIND_DEFAULT), 2u);
+
+    std::vector<void *> objects(OBJECTS);
+    std::map<uintptr_t, unsigned> page_class;
+    for (size_t i = 0; i < OBJECTS; ++i) {
+        unsigned cls = i % 2;
+        objects[i] = memkind_arena_class_malloc(MEMKIND_DEFAULT, cls, 64u);
+        ASSERT_NE(objects[i], nullptr);
+        uintptr_t page = (uintptr_t)objects[i] & ~(PAGE_SIZE - 1u);
+        auto it = page_class.emplace(page, cls).first;
+        ASSERT_EQ(it->second, cls);
+    }
+    ASSERT_GE(page_class.size(), 2u);
+
+    void *regular = memkind_malloc(MEMKIND_DEFAULT, 64u);
+    ASSERT_FALSE(memkind_arena_class_free(regular));
+    memkind_free(MEMKIND_DEFAULT, regular);
+    ASSERT_FALSE(memkind_arena_class_free(nullptr));
+
+    // realloc keeps allocation in its class
+    objects[0] = memkind_arena_class_realloc(MEMKIND_DEFAULT, objects[0], 96u);
+    ASSERT_NE(objects[0], nullptr);
+    for (auto object : objects)
+        ASSERT_TRUE(memkind_arena_class_free(object));
+    for (size_t i = 0; i < OBJECTS; ++i) {
+        unsigned cls = (i + 1) % 2;
+        objects[i] = memkind_arena_class_malloc(MEMKIND_DEFAULT, cls, 64u);
+        ASSERT_NE(objects[i], nullptr);
+        uintptr_t page = (uintptr_t)objects[i] & ~(PAGE_SIZE - 1u);
+        auto it = page_class.emplace(page, cls).first;
+        ASSERT_EQ(it->second, cls);
+    }
+    std::vector<void *> regulars(OBJECTS);
+    for (auto &object : regulars) {
+        object = memkind_malloc(MEMKIND_DEFAULT, 64u);
+        ASSERT_NE(object, nullptr);
+        uintptr_t page = (uintptr_t)object & ~(PAGE_SIZE - 1u);
+        ASSERT_EQ(page_class.count(page), 0u);
+    }
+    for (auto object : regulars)
+        memkind_free(MEMKIND_DEFAULT, object);
+    for (auto object : objects)
+        ASSERT_TRUE(memkind_arena_class_free(object));
+
+    void *zeroed =
+        memkind_arena_class_calloc(MEMKIND_DEFAULT, 1u, 16u, 8u);
+    ASSERT_NE(zeroed, nullptr);
+    for (size_t i = 0; i < 16u * 8u; ++i)
+        ASSERT_EQ(((char *)zeroed)[i], 0);
+    ASSERT_TRUE(memkind_arena_class_free(zeroed));
+    void *aligned = nullptr;
+    ASSERT_EQ(memkind_arena_class_posix_memalign(MEMKIND_DEFAULT, 0u,
+                                                 &aligned, 4096u, 100u),
+              0);
+    ASSERT_EQ((uintptr_t)aligned % 4096u, 0u);
+    ASSERT_TRUE(memkind_arena_class_free(aligned));
+}
+
+TEST_F(TachankaTest, PagePurity)
+{
+    const uintptr_t BASE = 0x100000000u;
+    const size_t PAGE_SIZE = page_migration_get_page_size();
+    const __u64 TIMESTAMP = 1000000000u;
+    struct {
+        uint64_t hash;
+        uintptr_t addr;
+        size_t size;
+    } blocks[] = {
+        // page 0 - hot and cold, pages 1-3 - cold, page 4 - hot
+        {1u, BASE, PAGE_SIZE / 4},
+        {2u, BASE + PAGE_SIZE / 4, 3 * PAGE_SIZE / 4},
+        {2u, BASE + PAGE_SIZE, 3 * PAGE_SIZE},
+        {1u, BASE + 4 * PAGE_SIZE, PAGE_SIZE},
+    };
+    for (auto &block : blocks)
+        create_block((void *)block.addr, block.size, block.hash, TIMESTAMP);
+    ASSERT_EQ(tachanka_get_page_purity(), -1.);
+
+    std::vector<tachanka_touch_sample_t> samples;
+    for (size_t i = 0; i < 10; ++i)
+        samples.push_back({(void *)BASE, TIMESTAMP + i * 1000000u});
+    samples.push_back({(void *)(BASE + PAGE_SIZE), TIMESTAMP});
+    tachanka_touch_batch(samples.data(), samples.size());
+    tachanka_set_dram_total_ratio(0.25, 0.25);
+    tachanka_update_threshold();
+    ASSERT_EQ(tachanka_get_tier_hash(1u), 0);
+    ASSERT_EQ(tachanka_get_tier_hash(2u), 1);
+    ASSERT_DOUBLE_EQ(tachanka_get_page_purity(), 19. / 20.);
+
+    // page 0 holds only the hot block
+    destroy_block((void *)(BASE + PAGE_SIZE / 4), TIMESTAMP + 1u);
+    ASSERT_DOUBLE_EQ(tachanka_get_page_purity(), 1.);
+}
+
+// reallocated block keeps the type of the old block; the type carried by
+// the event is used when the old block is not tracked
+TEST_F(TachankaTest, ReallocTypePropagation)
+{
+    const uintptr_t BASE = 0x100000000u;
+    uint64_t hash = 0u;
+    ASSERT_FALSE(tachanka_get_addr_hash((void *)BASE, &hash));
+
+    create_block((void *)BASE, 256u, 7u);
+    ASSERT_TRUE(tachanka_get_addr_hash((void *)BASE, &hash));
+    ASSERT_EQ(hash, 7u);
+
+    EventEntry_t event;
+    event.type = EVENT_REALLOC;
+    event.timestamp = 1001u;
+    event.data.reallocData = {(void *)BASE, (void *)(BASE + 4096u), 0u, 512u,
+                              false, 0.f};
+    tachanka_ranking_event_process(&event);
+    ASSERT_FALSE(tachanka_get_addr_hash((void *)BASE, &hash));
+    ASSERT_TRUE(tachanka_get_addr_hash((void *)(BASE + 4096u), &hash));
+    ASSERT_EQ(hash, 7u);
+
+    event.timestamp = 1002u;
+    event.data.reallocData = {(void *)(BASE + 8192u),
+                              (void *)(BASE + 12288u), 9u, 64u, false, 0.f};
+    tachanka_ranking_event_process(&event);
+    ASSERT_TRUE(tachanka_get_addr_hash((void *)(BASE + 12288u), &hash));
+    ASSERT_EQ(hash, 9u);
+}
+
+TEST(HotnessStats, PublishRead)
+{
+    ASSERT_EQ(hotness_stats_map(getpid()), nullptr);
+    ASSERT_EQ(hotness_stats_open(), 0);
+    ASSERT_TRUE(hotness_stats_enabled());
+    const hotness_stats_t *page = hotness_stats_map(getpid());
+    ASSERT_NE(page, nullptr);
+
+    hotness_stats_t stats = {};
+    stats.cycles = 42u;
+    stats.tiers = 2u;
+    stats.tier_size[1] = 1u << 30;
+    stats.thresholds = 1u;
+    stats.controller_integral[0] = -0.25;
+    stats.page_purity = 0.75;
+    stats.event_latency[EVENT_REALLOC][hotness_stats_latency_bucket(1000u)] =
+        3u;
+    hotness_stats_publish(&stats);
+    hotness_stats_t snapshot;
+    ASSERT_EQ(hotness_stats_read(page, &snapshot), 0);
+    ASSERT_EQ(snapshot.magic, HOTNESS_STATS_MAGIC);
+    ASSERT_EQ(snapshot.version, HOTNESS_STATS_VERSION);
+    ASSERT_EQ(snapshot.pid, getpid());
+    ASSERT_EQ(snapshot.sequence, 2u);
+    ASSERT_EQ(snapshot.cycles, 42u);
+    ASSERT_EQ(snapshot.tier_size[1], 1u << 30);
+    ASSERT_EQ(snapshot.controller_integral[0], -0.25);
+    ASSERT_EQ(snapshot.page_purity, 0.75);
+    ASSERT_EQ(snapshot.event_latency[EVENT_REALLOC][9], 3u);
+
+    stats.cycles = 43u;
+    hotness_stats_publish(&stats);
+    ASSERT_EQ(hotness_stats_read(page, &snapshot), 0);
+    ASSERT_EQ(snapshot.sequence, 4u);
+    ASSERT_EQ(snapshot.cycles, 43u);
+
+    hotness_stats_close();
+    ASSERT_FALSE(hotness_stats_enabled());
+    ASSERT_EQ(hotness_stats_map(getpid()), nullptr);
+    // mapping outlives the file
+    ASSERT_EQ(hotness_stats_read(page, &snapshot), 0);
+    hotness_stats_unmap(page);
+
+    ASSERT_EQ(hotness_stats_latency_bucket(0u), 0u);
+    ASSERT_EQ(hotness_stats_latency_bucket(1u), 0u);
+    ASSERT_EQ(hotness_stats_latency_bucket(1023u), 9u);
+    ASSERT_EQ(hotness_stats_latency_bucket(UINT64_MAX),
+              HOTNESS_STATS_LATENCY_BUCKETS - 1u);
+
+    // stale file planted under the name of the page is replaced, not followed
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), HOTNESS_STATS_PATH, (int)getpid());
+    char victim[] = "/tmp/hotness_stats_victimXXXXXX";
+    int fd = mkstemp(victim);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(write(fd, "x", 1), 1);
+    close(fd);
+    ASSERT_EQ(symlink(victim, path), 0);
+    ASSERT_EQ(hotness_stats_open(), 0);
+    struct stat st;
+    ASSERT_EQ(lstat(path, &st), 0);
+    ASSERT_TRUE(S_ISREG(st.st_mode));
+    ASSERT_EQ(st.st_mode & 0777, 0600u);
+    ASSERT_EQ(stat(victim, &st), 0);
+    ASSERT_EQ(st.st_size, 1);
+    hotness_stats_close();
+    unlink(victim);
+}
+
+TEST_F(TachankaTest, StatsCounts)
+{
+    const uintptr_t BASE = 0x100000000u;
+    for (uintptr_t i = 0; i < 3u; ++i)
+        create_block((void *)(BASE + i * 4096u), 256u, 1u + i % 2u);
+    destroy_block((void *)BASE);
+
+    tachanka_stats_t stats;
+    tachanka_get_stats(&stats);
+    ASSERT_EQ(stats.types, 2u);
+    ASSERT_EQ(stats.blocks, 2u);
+    ASSERT_EQ(stats.thresholds, 1u);
+}
+
+// destroys that overtook their creates are kept in arrival order, the first
+// one is evicted when the table is full
+TEST_F(TachankaTest, PendingDestroys)
+{
+    const uintptr_t BASE = 0x100000000u;
+    for (uintptr_t i = 0; i <= RANKING_PENDING_DESTROYS_MAX; ++i)
+        destroy_block((void *)(BASE + i * 4096u), 2000u + i);
+    for (uintptr_t i = 0; i < 3u; ++i)
+        create_block((void *)(BASE + i * 4096u), 256u, 1u);
+    uint64_t hash;
+    // destroy of the first block was evicted
+    ASSERT_TRUE(tachanka_get_addr_hash((void *)BASE, &hash));
+    ASSERT_FALSE(tachanka_get_addr_hash((void *)(BASE + 4096u), &hash));
+    ASSERT_FALSE(tachanka_get_addr_hash((void *)(BASE + 8192u), &hash));
+    // destroy older than the create belongs to a previous block
+    void *last = (void *)(BASE + RANKING_PENDING_DESTROYS_MAX * 4096u);
+    create_block(last, 256u, 1u, 2000u + RANKING_PENDING_DESTROYS_MAX + 1u);
+    ASSERT_TRUE(tachanka_get_addr_hash(last, &hash));
+}
+
+TEST_F(TachankaTest, RangesCursor)
+{
+    const uintptr_t BASE = 0x100000000u;
+    for (uintptr_t i = 0; i < 3u; ++i)
+        create_block((void *)(BASE + i * 8192u), 256u * (i + 1u), 1u);
+
+    tachanka_range_t ranges[2];
+    uintptr_t cursor = 0u;
+    ASSERT_EQ(tachanka_get_tracked_ranges(&cursor, false, ranges, 2u), 2u);
+    ASSERT_EQ(ranges[0].addr, (void *)BASE);
+    ASSERT_EQ(ranges[0].size, 256u);
+    ASSERT_EQ(ranges[1].addr, (void *)(BASE + 8192u));
+    ASSERT_EQ(ranges[1].size, 512u);
+    ASSERT_NE(cursor, 0u);
+    ASSERT_EQ(tachanka_get_tracked_ranges(&cursor, false, ranges, 2u), 1u);
+    ASSERT_EQ(ranges[0].addr, (void *)(BASE + 16384u));
+    ASSERT_EQ(ranges[0].size, 768u);
+    // sweep is complete - the next one starts from the beginning
+    ASSERT_EQ(cursor, 0u);
+    ASSERT_EQ(tachanka_get_tracked_ranges(&cursor, false, ranges, 2u), 2u);
+    ASSERT_EQ(ranges[0].addr, (void *)BASE);
+}
+
+TEST_F(TachankaTest, SyntheticSampleSource)
+{
+    ASSERT_EQ(sample_source_parse("auto"), SAMPLE_SOURCE_AUTO);
+    ASSERT_EQ(sample_source_parse("pebs"), SAMPLE_SOURCE_PEBS);
+    ASSERT_EQ(sample_source_parse("idle_page"), SAMPLE_SOURCE_IDLE_PAGE);
+    ASSERT_EQ(sample_source_parse("synthetic"), SAMPLE_SOURCE_SYNTHETIC);
+    ASSERT_EQ(sample_source_parse("none"), SAMPLE_SOURCE_NONE);
+    ASSERT_EQ(sample_source_parse("soft_dirty"), -1);
+
+    const uintptr_t BASE = 0x100000000u;
+    create_block((void *)BASE, 4096u, 1u);
+    create_block((void *)(BASE + 8192u), 4096u, 2u);
+
+    const sample_source_t *source = &sample_source_synthetic;
+    ASSERT_EQ(start_source(source), 0);
+    ASSERT_EQ(source->collect(), 0u);
+    tachanka_touch_sample_t touches[] = {
+        {(void *)(BASE + 64u), 2000u},
+        {(void *)(BASE + 128u), 2001u},
+        {(void *)(BASE + 8192u), 2002u},
+        {(void *)(BASE + 65536u), 2003u}, // not tracked
+    };
+    sample_source_synthetic_push(touches, 2u);
+    sample_source_synthetic_push(touches + 2u, 2u);
+    // touches are delivered once, in the cycle after they are pushed
+    ASSERT_EQ(source->collect(), 2u);
+    ASSERT_EQ(source->collect(), 0u);
+    sample_source_synthetic_push(touches, 1u);
+    ASSERT_EQ(source->collect(), 1u);
+}
+
+TEST_F(TachankaTest, IdlePageSampleSource)
+{
+    const sample_source_t *source = &sample_source_idle_page;
+    if (start_source(source))
+        GTEST_SKIP() << "Idle page tracking with CAP_SYS_ADMIN is required."
+                     << std::endl;
+    const size_t PAGES = 16u;
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    char *buf = map_buffer(PAGES * page_size);
+    ASSERT_NE(buf, nullptr);
+    memset(buf, 1, PAGES * page_size);
+    create_block(buf, PAGES * page_size, 1u);
+
+    // pages not scanned before count as accessed
+    ASSERT_EQ(source->collect(), 1u);
+    ASSERT_EQ(source->collect(), 0u);
+    // scan of the block is spread over cycles
+    sample_source_idle_page_set_budget(PAGES / 4u);
+    buf[PAGES * page_size - 1u] = 2;
+    size_t touched = 0u;
+    for (unsigned i = 0; i < 4u; ++i)
+        touched += source->collect();
+    ASSERT_EQ(touched, 1u);
+}
+
+TEST(PebsPeriod, Adapt)
+{
+    pebs_period_input_t in = {};
+    in.period = 1000u;
+    in.seconds = 1.;
+    in.overhead_target = 0.01;
+    in.wanted_rate = 1e6;
+    // cycle of no length
+    in.seconds = 0.;
+    ASSERT_EQ(pebs_period_adapt(&in), 1000u);
+    in.seconds = 1.;
+    // no samples - shorter period
+    ASSERT_EQ(pebs_period_adapt(&in), 500u);
+    // samples are not wanted
+    in.wanted_rate = 0.;
+    ASSERT_EQ(pebs_period_adapt(&in), 1000u);
+    in.wanted_rate = 1e6;
+
+    // 1 us per sample: 10000 samples/s fit in 1% of a core
+    in.samples = 20000u;
+    in.busy_ns = 20000000u;
+    ASSERT_EQ(pebs_period_adapt(&in), 2000u);
+    in.samples = 5000u;
+    in.busy_ns = 5000000u;
+    ASSERT_EQ(pebs_period_adapt(&in), 500u);
+    // change of one step at most
+    in.samples = 100000u;
+    in.busy_ns = 100000000u;
+    ASSERT_EQ(pebs_period_adapt(&in), 2000u);
+    in.samples = 100u;
+    in.busy_ns = 100000u;
+    ASSERT_EQ(pebs_period_adapt(&in), 500u);
+
+    // enough samples for ranking within the budget
+    in.samples = 20000u;
+    in.busy_ns = 2000000u;
+    in.wanted_rate = 16000.;
+    ASSERT_EQ(pebs_period_adapt(&in), 1250u);
+
+    // lost samples - longer period even within the budget
+    in.lost = 10u;
+    ASSERT_EQ(pebs_period_adapt(&in), 2000u);
+    in.lost = 0u;
+
+    in.samples = 0u;
+    in.period = HOTNESS_PEBS_PERIOD_MIN + 1u;
+    ASSERT_EQ(pebs_period_adapt(&in), HOTNESS_PEBS_PERIOD_MIN);
+    in.wanted_rate = 0.;
+    in.samples = 1u;
+    in.period = HOTNESS_PEBS_PERIOD_MAX - 1u;
+    ASSERT_EQ(pebs_period_adapt(&in), HOTNESS_PEBS_PERIOD_MAX);
+}
+
+TEST_F(TachankaTest, HotnessProfileSaveLoad)
+{
+    const uintptr_t BASE = 0x100000000u;
+    const uint64_t NOW = 1000000000000u;
+    char path[] = "/tmp/memkind_hotness_profile_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    // types 1 (hot) and 2 (cold) are touched, type 3 is not
+    for (uintptr_t i = 0; i < 3u; ++i)
+        create_block((void *)(BASE + i * 4096u), 4096u, 1u + i, NOW);
+    std::vector<tachanka_touch_sample_t> touches;
+    for (uint64_t i = 0; i < 100u; ++i)
+        touches.push_back({(void *)(BASE + 64u), NOW + i * 1000u});
+    touches.push_back({(void *)(BASE + 4096u + 64u), NOW + 100000u});
+    tachanka_touch_batch(touches.data(), touches.size());
+    double desired = 0.5, actual = 0.5;
+    tachanka_set_tier_total_ratios(1u, &desired, &actual);
+    tachanka_update_threshold();
+    double hot_f = tachanka_get_addr_hotness((void *)BASE);
+    double cold_f = tachanka_get_addr_hotness((void *)(BASE + 4096u));
+    ASSERT_GT(hot_f, cold_f);
+    int hot_tier = tachanka_get_tier_hash(1u);
+    int cold_tier = tachanka_get_tier_hash(2u);
+    ASSERT_EQ(hot_tier, 0);
+    ASSERT_EQ(cold_tier, 1);
+    ASSERT_EQ(hotness_profile_save(path), 0);
+    tachanka_destroy();
+
+    tachanka_init(DEFAULT_OLD_HOTNESS_WINDOW_WEIGHT,
+                  RANKING_BUFFER_SIZE_ELEMENTS);
+    ASSERT_EQ(tachanka_get_tier_hash(1u), -1);
+    ASSERT_EQ(hotness_profile_load(path, NOW + 200000u), 2);
+    // decisions are made before any block is tracked
+    ASSERT_EQ(tachanka_get_tier_hash(1u), hot_tier);
+    ASSERT_EQ(tachanka_get_tier_hash(2u), cold_tier);
+    ASSERT_EQ(tachanka_get_tier_hash(3u), -1);
+    create_block((void *)BASE, 4096u, 1u, NOW + 300000u);
+    ASSERT_EQ(tachanka_get_addr_hotness((void *)BASE), hot_f);
+
+    // profile of other configuration or a damaged one is not loaded
+    FILE *file = fopen(path, "r+b");
+    ASSERT_NE(file, nullptr);
+    hotness_profile_header_t header;
+    ASSERT_EQ(fread(&header, sizeof(header), 1u, file), 1u);
+    header.coeffs++;
+    ASSERT_EQ(fseek(file, 0, SEEK_SET), 0);
+    ASSERT_EQ(fwrite(&header, sizeof(header), 1u, file), 1u);
+    fclose(file);
+    ASSERT_EQ(hotness_profile_load(path, NOW), -1);
+    unlink(path);
+    ASSERT_EQ(hotness_profile_load(path, NOW), -1);
+}
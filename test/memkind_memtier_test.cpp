@@ -3,6 +3,8 @@
 
 #include <memkind/internal/memkind_memtier.h>
 
+#include <algorithm>
+#include <atomic>
 #include <random>
 #include <thread>
 
@@ -255,6 +257,95 @@ TEST_F(MemkindMemtierKindTest, test_tier_static_policy_failure)
     memtier_builder_delete(builder);
 }
 
+// per-thread statistics are folded lazily - each thread bucket holds at most
+// FLUSH_THRESHOLD bytes that are not yet visible
+TEST_F(MemkindMemtierKindTest, test_tier_alloc_size_staleness_bound)
+{
+    const size_t num_threads = 8;
+    const size_t iteration_count = 4000;
+    const size_t alloc_size = 64;
+    const long long bound =
+        std::min(num_threads, (size_t)THREAD_BUCKETS) * FLUSH_THRESHOLD;
+    // folded, so the buckets hold nothing
+    const long long base = memtier_kind_allocated_size(MEMKIND_DEFAULT);
+    const long long max_size = alloc_size * num_threads * iteration_count;
+    std::vector<std::vector<void *>> alloc_vec(num_threads);
+    std::vector<std::thread> thds;
+    std::atomic<size_t> running(num_threads);
+
+    for (size_t i = 0; i < num_threads; ++i) {
+        thds.push_back(std::thread([&, i]() {
+            alloc_vec[i].reserve(iteration_count);
+            for (size_t j = 0; j < iteration_count; ++j)
+                alloc_vec[i].push_back(
+                    memtier_kind_malloc(MEMKIND_DEFAULT, alloc_size));
+            --running;
+        }));
+    }
+    // real size is between base and base + max_size while threads run
+    while (running) {
+        long long size =
+            memtier_kind_allocated_size_unflushed(MEMKIND_DEFAULT);
+        ASSERT_GE(size, base - bound);
+        ASSERT_LE(size, base + max_size + bound);
+    }
+    for (auto &thd : thds)
+        thd.join();
+    thds.clear();
+    long long size = memtier_kind_allocated_size_unflushed(MEMKIND_DEFAULT);
+    ASSERT_LE(std::llabs(size - (base + max_size)), bound);
+
+    for (size_t i = 0; i < num_threads; ++i) {
+        thds.push_back(std::thread([&, i]() {
+            for (void *ptr : alloc_vec[i])
+                memtier_kind_free(MEMKIND_DEFAULT, ptr);
+        }));
+    }
+    for (auto &thd : thds)
+        thd.join();
+    size = memtier_kind_allocated_size_unflushed(MEMKIND_DEFAULT);
+    ASSERT_LE(std::llabs(size - base), bound);
+    ASSERT_EQ(base, (long long)memtier_kind_allocated_size(MEMKIND_DEFAULT));
+}
+
+// folding makes the totals exact, also for deltas below FLUSH_THRESHOLD
+TEST_F(MemkindMemtierKindTest, test_tier_alloc_size_exact_after_fold)
+{
+    const size_t num_threads = 4;
+    const size_t alloc_size = 64;
+    const size_t size = memtier_kind_allocated_size(MEMKIND_DEFAULT);
+    ASSERT_EQ(size, memtier_kind_allocated_size_unflushed(MEMKIND_DEFAULT));
+    std::vector<void *> alloc_vec(num_threads);
+    std::vector<std::thread> thds;
+
+    // single allocation per thread never reaches FLUSH_THRESHOLD
+    for (size_t i = 0; i < num_threads; ++i) {
+        thds.push_back(std::thread([&, i]() {
+            alloc_vec[i] = memtier_kind_malloc(MEMKIND_DEFAULT, alloc_size);
+        }));
+    }
+    for (auto &thd : thds)
+        thd.join();
+    thds.clear();
+    ASSERT_EQ(size, memtier_kind_allocated_size_unflushed(MEMKIND_DEFAULT));
+    ASSERT_EQ(size + num_threads * alloc_size,
+              memtier_kind_allocated_size(MEMKIND_DEFAULT));
+    ASSERT_EQ(size + num_threads * alloc_size,
+              memtier_kind_allocated_size_unflushed(MEMKIND_DEFAULT));
+
+    for (size_t i = 0; i < num_threads; ++i) {
+        thds.push_back(std::thread([&, i]() {
+            memtier_kind_free(MEMKIND_DEFAULT, alloc_vec[i]);
+        }));
+    }
+    for (auto &thd : thds)
+        thd.join();
+    ASSERT_EQ(size + num_threads * alloc_size,
+              memtier_kind_allocated_size_unflushed(MEMKIND_DEFAULT));
+    ASSERT_EQ(size, memtier_kind_allocated_size(MEMKIND_DEFAULT));
+    ASSERT_EQ(size, memtier_kind_allocated_size_unflushed(MEMKIND_DEFAULT));
+}
+
 TEST_F(MemkindMemtierDynamicTest, test_tier_policy_dynamic_threshold_two_kinds)
 {
     int res = memtier_builder_add_tier(m_builder, MEMKIND_DEFAULT, 1);
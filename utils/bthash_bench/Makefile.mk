@@ -0,0 +1,13 @@
+# SPDX-License-Identifier: BSD-2-Clause
+# Copyright (C) 2021 Intel Corporation.
+
+noinst_PROGRAMS += utils/bthash_bench/bthash_bench
+
+utils_bthash_bench_bthash_bench_SOURCES = utils/bthash_bench/bthash_bench.cpp
+utils_bthash_bench_bthash_bench_LDADD = libmemkind.la
+utils_bthash_bench_bthash_bench_LDFLAGS = $(PTHREAD_CFLAGS)
+
+clean-local: utils_bthash_bench_bthash_bench-clean
+
+utils_bthash_bench_bthash_bench-clean:
+	rm -f utils/bthash_bench/*.gcno
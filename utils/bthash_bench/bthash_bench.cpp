@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/* Copyright (C) 2021 Intel Corporation. */
+
+#include <memkind/internal/bthash.h>
+
+#include <argp.h>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <pthread.h>
+#include <random>
+#include <stdint.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Compares allocation-site hashing methods used by data hotness policy:
+//  - time per hash (the per-allocation overhead),
+//  - unstable sites: single call site that produced more than one hash,
+//  - colliding sites: call sites that share a hash with a different site.
+// Call sites are called in random order, so stale return addresses of
+// other sites are left on the stack - as in a real application.
+
+using hash_fn = uint64_t (*)(uint64_t);
+
+static void *g_stackLow;
+
+// mimics memtier_policy_data_hotness_get_kind()
+__attribute__((noinline)) static uint64_t alloc_path(hash_fn fn,
+                                                     uint64_t size)
+{
+    void *foo = nullptr;
+    bthash_set_stack_range(&foo, g_stackLow);
+    uint64_t hash = fn(size);
+    asm volatile("" : : "r"(&foo) : "memory");
+    return hash;
+}
+
+template <int N>
+__attribute__((noinline)) static uint64_t call_site(hash_fn fn, uint64_t size)
+{
+    // N makes every instantiation unique - prevents identical code folding
+    asm volatile("" : : "r"(N) : "memory");
+    uint64_t hash = alloc_path(fn, size);
+    asm volatile("" : : "r"(hash) : "memory");
+    return hash;
+}
+
+using site_fn = uint64_t (*)(hash_fn, uint64_t);
+
+template <int N> struct SiteTable {
+    static void fill(std::vector<site_fn> &sites)
+    {
+        SiteTable<N - 1>::fill(sites);
+        sites.push_back(&call_site<N - 1>);
+    }
+};
+
+template <> struct SiteTable<0> {
+    static void fill(std::vector<site_fn> &sites)
+    {}
+};
+
+static const int SITES_NUM = 64;
+
+struct BenchArgs {
+    size_t iter_no;
+    size_t alloc_size;
+};
+
+struct Method {
+    const char *name;
+    hash_fn fn;
+};
+
+static void run_method(const Method &method, const std::vector<site_fn> &sites,
+                       const std::vector<int> &order, const BenchArgs &args)
+{
+    std::unordered_map<int, std::unordered_set<uint64_t>> site_hashes;
+    for (int site : order)
+        site_hashes[site].insert(sites[site](method.fn, args.alloc_size));
+
+    uint64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int site : order)
+        sum += sites[site](method.fn, args.alloc_size);
+    auto end = std::chrono::steady_clock::now();
+    double ns =
+        std::chrono::duration<double, std::nano>(end - start).count() /
+        order.size();
+
+    size_t unstable = 0;
+    std::unordered_map<uint64_t, std::unordered_set<int>> hash_sites;
+    for (auto &entry : site_hashes) {
+        if (entry.second.size() > 1)
+            ++unstable;
+        for (uint64_t hash : entry.second)
+            hash_sites[hash].insert(entry.first);
+    }
+    std::unordered_set<int> colliding;
+    for (auto &entry : hash_sites)
+        if (entry.second.size() > 1)
+            colliding.insert(entry.second.begin(), entry.second.end());
+
+    std::cout << std::left << std::setw(16) << method.name << std::right
+              << " ns/alloc: " << std::fixed << std::setprecision(2)
+              << std::setw(8) << ns << " distinct hashes: " << std::setw(6)
+              << hash_sites.size() << " unstable sites: " << std::setw(3)
+              << unstable << " colliding sites: " << std::setw(3)
+              << colliding.size() << " (checksum " << std::hex << sum
+              << std::dec << ")" << std::endl;
+}
+
+// clang-format off
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+    auto args = (BenchArgs *)state->input;
+    switch (key) {
+        case 'i':
+            args->iter_no = std::strtoul(arg, nullptr, 10);
+            break;
+        case 's':
+            args->alloc_size = std::strtoul(arg, nullptr, 10);
+            break;
+    }
+    return 0;
+}
+
+static struct argp_option options[] = {
+    {"iterations", 'i', "int", 0, "Number of hashed allocations per method."},
+    {"size", 's', "int", 0, "Allocation size passed to hash."},
+    {0}};
+// clang-format on
+
+static struct argp argp = {options, parse_opt, nullptr, nullptr};
+
+int main(int argc, char *argv[])
+{
+    struct BenchArgs arguments = {
+        .iter_no = 1000000,
+        .alloc_size = 64 };
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    pthread_attr_t attr;
+    size_t stack_size;
+    pthread_getattr_np(pthread_self(), &attr);
+    pthread_attr_getstack(&attr, &g_stackLow, &stack_size);
+    pthread_attr_destroy(&attr);
+    read_maps();
+
+    std::vector<site_fn> sites;
+    SiteTable<SITES_NUM>::fill(sites);
+    std::mt19937 gen(1234);
+    std::uniform_int_distribution<int> site_dist(0, SITES_NUM - 1);
+    std::vector<int> order(arguments.iter_no);
+    for (auto &site : order)
+        site = site_dist(gen);
+
+    std::cout << "call sites: " << SITES_NUM
+              << ", iterations: " << arguments.iter_no << std::endl;
+    const Method methods[] = {
+        {"stack_scan", bthash_stack_scan},
+        {"backtrace", bthash_backtrace},
+        {"frame_pointers", bthash_frame_pointers},
+    };
+    for (auto &method : methods)
+        run_method(method, sites, order, arguments);
+
+    return 0;
+}
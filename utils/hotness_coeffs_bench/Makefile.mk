@@ -0,0 +1,13 @@
+# SPDX-License-Identifier: BSD-2-Clause
+# Copyright (C) 2021 Intel Corporation.
+
+noinst_PROGRAMS += utils/hotness_coeffs_bench/hotness_coeffs_bench
+
+utils_hotness_coeffs_bench_hotness_coeffs_bench_SOURCES = utils/hotness_coeffs_bench/hotness_coeffs_bench.cpp
+utils_hotness_coeffs_bench_hotness_coeffs_bench_LDADD = libmemkind.la
+utils_hotness_coeffs_bench_hotness_coeffs_bench_LDFLAGS = $(PTHREAD_CFLAGS)
+
+clean-local: utils_hotness_coeffs_bench_hotness_coeffs_bench-clean
+
+utils_hotness_coeffs_bench_hotness_coeffs_bench-clean:
+	rm -f utils/hotness_coeffs_bench/*.gcno
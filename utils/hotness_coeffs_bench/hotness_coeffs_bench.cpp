@@ -0,0 +1,272 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/* Copyright (C) 2021 Intel Corporation. */
+
+extern "C" {
+#include <memkind/internal/ranking.h>
+}
+
+#include <algorithm>
+#include <argp.h>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Measures throughput of exponential coeffs hotness update
+// (HOTNESS_POLICY_EXPONENTIAL_COEFFS), in samples per second:
+//  - pow:          reference implementation, pow() per coeff,
+//  - fast_exp:     ranking_update_coeffs(), one sample at a time,
+//  - fast_exp_batch: all samples of a type in a batch applied with
+//                  ranking_update_coeffs_batch(),
+//  - ranking_touch / ranking_touch_batch: the same, including ranking
+//                  update, for each ranking backend (wre tree, histogram).
+// Samples are processed in batches, as PEBS samples in a monitor cycle.
+// Batched variants take samples already sorted by type; cost of sorting
+// is reported separately (sort_batches).
+
+struct BenchArgs {
+    size_t samples_no;
+    size_t types_no;
+    size_t batch_size;
+};
+
+struct Sample {
+    uint32_t type;
+    uint64_t timestamp;
+    double add_hotness;
+};
+
+struct Type {
+    uint64_t t0;
+    double f;
+    double coeffs[EXPONENTIAL_COEFFS_NUMBER];
+};
+
+static double run_single(const std::vector<Sample> &samples,
+                         std::vector<Type> &types,
+                         double (*update)(double *, double, double))
+{
+    for (const Sample &sample : samples) {
+        Type &type = types[sample.type];
+        double seconds_diff = (sample.timestamp - type.t0) / 1000000000.0;
+        type.t0 = sample.timestamp;
+        type.f = update(type.coeffs, seconds_diff, sample.add_hotness);
+    }
+    return samples.size();
+}
+
+static bool sample_less(const Sample &a, const Sample &b)
+{
+    return a.type != b.type ? a.type < b.type : a.timestamp < b.timestamp;
+}
+
+static double sort_batches(std::vector<Sample> &samples, size_t batch_size)
+{
+    for (size_t begin = 0; begin < samples.size(); begin += batch_size) {
+        size_t end = std::min(begin + batch_size, samples.size());
+        std::sort(samples.begin() + begin, samples.begin() + end,
+                  sample_less);
+    }
+    return samples.size();
+}
+
+static double run_batch(const std::vector<Sample> &sorted,
+                        std::vector<Type> &types, size_t batch_size)
+{
+    std::vector<double> seconds_diffs(batch_size);
+    std::vector<double> add_hotness(batch_size);
+    for (size_t begin = 0; begin < sorted.size(); begin += batch_size) {
+        size_t end = std::min(begin + batch_size, sorted.size());
+        size_t i = begin;
+        while (i < end) {
+            Type &type = types[sorted[i].type];
+            size_t count = 0;
+            for (; i < end && &types[sorted[i].type] == &type; ++i) {
+                seconds_diffs[count] =
+                    (sorted[i].timestamp - type.t0) / 1000000000.0;
+                add_hotness[count++] = sorted[i].add_hotness;
+                type.t0 = sorted[i].timestamp;
+            }
+            type.f = ranking_update_coeffs_batch(
+                type.coeffs, seconds_diffs.data(), add_hotness.data(), count);
+        }
+    }
+    return sorted.size();
+}
+
+static double run_ranking(const std::vector<Sample> &samples,
+                          size_t types_no, size_t batch_size, bool batched,
+                          int backend)
+{
+    ranking_t *ranking;
+    ranking_create_backend(&ranking, 0.9, backend);
+    std::vector<struct ttype> types(types_no);
+    for (auto &type : types) {
+        type = {};
+        type.total_size = 1;
+        ranking_add(ranking, type.f, type.total_size);
+    }
+    std::vector<ranking_touch_sample_t> batch;
+    for (size_t begin = 0; begin < samples.size(); begin += batch_size) {
+        size_t end = std::min(begin + batch_size, samples.size());
+        if (batched) {
+            // samples are sorted by type index, types are in one array -
+            // so they are sorted by ttype address, as required
+            batch.clear();
+            for (size_t i = begin; i < end; ++i)
+                batch.push_back({&types[samples[i].type],
+                                 samples[i].timestamp,
+                                 samples[i].add_hotness});
+            ranking_touch_batch(ranking, batch.data(), batch.size());
+        } else {
+            for (size_t i = begin; i < end; ++i)
+                ranking_touch(ranking, &types[samples[i].type],
+                              samples[i].timestamp, samples[i].add_hotness);
+        }
+    }
+    ranking_destroy(ranking);
+    return samples.size();
+}
+
+template <typename F>
+static void measure(const char *name, F fn, double checksum_f(void))
+{
+    auto start = std::chrono::steady_clock::now();
+    double processed = fn();
+    auto end = std::chrono::steady_clock::now();
+    double s = std::chrono::duration<double>(end - start).count();
+    std::cout << std::left << std::setw(30) << name << std::right
+              << " Msamples/s: " << std::fixed << std::setprecision(2)
+              << std::setw(8) << processed / s / 1e6
+              << " (checksum " << std::setprecision(6) << checksum_f() << ")"
+              << std::endl;
+}
+
+static std::vector<Type> g_types;
+
+static double types_checksum(void)
+{
+    double sum = 0;
+    for (auto &type : g_types)
+        sum += type.f;
+    return sum;
+}
+
+static double no_checksum(void)
+{
+    return 0;
+}
+
+// clang-format off
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+    auto args = (BenchArgs *)state->input;
+    switch (key) {
+        case 'n':
+            args->samples_no = std::strtoul(arg, nullptr, 10);
+            break;
+        case 't':
+            args->types_no = std::strtoul(arg, nullptr, 10);
+            break;
+        case 'b':
+            args->batch_size = std::strtoul(arg, nullptr, 10);
+            break;
+    }
+    return 0;
+}
+
+static struct argp_option options[] = {
+    {"samples", 'n', "int", 0, "Number of hotness samples."},
+    {"types", 't', "int", 0, "Number of allocation types (ttypes)."},
+    {"batch", 'b', "int", 0, "Number of samples processed in one batch."},
+    {0}};
+// clang-format on
+
+static struct argp argp = {options, parse_opt, nullptr, nullptr};
+
+int main(int argc, char *argv[])
+{
+    struct BenchArgs arguments = {
+        .samples_no = 10000000,
+        .types_no = 1024,
+        .batch_size = 1024 };
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (!arguments.types_no || !arguments.batch_size) {
+        std::cerr << "types and batch have to be positive" << std::endl;
+        return -1;
+    }
+
+    // hotness of types follows Zipf-like distribution
+    std::mt19937 gen(1234);
+    std::vector<double> weights(arguments.types_no);
+    for (size_t i = 0; i < weights.size(); ++i)
+        weights[i] = 1. / (i + 1);
+    std::discrete_distribution<uint32_t> type_dist(weights.begin(),
+                                                   weights.end());
+    std::exponential_distribution<double> dt_dist(1e-4); // mean 10us
+    std::vector<Sample> samples(arguments.samples_no);
+    uint64_t timestamp = 1;
+    for (auto &sample : samples) {
+        timestamp += uint64_t(dt_dist(gen)) + 1;
+        sample = {type_dist(gen), timestamp, 1.};
+    }
+
+    std::cout << "samples: " << arguments.samples_no
+              << ", types: " << arguments.types_no
+              << ", batch: " << arguments.batch_size << std::endl;
+
+    g_types.assign(arguments.types_no, Type());
+    measure(
+        "pow",
+        [&]() {
+            return run_single(samples, g_types, ranking_update_coeffs_pow);
+        },
+        types_checksum);
+    g_types.assign(arguments.types_no, Type());
+    measure(
+        "fast_exp",
+        [&]() { return run_single(samples, g_types, ranking_update_coeffs); },
+        types_checksum);
+    std::vector<Sample> sorted = samples;
+    measure(
+        "sort_batches",
+        [&]() { return sort_batches(sorted, arguments.batch_size); },
+        no_checksum);
+    g_types.assign(arguments.types_no, Type());
+    measure(
+        "fast_exp_batch",
+        [&]() { return run_batch(sorted, g_types, arguments.batch_size); },
+        types_checksum);
+    const struct {
+        const char *name;
+        int backend;
+    } backends[] = {{"wre", RANKING_BACKEND_WRE},
+                    {"histogram", RANKING_BACKEND_HISTOGRAM}};
+    for (auto &backend : backends) {
+        std::string name = std::string("ranking_touch(") + backend.name + ")";
+        measure(
+            name.c_str(),
+            [&]() {
+                return run_ranking(samples, arguments.types_no,
+                                   arguments.batch_size, false,
+                                   backend.backend);
+            },
+            no_checksum);
+        name = std::string("ranking_touch_batch(") + backend.name + ")";
+        measure(
+            name.c_str(),
+            [&]() {
+                return run_ranking(sorted, arguments.types_no,
+                                   arguments.batch_size, true,
+                                   backend.backend);
+            },
+            no_checksum);
+    }
+
+    return 0;
+}
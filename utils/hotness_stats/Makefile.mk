@@ -0,0 +1,13 @@
+# SPDX-License-Identifier: BSD-2-Clause
+# Copyright (C) 2021 Intel Corporation.
+
+noinst_PROGRAMS += utils/hotness_stats/hotness_stats
+
+utils_hotness_stats_hotness_stats_SOURCES = utils/hotness_stats/hotness_stats.cpp
+utils_hotness_stats_hotness_stats_LDADD = libmemkind.la
+utils_hotness_stats_hotness_stats_LDFLAGS = $(PTHREAD_CFLAGS)
+
+clean-local: utils_hotness_stats_hotness_stats-clean
+
+utils_hotness_stats_hotness_stats-clean:
+	rm -f utils/hotness_stats/*.gcno
@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/* Copyright (C) 2021 Intel Corporation. */
+
+extern "C" {
+#include <memkind/internal/hotness_stats.h>
+}
+
+#include <argp.h>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <signal.h>
+#include <thread>
+
+// Watches the data hotness policy of a running process, started with
+// HOTNESS_STATS_PAGE=1 - prints its live statistics (see hotness_stats.h)
+// every interval:
+//  - allocated size of tiers, desired and actual hot/total ratio,
+//  - thresholds between tiers with error and integrated error of their
+//    controllers,
+//  - tracked types and blocks, share of bytes that lie on pages of their
+//    own hotness (page purity),
+//  - depth of ranking event queue, dropped events,
+//  - PEBS samples and lost samples per second, sampling period and CPU
+//    time of draining PEBS rings per second,
+//  - processing time of ranking events in the interval (median and 99th
+//    percentile, upper bounds of histogram buckets).
+
+struct StatsArgs {
+    pid_t pid;
+    unsigned interval_ms;
+    size_t count;
+};
+
+static const char *const EVENT_NAMES[HOTNESS_STATS_EVENT_TYPES] = {
+    "create", "destroy", "realloc", "touch",
+    "callback", "run_update", "run_release", "other"};
+
+// upper bound of latency below which @p fraction of events was processed
+static uint64_t latency_percentile(const uint64_t *histogram, uint64_t total,
+                                   double fraction)
+{
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < HOTNESS_STATS_LATENCY_BUCKETS; ++i) {
+        sum += histogram[i];
+        if (sum >= fraction * total)
+            return 2ull << i;
+    }
+    return 2ull << (HOTNESS_STATS_LATENCY_BUCKETS - 1);
+}
+
+static void print_stats(const hotness_stats_t &stats,
+                        const hotness_stats_t &prev)
+{
+    std::cout << "pid " << stats.pid << ", cycle " << stats.cycles
+              << std::endl;
+    std::cout << "  tiers [MiB]:";
+    for (uint64_t i = 0; i < stats.tiers; ++i)
+        std::cout << " " << std::fixed << std::setprecision(1)
+                  << stats.tier_size[i] / 1048576.;
+    std::cout << ", hot/total desired " << std::setprecision(3)
+              << stats.hot_total_desired_ratio << " actual "
+              << stats.hot_total_actual_ratio << std::endl;
+    for (uint64_t i = 0; i < stats.thresholds; ++i) {
+        std::cout << "  threshold " << i << ": ";
+        if (stats.thresh_valid[i])
+            std::cout << std::scientific << std::setprecision(3)
+                      << stats.thresh[i];
+        else
+            std::cout << "invalid";
+        std::cout << std::fixed << std::setprecision(4) << ", error "
+                  << stats.controller_error[i] << ", integral "
+                  << stats.controller_integral[i] << std::endl;
+    }
+    std::cout << "  types " << stats.types << ", blocks " << stats.blocks;
+    if (stats.page_purity >= 0.)
+        std::cout << ", page purity " << std::fixed << std::setprecision(3)
+                  << stats.page_purity;
+    std::cout << std::endl;
+    std::cout << "  events: rings " << stats.event_rings << ", queued "
+              << stats.event_queue_depth << ", popped "
+              << stats.events_popped << ", overflowed "
+              << stats.events_overflowed << ", dropped "
+              << stats.events_dropped << std::endl;
+    std::cout << "  pebs: samples/s " << std::setprecision(0)
+              << stats.pebs_samples_per_second << ", lost/s "
+              << stats.pebs_lost_per_second << ", dropped "
+              << stats.pebs_dropped << ", period " << stats.pebs_period
+              << ", overhead " << std::setprecision(4) << stats.pebs_overhead
+              << std::endl;
+    for (unsigned type = 0; type < HOTNESS_STATS_EVENT_TYPES; ++type) {
+        uint64_t histogram[HOTNESS_STATS_LATENCY_BUCKETS];
+        uint64_t total = 0;
+        for (unsigned i = 0; i < HOTNESS_STATS_LATENCY_BUCKETS; ++i) {
+            histogram[i] = stats.event_latency[type][i] -
+                prev.event_latency[type][i];
+            total += histogram[i];
+        }
+        if (!total)
+            continue;
+        std::cout << "  " << std::setw(12) << EVENT_NAMES[type] << ": "
+                  << total << " events, p50 < "
+                  << latency_percentile(histogram, total, 0.5)
+                  << " ns, p99 < "
+                  << latency_percentile(histogram, total, 0.99) << " ns"
+                  << std::endl;
+    }
+}
+
+// clang-format off
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+    auto args = (StatsArgs *)state->input;
+    switch (key) {
+        case 'p':
+            args->pid = std::strtol(arg, nullptr, 10);
+            break;
+        case 'i':
+            args->interval_ms = std::strtoul(arg, nullptr, 10);
+            break;
+        case 'n':
+            args->count = std::strtoul(arg, nullptr, 10);
+            break;
+    }
+    return 0;
+}
+
+static struct argp_option options[] = {
+    {"pid", 'p', "int", 0, "Process to watch."},
+    {"interval", 'i', "int", 0, "Interval between reports [ms]."},
+    {"count", 'n', "int", 0, "Number of reports, 0 - until the process exits."},
+    {0}};
+// clang-format on
+
+static struct argp argp = {options, parse_opt, nullptr, nullptr};
+
+int main(int argc, char *argv[])
+{
+    struct StatsArgs arguments = {
+        .pid = 0,
+        .interval_ms = 1000,
+        .count = 0 };
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (arguments.pid <= 0) {
+        std::cerr << "pid has to be given" << std::endl;
+        return -1;
+    }
+
+    const hotness_stats_t *page = hotness_stats_map(arguments.pid);
+    if (!page) {
+        std::cerr << "no stats page of process " << arguments.pid
+                  << " - is it started with HOTNESS_STATS_PAGE=1?"
+                  << std::endl;
+        return -1;
+    }
+    hotness_stats_t prev = {};
+    hotness_stats_t stats;
+    for (size_t i = 0; !arguments.count || i < arguments.count; ++i) {
+        if (i)
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(arguments.interval_ms));
+        if (hotness_stats_read(page, &stats)) {
+            std::cerr << "stats page is busy" << std::endl;
+            continue;
+        }
+        print_stats(stats, prev);
+        prev = stats;
+        // page of an exited process is removed, the mapping stays valid
+        if (kill(arguments.pid, 0))
+            break;
+    }
+    hotness_stats_unmap(page);
+    return 0;
+}
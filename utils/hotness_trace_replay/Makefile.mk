@@ -0,0 +1,13 @@
+# SPDX-License-Identifier: BSD-2-Clause
+# Copyright (C) 2021 Intel Corporation.
+
+noinst_PROGRAMS += utils/hotness_trace_replay/hotness_trace_replay
+
+utils_hotness_trace_replay_hotness_trace_replay_SOURCES = utils/hotness_trace_replay/hotness_trace_replay.cpp
+utils_hotness_trace_replay_hotness_trace_replay_LDADD = libmemkind.la
+utils_hotness_trace_replay_hotness_trace_replay_LDFLAGS = $(PTHREAD_CFLAGS)
+
+clean-local: utils_hotness_trace_replay_hotness_trace_replay-clean
+
+utils_hotness_trace_replay_hotness_trace_replay-clean:
+	rm -f utils/hotness_trace_replay/*.gcno
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/* Copyright (C) 2021 Intel Corporation. */
+
+extern "C" {
+#include <memkind/internal/qsbr.h>
+#include <memkind/internal/sample_trace.h>
+#include <memkind/internal/tachanka.h>
+}
+
+#include <algorithm>
+#include <argp.h>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+// Replays a trace recorded with HOTNESS_TRACE_FILE=<path> through
+// tachanka/ranking, deterministically and without PEBS:
+//  - ranking events are processed in the recorded order,
+//  - touches are applied at the end of each recorded monitor cycle,
+//    followed by threshold update, reclamation of removed metadata and
+//    release of its memory - as in pebs_monitor(),
+//  - every allocation is placed in DRAM or PMEM as memtier would do:
+//    by tier of its type or, when hotness is unknown, by static ratio.
+// Page migration is not simulated.
+//
+// Placement quality is reported per interval of monitor cycles:
+//  - dram_hit:   ratio of sampled touches that hit blocks placed in DRAM,
+//  - oracle_hit: the same for the best placement with the same DRAM budget,
+//                blocks chosen by touches per byte in the interval.
+// Summary reports processing throughput of the whole pipeline.
+
+struct ReplayArgs {
+    const char *trace;
+    double dram_ratio;
+    size_t interval;
+};
+
+struct Block {
+    size_t size;
+    bool dram;
+    size_t touches; // in current interval
+};
+
+static std::map<uintptr_t, Block> g_blocks;
+// blocks freed in current interval, still taken into account by oracle
+static std::vector<Block> g_freedBlocks;
+static size_t g_liveBytes = 0;
+static size_t g_dramBytes = 0;
+
+static size_t replay_total_size(void)
+{
+    return g_liveBytes;
+}
+
+struct Stats {
+    size_t records;
+    size_t events;
+    size_t touches;
+    size_t tracked_touches;
+    size_t dram_touches;
+    size_t oracle_touches;
+    size_t cycles;
+    size_t mismatched; // tier differs from the recorded one
+    size_t unknown;    // placed by static ratio
+};
+
+static bool place_in_dram(uint64_t hash, size_t size, double dram_ratio,
+                          Stats &stats)
+{
+    int tier = tachanka_get_tier_hash(hash);
+    if (tier >= 0)
+        return tier == 0;
+    // fallback to static ratio
+    ++stats.unknown;
+    return g_dramBytes + size <= dram_ratio * (g_liveBytes + size);
+}
+
+static void add_block(uintptr_t addr, size_t size, bool dram)
+{
+    g_blocks[addr] = {size, dram, 0};
+    g_liveBytes += size;
+    if (dram)
+        g_dramBytes += size;
+}
+
+/// @return true if block was in DRAM
+static bool remove_block(uintptr_t addr)
+{
+    auto it = g_blocks.find(addr);
+    if (it == g_blocks.end())
+        return false;
+    bool dram = it->second.dram;
+    if (it->second.touches)
+        g_freedBlocks.push_back(it->second);
+    g_liveBytes -= it->second.size;
+    if (dram)
+        g_dramBytes -= it->second.size;
+    g_blocks.erase(it);
+    return dram;
+}
+
+static Block *find_block(uintptr_t addr)
+{
+    auto it = g_blocks.upper_bound(addr);
+    if (it == g_blocks.begin())
+        return nullptr;
+    --it;
+    return addr < it->first + it->second.size ? &it->second : nullptr;
+}
+
+// greedy - the hottest (per byte) blocks fill DRAM budget
+static size_t oracle_touches(double dram_ratio)
+{
+    std::vector<const Block *> touched;
+    for (auto &entry : g_blocks)
+        if (entry.second.touches)
+            touched.push_back(&entry.second);
+    for (auto &block : g_freedBlocks)
+        touched.push_back(&block);
+    std::sort(touched.begin(), touched.end(),
+              [](const Block *a, const Block *b) {
+                  return a->touches * (double)b->size >
+                      b->touches * (double)a->size;
+              });
+    double budget = dram_ratio * g_liveBytes;
+    size_t touches = 0;
+    for (const Block *block : touched) {
+        if (block->size > budget)
+            continue;
+        budget -= block->size;
+        touches += block->touches;
+    }
+    return touches;
+}
+
+static void report_interval(Stats &stats, Stats &last,
+                            uint64_t timestamp, uint64_t start,
+                            double dram_ratio)
+{
+    size_t oracle = oracle_touches(dram_ratio);
+    for (auto &entry : g_blocks)
+        entry.second.touches = 0;
+    g_freedBlocks.clear();
+    size_t tracked = stats.tracked_touches - last.tracked_touches;
+    size_t dram = stats.dram_touches - last.dram_touches;
+    std::cout << std::fixed << std::setprecision(3) << std::setw(10)
+              << (timestamp - start) / 1e9 << " s  cycle " << std::setw(8)
+              << stats.cycles << "  live MB " << std::setw(10)
+              << g_liveBytes / 1048576. << "  dram_ratio " << std::setw(6)
+              << (g_liveBytes ? (double)g_dramBytes / g_liveBytes : 0.)
+              << "  touches " << std::setw(8)
+              << stats.touches - last.touches << "  dram_hit "
+              << std::setw(6) << (tracked ? (double)dram / tracked : 0.)
+              << "  oracle_hit " << std::setw(6)
+              << (tracked ? (double)oracle / tracked : 0.) << std::endl;
+    stats.oracle_touches += oracle;
+    last = stats;
+}
+
+static int replay(const ReplayArgs &args)
+{
+    sample_trace_reader_t *reader = sample_trace_reader_open(args.trace);
+    if (!reader) {
+        std::cerr << "cannot open trace " << args.trace << std::endl;
+        return -1;
+    }
+    tachanka_init(DEFAULT_OLD_HOTNESS_WINDOW_WEIGHT,
+                  RANKING_BUFFER_SIZE_ELEMENTS);
+    tachanka_set_total_size_source(replay_total_size);
+    tachanka_set_dram_total_ratio(args.dram_ratio, args.dram_ratio);
+
+    Stats stats = {}, last = {};
+    std::vector<tachanka_touch_sample_t> touches;
+    uint64_t start = 0;
+    sample_trace_record_t record;
+    EventEntry_t event;
+    int ret;
+    auto time_start = std::chrono::steady_clock::now();
+    while ((ret = sample_trace_reader_next(reader, &record)) == 1) {
+        ++stats.records;
+        event.timestamp = record.timestamp;
+        switch (record.type) {
+            case SAMPLE_TRACE_ALLOC: {
+                bool dram =
+                    place_in_dram(record.hash, record.size, args.dram_ratio,
+                                  stats);
+                stats.mismatched += dram != record.is_hot;
+                add_block(record.addr, record.size, dram);
+                event.type = EVENT_CREATE_ADD;
+                event.data.createAddData = {record.hash, (void *)record.addr,
+                                            record.size, dram, record.weight};
+                break;
+            }
+            case SAMPLE_TRACE_FREE:
+                remove_block(record.addr);
+                event.type = EVENT_DESTROY_REMOVE;
+                event.data.destroyRemoveData = {(void *)record.addr, 0};
+                break;
+            case SAMPLE_TRACE_REALLOC: {
+                // memory stays in the kind of the old block
+                bool dram = remove_block(record.addr);
+                stats.mismatched += dram != record.is_hot;
+                add_block(record.new_addr, record.size, dram);
+                event.type = EVENT_REALLOC;
+                event.data.reallocData = {(void *)record.addr,
+                                          (void *)record.new_addr, record.hash,
+                                          record.size, dram, record.weight};
+                break;
+            }
+            case SAMPLE_TRACE_TOUCH: {
+                ++stats.touches;
+                Block *block = find_block(record.addr);
+                if (block) {
+                    ++block->touches;
+                    ++stats.tracked_touches;
+                    stats.dram_touches += block->dram;
+                }
+                touches.push_back({(void *)record.addr, record.timestamp});
+                continue;
+            }
+            case SAMPLE_TRACE_CYCLE: {
+                if (!start)
+                    start = record.timestamp;
+                tachanka_touch_batch(touches.data(), touches.size());
+                touches.clear();
+                double actual =
+                    g_liveBytes ? (double)g_dramBytes / g_liveBytes : 0.;
+                tachanka_set_dram_total_ratio(args.dram_ratio, actual);
+                tachanka_update_threshold();
+                (void)qsbr_reclaim();
+                (void)tachanka_release_free_memory();
+                if (++stats.cycles % args.interval == 0)
+                    report_interval(stats, last, record.timestamp, start,
+                                    args.dram_ratio);
+                continue;
+            }
+        }
+        ++stats.events;
+        tachanka_ranking_event_process(&event);
+    }
+    auto time_end = std::chrono::steady_clock::now();
+    double s = std::chrono::duration<double>(time_end - time_start).count();
+    sample_trace_reader_close(reader);
+    tachanka_destroy();
+    if (ret < 0) {
+        std::cerr << "corrupted trace after " << stats.records << " records"
+                  << std::endl;
+        return -1;
+    }
+
+    std::cout << "records: " << stats.records << ", events: " << stats.events
+              << ", touches: " << stats.touches << " (tracked "
+              << stats.tracked_touches << "), cycles: " << stats.cycles
+              << std::endl;
+    std::cout << "placed by static ratio: " << stats.unknown
+              << ", placement differs from recorded: " << stats.mismatched
+              << std::endl;
+    // oracle is known only for complete intervals
+    double tracked = last.tracked_touches;
+    std::cout << std::fixed << std::setprecision(3) << "dram_hit: "
+              << (tracked ? last.dram_touches / tracked : 0.)
+              << ", oracle_hit: "
+              << (tracked ? last.oracle_touches / tracked : 0.)
+              << " (complete intervals)" << std::endl;
+    std::cout << std::setprecision(2) << "replay time [s]: " << s
+              << ", Mrecords/s: " << stats.records / s / 1e6
+              << ", Mtouches/s: " << stats.touches / s / 1e6 << std::endl;
+    return 0;
+}
+
+// clang-format off
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+    auto args = (ReplayArgs *)state->input;
+    switch (key) {
+        case 'r':
+            args->dram_ratio = std::strtod(arg, nullptr);
+            break;
+        case 'i':
+            args->interval = std::strtoul(arg, nullptr, 10);
+            break;
+        case ARGP_KEY_ARG:
+            if (args->trace)
+                argp_usage(state);
+            args->trace = arg;
+            break;
+        case ARGP_KEY_END:
+            if (!args->trace)
+                argp_usage(state);
+            break;
+    }
+    return 0;
+}
+
+static struct argp_option options[] = {
+    {"ratio", 'r', "double", 0, "Desired DRAM to total size ratio."},
+    {"interval", 'i', "int", 0, "Number of monitor cycles per report line."},
+    {0}};
+// clang-format on
+
+static struct argp argp = {options, parse_opt, "TRACE", nullptr};
+
+int main(int argc, char *argv[])
+{
+    struct ReplayArgs arguments = {
+        .trace = nullptr,
+        .dram_ratio = 0.2,
+        .interval = 10 };
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (arguments.dram_ratio <= 0 || arguments.dram_ratio > 1 ||
+        !arguments.interval) {
+        std::cerr << "ratio has to be in (0, 1], interval has to be positive"
+                  << std::endl;
+        return -1;
+    }
+
+    return replay(arguments);
+}
@@ -0,0 +1,13 @@
+# SPDX-License-Identifier: BSD-2-Clause
+# Copyright (C) 2021 Intel Corporation.
+
+noinst_PROGRAMS += utils/slab_alloc_bench/slab_alloc_bench
+
+utils_slab_alloc_bench_slab_alloc_bench_SOURCES = utils/slab_alloc_bench/slab_alloc_bench.cpp
+utils_slab_alloc_bench_slab_alloc_bench_LDADD = libmemkind.la
+utils_slab_alloc_bench_slab_alloc_bench_LDFLAGS = $(PTHREAD_CFLAGS)
+
+clean-local: utils_slab_alloc_bench_slab_alloc_bench-clean
+
+utils_slab_alloc_bench_slab_alloc_bench-clean:
+	rm -f utils/slab_alloc_bench/*.gcno
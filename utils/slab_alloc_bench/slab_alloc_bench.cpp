@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/* Copyright (C) 2021 Intel Corporation. */
+
+#include <memkind/internal/slab_allocator.h>
+
+#include <argp.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Measures throughput of fixed-size allocations used for tachanka metadata
+// (critnib nodes, tblocks, ttypes, WRE nodes), in million malloc+free
+// pairs per second, summed over threads:
+//  - global_freelist: reference - single lock-free stack shared by all
+//                     threads (slab_allocator before per-thread magazines),
+//                     with versioned top, so that it is safe to run,
+//  - slab_alloc:      slab_alloc_malloc()/slab_alloc_free() - per-thread
+//                     magazines exchanged with a depot,
+//  - malloc:          malloc()/free() for comparison.
+// Each thread allocates a batch of elements, writes them and frees them
+// in the same order.
+
+struct BenchArgs {
+    size_t ops_per_thread;
+    size_t batch_size;
+    size_t element_size;
+    size_t max_threads;
+};
+
+// previous slab_allocator design: elements from one array, free list is
+// a Treiber stack of element indices
+class GlobalFreelist
+{
+public:
+    GlobalFreelist(size_t element_size, size_t max_elements)
+        : m_elementSize(element_size + sizeof(uint64_t)),
+          m_maxElements(max_elements),
+          m_memory(m_elementSize * max_elements), m_top(0), m_used(0)
+    {}
+
+    void *malloc()
+    {
+        uint64_t top = m_top.load(std::memory_order_acquire);
+        uint64_t new_top;
+        do {
+            while (!(uint32_t)top) {
+                uint64_t used = m_used.load();
+                if (used < m_maxElements) {
+                    if (m_used.compare_exchange_weak(used, used + 1))
+                        return element(used + 1) + sizeof(uint64_t);
+                    continue;
+                }
+                // all elements are taken - wait for a free
+                std::this_thread::yield();
+                top = m_top.load(std::memory_order_acquire);
+            }
+            uint64_t next = *(uint64_t *)element((uint32_t)top);
+            new_top = ((top >> 32) + 1) << 32 | next;
+        } while (!m_top.compare_exchange_weak(top, new_top));
+        return element((uint32_t)top) + sizeof(uint64_t);
+    }
+
+    void free(void *ptr)
+    {
+        uint8_t *el = (uint8_t *)ptr - sizeof(uint64_t);
+        uint64_t index = (el - m_memory.data()) / m_elementSize + 1;
+        uint64_t top = m_top.load(std::memory_order_relaxed);
+        do {
+            *(uint64_t *)el = (uint32_t)top;
+        } while (!m_top.compare_exchange_weak(top, ((top >> 32) + 1) << 32 |
+                                                  index));
+    }
+
+private:
+    uint8_t *element(uint64_t index)
+    {
+        return &m_memory[(index - 1) * m_elementSize];
+    }
+
+    size_t m_elementSize;
+    size_t m_maxElements;
+    std::vector<uint8_t> m_memory;
+    std::atomic<uint64_t> m_top;
+    std::atomic<uint64_t> m_used;
+};
+
+template <typename Alloc, typename Free>
+static double run(const BenchArgs &args, size_t threads_no, Alloc alloc_fn,
+                  Free free_fn)
+{
+    std::atomic<size_t> ready(0);
+    std::atomic<bool> start(false);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threads_no; ++t) {
+        threads.emplace_back([&]() {
+            std::vector<void *> batch(args.batch_size);
+            ++ready;
+            while (!start)
+                std::this_thread::yield();
+            for (size_t done = 0; done < args.ops_per_thread;
+                 done += args.batch_size) {
+                for (auto &ptr : batch) {
+                    ptr = alloc_fn();
+                    memset(ptr, 0, args.element_size);
+                }
+                for (auto ptr : batch)
+                    free_fn(ptr);
+            }
+        });
+    }
+    while (ready != threads_no)
+        std::this_thread::yield();
+    auto time_start = std::chrono::steady_clock::now();
+    start = true;
+    for (auto &thread : threads)
+        thread.join();
+    auto time_end = std::chrono::steady_clock::now();
+    double s = std::chrono::duration<double>(time_end - time_start).count();
+    size_t rounds =
+        (args.ops_per_thread + args.batch_size - 1) / args.batch_size;
+    return threads_no * rounds * args.batch_size / s / 1e6;
+}
+
+// clang-format off
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+    auto args = (BenchArgs *)state->input;
+    switch (key) {
+        case 'n':
+            args->ops_per_thread = std::strtoul(arg, nullptr, 10);
+            break;
+        case 'b':
+            args->batch_size = std::strtoul(arg, nullptr, 10);
+            break;
+        case 's':
+            args->element_size = std::strtoul(arg, nullptr, 10);
+            break;
+        case 't':
+            args->max_threads = std::strtoul(arg, nullptr, 10);
+            break;
+    }
+    return 0;
+}
+
+static struct argp_option options[] = {
+    {"ops", 'n', "int", 0, "Number of malloc+free pairs per thread."},
+    {"batch", 'b', "int", 0, "Number of elements allocated before freeing."},
+    {"size", 's', "int", 0, "Element size in bytes."},
+    {"threads", 't', "int", 0, "Maximum number of threads (1, 2, 4, ...)."},
+    {0}};
+// clang-format on
+
+static struct argp argp = {options, parse_opt, nullptr, nullptr};
+
+int main(int argc, char *argv[])
+{
+    struct BenchArgs arguments = {
+        .ops_per_thread = 1000000,
+        .batch_size = 256,
+        .element_size = 48,
+        .max_threads = 128 };
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (!arguments.batch_size || !arguments.element_size ||
+        !arguments.max_threads) {
+        std::cerr << "batch, size and threads have to be positive"
+                  << std::endl;
+        return -1;
+    }
+
+    std::cout << "ops per thread: " << arguments.ops_per_thread
+              << ", batch: " << arguments.batch_size
+              << ", element size: " << arguments.element_size
+              << ", magazine size: " << SLAB_ALLOC_MAGAZINE_SIZE << std::endl;
+    std::cout << std::setw(8) << "threads" << std::setw(20)
+              << "global_freelist" << std::setw(20) << "slab_alloc"
+              << std::setw(20) << "malloc" << "   [Mops/s]" << std::endl;
+    for (size_t threads = 1; threads <= arguments.max_threads; threads *= 2) {
+        GlobalFreelist global(arguments.element_size,
+                              threads * arguments.batch_size);
+        double global_ops = run(
+            arguments, threads, [&]() { return global.malloc(); },
+            [&](void *ptr) { global.free(ptr); });
+
+        slab_alloc_t slab;
+        slab_alloc_init(&slab, arguments.element_size, 0);
+        double slab_ops = run(
+            arguments, threads, [&]() { return slab_alloc_malloc(&slab); },
+            [](void *ptr) { slab_alloc_free(ptr); });
+        slab_alloc_destroy(&slab);
+
+        double malloc_ops = run(
+            arguments, threads,
+            [&]() { return std::malloc(arguments.element_size); },
+            [](void *ptr) { std::free(ptr); });
+
+        std::cout << std::setw(8) << threads << std::fixed
+                  << std::setprecision(2) << std::setw(20) << global_ops
+                  << std::setw(20) << slab_ops << std::setw(20) << malloc_ops
+                  << std::endl;
+    }
+    return 0;
+}